@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "bwa.h"
+#include "bwt.h"
+#include "bwamem.h"
+#include "ksw.h"
+#include "utils.h"
+#include "kseq.h"
+KSEQ_DECLARE(gzFile)
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/*****************************
+ * bwt_extend() with kernels *
+ *****************************/
+
+static int bench_occ(int argc, char *argv[])
+{
+	int c, i, j, kernel, max_len = 20, n = 500000;
+	uint8_t *q;
+	char *prefix, *fn;
+	bwt_t *bwt;
+	uint64_t sum0 = 0;
+
+	while ((c = getopt(argc, argv, "n:l:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'l') max_len = atoi(optarg);
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "Usage: bwa bench occ [-n %d] [-l %d] <idxbase>\n", n, max_len);
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+		fprintf(stderr, "[E::%s] fail to locate the index files\n", __func__);
+		return 1;
+	}
+	fn = calloc(strlen(prefix) + 5, 1);
+	bwt = bwt_restore_bwt(strcat(strcpy(fn, prefix), ".bwt"));
+	free(fn); free(prefix);
+
+	q = malloc((size_t)n * max_len); // random queries; the same for all kernels
+	srand48(11);
+	for (i = 0; i < n * max_len; ++i) q[i] = lrand48() & 3;
+
+	printf("kernel\tn_extend\tns_per_extend\tchecksum\n");
+	for (kernel = BWT_OCC_SCALAR; kernel <= BWT_OCC_AVX512; ++kernel) {
+		uint64_t n_ext = 0, sum = 0;
+		double t;
+		if (bwt_occ_set_kernel(kernel) < 0) {
+			printf("%s\tNA\tNA\tNA\n", bwt_occ_kernel_name(kernel));
+			continue;
+		}
+		t = realtime();
+		for (i = 0; i < n; ++i) {
+			const uint8_t *qi = &q[(size_t)i * max_len];
+			bwtintv_t ik, ok[4];
+			bwt_set_intv(bwt, qi[0], ik);
+			for (j = 1; j < max_len && ik.x[2] > 0; ++j) {
+				bwt_extend(bwt, &ik, ok, 1);
+				++n_ext;
+				ik = ok[qi[j]];
+				sum += ik.x[0] + ik.x[1] + ik.x[2];
+			}
+		}
+		t = realtime() - t;
+		if (kernel == BWT_OCC_SCALAR) sum0 = sum;
+		printf("%s\t%ld\t%.2f\t%016llx%s\n", bwt_occ_kernel_name(kernel), (long)n_ext, t * 1e9 / n_ext, (unsigned long long)sum, sum == sum0? "" : "\tMISMATCH");
+	}
+	bwt_occ_set_kernel(-1);
+	free(q);
+	bwt_destroy(bwt);
+	return 0;
+}
+
+/**********************************
+ * bwt_sa() versus bwt_sa_batch() *
+ **********************************/
+
+static int bench_sa(int argc, char *argv[])
+{
+	int c, i, n = 1000000, batch = 500;
+	bwtint_t *k, *sa0, *sa1;
+	bwt_t *bwt;
+	double t0, t1;
+
+	while ((c = getopt(argc, argv, "n:b:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'b') batch = atoi(optarg);
+	}
+	if (optind + 1 > argc) {
+		fprintf(stderr, "Usage: bwa bench sa [-n %d] [-b %d] <idxbase>\n", n, batch);
+		return 1;
+	}
+	if ((bwt = bwa_idx_load_bwt(argv[optind])) == 0) return 1;
+	k = malloc(n * sizeof(bwtint_t));
+	sa0 = malloc(n * sizeof(bwtint_t));
+	sa1 = malloc(n * sizeof(bwtint_t));
+	srand48(11);
+	for (i = 0; i < n; ++i) k[i] = (bwtint_t)(drand48() * (bwt->seq_len + 1));
+
+	t0 = realtime();
+	for (i = 0; i < n; ++i) sa0[i] = bwt_sa(bwt, k[i]);
+	t0 = realtime() - t0;
+	t1 = realtime();
+	for (i = 0; i < n; i += batch)
+		bwt_sa_batch(bwt, n - i < batch? n - i : batch, k + i, sa1 + i);
+	t1 = realtime() - t1;
+
+	printf("# sa_intv=%d, SA size=%.1f MB\n", bwt->sa_intv, bwt->n_sa * sizeof(bwtint_t) / 1048576.);
+	printf("method\tn_locate\tns_per_locate\n");
+	printf("bwt_sa\t%d\t%.2f\n", n, t0 * 1e9 / n);
+	printf("bwt_sa_batch\t%d\t%.2f%s\n", n, t1 * 1e9 / n, memcmp(sa0, sa1, n * sizeof(bwtint_t))? "\tMISMATCH" : "");
+	free(k); free(sa0); free(sa1);
+	bwt_destroy(bwt);
+	return 0;
+}
+
+/**************************************************
+ * mem_process_seqs() with and without huge pages *
+ **************************************************/
+
+static int bench_mem(int argc, char *argv[])
+{
+	int c, i, j, n, chunk_size = 10000000;
+	mem_opt_t *opt;
+	bseq1_t *seqs, *s;
+	gzFile fp;
+	kseq_t *ks;
+
+	opt = mem_opt_init();
+	while ((c = getopt(argc, argv, "t:K:")) >= 0) {
+		if (c == 't') opt->n_threads = atoi(optarg);
+		else if (c == 'K') chunk_size = atoi(optarg);
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Usage: bwa bench mem [-t %d] [-K %d] <idxbase> <reads.fq>\n", opt->n_threads, chunk_size);
+		free(opt);
+		return 1;
+	}
+	fp = xzopen(argv[optind+1], "r");
+	ks = kseq_init(fp);
+	seqs = bseq_read(chunk_size, &n, ks, 0); // one batch, mapped with each kind of page
+	kseq_destroy(ks);
+	err_gzclose(fp);
+	s = calloc(n, sizeof(bseq1_t));
+
+	printf("pages\tMB_on_huge\tn_reads\treads_per_sec\tchecksum\n");
+	for (j = 0; j < 2; ++j) {
+		bwaidx_t *idx;
+		uint64_t sum = 0;
+		int64_t n_huge = 0;
+		double t;
+		if ((idx = bwa_idx_load_from_disk(argv[optind], BWA_IDX_ALL)) == 0) return 1; // not the .bwaidx, so that both runs start on the heap
+		if (j == 1) {
+			bwa_idx_hugepage(idx);
+			if (idx->mem) n_huge = huge_backed(idx->mem, idx->l_mem);
+		}
+		for (i = 0; i < n; ++i) { // mem_process_seqs() encodes seq in place
+			s[i] = seqs[i];
+			s[i].seq = strdup(seqs[i].seq);
+			s[i].sam = 0;
+		}
+		t = realtime();
+		mem_process_seqs(opt, idx->bwt, idx->bns, idx->pac, 0, n, s, 0);
+		t = realtime() - t;
+		for (i = 0; i < n; ++i) {
+			const char *p;
+			for (p = s[i].sam; p && *p; ++p) sum = sum * 31 + *p;
+			free(s[i].seq); free(s[i].sam);
+		}
+		printf("%s\t%.1f\t%d\t%.1f\t%016llx\n", j == 0? "4k" : idx->huge == HUGE_TLB? "hugetlbfs" : idx->huge == HUGE_THP? "thp" : "4k",
+			   n_huge / 1048576., n, n / t, (unsigned long long)sum);
+		bwa_idx_destroy(idx);
+	}
+	for (i = 0; i < n; ++i) {
+		free(seqs[i].name); free(seqs[i].comment); free(seqs[i].seq); free(seqs[i].qual);
+	}
+	free(seqs); free(s); free(opt);
+	return 0;
+}
+
+/***************************************
+ * mem_process_seqs2() over NUMA nodes *
+ ***************************************/
+
+static int bench_numa(int argc, char *argv[])
+{
+	int c, i, j, n, n_node, t_node = 1, chunk_size = 10000000;
+	mem_opt_t *opt;
+	bseq1_t *seqs, *s;
+	bwaidx_t *idx;
+	bwa_numa_t *nm;
+	gzFile fp;
+	kseq_t *ks;
+
+	opt = mem_opt_init();
+	while ((c = getopt(argc, argv, "t:K:")) >= 0) {
+		if (c == 't') t_node = atoi(optarg);
+		else if (c == 'K') chunk_size = atoi(optarg);
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Usage: bwa bench numa [-t %d] [-K %d] <idxbase> <reads.fq>\n", t_node, chunk_size);
+		fprintf(stderr, "Note: -t sets the threads per node\n");
+		free(opt);
+		return 1;
+	}
+	if ((idx = bwa_idx_load_from_disk(argv[optind], BWA_IDX_ALL)) == 0) return 1;
+	fp = xzopen(argv[optind+1], "r");
+	ks = kseq_init(fp);
+	seqs = bseq_read(chunk_size, &n, ks, 0);
+	kseq_destroy(ks);
+	err_gzclose(fp);
+	s = calloc(n, sizeof(bseq1_t));
+	nm = bwa_numa_init(idx, BWA_NUMA_OFF, 0); // only to count the nodes
+	n_node = nm->n_node;
+	bwa_numa_destroy(nm);
+
+	printf("policy\tn_node\tn_threads\tn_reads\treads_per_sec\tchecksum\n");
+	for (j = 0; j <= n_node + 1; ++j) { // unpinned on all nodes, replicated on 1..n_node nodes, then interleaved on all
+		int mode = j == 0? BWA_NUMA_OFF : j <= n_node? BWA_NUMA_REPLICATE : BWA_NUMA_INTERLEAVE;
+		int k = j == 0 || j > n_node? n_node : j;
+		uint64_t sum = 0;
+		double t;
+		nm = mode == BWA_NUMA_OFF? 0 : bwa_numa_init(idx, mode, k); // interleaving comes last as it leaves idx spread
+		opt->n_threads = k * t_node;
+		for (i = 0; i < n; ++i) {
+			s[i] = seqs[i];
+			s[i].seq = strdup(seqs[i].seq);
+			s[i].sam = 0;
+		}
+		t = realtime();
+		mem_process_seqs2(opt, idx->bwt, idx->bns, idx->pac, 0, n, s, 0, nm);
+		t = realtime() - t;
+		for (i = 0; i < n; ++i) {
+			const char *p;
+			for (p = s[i].sam; p && *p; ++p) sum = sum * 31 + *p;
+			free(s[i].seq); free(s[i].sam);
+		}
+		printf("%s\t%d\t%d\t%d\t%.1f\t%016llx\n", mode == BWA_NUMA_OFF? "none" : mode == BWA_NUMA_REPLICATE? "replicate" : "interleave",
+			   k, opt->n_threads, n, n / t, (unsigned long long)sum);
+		bwa_numa_destroy(nm);
+	}
+	for (i = 0; i < n; ++i) {
+		free(seqs[i].name); free(seqs[i].comment); free(seqs[i].seq); free(seqs[i].qual);
+	}
+	free(seqs); free(s); free(opt);
+	bwa_idx_destroy(idx);
+	return 0;
+}
+
+/*******************************
+ * ksw_align2() with kernels *
+ *******************************/
+
+static int bench_ksw(int argc, char *argv[])
+{
+	int c, i, j, k, kernel, n = 20000, qlen = 150, tlen = 600;
+	uint8_t *q, *t;
+	int8_t mat[25];
+	uint64_t sum0[2] = {0, 0};
+
+	while ((c = getopt(argc, argv, "n:l:L:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'l') qlen = atoi(optarg);
+		else if (c == 'L') tlen = atoi(optarg);
+	}
+	if (qlen < 1 || tlen < qlen) {
+		fprintf(stderr, "Usage: bwa bench ksw [-n %d] [-l %d] [-L %d]\n", n, qlen, tlen);
+		fprintf(stderr, "Note: each target holds a copy of the query with 5%% substitutions\n");
+		return 1;
+	}
+	bwa_fill_scmat(1, 4, mat);
+	q = malloc((size_t)n * qlen);
+	t = malloc((size_t)n * tlen);
+	srand48(11);
+	for (i = 0; i < n; ++i) { // as in mate rescue: the query somewhere in a longer target
+		uint8_t *qi = &q[(size_t)i * qlen], *ti = &t[(size_t)i * tlen];
+		for (j = 0; j < qlen; ++j) qi[j] = lrand48() & 3;
+		for (j = 0; j < tlen; ++j) ti[j] = lrand48() & 3;
+		k = lrand48() % (tlen - qlen + 1);
+		for (j = 0; j < qlen; ++j) ti[k + j] = drand48() < .05? lrand48() & 3 : qi[j];
+	}
+
+	printf("kernel\tscore\tn_cells\tMcells_per_sec\tchecksum\n");
+	for (kernel = KSW_KERNEL_SSE2; kernel <= KSW_KERNEL_AVX512 + 1; ++kernel) { // the last round is the default choice
+		for (j = 0; j < 2; ++j) { // 8-bit, then 16-bit scores
+			uint64_t sum = 0;
+			double rt;
+			const char *name = kernel > KSW_KERNEL_AVX512? "auto" : ksw_kernel_name(kernel);
+			if (ksw_set_kernel(kernel > KSW_KERNEL_AVX512? -1 : kernel) < 0) {
+				printf("%s\t%s\tNA\tNA\tNA\n", name, j? "i16" : "u8");
+				continue;
+			}
+			rt = realtime();
+			for (i = 0; i < n; ++i) {
+				kswr_t r;
+				r = ksw_align2(qlen, &q[(size_t)i * qlen], tlen, &t[(size_t)i * tlen], 5, mat, 6, 1, 6, 1, (j? 0 : KSW_XBYTE) | KSW_XSUBO | 20, 0);
+				sum = sum * 31 + ((uint64_t)r.score << 48 ^ (uint64_t)r.te << 32 ^ (uint64_t)r.qe << 16 ^ (uint64_t)r.score2 << 8 ^ r.te2);
+			}
+			rt = realtime() - rt;
+			if (kernel == KSW_KERNEL_SSE2) sum0[j] = sum;
+			printf("%s\t%s\t%ld\t%.1f\t%016llx%s\n", name, j? "i16" : "u8", (long)n * qlen * tlen, (double)n * qlen * tlen / rt * 1e-6,
+				   (unsigned long long)sum, sum == sum0[j]? "" : "\tMISMATCH");
+		}
+	}
+	free(q); free(t);
+	return 0;
+}
+
+/************************************
+ * ksw_extend2() against the scalar *
+ ************************************/
+
+static int bench_extend(int argc, char *argv[])
+{
+	int c, i, j, k, r, n = 100000, qlen = 100, w = 100, b = 32;
+	uint8_t *q, *t;
+	int8_t mat[25];
+	uint64_t sum0 = 0;
+	kswext_t *ext;
+	kswbuf_t buf = {0,0,0,0};
+
+	while ((c = getopt(argc, argv, "n:l:w:b:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'l') qlen = atoi(optarg);
+		else if (c == 'w') w = atoi(optarg);
+		else if (c == 'b') b = atoi(optarg);
+	}
+	if (qlen < 1 || w < 1 || b < 1) {
+		fprintf(stderr, "Usage: bwa bench extend [-n %d] [-l %d] [-w %d] [-b %d]\n", n, qlen, w, b);
+		fprintf(stderr, "Note: each target is the query with 5%% substitutions and 1%% indels, as by the bwa-mem defaults\n");
+		return 1;
+	}
+	bwa_fill_scmat(1, 4, mat);
+	q = malloc((size_t)n * qlen);
+	t = malloc((size_t)n * (qlen + w));
+	srand48(11);
+	for (i = 0; i < n; ++i) { // the query followed by the reference; the target is w longer
+		uint8_t *qi = &q[(size_t)i * qlen], *ti = &t[(size_t)i * (qlen + w)];
+		for (j = 0; j < qlen; ++j) qi[j] = lrand48() & 3;
+		for (j = k = 0; j < qlen + w; ++j) {
+			double x = drand48();
+			if (k >= qlen || x < .05) ti[j] = lrand48() & 3, ++k;
+			else if (x < .055) ti[j] = lrand48() & 3; // insertion to the target
+			else if (x < .06) k += 2, ti[j] = k - 1 < qlen? qi[k - 1] : lrand48() & 3; // deletion from the target
+			else ti[j] = qi[k++];
+		}
+	}
+
+	ext = calloc(n, sizeof(kswext_t));
+	for (i = 0; i < n; ++i) {
+		ext[i].qlen = qlen, ext[i].query = &q[(size_t)i * qlen];
+		ext[i].tlen = qlen + w, ext[i].target = &t[(size_t)i * (qlen + w)];
+		ext[i].w = w, ext[i].end_bonus = 5, ext[i].h0 = 20;
+	}
+
+	printf("kernel\tn_ext\tMcells_per_sec\tchecksum\n");
+	for (r = 0; r < 4; ++r) { // scalar, SSE2, SSE2 with a reused buffer, then in batches of b
+		static const char *name[] = { "scalar", "sse2", "sse2_buf", "batch" };
+		uint64_t sum = 0;
+		double rt = realtime();
+		if (r == 3)
+			for (i = 0; i < n; i += b)
+				ksw_extend2_batch(n - i < b? n - i : b, &ext[i], 5, mat, 6, 1, 6, 1, 100, &buf);
+		for (i = 0; i < n; ++i) {
+			kswext_t *p = &ext[i];
+			if (r == 0) p->score = ksw_extend2_scalar(p->qlen, p->query, p->tlen, p->target, 5, mat, 6, 1, 6, 1, p->w, p->end_bonus, 100, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off);
+			else if (r < 3) p->score = ksw_extend2_buf(p->qlen, p->query, p->tlen, p->target, 5, mat, 6, 1, 6, 1, p->w, p->end_bonus, 100, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off, r == 2? &buf : 0);
+			sum = sum * 31 + ((uint64_t)p->score << 48 ^ (uint64_t)p->qle << 36 ^ (uint64_t)p->tle << 24 ^ (uint64_t)p->gtle << 12 ^ (uint64_t)(p->gscore & 0xfff) ^ (uint64_t)p->max_off << 56);
+			if (r < 3) p->score = p->qle = p->tle = p->gtle = p->gscore = p->max_off = 0;
+		}
+		rt = realtime() - rt;
+		if (r == 0) sum0 = sum;
+		printf("%s\t%d\t%.1f\t%016llx%s\n", name[r], n, (double)n * qlen * (2 * w + 1) / rt * 1e-6,
+			   (unsigned long long)sum, sum == sum0? "" : "\tMISMATCH");
+	}
+	ksw_buf_destroy(&buf);
+	free(ext); free(q); free(t);
+	return 0;
+}
+
+static int bench_global(int argc, char *argv[])
+{
+	int c, i, j, k, r, n = 100000, qlen = 150, w = 30;
+	uint8_t *q, *t;
+	int8_t mat[25];
+	uint64_t sum0 = 0;
+
+	while ((c = getopt(argc, argv, "n:l:w:")) >= 0) {
+		if (c == 'n') n = atoi(optarg);
+		else if (c == 'l') qlen = atoi(optarg);
+		else if (c == 'w') w = atoi(optarg);
+	}
+	if (qlen < 1 || w < 1) {
+		fprintf(stderr, "Usage: bwa bench global [-n %d] [-l %d] [-w %d]\n", n, qlen, w);
+		fprintf(stderr, "Note: each target is the query with 5%% substitutions and 1%% indels, and has the same length\n");
+		return 1;
+	}
+	bwa_fill_scmat(1, 4, mat);
+	q = malloc((size_t)n * qlen);
+	t = malloc((size_t)n * qlen);
+	srand48(11);
+	for (i = 0; i < n; ++i) {
+		uint8_t *qi = &q[(size_t)i * qlen], *ti = &t[(size_t)i * qlen];
+		for (j = 0; j < qlen; ++j) qi[j] = lrand48() & 3;
+		for (j = k = 0; j < qlen; ++j) {
+			double x = drand48();
+			if (k >= qlen || x < .05) ti[j] = lrand48() & 3, ++k;
+			else if (x < .055) ti[j] = lrand48() & 3; // insertion to the target
+			else if (x < .06) k += 2, ti[j] = k - 1 < qlen? qi[k - 1] : lrand48() & 3; // deletion from the target
+			else ti[j] = qi[k++];
+		}
+	}
+
+	printf("kernel\tn_aln\tMcells_per_sec\tchecksum\n");
+	for (r = 0; r < 2; ++r) { // scalar, then SSE2
+		uint64_t sum = 0;
+		double rt = realtime();
+		for (i = 0; i < n; ++i) {
+			int n_cigar, score;
+			uint32_t *cigar = 0;
+			score = (r? ksw_global2 : ksw_global2_scalar)(qlen, &q[(size_t)i * qlen], qlen, &t[(size_t)i * qlen], 5, mat, 6, 1, 6, 1, w, &n_cigar, &cigar);
+			sum = sum * 31 + (uint32_t)score;
+			for (j = 0; j < n_cigar; ++j) sum = sum * 31 + cigar[j];
+			free(cigar);
+		}
+		rt = realtime() - rt;
+		if (r == 0) sum0 = sum;
+		printf("%s\t%d\t%.1f\t%016llx%s\n", r? "sse2" : "scalar", n, (double)n * qlen * (2 * w + 1) / rt * 1e-6,
+			   (unsigned long long)sum, sum == sum0? "" : "\tMISMATCH");
+	}
+	free(q); free(t);
+	return 0;
+}
+
+/*****************
+ * Main function *
+ *****************/
+
+int main_bench(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "\nUsage: bwa bench <command> [options]\n\n");
+		fprintf(stderr, "Command: occ      time bwt_extend() with each Occ kernel\n");
+		fprintf(stderr, "         sa       time bwt_sa() against bwt_sa_batch()\n");
+		fprintf(stderr, "         ksw      time ksw_align2() with each SIMD kernel\n");
+		fprintf(stderr, "         extend   time ksw_extend2() against ksw_extend2_scalar() and ksw_extend2_batch()\n");
+		fprintf(stderr, "         global   time ksw_global2() against ksw_global2_scalar()\n");
+		fprintf(stderr, "         mem      time mem_process_seqs() with the index on 4 KB and on huge pages\n");
+		fprintf(stderr, "         numa     time mem_process_seqs2() with the index replicated on 1, 2, ... NUMA nodes\n\n");
+		return 1;
+	}
+	if (strcmp(argv[1], "occ") == 0) return bench_occ(argc - 1, argv + 1);
+	if (strcmp(argv[1], "sa") == 0) return bench_sa(argc - 1, argv + 1);
+	if (strcmp(argv[1], "ksw") == 0) return bench_ksw(argc - 1, argv + 1);
+	if (strcmp(argv[1], "extend") == 0) return bench_extend(argc - 1, argv + 1);
+	if (strcmp(argv[1], "global") == 0) return bench_global(argc - 1, argv + 1);
+	if (strcmp(argv[1], "mem") == 0) return bench_mem(argc - 1, argv + 1);
+	if (strcmp(argv[1], "numa") == 0) return bench_numa(argc - 1, argv + 1);
+	fprintf(stderr, "[E::%s] unrecognized command '%s'\n", __func__, argv[1]);
+	return 1;
+}
@@ -25,12 +25,17 @@
 
 /* Contact: Heng Li <lh3@sanger.ac.uk> */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for F_SETPIPE_SZ
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include "bntseq.h"
 #include "utils.h"
 
@@ -224,24 +229,32 @@ void bns_destroy(bntseq_t *bns)
 #define _set_pac(pac, l, c) ((pac)[(l)>>2] |= (c)<<((~(l)&3)<<1))
 #define _get_pac(pac, l) ((pac)[(l)>>2]>>((~(l)&3)<<1)&3)
 
-static uint8_t *add1(const kseq_t *seq, bntseq_t *bns, uint8_t *pac, int64_t *m_pac, int *m_seqs, int *m_holes, bntamb1_t **q)
+static uint8_t *add1(const char *name, const char *comment, int64_t l_seq, const char *s, bntseq_t *bns, uint8_t *pac, int64_t *m_pac, int *m_seqs, int *m_holes, bntamb1_t **q)
 {
 	bntann1_t *p;
-	int i, lasts;
+	int64_t i;
+	int lasts;
 	if (bns->n_seqs == *m_seqs) {
 		*m_seqs <<= 1;
 		bns->anns = (bntann1_t*)realloc(bns->anns, *m_seqs * sizeof(bntann1_t));
 	}
 	p = bns->anns + bns->n_seqs;
-	p->name = strdup((char*)seq->name.s);
-	p->anno = seq->comment.l > 0? strdup((char*)seq->comment.s) : strdup("(null)");
-	p->gi = 0; p->len = seq->seq.l;
+	p->name = strdup(name);
+	p->anno = comment && *comment? strdup(comment) : strdup("(null)");
+	p->gi = 0; p->len = l_seq;
 	p->offset = (bns->n_seqs == 0)? 0 : (p-1)->offset + (p-1)->len;
 	p->n_ambs = 0;
-	for (i = lasts = 0; i < seq->seq.l; ++i) {
-		int c = nst_nt4_table[(int)seq->seq.s[i]];
+	if (bns->l_pac + l_seq > *m_pac) { // grow the pac to fit the whole sequence
+		int64_t m = *m_pac;
+		while (m < bns->l_pac + l_seq) m <<= 1;
+		pac = realloc(pac, m/4);
+		memset(pac + *m_pac/4, 0, (m - *m_pac)/4);
+		*m_pac = m;
+	}
+	for (i = lasts = 0; i < l_seq; ++i) {
+		int c = nst_nt4_table[(int)s[i]];
 		if (c >= 4) { // N
-			if (lasts == seq->seq.s[i]) { // contiguous N
+			if (lasts == s[i]) { // contiguous N
 				++(*q)->len;
 			} else {
 				if (bns->n_holes == *m_holes) {
@@ -251,82 +264,229 @@ static uint8_t *add1(const kseq_t *seq, bntseq_t *bns, uint8_t *pac, int64_t *m_
 				*q = bns->ambs + bns->n_holes;
 				(*q)->len = 1;
 				(*q)->offset = p->offset + i;
-				(*q)->amb = seq->seq.s[i];
+				(*q)->amb = s[i];
 				++p->n_ambs;
 				++bns->n_holes;
 			}
+			c = lrand48()&3;
 		}
-		lasts = seq->seq.s[i];
-		{ // fill buffer
-			if (c >= 4) c = lrand48()&3;
-			if (bns->l_pac == *m_pac) { // double the pac size
-				*m_pac <<= 1;
-				pac = realloc(pac, *m_pac/4);
-				memset(pac + bns->l_pac/4, 0, (*m_pac - bns->l_pac)/4);
-			}
-			_set_pac(pac, bns->l_pac, c);
-			++bns->l_pac;
-		}
+		lasts = s[i];
+		_set_pac(pac, bns->l_pac, c);
+		++bns->l_pac;
 	}
 	++bns->n_seqs;
 	return pac;
 }
 
-int64_t bns_fasta2bntseq(gzFile fp_fa, const char *prefix, int for_only)
-{
-	extern void seq_reverse(int len, ubyte_t *seq, int is_comp); // in bwaseqio.c
-	kseq_t *seq;
-	char name[1024];
+/* FASTA packing runs on three threads: one inflates the input into a pipe,
+ * and a two-step kt_pipeline() parses batches of sequences from the pipe and
+ * packs them in order. Packing consumes lrand48() in input order, so the
+ * output is the same as from a single thread. */
+
+#define FA_BATCH_SIZE 0x1000000 // bases parsed per batch
+
+typedef struct {
+	gzFile fp;
+	int fd;
+} fa_inflate_t;
+
+typedef struct {
+	kseq_t *ks;
 	bntseq_t *bns;
-	uint8_t *pac = 0;
-	int32_t m_seqs, m_holes;
-	int64_t ret = -1, m_pac, l;
+	uint8_t *pac;
+	int64_t m_pac;
+	int m_seqs, m_holes;
 	bntamb1_t *q;
+} fa_pack_t;
+
+typedef struct {
+	int n, m;
+	char **name, **comment, **seq;
+	int64_t *l_seq;
+} fa_batch_t;
+
+static void *fa_inflate(void *data)
+{
+	fa_inflate_t *f = (fa_inflate_t*)data;
+	char *buf;
+	int l, k, x;
+	buf = malloc(0x100000);
+	while ((l = gzread(f->fp, buf, 0x100000)) > 0) {
+		for (k = 0; k < l; k += x)
+			if ((x = write(f->fd, buf + k, l - k)) < 0) {
+				if (errno == EINTR) { x = 0; continue; }
+				_err_fatal_simple("write", strerror(errno));
+			}
+	}
+	if (l < 0) _err_fatal_simple("gzread", "fail to decompress the FASTA");
+	free(buf);
+	close(f->fd);
+	return 0;
+}
+
+static void *fa_pack_step(void *shared, int step, void *_data)
+{
+	fa_pack_t *f = (fa_pack_t*)shared;
+	fa_batch_t *b = (fa_batch_t*)_data;
+	int i;
+	if (step == 0) { // parse
+		int64_t size = 0;
+		b = calloc(1, sizeof(fa_batch_t));
+		while (size < FA_BATCH_SIZE && kseq_read(f->ks) >= 0) {
+			if (b->n == b->m) {
+				b->m = b->m? b->m<<1 : 16;
+				b->name = realloc(b->name, b->m * sizeof(char*));
+				b->comment = realloc(b->comment, b->m * sizeof(char*));
+				b->seq = realloc(b->seq, b->m * sizeof(char*));
+				b->l_seq = realloc(b->l_seq, b->m * sizeof(int64_t));
+			}
+			b->name[b->n] = strdup(f->ks->name.s);
+			b->comment[b->n] = f->ks->comment.l? strdup(f->ks->comment.s) : 0;
+			b->seq[b->n] = f->ks->seq.s, b->l_seq[b->n] = f->ks->seq.l; // take over the buffer; kseq allocates anew
+			f->ks->seq.s = 0, f->ks->seq.l = f->ks->seq.m = 0;
+			size += b->l_seq[b->n++];
+		}
+		if (b->n > 0) return b;
+		free(b);
+		return 0;
+	} else if (step == 1) { // pack
+		for (i = 0; i < b->n; ++i) {
+			f->pac = add1(b->name[i], b->comment[i], b->l_seq[i], b->seq[i], f->bns, f->pac, &f->m_pac, &f->m_seqs, &f->m_holes, &f->q);
+			free(b->name[i]); free(b->comment[i]); free(b->seq[i]);
+		}
+		free(b->name); free(b->comment); free(b->seq); free(b->l_seq);
+		free(b);
+	}
+	return 0;
+}
+
+// parse and pack the forward strand of all sequences in fp_fa after those already in bns and pac, if any; return the pac
+static uint8_t *fa_pack(gzFile fp_fa, bntseq_t *bns, uint8_t *pac, int64_t *m_pac)
+{
+	extern void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
+	fa_inflate_t fi;
+	fa_pack_t f;
+	pthread_t tid;
+	int fd[2];
+	gzFile fp;
+
+	if (pipe(fd) < 0) _err_fatal_simple("pipe", strerror(errno));
+#ifdef F_SETPIPE_SZ
+	fcntl(fd[1], F_SETPIPE_SZ, 0x100000);
+#endif
+	fi.fp = fp_fa, fi.fd = fd[1];
+	pthread_create(&tid, 0, fa_inflate, &fi);
+	fp = gzdopen(fd[0], "r"); // the pipe carries plain text, which gzread() passes through
+	memset(&f, 0, sizeof(fa_pack_t));
+	f.ks = kseq_init(fp);
+	f.bns = bns;
+	f.m_seqs = bns->n_seqs > 8? bns->n_seqs : 8;
+	f.m_holes = bns->n_holes > 8? bns->n_holes : 8;
+	bns->anns = (bntann1_t*)realloc(bns->anns, f.m_seqs * sizeof(bntann1_t));
+	bns->ambs = (bntamb1_t*)realloc(bns->ambs, f.m_holes * sizeof(bntamb1_t));
+	if (pac == 0) *m_pac = 0x10000, pac = calloc(*m_pac/4, 1);
+	f.pac = pac, f.m_pac = *m_pac;
+	f.q = bns->ambs;
+	kt_pipeline(2, fa_pack_step, &f, 2);
+	pthread_join(tid, 0);
+	kseq_destroy(f.ks);
+	err_gzclose(fp);
+	*m_pac = f.m_pac;
+	return f.pac;
+}
+
+// append the reverse complement of the first bns->l_pac bases
+static uint8_t *fa_pack_rev(bntseq_t *bns, uint8_t *pac, int64_t m_pac)
+{
+	int64_t l, ll_pac = (bns->l_pac * 2 + 3) / 4 * 4;
+	if (ll_pac > m_pac) pac = realloc(pac, ll_pac/4);
+	memset(pac + (bns->l_pac+3)/4, 0, (ll_pac - (bns->l_pac+3)/4*4) / 4);
+	for (l = bns->l_pac - 1; l >= 0; --l, ++bns->l_pac)
+		_set_pac(pac, bns->l_pac, 3-_get_pac(pac, l));
+	return pac;
+}
+
+void bns_dump_pac(const char *fn, const uint8_t *pac, int64_t l_pac)
+{
 	FILE *fp;
+	ubyte_t ct;
+	fp = xopen(fn, "wb");
+	err_fwrite(pac, 1, (l_pac>>2) + ((l_pac&3) == 0? 0 : 1), fp);
+	// the following codes make the pac file size always (l_pac/4+1+1)
+	if (l_pac % 4 == 0) {
+		ct = 0;
+		err_fwrite(&ct, 1, 1, fp);
+	}
+	ct = l_pac % 4;
+	err_fwrite(&ct, 1, 1, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+}
 
-	// initialization
-	seq = kseq_init(fp_fa);
+static bntseq_t *fa_bns_init(void)
+{
+	bntseq_t *bns;
 	bns = (bntseq_t*)calloc(1, sizeof(bntseq_t));
 	bns->seed = 11; // fixed seed for random generator
 	srand48(bns->seed);
-	m_seqs = m_holes = 8; m_pac = 0x10000;
-	bns->anns = (bntann1_t*)calloc(m_seqs, sizeof(bntann1_t));
-	bns->ambs = (bntamb1_t*)calloc(m_holes, sizeof(bntamb1_t));
-	pac = calloc(m_pac/4, 1);
-	q = bns->ambs;
+	return bns;
+}
+
+int64_t bns_fasta2bntseq(gzFile fp_fa, const char *prefix, int for_only)
+{
+	char name[1024];
+	bntseq_t *bns;
+	uint8_t *pac;
+	int64_t m_pac, ret;
+
+	bns = fa_bns_init();
+	pac = fa_pack(fp_fa, bns, 0, &m_pac);
+	if (!for_only) pac = fa_pack_rev(bns, pac, m_pac); // add the reverse complemented sequence
+	ret = bns->l_pac;
 	strcpy(name, prefix); strcat(name, ".pac");
-	fp = xopen(name, "wb");
-	// read sequences
-	while (kseq_read(seq) >= 0) pac = add1(seq, bns, pac, &m_pac, &m_seqs, &m_holes, &q);
-	if (!for_only) { // add the reverse complemented sequence
-		int64_t ll_pac = (bns->l_pac * 2 + 3) / 4 * 4;
-		if (ll_pac > m_pac) pac = realloc(pac, ll_pac/4);
-		memset(pac + (bns->l_pac+3)/4, 0, (ll_pac - (bns->l_pac+3)/4*4) / 4);
-		for (l = bns->l_pac - 1; l >= 0; --l, ++bns->l_pac)
-			_set_pac(pac, bns->l_pac, 3-_get_pac(pac, l));
-	}
+	bns_dump_pac(name, pac, bns->l_pac);
+	bns_dump(bns, prefix);
+	bns_destroy(bns);
+	free(pac);
+	return ret;
+}
+
+int64_t bns_fasta2bntseq2(gzFile fp_fa, const char *prefix, const char *fn_fr)
+{
+	char name[1024];
+	bntseq_t *bns;
+	uint8_t *pac;
+	int64_t m_pac, ret;
+
+	bns = fa_bns_init();
+	pac = fa_pack(fp_fa, bns, 0, &m_pac);
 	ret = bns->l_pac;
-	{ // finalize .pac file
-		ubyte_t ct;
-		err_fwrite(pac, 1, (bns->l_pac>>2) + ((bns->l_pac&3) == 0? 0 : 1), fp);
-		// the following codes make the pac file size always (l_pac/4+1+1)
-		if (bns->l_pac % 4 == 0) {
-			ct = 0;
-			err_fwrite(&ct, 1, 1, fp);
-		}
-		ct = bns->l_pac % 4;
-		err_fwrite(&ct, 1, 1, fp);
-		// close .pac file
-		err_fflush(fp);
-		err_fclose(fp);
-	}
+	strcpy(name, prefix); strcat(name, ".pac");
+	bns_dump_pac(name, pac, bns->l_pac);
 	bns_dump(bns, prefix);
+	if (fn_fr) {
+		pac = fa_pack_rev(bns, pac, m_pac);
+		bns_dump_pac(fn_fr, pac, bns->l_pac);
+	}
 	bns_destroy(bns);
-	kseq_destroy(seq);
 	free(pac);
 	return ret;
 }
 
+uint8_t *bns_fasta_append(gzFile fp_fa, bntseq_t *bns, uint8_t *pac)
+{
+	int64_t i, n_amb = 0, m_pac = (bns->l_pac/4 + 1) * 4;
+	for (i = 0; i < bns->n_seqs; ++i)
+		if (bns->anns[i].anno[0] == 0) { // bns_restore() reads "(null)" as empty; write it back as add1() did
+			free(bns->anns[i].anno);
+			bns->anns[i].anno = strdup("(null)");
+		}
+	for (i = 0; i < bns->n_holes; ++i) n_amb += bns->ambs[i].len;
+	srand48(bns->seed); // replay the draws for the ambiguous bases already packed
+	for (i = 0; i < n_amb; ++i) lrand48();
+	return fa_pack(fp_fa, bns, pac, &m_pac);
+}
+
 int bwa_fa2pac(int argc, char *argv[])
 {
 	int c, for_only = 0;
@@ -74,6 +74,11 @@ extern "C" {
 	bntseq_t *bns_restore_core(const char *ann_filename, const char* amb_filename, const char* pac_filename);
 	void bns_destroy(bntseq_t *bns);
 	int64_t bns_fasta2bntseq(gzFile fp_fa, const char *prefix, int for_only);
+	// in one pass, write the forward-only .pac, .ann and .amb, and the forward-reverse pac to fn_fr if not NULL
+	int64_t bns_fasta2bntseq2(gzFile fp_fa, const char *prefix, const char *fn_fr);
+	// append the sequences in fp_fa to bns and its forward pac of >=bns->l_pac/4+1 bytes, as if packed in one go; return the new pac
+	uint8_t *bns_fasta_append(gzFile fp_fa, bntseq_t *bns, uint8_t *pac);
+	void bns_dump_pac(const char *fn, const uint8_t *pac, int64_t l_pac);
 	int bns_pos2rid(const bntseq_t *bns, int64_t pos_f);
 	int bns_cnt_ambi(const bntseq_t *bns, int64_t pos_f, int len, int *ref_id);
 	uint8_t *bns_get_seq(int64_t l_pac, const uint8_t *pac, int64_t beg, int64_t end, int64_t *len);
@@ -2,6 +2,11 @@
 #include <stdio.h>
 #include <zlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bntseq.h"
 #include "bwa.h"
 #include "ksw.h"
@@ -251,47 +256,146 @@ bwt_t *bwa_idx_load_bwt(const char *hint)
 		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to locate the index files\n", __func__);
 		return 0;
 	}
-	tmp = calloc(strlen(prefix) + 5, 1);
+	tmp = calloc(strlen(prefix) + 6, 1);
 	strcat(strcpy(tmp, prefix), ".bwt"); // FM-index
 	bwt = bwt_restore_bwt(tmp);
 	strcat(strcpy(tmp, prefix), ".sa");  // partial suffix array (SA)
 	bwt_restore_sa(tmp, bwt);
+	strcat(strcpy(tmp, prefix), ".kmer"); // optional k-mer table
+	bwt_restore_kmer(tmp, bwt);
 	free(tmp); free(prefix);
 	return bwt;
 }
 
-bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which)
+/* The loader parses the small headers first, allocates every array and then
+ * reads the arrays with pread() in BWA_LOAD_CHUNK ranges on a few threads.
+ * Ranges of the components alternate, so that the components are read
+ * concurrently rather than one after another. */
+
+#define BWA_LOAD_CHUNK 0x4000000 // 64 MB
+
+enum { IDX_COMP_BWT = 0, IDX_COMP_SA, IDX_COMP_KMER, IDX_COMP_PAC, IDX_COMP_N };
+static const char *idx_comp_name[IDX_COMP_N] = { "bwt", "sa", "kmer", "pac" };
+
+typedef struct {
+	int fd, comp;
+	uint8_t *buf;
+	int64_t off, len;
+	double t; // realtime() once read
+} idx_range_t;
+
+static void idx_read_worker(void *data, long i, int tid)
+{
+	idx_range_t *r = (idx_range_t*)data + i;
+	int64_t k = 0, x;
+	while (k < r->len) {
+		x = pread(r->fd, r->buf + k, r->len - k, r->off + k);
+		if (x < 0 && errno == EINTR) continue;
+		if (x <= 0) err_fatal(__func__, "fail to read the .%s file: %s", idx_comp_name[r->comp], x < 0? strerror(errno) : "unexpected end of file");
+		k += x;
+	}
+	r->t = realtime();
+}
+
+bwaidx_t *bwa_idx_load_from_disk2(const char *hint, int which, int n_threads)
 {
+	extern void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
 	bwaidx_t *idx;
-	char *prefix;
+	char *prefix, *fn;
+	int i, j, n, m, fd[IDX_COMP_N];
+	int64_t off[IDX_COMP_N], len[IDX_COMP_N];
+	uint8_t *buf[IDX_COMP_N];
+	idx_range_t *r;
+	double t0;
+
 	prefix = bwa_idx_infer_prefix(hint);
 	if (prefix == 0) {
 		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] fail to locate the index files\n", __func__);
 		return 0;
 	}
 	idx = calloc(1, sizeof(bwaidx_t));
-	if (which & BWA_IDX_BWT) idx->bwt = bwa_idx_load_bwt(hint);
+	fn = calloc(strlen(prefix) + 6, 1);
+	for (i = 0; i < IDX_COMP_N; ++i) fd[i] = -1, len[i] = 0;
+	if (which & BWA_IDX_BWT) {
+		idx->bwt = bwt_restore_bwt_hdr(strcat(strcpy(fn, prefix), ".bwt"), &off[IDX_COMP_BWT]); // FM-index
+		fd[IDX_COMP_BWT] = open(fn, O_RDONLY);
+		buf[IDX_COMP_BWT] = (uint8_t*)idx->bwt->bwt, len[IDX_COMP_BWT] = idx->bwt->bwt_size << 2;
+		strcat(strcpy(fn, prefix), ".sa"); // partial suffix array (SA)
+		if (!(which & BWA_IDX_LAZY) || bwt_map_sa(fn, idx->bwt) < 0) {
+			off[IDX_COMP_SA] = bwt_restore_sa_hdr(fn, idx->bwt);
+			fd[IDX_COMP_SA] = open(fn, O_RDONLY);
+			buf[IDX_COMP_SA] = (uint8_t*)(idx->bwt->sa + 1), len[IDX_COMP_SA] = (idx->bwt->n_sa - 1) * sizeof(bwtint_t);
+		}
+		if ((off[IDX_COMP_KMER] = bwt_restore_kmer_hdr(strcat(strcpy(fn, prefix), ".kmer"), idx->bwt)) >= 0) { // optional k-mer table
+			fd[IDX_COMP_KMER] = open(fn, O_RDONLY);
+			buf[IDX_COMP_KMER] = (uint8_t*)idx->bwt->kmer, len[IDX_COMP_KMER] = bwt_kmer_off(idx->bwt->kmer_k + 1) * 16;
+		}
+	}
 	if (which & BWA_IDX_BNS) {
-		int i, c;
+		int c;
 		idx->bns = bns_restore(prefix);
 		for (i = c = 0; i < idx->bns->n_seqs; ++i)
 			if (idx->bns->anns[i].is_alt) ++c;
 		if (bwa_verbose >= 3)
 			fprintf(stderr, "[M::%s] read %d ALT contigs\n", __func__, c);
-		if (which & BWA_IDX_PAC) {
+		if ((which & BWA_IDX_PAC) && (which & BWA_IDX_LAZY)) { // the .pac file is the array as is
+			void *p = mmap(0, idx->bns->l_pac/4+1, PROT_READ, MAP_PRIVATE, fileno(idx->bns->fp_pac), 0);
+			if (p != MAP_FAILED) idx->pac = p, idx->l_pac_map = idx->bns->l_pac/4+1;
+		}
+		if ((which & BWA_IDX_PAC) && idx->pac == 0) { // concatenated 2-bit encoded sequence
 			idx->pac = calloc(idx->bns->l_pac/4+1, 1);
-			err_fread_noeof(idx->pac, 1, idx->bns->l_pac/4+1, idx->bns->fp_pac); // concatenated 2-bit encoded sequence
-			err_fclose(idx->bns->fp_pac);
-			idx->bns->fp_pac = 0;
+			fd[IDX_COMP_PAC] = fileno(idx->bns->fp_pac);
+			buf[IDX_COMP_PAC] = idx->pac, off[IDX_COMP_PAC] = 0, len[IDX_COMP_PAC] = idx->bns->l_pac/4+1;
 		}
 	}
-	free(prefix);
+	for (i = 0; i < IDX_COMP_N; ++i)
+		if (len[i] > 0 && fd[i] < 0)
+			err_fatal(__func__, "fail to open the .%s file: %s", idx_comp_name[i], strerror(errno));
+
+	for (i = m = 0; i < IDX_COMP_N; ++i) m += (len[i] + BWA_LOAD_CHUNK - 1) / BWA_LOAD_CHUNK;
+	r = calloc(m, sizeof(idx_range_t));
+	for (j = n = 0; n < m; ++j) // the j-th range of each component in turn
+		for (i = 0; i < IDX_COMP_N; ++i) {
+			int64_t o = (int64_t)j * BWA_LOAD_CHUNK;
+			if (o >= len[i]) continue;
+			r[n].fd = fd[i], r[n].comp = i, r[n].buf = buf[i] + o;
+			r[n].off = off[i] + o, r[n].len = len[i] - o < BWA_LOAD_CHUNK? len[i] - o : BWA_LOAD_CHUNK;
+			++n;
+		}
+	t0 = realtime();
+	kt_for(n_threads > 1? n_threads : 1, idx_read_worker, r, n);
+	if (bwa_verbose >= 3) {
+		for (i = 0; i < IDX_COMP_N; ++i) {
+			double t = 0.;
+			if (len[i] == 0) continue;
+			for (j = 0; j < n; ++j)
+				if (r[j].comp == i && r[j].t - t0 > t) t = r[j].t - t0;
+			fprintf(stderr, "[M::%s] read %.1f MB of .%s in %.2f sec\n", __func__, len[i] / 1048576., idx_comp_name[i], t);
+		}
+	}
+	free(r);
+	for (i = 0; i < IDX_COMP_PAC; ++i)
+		if (fd[i] >= 0) close(fd[i]);
+	if (idx->bns && idx->bns->fp_pac && idx->pac) {
+		err_fclose(idx->bns->fp_pac);
+		idx->bns->fp_pac = 0;
+	}
+	free(fn); free(prefix);
 	return idx;
 }
 
+bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which)
+{
+	return bwa_idx_load_from_disk2(hint, which, BWA_LOAD_THREADS);
+}
+
 bwaidx_t *bwa_idx_load(const char *hint, int which)
 {
-	return bwa_idx_load_from_disk(hint, which);
+	bwaidx_t *idx;
+	if ((which & BWA_IDX_ALL) != BWA_IDX_ALL || (idx = bwa_idx_load_from_mmap(hint)) == 0)
+		idx = bwa_idx_load_from_disk(hint, which);
+	if (idx && (which & BWA_IDX_HUGE)) bwa_idx_hugepage(idx);
+	return idx;
 }
 
 void bwa_idx_destroy(bwaidx_t *idx)
@@ -300,26 +404,35 @@ void bwa_idx_destroy(bwaidx_t *idx)
 	if (idx->mem == 0) {
 		if (idx->bwt) bwt_destroy(idx->bwt);
 		if (idx->bns) bns_destroy(idx->bns);
-		if (idx->pac) free(idx->pac);
+		if (idx->l_pac_map) munmap(idx->pac, idx->l_pac_map);
+		else if (idx->pac) free(idx->pac);
 	} else {
 		free(idx->bwt); free(idx->bns->anns); free(idx->bns);
-		if (!idx->is_shm) free(idx->mem);
+		if (idx->is_mmap) munmap(idx->mem - BWA_MMAP_HDR_SIZE, BWA_MMAP_HDR_SIZE + idx->l_mem);
+		else if (idx->is_shm) bwa_shm_detach(idx);
+		else huge_free(idx->mem, idx->l_mem, idx->huge);
 	}
 	free(idx);
 }
 
+// bwt_t is padded to 64 bytes in the flat layout, such that BWT_FMT_CL lines stay cache-aligned in shm
+#define BWA_BWT_HDR_SIZE ((sizeof(bwt_t) + 63) & ~(size_t)63)
+
 int bwa_mem2idx(int64_t l_mem, uint8_t *mem, bwaidx_t *idx)
 {
 	int64_t k = 0, x;
 	int i;
 
 	// generate idx->bwt
-	x = sizeof(bwt_t); idx->bwt = malloc(x); memcpy(idx->bwt, mem + k, x); k += x;
+	x = sizeof(bwt_t); idx->bwt = malloc(x); memcpy(idx->bwt, mem + k, x); k += BWA_BWT_HDR_SIZE;
 	x = idx->bwt->bwt_size * 4; idx->bwt->bwt = (uint32_t*)(mem + k); k += x;
 	x = idx->bwt->n_sa * sizeof(bwtint_t); idx->bwt->sa = (bwtint_t*)(mem + k); k += x;
+	idx->bwt->l_sa_map = 0;
+	x = idx->bwt->kmer_k? bwt_kmer_off(idx->bwt->kmer_k + 1) * 16 : 0; idx->bwt->kmer = x? (uint64_t*)(mem + k) : 0; k += x;
 
 	// generate idx->bns and idx->pac
 	x = sizeof(bntseq_t); idx->bns = malloc(x); memcpy(idx->bns, mem + k, x); k += x;
+	idx->bns->fp_pac = 0;
 	x = idx->bns->n_holes * sizeof(bntamb1_t); idx->bns->ambs = (bntamb1_t*)(mem + k); k += x;
 	x = idx->bns->n_seqs  * sizeof(bntann1_t); idx->bns->anns = malloc(x); memcpy(idx->bns->anns, mem + k, x); k += x;
 	for (i = 0; i < idx->bns->n_seqs; ++i) {
@@ -333,26 +446,39 @@ int bwa_mem2idx(int64_t l_mem, uint8_t *mem, bwaidx_t *idx)
 	return 0;
 }
 
-int bwa_idx2mem(bwaidx_t *idx)
+// the size of the flat layout of a fully loaded index
+static int64_t bwa_idx_flat_size(const bwaidx_t *idx)
 {
 	int i;
-	int64_t k, x, tmp;
-	uint8_t *mem;
+	int64_t l;
+	l = BWA_BWT_HDR_SIZE + idx->bwt->bwt_size * 4 + idx->bwt->n_sa * sizeof(bwtint_t);
+	if (idx->bwt->kmer_k) l += bwt_kmer_off(idx->bwt->kmer_k + 1) * 16;
+	l += sizeof(bntseq_t) + idx->bns->n_holes * sizeof(bntamb1_t) + idx->bns->n_seqs * sizeof(bntann1_t);
+	for (i = 0; i < idx->bns->n_seqs; ++i)
+		l += strlen(idx->bns->anns[i].name) + strlen(idx->bns->anns[i].anno) + 2;
+	return l + idx->bns->l_pac/4+1;
+}
+
+// move the index into _mem_ of bwa_idx_flat_size() bytes, freeing each part once copied
+static void bwa_idx_flatten(bwaidx_t *idx, uint8_t *mem)
+{
+	int i;
+	int64_t k, x;
 
 	// copy idx->bwt
-	x = idx->bwt->bwt_size * 4;
-	mem = realloc(idx->bwt->bwt, sizeof(bwt_t) + x); idx->bwt->bwt = 0;
-	memmove(mem + sizeof(bwt_t), mem, x);
-	memcpy(mem, idx->bwt, sizeof(bwt_t)); k = sizeof(bwt_t) + x;
-	x = idx->bwt->n_sa * sizeof(bwtint_t); mem = realloc(mem, k + x); memcpy(mem + k, idx->bwt->sa, x); k += x;
-	free(idx->bwt->sa);
+	memset(mem, 0, BWA_BWT_HDR_SIZE);
+	memcpy(mem, idx->bwt, sizeof(bwt_t)); k = BWA_BWT_HDR_SIZE;
+	x = idx->bwt->bwt_size * 4; memcpy(mem + k, idx->bwt->bwt, x); k += x;
+	free(idx->bwt->bwt);
+	x = idx->bwt->n_sa * sizeof(bwtint_t); memcpy(mem + k, idx->bwt->sa, x); k += x;
+	bwt_free_sa(idx->bwt);
+	if (idx->bwt->kmer_k) {
+		x = bwt_kmer_off(idx->bwt->kmer_k + 1) * 16; memcpy(mem + k, idx->bwt->kmer, x); k += x;
+		free(idx->bwt->kmer);
+	}
 	free(idx->bwt); idx->bwt = 0;
 
 	// copy idx->bns
-	tmp = idx->bns->n_seqs * sizeof(bntann1_t) + idx->bns->n_holes * sizeof(bntamb1_t);
-	for (i = 0; i < idx->bns->n_seqs; ++i) // compute the size of heap-allocated memory
-		tmp += strlen(idx->bns->anns[i].name) + strlen(idx->bns->anns[i].anno) + 2;
-	mem = realloc(mem, k + sizeof(bntseq_t) + tmp);
 	x = sizeof(bntseq_t); memcpy(mem + k, idx->bns, x); k += x;
 	x = idx->bns->n_holes * sizeof(bntamb1_t); memcpy(mem + k, idx->bns->ambs, x); k += x;
 	free(idx->bns->ambs);
@@ -365,13 +491,139 @@ int bwa_idx2mem(bwaidx_t *idx)
 	free(idx->bns->anns);
 
 	// copy idx->pac
-	x = idx->bns->l_pac/4+1;
-	mem = realloc(mem, k + x);
-	memcpy(mem + k, idx->pac, x); k += x;
+	x = idx->bns->l_pac/4+1; memcpy(mem + k, idx->pac, x);
 	free(idx->bns); idx->bns = 0;
-	free(idx->pac); idx->pac = 0;
+	if (idx->l_pac_map) munmap(idx->pac, idx->l_pac_map);
+	else free(idx->pac);
+	idx->pac = 0, idx->l_pac_map = 0;
+}
+
+int bwa_idx2mem(bwaidx_t *idx)
+{
+	int64_t l_mem;
+	uint8_t *mem;
+	l_mem = bwa_idx_flat_size(idx);
+	mem = malloc(l_mem);
+	bwa_idx_flatten(idx, mem);
+	return bwa_mem2idx(l_mem, mem, idx);
+}
+
+int bwa_idx_hugepage(bwaidx_t *idx)
+{
+	int64_t l, n;
+	uint8_t *p;
+	const char *how;
+	if (idx->is_mmap || idx->is_shm) { // already mapped; the kernel may still merge or fault in huge pages
+		p = idx->is_mmap? idx->mem - BWA_MMAP_HDR_SIZE : idx->mem;
+		l = idx->is_mmap? BWA_MMAP_HDR_SIZE + idx->l_mem : idx->l_mem;
+		huge_advise(p, l);
+		how = idx->is_mmap? "file mapping" : "shared memory";
+	} else if (idx->mem == 0 && idx->bwt && idx->bns && idx->pac) {
+		l = bwa_idx_flat_size(idx);
+		p = huge_alloc(l, &idx->huge);
+		bwa_idx_flatten(idx, p);
+		bwa_mem2idx(l, p, idx);
+		how = idx->huge == HUGE_TLB? "hugetlbfs" : idx->huge == HUGE_THP? "transparent huge pages" : "malloc";
+	} else {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] huge pages require the whole index; ignored\n", __func__);
+		return -1;
+	}
+	n = huge_backed(p, l);
+	if (bwa_verbose >= 3) {
+		if (n < 0) fprintf(stderr, "[M::%s] %.1f MB of index via %s; huge page use unknown\n", __func__, l / 1048576., how);
+		else fprintf(stderr, "[M::%s] %.1f of %.1f MB of index on huge pages via %s\n", __func__, n / 1048576., l / 1048576., how);
+	}
+	return n > 0? 0 : -1;
+}
+
+/*******************
+ * Flat index file *
+ *******************/
+
+/* <prefix>.bwaidx holds the layout of bwa_idx2mem() after a header page, such
+ * that the file can be mapped and used in place. The layout embeds bwt_t and
+ * bntseq_t as is, so the header records their sizes besides the version. */
 
-	return bwa_mem2idx(k, mem, idx);
+#define BWA_MMAP_MAGIC   "BWAIDX\1\0"
+#define BWA_MMAP_VERSION 1
+
+typedef struct {
+	char magic[8];
+	int32_t version, hdr_size;
+	int32_t size_bwt, size_bns, size_int; // sizeof(bwt_t), sizeof(bntseq_t) and sizeof(bwtint_t) of the writer
+	int64_t l_mem;
+} bwa_mmap_hdr_t;
+
+void bwa_idx_dump_mmap(const char *fn, bwaidx_t *idx)
+{
+	bwa_mmap_hdr_t *h;
+	uint8_t *hdr;
+	char *tmp;
+	FILE *fp;
+
+	if (idx->mem == 0) bwa_idx2mem(idx);
+	hdr = calloc(BWA_MMAP_HDR_SIZE, 1);
+	h = (bwa_mmap_hdr_t*)hdr;
+	memcpy(h->magic, BWA_MMAP_MAGIC, 8);
+	h->version = BWA_MMAP_VERSION, h->hdr_size = BWA_MMAP_HDR_SIZE;
+	h->size_bwt = sizeof(bwt_t), h->size_bns = sizeof(bntseq_t), h->size_int = sizeof(bwtint_t);
+	h->l_mem = idx->l_mem;
+	tmp = calloc(strlen(fn) + 5, 1);
+	strcat(strcpy(tmp, fn), ".tmp"); // write then rename, such that a reader never maps a partial file
+	fp = xopen(tmp, "wb");
+	err_fwrite(hdr, 1, BWA_MMAP_HDR_SIZE, fp);
+	err_fwrite(idx->mem, 1, idx->l_mem, fp);
+	err_fflush(fp);
+	err_fclose(fp);
+	if (rename(tmp, fn) != 0) err_fatal(__func__, "fail to rename '%s' to '%s': %s", tmp, fn, strerror(errno));
+	free(tmp); free(hdr);
+}
+
+bwaidx_t *bwa_idx_load_from_mmap(const char *hint)
+{
+	char *prefix, *fn;
+	int fd;
+	struct stat st, st_bwt;
+	bwa_mmap_hdr_t h;
+	uint8_t *map;
+	bwaidx_t *idx;
+
+	if ((prefix = bwa_idx_infer_prefix(hint)) == 0) return 0;
+	fn = calloc(strlen(prefix) + 8, 1);
+	strcat(strcpy(fn, prefix), ".bwt");
+	if (stat(fn, &st_bwt) != 0) st_bwt.st_mtime = 0;
+	strcat(strcpy(fn, prefix), ".bwaidx");
+	free(prefix);
+	if ((fd = open(fn, O_RDONLY)) < 0) {
+		free(fn);
+		return 0;
+	}
+	if (fstat(fd, &st) != 0 || read(fd, &h, sizeof(h)) != sizeof(h) || memcmp(h.magic, BWA_MMAP_MAGIC, 8) != 0
+		|| h.version != BWA_MMAP_VERSION || h.hdr_size != BWA_MMAP_HDR_SIZE || h.size_bwt != sizeof(bwt_t)
+		|| h.size_bns != sizeof(bntseq_t) || h.size_int != sizeof(bwtint_t) || st.st_size != h.hdr_size + h.l_mem)
+	{
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] '%s' is not a valid index file of this build; ignored\n", __func__, fn);
+		close(fd); free(fn);
+		return 0;
+	}
+	if (st.st_mtime < st_bwt.st_mtime) {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] '%s' is older than the .bwt file; ignored\n", __func__, fn);
+		close(fd); free(fn);
+		return 0;
+	}
+	map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] fail to map '%s': %s\n", __func__, fn, strerror(errno));
+		free(fn);
+		return 0;
+	}
+	idx = calloc(1, sizeof(bwaidx_t));
+	bwa_mem2idx(h.l_mem, map + BWA_MMAP_HDR_SIZE, idx);
+	idx->is_mmap = 1;
+	if (bwa_verbose >= 3) fprintf(stderr, "[M::%s] mapped %.1f MB of index from '%s'\n", __func__, h.l_mem / 1048576., fn);
+	free(fn);
+	return idx;
 }
 
 /***********************
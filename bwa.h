@@ -9,14 +9,53 @@
 #define BWA_IDX_BNS 0x2
 #define BWA_IDX_PAC 0x4
 #define BWA_IDX_ALL 0x7
+#define BWA_IDX_HUGE 0x8 // with bwa_idx_load(): put the index on huge pages; see bwa_idx_hugepage()
+#define BWA_IDX_LAZY 0x10 // map .sa and .pac instead of reading them, so only the pages in use are read
 
-#define BWA_CTL_SIZE 0x10000
+#define BWA_SHM_MAX_IDX  256 // index versions in the shared memory registry
+#define BWA_SHM_NAME_LEN 128 // the longest index name in the registry, plus one
+#define BWA_MMAP_HDR_SIZE 4096 // the header page of a .bwaidx file
+#define BWA_LOAD_THREADS  8    // concurrent reads in bwa_idx_load_from_disk()
+
+#define BWA_NUMA_OFF        0
+#define BWA_NUMA_REPLICATE  1 // a copy of the index on each NUMA node
+#define BWA_NUMA_INTERLEAVE 2 // one copy with its pages spread over the nodes
 
 #define BWTALGO_AUTO  0
 #define BWTALGO_RB2   1
 #define BWTALGO_BWTSW 2
 #define BWTALGO_IS    3
 
+// phases of bwa_idx_build2(), in this order; BWA_BUILD_SA is skipped if is wrote the .sa, BWA_BUILD_KMER without the k-mer table
+#define BWA_BUILD_PACK   0 // FASTA to .pac
+#define BWA_BUILD_BWT    1 // BWT construction
+#define BWA_BUILD_UPDATE 2 // the Occ of the BWT
+#define BWA_BUILD_SA     3 // the sampled SA
+#define BWA_BUILD_KMER   4 // the k-mer table
+
+typedef struct {
+	int phase;        // BWA_BUILD_*
+	double done;      // fraction of the phase done; 0 at its start and 1 at its end
+	double real, cpu; // wall-clock and CPU seconds (of all threads) since the phase started
+	int64_t bytes;    // input processed by the phase so far, in bytes of 2-bit bases
+	int64_t peak_rss; // peak resident memory of the process so far, in bytes
+} bwa_idxstat_t;
+
+// called from the thread of bwa_idx_build2() or from one worker at a time; bwtsw and the SA report as they proceed
+typedef void (*bwa_idx_progress_f)(const bwa_idxstat_t *st, void *data);
+
+typedef struct {
+	int algo_type;  // BWTALGO_*
+	int block_size; // block size for BWTALGO_BWTSW
+	int bwt_fmt;    // BWT_FMT_*: layout of the .bwt file
+	int sa_intv;    // SA sampling interval; a power of 2. 1 for the full SA
+	int kmer_k;     // if in [1,BWT_KMER_MAX], also write the k-mer table to .kmer
+	int n_threads;  // threads for the multi-threaded steps
+	int64_t max_mem; // if >0, memory budget in bytes; sets the algorithm if auto, the bwtsw block size and the SA passes
+	bwa_idx_progress_f progress; // if not NULL, called at the start and the end of each phase and as it proceeds
+	void *progress_data;
+} bwa_idxopt_t;
+
 typedef struct {
 	bwt_t    *bwt; // FM-index
 	bntseq_t *bns; // information on the reference sequences
@@ -25,8 +64,20 @@ typedef struct {
 	int    is_shm;
 	int64_t l_mem;
 	uint8_t  *mem;
+	int    is_mmap; // mem is mapped from a .bwaidx file, BWA_MMAP_HDR_SIZE bytes after its start
+	int    huge;    // HUGE_* in utils.h: how mem is allocated if neither in shm nor mapped
+	int    shm_fd, shm_slot, shm_ver; // a reader's hold on an index attached from shared memory
+	int64_t l_pac_map; // if >0, pac is a private mapping of the .pac file of this size
 } bwaidx_t;
 
+typedef struct {
+	int mode, n_node; // BWA_NUMA_*; NUMA nodes with CPUs in use
+	int *id;          // sysfs number of each node
+	void *cpus;       // cpu_set_t of each node; NULL if the topology is unknown
+	bwaidx_t *idx;    // the index as loaded
+	bwaidx_t **rep;   // rep[i]: the copy of the index for threads on node i
+} bwa_numa_t;
+
 typedef struct {
 	int l_seq, id;
 	char *name, *comment, *seq, *qual, *sam;
@@ -46,17 +97,36 @@ extern "C" {
 	uint32_t *bwa_gen_cigar(const int8_t mat[25], int q, int r, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM);
 	uint32_t *bwa_gen_cigar2(const int8_t mat[25], int o_del, int e_del, int o_ins, int e_ins, int w_, int64_t l_pac, const uint8_t *pac, int l_query, uint8_t *query, int64_t rb, int64_t re, int *score, int *n_cigar, int *NM);
 
+	void bwa_idxopt_init(bwa_idxopt_t *opt);
 	int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_size);
+	int bwa_idx_build2(const char *fa, const char *prefix, const bwa_idxopt_t *opt);
+	// BWTALGO_IS if the reference is short or the memory for its suffix array and SA samples is available, else BWTALGO_BWTSW
+	int bwa_idx_auto_algo(int64_t l_pac, int sa_intv);
+	// add the sequences in fa to the index at prefix without rebuilding it, the same as indexing all at once; -1 on failure
+	int bwa_idx_append(const char *prefix, const char *fa, int n_threads);
 
 	char *bwa_idx_infer_prefix(const char *hint);
 	bwt_t *bwa_idx_load_bwt(const char *hint);
 
 	bwaidx_t *bwa_idx_load_from_shm(const char *hint);
+	void bwa_shm_detach(bwaidx_t *idx);
+	bwaidx_t *bwa_idx_load_from_mmap(const char *hint);
 	bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which);
+	// read the components of the index concurrently on _n_threads_ threads; report the time of each at verbosity 3
+	bwaidx_t *bwa_idx_load_from_disk2(const char *hint, int which, int n_threads);
 	bwaidx_t *bwa_idx_load(const char *hint, int which);
 	void bwa_idx_destroy(bwaidx_t *idx);
 	int bwa_idx2mem(bwaidx_t *idx);
 	int bwa_mem2idx(int64_t l_mem, uint8_t *mem, bwaidx_t *idx);
+	// move a loaded index to huge pages, or advise them for a mapped one; log what is obtained; 0 if any
+	int bwa_idx_hugepage(bwaidx_t *idx);
+	void bwa_idx_dump_mmap(const char *fn, bwaidx_t *idx);
+
+	// place the index on the first _max_node_ NUMA nodes (all if <=0) as _mode_ asks
+	bwa_numa_t *bwa_numa_init(bwaidx_t *idx, int mode, int max_node);
+	void bwa_numa_destroy(bwa_numa_t *nm);
+	// pin the calling thread, worker _tid_, to its node; return the index of the node in nm->rep
+	int bwa_numa_bind(const bwa_numa_t *nm, int tid);
 
 	void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line);
 	char *bwa_set_rg(const char *s);
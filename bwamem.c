@@ -92,6 +92,8 @@ KSORT_INIT(mem_intv, bwtintv_t, intv_lt)
 
 typedef struct {
 	bwtintv_v mem, mem1, *tmpv[2];
+	kvec_t(bwtint_t) sa; // SA ranks to locate in mem_chain()
+	kswbuf_t kbuf; // scratch memory of ksw_extend2_batch()
 } smem_aux_t;
 
 static smem_aux_t *smem_aux_init()
@@ -108,6 +110,8 @@ static void smem_aux_destroy(smem_aux_t *a)
 	free(a->tmpv[0]->a); free(a->tmpv[0]);
 	free(a->tmpv[1]->a); free(a->tmpv[1]);
 	free(a->mem.a); free(a->mem1.a);
+	free(a->sa.a);
+	ksw_buf_destroy(&a->kbuf);
 	free(a);
 }
 
@@ -161,6 +165,291 @@ static void mem_collect_intv(const mem_opt_t *opt, const bwt_t *bwt, int len, co
 	ks_introsort(mem_intv, a->mem.n, a->mem.a);
 }
 
+/***********************
+ * Batched SMEM search *
+ ***********************/
+
+/* mem_collect_intv() of many reads in lockstep. Each read (lane) runs the
+ * same passes, bwt_smem1a() and bwt_seed_strategy1() as state machines that
+ * stop at every bwt_extend(). The Occ data of all stopped lanes is prefetched
+ * before any of them resumes, so the cache misses of different reads overlap.
+ * The seeds are the same as from mem_collect_intv(). */
+
+#define MEM_SEED_BATCH 32 // reads seeded in lockstep by one thread
+
+typedef kvec_t(uint8_t) uint8_v;
+
+enum { SM_NONE, SM_DONE, SM_FWD, SM_FWD_EXT, SM_FWD_NEXT, SM_FWD_END, SM_BWD, SM_BWD_J, SM_BWD_EXT, SM_BWD_KEEP, SM_S1, SM_S1_EXT };
+
+typedef struct {
+	int len;
+	const uint8_t *seq;
+	int pass, x, k, old_n; // where we are in mem_collect_intv()
+	int st, sx, i, j, c, min_intv, ret; // where we are in bwt_smem1a() or bwt_seed_strategy1() started at sx
+	uint32_t kmer;
+	uint64_t max_intv;
+	bwtintv_t ik, ok[4], m;
+	bwtintv_v mem, mem1, tmp[2], *prev, *curr;
+	uint8_v rev; // the reversed query and reference of a left extension
+	uint64_v srt; // the seeds of the chain being extended, by score
+} mem_lane_t;
+
+static void lane_reverse_intvs(bwtintv_v *p)
+{
+	int j;
+	for (j = 0; j < p->n>>1; ++j) {
+		bwtintv_t tmp = p->a[p->n - 1 - j];
+		p->a[p->n - 1 - j] = p->a[j];
+		p->a[j] = tmp;
+	}
+}
+
+// the same as bwt_smem1a(bwt, l->len, l->seq, l->sx, l->min_intv, l->max_intv, &l->mem1, ...) or bwt_seed_strategy1(); return 1 if stopped at an extension
+static int lane_smem(const bwt_t *bwt, mem_lane_t *l)
+{
+	const uint8_t *q = l->seq;
+	bwtintv_v *swap;
+	bwtintv_t *p;
+	int c;
+	for (;;) {
+		switch (l->st) {
+		case SM_FWD: // the forward search at l->i
+			if (l->i == l->len) { // push the last interval if we reach the end
+				kv_push(bwtintv_t, *l->curr, l->ik);
+				l->st = SM_FWD_END;
+			} else if (l->ik.x[2] < l->max_intv || q[l->i] > 3) { // an interval small enough, or an ambiguous base
+				kv_push(bwtintv_t, *l->curr, l->ik);
+				l->st = SM_FWD_END;
+			} else if (l->i - l->sx < bwt->kmer_k) { // q[sx..i] is in the k-mer table
+				c = 3 - q[l->i];
+				l->kmer |= (uint32_t)q[l->i] << ((l->i - l->sx)<<1);
+				bwt_kmer_intv(bwt, l->i - l->sx + 1, l->kmer, &l->ok[c]);
+				l->st = l->ok[c].x[2]? SM_FWD_NEXT : SM_FWD_EXT;
+				if (l->st == SM_FWD_EXT) return 1;
+			} else {
+				l->st = SM_FWD_EXT;
+				return 1;
+			}
+			break;
+		case SM_FWD_EXT:
+			bwt_extend(bwt, &l->ik, l->ok, 0);
+			// fall through
+		case SM_FWD_NEXT:
+			c = 3 - q[l->i];
+			l->st = SM_FWD;
+			if (l->ok[c].x[2] != l->ik.x[2]) { // change of the interval size
+				kv_push(bwtintv_t, *l->curr, l->ik);
+				if (l->ok[c].x[2] < l->min_intv) { // the interval size is too small to be extended further
+					l->st = SM_FWD_END;
+					break;
+				}
+			}
+			l->ik = l->ok[c]; l->ik.info = l->i + 1;
+			++l->i;
+			break;
+		case SM_FWD_END:
+			lane_reverse_intvs(l->curr); // s.t. smaller intervals (i.e. longer matches) visited first
+			l->ret = l->curr->a[0].info;
+			swap = l->curr; l->curr = l->prev; l->prev = swap;
+			l->i = l->sx - 1;
+			l->st = SM_BWD;
+			break;
+		case SM_BWD: // a round of the backward search at l->i
+			l->c = l->i < 0? -1 : q[l->i] < 4? q[l->i] : -1;
+			l->j = 0, l->curr->n = 0;
+			l->st = SM_BWD_J;
+			break;
+		case SM_BWD_J:
+			if (l->j == l->prev->n) { // the end of a round
+				if (l->curr->n == 0) {
+					lane_reverse_intvs(&l->mem1); // s.t. sorted by the start coordinate
+					l->st = SM_DONE;
+					return 0;
+				}
+				swap = l->curr; l->curr = l->prev; l->prev = swap;
+				--l->i;
+				l->st = SM_BWD;
+			} else if (l->c >= 0 && l->ik.x[2] >= l->max_intv) {
+				l->st = SM_BWD_EXT;
+				return 1;
+			} else l->st = SM_BWD_KEEP;
+			break;
+		case SM_BWD_EXT:
+			bwt_extend(bwt, &l->prev->a[l->j], l->ok, 1);
+			// fall through
+		case SM_BWD_KEEP:
+			p = &l->prev->a[l->j++];
+			c = l->c;
+			l->st = SM_BWD_J;
+			if (c < 0 || l->ik.x[2] < l->max_intv || l->ok[c].x[2] < l->min_intv) {
+				if (l->curr->n == 0 && (l->mem1.n == 0 || l->i + 1 < l->mem1.a[l->mem1.n-1].info>>32)) {
+					l->ik = *p; l->ik.info |= (uint64_t)(l->i + 1)<<32;
+					kv_push(bwtintv_t, l->mem1, l->ik);
+				}
+			} else if (l->curr->n == 0 || l->ok[c].x[2] != l->curr->a[l->curr->n-1].x[2]) {
+				l->ok[c].info = p->info;
+				kv_push(bwtintv_t, *l->curr, l->ok[c]);
+			}
+			break;
+		case SM_S1: // bwt_seed_strategy1() at l->i
+			if (l->i == l->len) l->ret = l->len;
+			else if (q[l->i] > 3) l->ret = l->i + 1;
+			else {
+				l->st = SM_S1_EXT;
+				return 1;
+			}
+			l->st = SM_DONE;
+			return 0;
+		case SM_S1_EXT:
+			bwt_extend(bwt, &l->ik, l->ok, 0);
+			c = 3 - q[l->i];
+			if (l->ok[c].x[2] < l->max_intv && l->i - l->sx >= l->min_intv) {
+				l->m = l->ok[c];
+				l->m.info = (uint64_t)l->sx<<32 | (l->i + 1);
+				l->ret = l->i + 1;
+				l->st = SM_DONE;
+				return 0;
+			}
+			l->ik = l->ok[c];
+			++l->i;
+			l->st = SM_S1;
+			break;
+		default:
+			return 0;
+		}
+	}
+}
+
+static void lane_smem_init(const bwt_t *bwt, mem_lane_t *l, int x, int min_intv, uint64_t max_intv)
+{
+	l->sx = x, l->min_intv = min_intv < 1? 1 : min_intv, l->max_intv = max_intv;
+	l->mem1.n = 0;
+	l->prev = &l->tmp[0], l->curr = &l->tmp[1];
+	bwt_set_intv(bwt, l->seq[x], l->ik); // the initial interval of a single base
+	l->ik.info = x + 1;
+	l->kmer = l->seq[x];
+	l->i = x + 1, l->curr->n = 0;
+	l->st = SM_FWD;
+}
+
+static void lane_s1_init(const bwt_t *bwt, mem_lane_t *l, int x, int min_len, int max_intv)
+{
+	int i, d;
+	uint32_t kmer = 0;
+	bwtintv_t tk;
+	l->sx = x, l->min_intv = min_len, l->max_intv = max_intv;
+	memset(&l->m, 0, sizeof(bwtintv_t));
+	bwt_set_intv(bwt, l->seq[x], l->ik);
+	l->i = x + 1;
+	l->st = SM_S1;
+	d = bwt->kmer_k < min_len? bwt->kmer_k : min_len;
+	if (bwt->kmer_k > 1 && x + d <= l->len) { // as in bwt_seed_strategy1()
+		for (i = x; i < x + d; ++i) {
+			if (l->seq[i] > 3) {
+				l->ret = i + 1;
+				l->st = SM_DONE;
+				return;
+			}
+			kmer |= (uint32_t)l->seq[i] << ((i - x)<<1);
+		}
+		bwt_kmer_intv(bwt, d, kmer, &tk);
+		if (tk.x[2] > 0) l->ik = tk, l->i = x + d;
+	}
+}
+
+// the same as mem_collect_intv(); return 1 if stopped at an extension
+static int lane_run(const mem_opt_t *opt, const bwt_t *bwt, mem_lane_t *l)
+{
+	int i, split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
+	for (;;) {
+		if (l->st != SM_NONE) { // finish the call in progress and take its output
+			if (lane_smem(bwt, l)) return 1;
+			l->st = SM_NONE;
+			if (l->pass == 1) {
+				for (i = 0; i < l->mem1.n; ++i) {
+					bwtintv_t *p = &l->mem1.a[i];
+					if ((uint32_t)p->info - (p->info>>32) >= opt->min_seed_len)
+						kv_push(bwtintv_t, l->mem, *p);
+				}
+				l->x = l->ret;
+			} else if (l->pass == 2) {
+				for (i = 0; i < l->mem1.n; ++i)
+					if ((uint32_t)l->mem1.a[i].info - (l->mem1.a[i].info>>32) >= opt->min_seed_len)
+						kv_push(bwtintv_t, l->mem, l->mem1.a[i]);
+				++l->k;
+			} else {
+				if (l->m.x[2] > 0) kv_push(bwtintv_t, l->mem, l->m);
+				l->x = l->ret;
+			}
+		}
+		if (l->pass == 1) { // first pass: find all SMEMs
+			while (l->x < l->len && l->seq[l->x] > 3) ++l->x;
+			if (l->x < l->len) {
+				lane_smem_init(bwt, l, l->x, 1, 0);
+				continue;
+			}
+			l->pass = 2, l->k = 0, l->old_n = l->mem.n;
+		}
+		if (l->pass == 2) { // second pass: find MEMs inside a long SMEM
+			for (; l->k < l->old_n; ++l->k) {
+				bwtintv_t *p = &l->mem.a[l->k];
+				int start = p->info>>32, end = (int32_t)p->info;
+				if (end - start < split_len || p->x[2] > opt->split_width) continue;
+				lane_smem_init(bwt, l, (start + end)>>1, p->x[2]+1, 0);
+				break;
+			}
+			if (l->k < l->old_n) continue;
+			l->pass = 3, l->x = 0;
+		}
+		if (l->pass == 3 && opt->max_mem_intv > 0) { // third pass: LAST-like
+			while (l->x < l->len && l->seq[l->x] > 3) ++l->x;
+			if (l->x < l->len) {
+				lane_s1_init(bwt, l, l->x, opt->min_seed_len, opt->max_mem_intv);
+				continue;
+			}
+		}
+		l->pass = 4;
+		ks_introsort(mem_intv, l->mem.n, l->mem.a);
+		return 0;
+	}
+}
+
+static void lane_prefetch(const bwt_t *bwt, const mem_lane_t *l)
+{
+	if (l->st == SM_BWD_EXT) bwt_extend_prefetch(bwt, &l->prev->a[l->j], 1);
+	else bwt_extend_prefetch(bwt, &l->ik, 0);
+}
+
+// seed n <= MEM_SEED_BATCH reads, whose len and seq are set; the seeds of lanes[i] are in lanes[i].mem
+static void mem_collect_intv_batch(const mem_opt_t *opt, const bwt_t *bwt, int n, mem_lane_t *lanes)
+{
+	int i, j, n_wait, wait[MEM_SEED_BATCH];
+	for (i = n_wait = 0; i < n; ++i) {
+		mem_lane_t *l = &lanes[i];
+		l->mem.n = 0, l->x = 0, l->st = SM_NONE;
+		l->pass = l->len < opt->min_seed_len? 4 : 1; // mem_chain() skips such reads
+		if (lane_run(opt, bwt, l)) wait[n_wait++] = i;
+	}
+	while (n_wait > 0) {
+		for (i = 0; i < n_wait; ++i)
+			lane_prefetch(bwt, &lanes[wait[i]]);
+		for (i = j = 0; i < n_wait; ++i)
+			if (lane_run(opt, bwt, &lanes[wait[i]])) wait[j++] = wait[i];
+		n_wait = j;
+	}
+}
+
+static void mem_lanes_destroy(mem_lane_t *lanes)
+{
+	int i;
+	for (i = 0; i < MEM_SEED_BATCH; ++i) {
+		free(lanes[i].mem.a); free(lanes[i].mem1.a);
+		free(lanes[i].tmp[0].a); free(lanes[i].tmp[1].a);
+		free(lanes[i].rev.a); free(lanes[i].srt.a);
+	}
+	free(lanes);
+}
+
 /************
  * Chaining *
  ************/
@@ -248,20 +537,17 @@ void mem_print_chain(const bntseq_t *bns, mem_chain_v *chn)
 	}
 }
 
-mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, int len, const uint8_t *seq, void *buf)
+// chain the seeds of the SA intervals in aux->mem, the output of mem_collect_intv()
+static mem_chain_v mem_chain_intv(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, int len, const uint8_t *seq, smem_aux_t *aux)
 {
 	int i, b, e, l_rep;
+	size_t j;
 	int64_t l_pac = bns->l_pac;
 	mem_chain_v chain;
 	kbtree_t(chn) *tree;
-	smem_aux_t *aux;
 
 	kv_init(chain);
-	if (len < opt->min_seed_len) return chain; // if the query is shorter than the seed length, no match
 	tree = kb_init(chn, KB_DEFAULT_SIZE);
-
-	aux = buf? (smem_aux_t*)buf : smem_aux_init();
-	mem_collect_intv(opt, bwt, len, seq, aux);
 	for (i = 0, b = e = l_rep = 0; i < aux->mem.n; ++i) { // compute frac_rep
 		bwtintv_t *p = &aux->mem.a[i];
 		int sb = (p->info>>32), se = (uint32_t)p->info;
@@ -270,7 +556,16 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
 		else e = e > se? e : se;
 	}
 	l_rep += e - b;
-	for (i = 0; i < aux->mem.n; ++i) {
+	for (i = 0, aux->sa.n = 0; i < aux->mem.n; ++i) { // collect SA ranks of all seeds, then locate them in one batch
+		bwtintv_t *p = &aux->mem.a[i];
+		int step, count;
+		int64_t k;
+		step = p->x[2] > opt->max_occ? p->x[2] / opt->max_occ : 1;
+		for (k = count = 0; k < p->x[2] && count < opt->max_occ; k += step, ++count)
+			kv_push(bwtint_t, aux->sa, p->x[0] + k);
+	}
+	bwt_sa_batch(bwt, aux->sa.n, aux->sa.a, aux->sa.a);
+	for (i = 0, j = 0; i < aux->mem.n; ++i) {
 		bwtintv_t *p = &aux->mem.a[i];
 		int step, count, slen = (uint32_t)p->info - (p->info>>32); // seed length
 		int64_t k;
@@ -280,7 +575,7 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
 			mem_chain_t tmp, *lower, *upper;
 			mem_seed_t s;
 			int rid, to_add = 0;
-			s.rbeg = tmp.pos = bwt_sa(bwt, p->x[0] + k); // this is the base coordinate in the forward-reverse reference
+			s.rbeg = tmp.pos = aux->sa.a[j++]; // this is the base coordinate in the forward-reverse reference
 			s.qbeg = p->info>>32;
 			s.score= s.len = slen;
 			rid = bns_intv2rid(bns, s.rbeg, s.rbeg + s.len);
@@ -299,7 +594,6 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
 			}
 		}
 	}
-	if (buf == 0) smem_aux_destroy(aux);
 
 	kv_resize(mem_chain_t, chain, kb_size(tree));
 
@@ -314,6 +608,20 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
 	return chain;
 }
 
+mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, int len, const uint8_t *seq, void *buf)
+{
+	mem_chain_v chain;
+	smem_aux_t *aux;
+
+	kv_init(chain);
+	if (len < opt->min_seed_len) return chain; // if the query is shorter than the seed length, no match
+	aux = buf? (smem_aux_t*)buf : smem_aux_init();
+	mem_collect_intv(opt, bwt, len, seq, aux);
+	chain = mem_chain_intv(opt, bwt, bns, len, seq, aux);
+	if (buf == 0) smem_aux_destroy(aux);
+	return chain;
+}
+
 /********************
  * Filtering chains *
  ********************/
@@ -629,25 +937,44 @@ static inline int cal_max_gap(const mem_opt_t *opt, int qlen)
 
 #define MAX_BAND_TRY  2
 
-void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av)
+/* mem_chain2aln() as a state machine that stops at every ksw_extend2(), so
+ * that the extensions of many reads can be run together by
+ * ksw_extend2_batch(). mem_ext_next() returns the next extension of a chain
+ * and mem_ext_apply() takes its result; the alignments are the same as from
+ * the extensions run one by one. The chains of a read depend on each other
+ * through the regions found so far, so a round of worker1() has at most one
+ * extension per read, MEM_SEED_BATCH in all, and the rounds with fewer than
+ * 16 go to ksw_extend2(). */
+
+typedef struct {
+	const mem_chain_t *c;
+	const uint8_t *query;
+	int l_query, k, state; // k: the seed being extended, in srt; state: 0 for the next seed, 1 for the left and 2 for the right extension
+	int i, aw[2], sc0, qe, re, l_rs; // i: the band try; aw: actual bandwidth used in extension
+	size_t a; // the alignment being built, in av
+	int64_t rmax[2];
+	uint8_t *rseq, *qs, *rs;
+	uint8_v *rev; // memory for qs and rs, kept across chains
+	uint64_t *srt; // the seeds sorted by score; the memory is kept across chains
+} mem_ext_t;
+
+static void mem_ext_init(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, uint8_v *rev, uint64_v *srt, mem_ext_t *e)
 {
-	int i, k, rid, max_off[2], aw[2]; // aw: actual bandwidth used in extension
-	int64_t l_pac = bns->l_pac, rmax[2], tmp, max = 0;
-	const mem_seed_t *s;
-	uint8_t *rseq = 0;
-	uint64_t *srt;
+	int i, rid;
+	int64_t l_pac = bns->l_pac, *rmax = e->rmax;
 
+	memset(e, 0, sizeof(mem_ext_t));
+	e->c = c, e->query = query, e->l_query = l_query, e->k = c->n - 1, e->rev = rev;
 	if (c->n == 0) return;
 	// get the max possible span
 	rmax[0] = l_pac<<1; rmax[1] = 0;
 	for (i = 0; i < c->n; ++i) {
-		int64_t b, e;
+		int64_t beg, end;
 		const mem_seed_t *t = &c->seeds[i];
-		b = t->rbeg - (t->qbeg + cal_max_gap(opt, t->qbeg));
-		e = t->rbeg + t->len + ((l_query - t->qbeg - t->len) + cal_max_gap(opt, l_query - t->qbeg - t->len));
-		rmax[0] = rmax[0] < b? rmax[0] : b;
-		rmax[1] = rmax[1] > e? rmax[1] : e;
-		if (t->len > max) max = t->len;
+		beg = t->rbeg - (t->qbeg + cal_max_gap(opt, t->qbeg));
+		end = t->rbeg + t->len + ((l_query - t->qbeg - t->len) + cal_max_gap(opt, l_query - t->qbeg - t->len));
+		rmax[0] = rmax[0] < beg? rmax[0] : beg;
+		rmax[1] = rmax[1] > end? rmax[1] : end;
 	}
 	rmax[0] = rmax[0] > 0? rmax[0] : 0;
 	rmax[1] = rmax[1] < l_pac<<1? rmax[1] : l_pac<<1;
@@ -656,17 +983,70 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
 		else rmax[0] = l_pac;
 	}
 	// retrieve the reference sequence
-	rseq = bns_fetch_seq(bns, pac, &rmax[0], c->seeds[0].rbeg, &rmax[1], &rid);
+	e->rseq = bns_fetch_seq(bns, pac, &rmax[0], c->seeds[0].rbeg, &rmax[1], &rid);
 	assert(c->rid == rid);
 
-	srt = malloc(c->n * 8);
+	if (srt->m < c->n) kv_resize(uint64_t, *srt, c->n);
+	e->srt = srt->a;
 	for (i = 0; i < c->n; ++i)
-		srt[i] = (uint64_t)c->seeds[i].score<<32 | i;
-	ks_introsort_64(c->n, srt);
+		e->srt[i] = (uint64_t)c->seeds[i].score<<32 | i;
+	ks_introsort_64(c->n, e->srt);
+}
 
-	for (k = c->n - 1; k >= 0; --k) {
+static void mem_ext_finish(mem_ext_t *e, mem_alnreg_v *av) // the alignment from seed k is complete
+{
+	const mem_chain_t *c = e->c;
+	const mem_seed_t *s = &c->seeds[(uint32_t)e->srt[e->k]];
+	mem_alnreg_t *a = &av->a[e->a];
+	int i;
+	if (bwa_verbose >= 4) printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n", a->qb, a->qe, (long)a->rb, (long)a->re, a->score, e->aw[0], e->aw[1]);
+
+	// compute seedcov
+	for (i = 0, a->seedcov = 0; i < c->n; ++i) {
+		const mem_seed_t *t = &c->seeds[i];
+		if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb && t->rbeg + t->len <= a->re) // seed fully contained
+			a->seedcov += t->len; // this is not very accurate, but for approx. mapQ, this is good enough
+	}
+	a->w = e->aw[0] > e->aw[1]? e->aw[0] : e->aw[1];
+	a->seedlen0 = s->len;
+
+	a->frac_rep = c->frac_rep;
+	e->state = 0, --e->k;
+}
+
+static void mem_ext_right(mem_ext_t *e, mem_alnreg_v *av) // the left end of the alignment from seed k is known
+{
+	const mem_seed_t *s = &e->c->seeds[(uint32_t)e->srt[e->k]];
+	mem_alnreg_t *a = &av->a[e->a];
+	if (s->qbeg + s->len != e->l_query) { // right extension
+		e->sc0 = a->score;
+		e->qe = s->qbeg + s->len;
+		e->re = s->rbeg + s->len - e->rmax[0];
+		assert(e->re >= 0);
+		e->i = 0, e->state = 2;
+	} else {
+		a->qe = e->l_query, a->re = s->rbeg + s->len;
+		mem_ext_finish(e, av);
+	}
+}
+
+// set *x to the next extension of the chain and return 1, or return 0 if the chain is done
+static int mem_ext_next(const mem_opt_t *opt, const bntseq_t *bns, mem_ext_t *e, mem_alnreg_v *av, kswext_t *x)
+{
+	const mem_chain_t *c = e->c;
+	const uint8_t *query = e->query;
+	const mem_seed_t *s;
+	int i, j, l_query = e->l_query;
+
+	while (e->state == 0) {
 		mem_alnreg_t *a;
-		s = &c->seeds[(uint32_t)srt[k]];
+		int k = e->k;
+		if (k < 0) {
+			free(e->rseq);
+			e->rseq = 0;
+			return 0;
+		}
+		s = &c->seeds[(uint32_t)e->srt[k]];
 
 		for (i = 0; i < av->n; ++i) { // test whether extension has been made before
 			mem_alnreg_t *p = &av->a[i];
@@ -691,98 +1071,109 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
 					   k, (long)s->len, (long)s->qbeg, (long)s->rbeg, av->a[i].qb, av->a[i].qe, (long)av->a[i].rb, (long)av->a[i].re);
 			for (i = k + 1; i < c->n; ++i) { // check overlapping seeds in the same chain
 				const mem_seed_t *t;
-				if (srt[i] == 0) continue;
-				t = &c->seeds[(uint32_t)srt[i]];
+				if (e->srt[i] == 0) continue;
+				t = &c->seeds[(uint32_t)e->srt[i]];
 				if (t->len < s->len * .95) continue; // only check overlapping if t is long enough; TODO: more efficient by early stopping
 				if (s->qbeg <= t->qbeg && s->qbeg + s->len - t->qbeg >= s->len>>2 && t->qbeg - s->qbeg != t->rbeg - s->rbeg) break;
 				if (t->qbeg <= s->qbeg && t->qbeg + t->len - s->qbeg >= s->len>>2 && s->qbeg - t->qbeg != s->rbeg - t->rbeg) break;
 			}
 			if (i == c->n) { // no overlapping seeds; then skip extension
-				srt[k] = 0; // mark that seed extension has not been performed
+				e->srt[k] = 0; // mark that seed extension has not been performed
+				--e->k;
 				continue;
 			}
 			if (bwa_verbose >= 4)
 				printf("** Seed(%d) might lead to a different alignment even though it is contained. Extension will be performed.\n", k);
 		}
 
+		e->a = av->n;
 		a = kv_pushp(mem_alnreg_t, *av);
 		memset(a, 0, sizeof(mem_alnreg_t));
-		a->w = aw[0] = aw[1] = opt->w;
+		a->w = e->aw[0] = e->aw[1] = opt->w;
 		a->score = a->truesc = -1;
 		a->rid = c->rid;
 
 		if (bwa_verbose >= 4) err_printf("** ---> Extending from seed(%d) [%ld;%ld,%ld] @ %s <---\n", k, (long)s->len, (long)s->qbeg, (long)s->rbeg, bns->anns[c->rid].name);
 		if (s->qbeg) { // left extension
-			uint8_t *rs, *qs;
-			int qle, tle, gtle, gscore;
-			qs = malloc(s->qbeg);
-			for (i = 0; i < s->qbeg; ++i) qs[i] = query[s->qbeg - 1 - i];
-			tmp = s->rbeg - rmax[0];
-			rs = malloc(tmp);
-			for (i = 0; i < tmp; ++i) rs[i] = rseq[tmp - 1 - i];
-			for (i = 0; i < MAX_BAND_TRY; ++i) {
-				int prev = a->score;
-				aw[0] = opt->w << i;
-				if (bwa_verbose >= 4) {
-					int j;
-					printf("*** Left ref:   "); for (j = 0; j < tmp; ++j) putchar("ACGTN"[(int)rs[j]]); putchar('\n');
-					printf("*** Left query: "); for (j = 0; j < s->qbeg; ++j) putchar("ACGTN"[(int)qs[j]]); putchar('\n');
-				}
-				a->score = ksw_extend2(s->qbeg, qs, tmp, rs, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, aw[0], opt->pen_clip5, opt->zdrop, s->len * opt->a, &qle, &tle, &gtle, &gscore, &max_off[0]);
-				if (bwa_verbose >= 4) { printf("*** Left extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", prev, a->score, aw[0], max_off[0]); fflush(stdout); }
-				if (a->score == prev || max_off[0] < (aw[0]>>1) + (aw[0]>>2)) break;
-			}
-			// check whether we prefer to reach the end of the query
-			if (gscore <= 0 || gscore <= a->score - opt->pen_clip5) { // local extension
-				a->qb = s->qbeg - qle, a->rb = s->rbeg - tle;
-				a->truesc = a->score;
-			} else { // to-end extension
-				a->qb = 0, a->rb = s->rbeg - gtle;
-				a->truesc = gscore;
-			}
-			free(qs); free(rs);
-		} else a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
-
-		if (s->qbeg + s->len != l_query) { // right extension
-			int qle, tle, qe, re, gtle, gscore, sc0 = a->score;
-			qe = s->qbeg + s->len;
-			re = s->rbeg + s->len - rmax[0];
-			assert(re >= 0);
-			for (i = 0; i < MAX_BAND_TRY; ++i) {
-				int prev = a->score;
-				aw[1] = opt->w << i;
-				if (bwa_verbose >= 4) {
-					int j;
-					printf("*** Right ref:   "); for (j = 0; j < rmax[1] - rmax[0] - re; ++j) putchar("ACGTN"[(int)rseq[re+j]]); putchar('\n');
-					printf("*** Right query: "); for (j = 0; j < l_query - qe; ++j) putchar("ACGTN"[(int)query[qe+j]]); putchar('\n');
-				}
-				a->score = ksw_extend2(l_query - qe, query + qe, rmax[1] - rmax[0] - re, rseq + re, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, aw[1], opt->pen_clip3, opt->zdrop, sc0, &qle, &tle, &gtle, &gscore, &max_off[1]);
-				if (bwa_verbose >= 4) { printf("*** Right extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", prev, a->score, aw[1], max_off[1]); fflush(stdout); }
-				if (a->score == prev || max_off[1] < (aw[1]>>1) + (aw[1]>>2)) break;
-			}
-			// similar to the above
-			if (gscore <= 0 || gscore <= a->score - opt->pen_clip3) { // local extension
-				a->qe = qe + qle, a->re = rmax[0] + re + tle;
-				a->truesc += a->score - sc0;
-			} else { // to-end extension
-				a->qe = l_query, a->re = rmax[0] + re + gtle;
-				a->truesc += gscore - sc0;
-			}
-		} else a->qe = l_query, a->re = s->rbeg + s->len;
-		if (bwa_verbose >= 4) printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n", a->qb, a->qe, (long)a->rb, (long)a->re, a->score, aw[0], aw[1]);
-
-		// compute seedcov
-		for (i = 0, a->seedcov = 0; i < c->n; ++i) {
-			const mem_seed_t *t = &c->seeds[i];
-			if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb && t->rbeg + t->len <= a->re) // seed fully contained
-				a->seedcov += t->len; // this is not very accurate, but for approx. mapQ, this is good enough
+			e->l_rs = s->rbeg - e->rmax[0];
+			if (e->rev->m < s->qbeg + e->l_rs) kv_resize(uint8_t, *e->rev, s->qbeg + e->l_rs);
+			e->qs = e->rev->a, e->rs = e->qs + s->qbeg;
+			for (i = 0; i < s->qbeg; ++i) e->qs[i] = query[s->qbeg - 1 - i];
+			for (i = 0; i < e->l_rs; ++i) e->rs[i] = e->rseq[e->l_rs - 1 - i];
+			e->i = 0, e->state = 1;
+		} else {
+			a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
+			mem_ext_right(e, av);
+		}
+	}
+
+	s = &c->seeds[(uint32_t)e->srt[e->k]];
+	if (e->state == 1) {
+		e->aw[0] = opt->w << e->i;
+		if (bwa_verbose >= 4) {
+			printf("*** Left ref:   "); for (j = 0; j < e->l_rs; ++j) putchar("ACGTN"[(int)e->rs[j]]); putchar('\n');
+			printf("*** Left query: "); for (j = 0; j < s->qbeg; ++j) putchar("ACGTN"[(int)e->qs[j]]); putchar('\n');
+		}
+		x->qlen = s->qbeg, x->query = e->qs, x->tlen = e->l_rs, x->target = e->rs;
+		x->w = e->aw[0], x->end_bonus = opt->pen_clip5, x->h0 = s->len * opt->a;
+	} else {
+		int l_ref = e->rmax[1] - e->rmax[0] - e->re;
+		e->aw[1] = opt->w << e->i;
+		if (bwa_verbose >= 4) {
+			printf("*** Right ref:   "); for (j = 0; j < l_ref; ++j) putchar("ACGTN"[(int)e->rseq[e->re+j]]); putchar('\n');
+			printf("*** Right query: "); for (j = 0; j < l_query - e->qe; ++j) putchar("ACGTN"[(int)query[e->qe+j]]); putchar('\n');
 		}
-		a->w = aw[0] > aw[1]? aw[0] : aw[1];
-		a->seedlen0 = s->len;
+		x->qlen = l_query - e->qe, x->query = query + e->qe, x->tlen = l_ref, x->target = e->rseq + e->re;
+		x->w = e->aw[1], x->end_bonus = opt->pen_clip3, x->h0 = e->sc0;
+	}
+	return 1;
+}
 
-		a->frac_rep = c->frac_rep;
+// take the result of the extension from mem_ext_next()
+static void mem_ext_apply(const mem_opt_t *opt, mem_ext_t *e, mem_alnreg_v *av, const kswext_t *x)
+{
+	const mem_seed_t *s = &e->c->seeds[(uint32_t)e->srt[e->k]];
+	mem_alnreg_t *a = &av->a[e->a];
+	int prev = a->score, left = (e->state == 1), aw = e->aw[!left];
+
+	a->score = x->score;
+	if (bwa_verbose >= 4) { printf("*** %s extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n", left? "Left" : "Right", prev, a->score, aw, x->max_off); fflush(stdout); }
+	if (a->score != prev && x->max_off >= (aw>>1) + (aw>>2) && ++e->i < MAX_BAND_TRY) return; // try again with a wider band
+	if (left) {
+		// check whether we prefer to reach the end of the query
+		if (x->gscore <= 0 || x->gscore <= a->score - opt->pen_clip5) { // local extension
+			a->qb = s->qbeg - x->qle, a->rb = s->rbeg - x->tle;
+			a->truesc = a->score;
+		} else { // to-end extension
+			a->qb = 0, a->rb = s->rbeg - x->gtle;
+			a->truesc = x->gscore;
+		}
+		mem_ext_right(e, av);
+	} else {
+		// similar to the above
+		if (x->gscore <= 0 || x->gscore <= a->score - opt->pen_clip3) { // local extension
+			a->qe = e->qe + x->qle, a->re = e->rmax[0] + e->re + x->tle;
+			a->truesc += a->score - e->sc0;
+		} else { // to-end extension
+			a->qe = e->l_query, a->re = e->rmax[0] + e->re + x->gtle;
+			a->truesc += x->gscore - e->sc0;
+		}
+		mem_ext_finish(e, av);
 	}
-	free(srt); free(rseq);
+}
+
+void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av)
+{
+	mem_ext_t e;
+	kswext_t p;
+	uint8_v rev = {0,0,0};
+	uint64_v srt = {0,0,0};
+	mem_ext_init(opt, bns, pac, l_query, query, c, &rev, &srt, &e);
+	while (mem_ext_next(opt, bns, &e, av, &p)) {
+		p.score = ksw_extend2(p.qlen, p.query, p.tlen, p.target, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, p.w, p.end_bonus, opt->zdrop, p.h0, &p.qle, &p.tle, &p.gtle, &p.gscore, &p.max_off);
+		mem_ext_apply(opt, &e, av, &p);
+	}
+	free(rev.a); free(srt.a);
 }
 
 /*****************************
@@ -1048,20 +1439,40 @@ void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac,
 	}
 }
 
-mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf)
+// filter the chains of a read before their extension
+static void mem_align1_flt(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, mem_chain_v *chn)
 {
-	int i;
-	mem_chain_v chn;
-	mem_alnreg_v regs;
+	chn->n = mem_chain_flt(opt, chn->n, chn->a);
+	mem_flt_chained_seeds(opt, bns, pac, l_seq, (uint8_t*)seq, chn->n, chn->a);
+	if (bwa_verbose >= 4) mem_print_chain(bns, chn);
+}
 
-	for (i = 0; i < l_seq; ++i) // convert to 2-bit encoding if we have not done so
-		seq[i] = seq[i] < 4? seq[i] : nst_nt4_table[(int)seq[i]];
+// deduplicate the alignments of a read after the extension of its chains
+static void mem_align1_fin(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, char *seq, mem_alnreg_v *regs)
+{
+	int i;
+	regs->n = mem_sort_dedup_patch(opt, bns, pac, (uint8_t*)seq, regs->n, regs->a);
+	if (bwa_verbose >= 4) {
+		err_printf("* %ld chains remain after removing duplicated chains\n", regs->n);
+		for (i = 0; i < regs->n; ++i) {
+			mem_alnreg_t *p = &regs->a[i];
+			printf("** %d, [%d,%d) <=> [%ld,%ld)\n", p->score, p->qb, p->qe, (long)p->rb, (long)p->re);
+		}
+	}
+	for (i = 0; i < regs->n; ++i) {
+		mem_alnreg_t *p = &regs->a[i];
+		if (p->rid >= 0 && bns->anns[p->rid].is_alt)
+			p->is_alt = 1;
+	}
+}
 
-	chn = mem_chain(opt, bwt, bns, l_seq, (uint8_t*)seq, buf);
-	chn.n = mem_chain_flt(opt, chn.n, chn.a);
-	mem_flt_chained_seeds(opt, bns, pac, l_seq, (uint8_t*)seq, chn.n, chn.a);
-	if (bwa_verbose >= 4) mem_print_chain(bns, &chn);
+// the part of mem_align1_core() after chaining
+static mem_alnreg_v mem_align1_chain(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, mem_chain_v chn)
+{
+	int i;
+	mem_alnreg_v regs;
 
+	mem_align1_flt(opt, bns, pac, l_seq, seq, &chn);
 	kv_init(regs);
 	for (i = 0; i < chn.n; ++i) {
 		mem_chain_t *p = &chn.a[i];
@@ -1070,22 +1481,18 @@ mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntse
 		free(chn.a[i].seeds);
 	}
 	free(chn.a);
-	regs.n = mem_sort_dedup_patch(opt, bns, pac, (uint8_t*)seq, regs.n, regs.a);
-	if (bwa_verbose >= 4) {
-		err_printf("* %ld chains remain after removing duplicated chains\n", regs.n);
-		for (i = 0; i < regs.n; ++i) {
-			mem_alnreg_t *p = &regs.a[i];
-			printf("** %d, [%d,%d) <=> [%ld,%ld)\n", p->score, p->qb, p->qe, (long)p->rb, (long)p->re);
-		}
-	}
-	for (i = 0; i < regs.n; ++i) {
-		mem_alnreg_t *p = &regs.a[i];
-		if (p->rid >= 0 && bns->anns[p->rid].is_alt)
-			p->is_alt = 1;
-	}
+	mem_align1_fin(opt, bns, pac, seq, &regs);
 	return regs;
 }
 
+mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf)
+{
+	int i;
+	for (i = 0; i < l_seq; ++i) // convert to 2-bit encoding if we have not done so
+		seq[i] = seq[i] < 4? seq[i] : nst_nt4_table[(int)seq[i]];
+	return mem_align1_chain(opt, bns, pac, l_seq, seq, mem_chain(opt, bwt, bns, l_seq, (uint8_t*)seq, buf));
+}
+
 mem_aln_t mem_reg2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const char *query_, const mem_alnreg_t *ar)
 {
 	mem_aln_t a;
@@ -1165,22 +1572,84 @@ typedef struct {
 	const uint8_t *pac;
 	const mem_pestat_t *pes;
 	smem_aux_t **aux;
+	mem_lane_t **lanes;
 	bseq1_t *seqs;
 	mem_alnreg_v *regs;
+	int n_seqs; // number of reads to map; even for paired-end
 	int64_t n_processed;
+	const bwa_numa_t *numa; // if not NULL, pin each thread to a node and use the copy of the index there
 } worker_t;
 
-static void worker1(void *data, int i, int tid)
+static inline void worker_index(const worker_t *w, int tid, const bwt_t **bwt, const uint8_t **pac)
+{
+	if (w->numa) {
+		const bwaidx_t *rep = w->numa->rep[bwa_numa_bind(w->numa, tid)];
+		*bwt = rep->bwt, *pac = rep->pac;
+	} else *bwt = w->bwt, *pac = w->pac;
+}
+
+static void worker1(void *data, int i, int tid) // map reads [i*MEM_SEED_BATCH,(i+1)*MEM_SEED_BATCH)
 {
 	worker_t *w = (worker_t*)data;
-	if (!(w->opt->flag&MEM_F_PE)) {
-		if (bwa_verbose >= 4) printf("=====> Processing read '%s' <=====\n", w->seqs[i].name);
-		w->regs[i] = mem_align1_core(w->opt, w->bwt, w->bns, w->pac, w->seqs[i].l_seq, w->seqs[i].seq, w->aux[tid]);
-	} else {
-		if (bwa_verbose >= 4) printf("=====> Processing read '%s'/1 <=====\n", w->seqs[i<<1|0].name);
-		w->regs[i<<1|0] = mem_align1_core(w->opt, w->bwt, w->bns, w->pac, w->seqs[i<<1|0].l_seq, w->seqs[i<<1|0].seq, w->aux[tid]);
-		if (bwa_verbose >= 4) printf("=====> Processing read '%s'/2 <=====\n", w->seqs[i<<1|1].name);
-		w->regs[i<<1|1] = mem_align1_core(w->opt, w->bwt, w->bns, w->pac, w->seqs[i<<1|1].l_seq, w->seqs[i<<1|1].seq, w->aux[tid]);
+	mem_lane_t *lanes = w->lanes[tid];
+	smem_aux_t *aux = w->aux[tid];
+	const bwt_t *bwt;
+	const uint8_t *pac;
+	int j, k, n = w->n_seqs - i * MEM_SEED_BATCH < MEM_SEED_BATCH? w->n_seqs - i * MEM_SEED_BATCH : MEM_SEED_BATCH;
+	int c[MEM_SEED_BATCH], owner[MEM_SEED_BATCH]; // c: the chain being extended
+	bseq1_t *s = &w->seqs[i * MEM_SEED_BATCH];
+	mem_chain_v chn[MEM_SEED_BATCH];
+	mem_ext_t e[MEM_SEED_BATCH];
+	kswext_t jobs[MEM_SEED_BATCH];
+
+	worker_index(w, tid, &bwt, &pac);
+	for (j = 0; j < n; ++j) {
+		for (k = 0; k < s[j].l_seq; ++k) // convert to 2-bit encoding if we have not done so
+			s[j].seq[k] = s[j].seq[k] < 4? s[j].seq[k] : nst_nt4_table[(int)s[j].seq[k]];
+		lanes[j].len = s[j].l_seq, lanes[j].seq = (uint8_t*)s[j].seq;
+	}
+	mem_collect_intv_batch(w->opt, bwt, n, lanes);
+	for (j = 0; j < n; ++j) {
+		bwtintv_v tmp;
+		if (bwa_verbose >= 4) {
+			if (!(w->opt->flag&MEM_F_PE)) printf("=====> Processing read '%s' <=====\n", s[j].name);
+			else printf("=====> Processing read '%s'/%d <=====\n", s[j].name, (i * MEM_SEED_BATCH + j) % 2 + 1);
+		}
+		kv_init(chn[j]);
+		if (s[j].l_seq >= w->opt->min_seed_len) { // chain the seeds in lanes[j].mem as mem_chain() does
+			tmp = aux->mem, aux->mem = lanes[j].mem, lanes[j].mem = tmp;
+			chn[j] = mem_chain_intv(w->opt, bwt, w->bns, s[j].l_seq, (uint8_t*)s[j].seq, aux);
+			tmp = aux->mem, aux->mem = lanes[j].mem, lanes[j].mem = tmp;
+		}
+		if (bwa_verbose >= 4) // keep the debugging output of a read together
+			w->regs[i * MEM_SEED_BATCH + j] = mem_align1_chain(w->opt, w->bns, pac, s[j].l_seq, s[j].seq, chn[j]);
+	}
+	if (bwa_verbose >= 4) return;
+	// extend the chains of all reads; in a round, each read with chains left gives one extension
+	for (j = 0; j < n; ++j) {
+		mem_align1_flt(w->opt, w->bns, pac, s[j].l_seq, s[j].seq, &chn[j]);
+		kv_init(w->regs[i * MEM_SEED_BATCH + j]);
+		c[j] = 0;
+		if (chn[j].n) mem_ext_init(w->opt, w->bns, pac, s[j].l_seq, (uint8_t*)s[j].seq, &chn[j].a[0], &lanes[j].rev, &lanes[j].srt, &e[j]);
+	}
+	for (;;) {
+		int n_jobs = 0;
+		for (j = 0; j < n; ++j) {
+			mem_alnreg_v *av = &w->regs[i * MEM_SEED_BATCH + j];
+			while (c[j] < chn[j].n && !mem_ext_next(w->opt, w->bns, &e[j], av, &jobs[n_jobs])) {
+				free(chn[j].a[c[j]].seeds);
+				if (++c[j] < chn[j].n) mem_ext_init(w->opt, w->bns, pac, s[j].l_seq, (uint8_t*)s[j].seq, &chn[j].a[c[j]], &lanes[j].rev, &lanes[j].srt, &e[j]);
+			}
+			if (c[j] < chn[j].n) owner[n_jobs++] = j;
+		}
+		if (n_jobs == 0) break;
+		ksw_extend2_batch(n_jobs, jobs, 5, w->opt->mat, w->opt->o_del, w->opt->e_del, w->opt->o_ins, w->opt->e_ins, w->opt->zdrop, &aux->kbuf);
+		for (k = 0; k < n_jobs; ++k)
+			mem_ext_apply(w->opt, &e[owner[k]], &w->regs[i * MEM_SEED_BATCH + owner[k]], &jobs[k]);
+	}
+	for (j = 0; j < n; ++j) {
+		free(chn[j].a);
+		mem_align1_fin(w->opt, w->bns, pac, s[j].seq, &w->regs[i * MEM_SEED_BATCH + j]);
 	}
 }
 
@@ -1189,20 +1658,28 @@ static void worker2(void *data, int i, int tid)
 	extern int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2]);
 	extern void mem_reg2ovlp(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bseq1_t *s, mem_alnreg_v *a);
 	worker_t *w = (worker_t*)data;
+	const bwt_t *bwt;
+	const uint8_t *pac;
+	worker_index(w, tid, &bwt, &pac);
 	if (!(w->opt->flag&MEM_F_PE)) {
 		if (bwa_verbose >= 4) printf("=====> Finalizing read '%s' <=====\n", w->seqs[i].name);
 		mem_mark_primary_se(w->opt, w->regs[i].n, w->regs[i].a, w->n_processed + i);
 		if (w->opt->flag & MEM_F_PRIMARY5) mem_reorder_primary5(w->opt->T, &w->regs[i]);
-		mem_reg2sam(w->opt, w->bns, w->pac, &w->seqs[i], &w->regs[i], 0, 0);
+		mem_reg2sam(w->opt, w->bns, pac, &w->seqs[i], &w->regs[i], 0, 0);
 		free(w->regs[i].a);
 	} else {
 		if (bwa_verbose >= 4) printf("=====> Finalizing read pair '%s' <=====\n", w->seqs[i<<1|0].name);
-		mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], &w->regs[i<<1]);
+		mem_sam_pe(w->opt, w->bns, pac, w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], &w->regs[i<<1]);
 		free(w->regs[i<<1|0].a); free(w->regs[i<<1|1].a);
 	}
 }
 
 void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0)
+{
+	mem_process_seqs2(opt, bwt, bns, pac, n_processed, n, seqs, pes0, 0);
+}
+
+void mem_process_seqs2(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0, const bwa_numa_t *numa)
 {
 	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
 	worker_t w;
@@ -1214,15 +1691,21 @@ void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
 	global_bns = bns;
 	w.regs = malloc(n * sizeof(mem_alnreg_v));
 	w.opt = opt; w.bwt = bwt; w.bns = bns; w.pac = pac;
-	w.seqs = seqs; w.n_processed = n_processed;
+	w.seqs = seqs; w.n_processed = n_processed; w.numa = numa;
 	w.pes = &pes[0];
+	w.n_seqs = (opt->flag&MEM_F_PE)? n>>1<<1 : n;
 	w.aux = malloc(opt->n_threads * sizeof(smem_aux_t));
-	for (i = 0; i < opt->n_threads; ++i)
+	w.lanes = malloc(opt->n_threads * sizeof(mem_lane_t*));
+	for (i = 0; i < opt->n_threads; ++i) {
 		w.aux[i] = smem_aux_init();
-	kt_for(opt->n_threads, worker1, &w, (opt->flag&MEM_F_PE)? n>>1 : n); // find mapping positions
-	for (i = 0; i < opt->n_threads; ++i)
+		w.lanes[i] = calloc(MEM_SEED_BATCH, sizeof(mem_lane_t));
+	}
+	kt_for(opt->n_threads, worker1, &w, (w.n_seqs + MEM_SEED_BATCH - 1) / MEM_SEED_BATCH); // find mapping positions
+	for (i = 0; i < opt->n_threads; ++i) {
 		smem_aux_destroy(w.aux[i]);
-	free(w.aux);
+		mem_lanes_destroy(w.lanes[i]);
+	}
+	free(w.aux); free(w.lanes);
 	if (opt->flag&MEM_F_PE) { // infer insert sizes if not provided
 		if (pes0) memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
 		else mem_pestat(opt, bns->l_pac, n, w.regs, pes); // otherwise, infer the insert size distribution from data
@@ -132,6 +132,8 @@ extern "C" {
 	 *               corresponding to each FF, FR, RF and RR orientation. See mem_pestat() for more info.
 	 */
 	void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0);
+	// as mem_process_seqs(), with each thread pinned to a NUMA node and using the copy of the index in _numa_ there
+	void mem_process_seqs2(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0, const bwa_numa_t *numa);
 
 	/**
 	 * Find the aligned regions for one query sequence
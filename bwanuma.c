@@ -0,0 +1,181 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#endif
+#include "bwa.h"
+#include "utils.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+/* The topology is read from sysfs and memory is placed with the mbind()
+ * system call, so that libnuma is not needed. Nodes without CPUs hold no
+ * replica. Worker tid runs on node tid % n_node, on any CPU of that node. */
+
+#define NUMA_MAX_NODE 1024
+
+#ifndef MPOL_BIND
+#define MPOL_BIND       2
+#define MPOL_INTERLEAVE 3
+#define MPOL_MF_MOVE    (1<<1)
+#endif
+
+#ifdef __linux__
+
+// parse a sysfs list such as "0-3,8-11" into a bit set of _max_ bits; return the number of bits set
+static int numa_parse_list(const char *fn, unsigned long *set, int max)
+{
+	FILE *fp;
+	char buf[4096], *p, *q;
+	int n = 0;
+	long a, b;
+	memset(set, 0, max / 8);
+	if ((fp = fopen(fn, "r")) == 0) return 0;
+	if (fgets(buf, sizeof(buf), fp) == 0) buf[0] = 0;
+	fclose(fp);
+	for (p = buf; *p && *p != '\n'; p = *q == ','? q + 1 : q) {
+		a = b = strtol(p, &q, 10);
+		if (q == p) break;
+		if (*q == '-') b = strtol(q + 1, &q, 10);
+		for (; a <= b && a < max; ++a, ++n)
+			set[a / (8 * sizeof(long))] |= 1UL << a % (8 * sizeof(long));
+	}
+	return n;
+}
+
+static int numa_mbind(void *p, size_t size, int mode, const unsigned long *nodes, unsigned flags)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	unsigned long beg = ((unsigned long)p + page - 1) & ~(page - 1), end = ((unsigned long)p + size) & ~(page - 1);
+	if (end <= beg) return 0;
+	return syscall(SYS_mbind, beg, end - beg, mode, nodes, NUMA_MAX_NODE + 1, flags);
+}
+
+#endif
+
+static bwaidx_t *numa_replicate(const bwaidx_t *idx, int node)
+{
+	bwaidx_t *rep;
+	uint8_t *p;
+	p = mmap(0, idx->l_mem, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return 0;
+#ifdef __linux__
+	{
+		unsigned long nodes[NUMA_MAX_NODE / (8 * sizeof(long))];
+		memset(nodes, 0, sizeof(nodes));
+		nodes[node / (8 * sizeof(long))] |= 1UL << node % (8 * sizeof(long));
+		if (numa_mbind(p, idx->l_mem, MPOL_BIND, nodes, 0) < 0 && bwa_verbose >= 2)
+			fprintf(stderr, "[W::%s] fail to bind the copy to node %d\n", __func__, node);
+	}
+#endif
+	if (idx->huge != HUGE_NONE) huge_advise(p, idx->l_mem);
+	memcpy(p, idx->mem, idx->l_mem); // pages are faulted in on the node they are bound to
+	rep = calloc(1, sizeof(bwaidx_t));
+	bwa_mem2idx(idx->l_mem, p, rep);
+	return rep;
+}
+
+bwa_numa_t *bwa_numa_init(bwaidx_t *idx, int mode, int max_node)
+{
+	bwa_numa_t *nm;
+	int i;
+	if (idx->bwt == 0 || idx->bns == 0 || idx->pac == 0) {
+		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] NUMA placement requires the whole index\n", __func__);
+		return 0;
+	}
+	if (idx->mem == 0) bwa_idx2mem(idx); // replicas are copies of the flat layout
+	nm = calloc(1, sizeof(bwa_numa_t));
+	nm->mode = mode, nm->idx = idx;
+	nm->id = calloc(NUMA_MAX_NODE, sizeof(int));
+#ifdef __linux__
+	{
+		unsigned long online[NUMA_MAX_NODE / (8 * sizeof(long))], cpus[NUMA_MAX_NODE / (8 * sizeof(long))];
+		char fn[64];
+		int j;
+		numa_parse_list("/sys/devices/system/node/online", online, NUMA_MAX_NODE);
+		nm->cpus = calloc(NUMA_MAX_NODE, sizeof(cpu_set_t));
+		for (i = 0; i < NUMA_MAX_NODE && (max_node <= 0 || nm->n_node < max_node); ++i) {
+			cpu_set_t *cs = (cpu_set_t*)nm->cpus + nm->n_node;
+			if (!(online[i / (8 * sizeof(long))] >> i % (8 * sizeof(long)) & 1)) continue;
+			sprintf(fn, "/sys/devices/system/node/node%d/cpulist", i);
+			if (numa_parse_list(fn, cpus, NUMA_MAX_NODE) == 0) continue; // memory-only node
+			CPU_ZERO(cs);
+			for (j = 0; j < NUMA_MAX_NODE && j < CPU_SETSIZE; ++j)
+				if (cpus[j / (8 * sizeof(long))] >> j % (8 * sizeof(long)) & 1) CPU_SET(j, cs);
+			nm->id[nm->n_node++] = i;
+		}
+	}
+#endif
+	if (nm->n_node == 0) { // no topology; run as a single node without pinning
+		nm->n_node = 1;
+		free(nm->cpus); nm->cpus = 0;
+	}
+	nm->rep = calloc(nm->n_node, sizeof(bwaidx_t*));
+	for (i = 0; i < nm->n_node; ++i) nm->rep[i] = idx;
+#ifdef __linux__
+	if (nm->n_node > 1) {
+		unsigned long nodes[NUMA_MAX_NODE / (8 * sizeof(long))];
+		memset(nodes, 0, sizeof(nodes));
+		if (mode == BWA_NUMA_INTERLEAVE) {
+			for (i = 0; i < nm->n_node; ++i)
+				nodes[nm->id[i] / (8 * sizeof(long))] |= 1UL << nm->id[i] % (8 * sizeof(long));
+			if (numa_mbind(idx->mem, idx->l_mem, MPOL_INTERLEAVE, nodes, MPOL_MF_MOVE) < 0 && bwa_verbose >= 2)
+				fprintf(stderr, "[W::%s] fail to interleave the index\n", __func__);
+		} else if (mode == BWA_NUMA_REPLICATE) {
+			int shared = idx->is_mmap || idx->is_shm; // a shared mapping may live on any node; copy it to every node
+			if (!shared) { // move the private copy to the first node
+				nodes[nm->id[0] / (8 * sizeof(long))] |= 1UL << nm->id[0] % (8 * sizeof(long));
+				numa_mbind(idx->mem, idx->l_mem, MPOL_BIND, nodes, MPOL_MF_MOVE);
+			}
+			for (i = shared? 0 : 1; i < nm->n_node; ++i) {
+				bwaidx_t *rep;
+				if ((rep = numa_replicate(idx, nm->id[i])) != 0) nm->rep[i] = rep;
+				else if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] fail to copy the index to node %d\n", __func__, nm->id[i]);
+			}
+		}
+	}
+#endif
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] %d NUMA node(s) in use; index %s\n", __func__, nm->n_node, nm->n_node == 1 || mode == BWA_NUMA_OFF? "as loaded"
+				: mode == BWA_NUMA_INTERLEAVE? "interleaved across them" : "replicated on each");
+	return nm;
+}
+
+void bwa_numa_destroy(bwa_numa_t *nm)
+{
+	int i;
+	if (nm == 0) return;
+	for (i = 0; i < nm->n_node; ++i) {
+		bwaidx_t *rep = nm->rep[i];
+		if (rep == nm->idx) continue; // owned by the caller
+		free(rep->bwt); free(rep->bns->anns); free(rep->bns);
+		munmap(rep->mem, rep->l_mem);
+		free(rep);
+	}
+	free(nm->rep); free(nm->id); free(nm->cpus);
+	free(nm);
+}
+
+int bwa_numa_bind(const bwa_numa_t *nm, int tid)
+{
+	static __thread const bwa_numa_t *cur_nm = 0;
+	static __thread int cur_tid = -1;
+	int i = tid % nm->n_node;
+	if (cur_nm == nm && cur_tid == tid) return i; // kt_for() starts new threads, so this is once per thread and batch
+	cur_nm = nm, cur_tid = tid;
+#ifdef __linux__
+	if (nm->cpus && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), (cpu_set_t*)nm->cpus + i) != 0 && bwa_verbose >= 2)
+		fprintf(stderr, "[W::%s] fail to pin thread %d to node %d\n", __func__, tid, nm->id[i]);
+#endif
+	return i;
+}
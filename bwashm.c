@@ -1,5 +1,7 @@
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -8,30 +10,129 @@
 #include <errno.h>
 #include <stdio.h>
 #include "bwa.h"
+#include "utils.h"
 
-int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn)
+/* Staged indices are listed in a registry, the shared memory segment
+ * BWA_SHM_REG of BWA_SHM_MAX_IDX slots. Each version of an index lives in its
+ * own segment /bwaidx-<name>.<version>. The registry is only accessed under an
+ * exclusive flock() on it; a stager holds an exclusive flock() on the segment
+ * it is filling and an attached reader a shared one on its segment. Such locks
+ * go with the process, so a crashed stager or reader never leaves one behind.
+ *
+ * Staging fills a new version in state STAGING and publishes it as READY,
+ * retiring the older versions of the same name. Readers attach to the newest
+ * READY version. A segment that is retired, or left STAGING by a dead stager,
+ * is unlinked as soon as no process holds it; existing mappings stay valid. */
+
+#define BWA_SHM_REG   "/bwareg"
+#define BWA_SHM_MAGIC "BWAREG\1\0"
+
+enum { BWA_SHM_FREE = 0, BWA_SHM_STAGING, BWA_SHM_READY, BWA_SHM_RETIRED };
+
+static const char *shm_state_str[] = { "free", "staging", "ready", "retired" };
+
+typedef struct {
+	char name[BWA_SHM_NAME_LEN];
+	int64_t l_mem;
+	int32_t ver, state, n_ref, dummy; // n_ref: attached readers
+} shm_ent_t;
+
+typedef struct {
+	char magic[8];
+	shm_ent_t ent[BWA_SHM_MAX_IDX];
+} shm_reg_t;
+
+static const char *shm_name(const char *hint) // the index name is the file name of the prefix
 {
 	const char *name;
-	uint8_t *shm, *shm_idx;
-	uint16_t *cnt;
-	int shmid, to_init = 0, l;
-	char path[PATH_MAX + 1], *tmpfn = (char*)_tmpfn;
-
-	if (hint == 0 || hint[0] == 0) return -1;
 	for (name = hint + strlen(hint) - 1; name >= hint && *name != '/'; --name);
-	++name;
+	return name + 1;
+}
 
-	if ((shmid = shm_open("/bwactl", O_RDWR, 0)) < 0) {
-		shmid = shm_open("/bwactl", O_CREAT|O_RDWR|O_EXCL, 0644);
-		to_init = 1;
+static void shm_path(char *path, const char *name, int ver)
+{
+	snprintf(path, PATH_MAX, "/bwaidx-%s.%d", name, ver);
+}
+
+// map the registry and lock it; 0 if it is absent (and !to_create) or broken
+static shm_reg_t *shm_reg_open(int to_create, int *fd)
+{
+	struct stat st;
+	shm_reg_t *r;
+	if ((*fd = shm_open(BWA_SHM_REG, to_create? O_CREAT|O_RDWR : O_RDWR, 0644)) < 0) return 0;
+	if (flock(*fd, LOCK_EX) != 0 || fstat(*fd, &st) != 0) goto reg_err;
+	if (st.st_size == 0 && to_create) { // a new registry; initialize under the lock
+		if (ftruncate(*fd, sizeof(shm_reg_t)) != 0) goto reg_err;
+	} else if (st.st_size != sizeof(shm_reg_t)) goto reg_bad;
+	r = mmap(0, sizeof(shm_reg_t), PROT_READ|PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (r == MAP_FAILED) goto reg_err;
+	if (st.st_size == 0) memcpy(r->magic, BWA_SHM_MAGIC, 8);
+	else if (memcmp(r->magic, BWA_SHM_MAGIC, 8) != 0) {
+		munmap(r, sizeof(shm_reg_t));
+		goto reg_bad;
 	}
-	if (shmid < 0) return -1;
-	ftruncate(shmid, BWA_CTL_SIZE);
-	shm = mmap(0, BWA_CTL_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, shmid, 0);
-	cnt = (uint16_t*)shm;
-	if (to_init) {
-		memset(shm, 0, BWA_CTL_SIZE);
-		cnt[1] = 4;
+	return r;
+
+reg_bad:
+	if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] the registry %s is of a different bwa build\n", __func__, BWA_SHM_REG);
+
+reg_err:
+	close(*fd); // also releases the lock
+	return 0;
+}
+
+static void shm_reg_close(shm_reg_t *r, int fd)
+{
+	munmap(r, sizeof(shm_reg_t));
+	close(fd);
+}
+
+// with the registry locked: free the slots and segments no process holds any more
+static void shm_reg_gc(shm_reg_t *r)
+{
+	int i, fd;
+	char path[PATH_MAX];
+	for (i = 0; i < BWA_SHM_MAX_IDX; ++i) {
+		shm_ent_t *e = &r->ent[i];
+		if (e->state == BWA_SHM_FREE) continue;
+		shm_path(path, e->name, e->ver);
+		if ((fd = shm_open(path, O_RDONLY, 0)) < 0) { // the segment is gone
+			memset(e, 0, sizeof(shm_ent_t));
+			continue;
+		}
+		if (flock(fd, LOCK_EX|LOCK_NB) == 0) { // no stager or reader holds it
+			if (e->state == BWA_SHM_READY) e->n_ref = 0; // forget the readers that died attached
+			else {
+				shm_unlink(path);
+				memset(e, 0, sizeof(shm_ent_t));
+			}
+		}
+		close(fd);
+	}
+}
+
+static int shm_reg_find(const shm_reg_t *r, const char *name) // the newest READY version of name, or -1
+{
+	int i, k = -1;
+	for (i = 0; i < BWA_SHM_MAX_IDX; ++i)
+		if (r->ent[i].state == BWA_SHM_READY && strcmp(r->ent[i].name, name) == 0)
+			if (k < 0 || r->ent[i].ver > r->ent[k].ver) k = i;
+	return k;
+}
+
+int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn)
+{
+	const char *name;
+	uint8_t *shm_idx;
+	int rfd, fd, i, k, ver, ret = -1;
+	char path[PATH_MAX], *tmpfn = (char*)_tmpfn;
+	shm_reg_t *r;
+
+	if (hint == 0 || hint[0] == 0) return -1;
+	name = shm_name(hint);
+	if (strlen(name) >= BWA_SHM_NAME_LEN) {
+		fprintf(stderr, "[E::%s] the index name '%s' is longer than %d characters\n", __func__, name, BWA_SHM_NAME_LEN - 1);
+		return -1;
 	}
 
 	if (idx->mem == 0) bwa_idx2mem(idx);
@@ -45,169 +146,255 @@ int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn)
 				rest -= fwrite(&idx->mem[idx->l_mem - rest], 1, l, fp);
 			}
 			fclose(fp);
-			free(idx->mem); idx->mem = 0;
+			huge_free(idx->mem, idx->l_mem, idx->huge); idx->mem = 0;
 		} else {
 			fprintf(stderr, "[W::%s] fail to create the temporary file. Option '-f' is ignored.\n", __func__);
 			tmpfn = 0;
 		}
 	}
 
-	strcat(strcpy(path, "/bwaidx-"), name);
-	if ((shmid = shm_open(path, O_CREAT|O_RDWR|O_EXCL, 0644)) < 0) {
-		shm_unlink(path);
+	// take a slot and a new version, and create the segment locked
+	if ((r = shm_reg_open(1, &rfd)) == 0) {
+		perror("shm_open()");
+		return -1;
+	}
+	shm_reg_gc(r);
+	for (i = 0, k = -1, ver = 0; i < BWA_SHM_MAX_IDX; ++i) {
+		if (r->ent[i].state == BWA_SHM_FREE) {
+			if (k < 0) k = i;
+		} else if (strcmp(r->ent[i].name, name) == 0 && r->ent[i].ver > ver)
+			ver = r->ent[i].ver;
+	}
+	if (k < 0) {
+		fprintf(stderr, "[E::%s] no free slot among the %d of the registry\n", __func__, BWA_SHM_MAX_IDX);
+		shm_reg_close(r, rfd);
+		return -1;
+	}
+	shm_path(path, name, ++ver);
+	shm_unlink(path); // a leftover of a registry that has been reset
+	if ((fd = shm_open(path, O_CREAT|O_RDWR|O_EXCL, 0644)) < 0) {
 		perror("shm_open()");
+		shm_reg_close(r, rfd);
+		return -1;
+	}
+	if (flock(fd, LOCK_EX) != 0) {
+		perror("flock()");
+		shm_unlink(path);
+		close(fd);
+		shm_reg_close(r, rfd);
 		return -1;
 	}
-	l = 8 + strlen(name) + 1;
-	if (cnt[1] + l > BWA_CTL_SIZE) return -1;
-	memcpy(shm + cnt[1], &idx->l_mem, 8);
-	memcpy(shm + cnt[1] + 8, name, l - 8);
-	cnt[1] += l; ++cnt[0];
-	ftruncate(shmid, idx->l_mem);
-	shm_idx = mmap(0, idx->l_mem, PROT_READ|PROT_WRITE, MAP_SHARED, shmid, 0);
+	strcpy(r->ent[k].name, name);
+	r->ent[k].l_mem = idx->l_mem, r->ent[k].ver = ver, r->ent[k].state = BWA_SHM_STAGING, r->ent[k].n_ref = 0;
+	shm_reg_close(r, rfd);
+
+	// fill the segment with the registry unlocked
+	if (ftruncate(fd, idx->l_mem) != 0 || (shm_idx = mmap(0, idx->l_mem, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		perror("mmap()");
+		shm_unlink(path);
+		close(fd);
+		return -1;
+	}
+	huge_advise(shm_idx, idx->l_mem); // before the pages are faulted in; tmpfs honors it if shmem_enabled allows
 	if (tmpfn) {
 		FILE *fp;
-		fp = fopen(tmpfn, "rb");
-		int64_t rest = idx->l_mem;
-		while (rest > 0) {
-			int64_t l = rest < 0x1000000? rest : 0x1000000;
-			rest -= fread(&shm_idx[idx->l_mem - rest], 1, l, fp);
+		int64_t rest = idx->l_mem, l;
+		if ((fp = fopen(tmpfn, "rb")) != 0) {
+			for (; rest > 0; rest -= l) // stop at a short read, too
+				if ((l = fread(&shm_idx[idx->l_mem - rest], 1, rest < 0x1000000? rest : 0x1000000, fp)) == 0) break;
+			fclose(fp);
 		}
-		fclose(fp);
 		unlink(tmpfn);
+		if (rest > 0) {
+			fprintf(stderr, "[E::%s] fail to read the temporary file '%s'\n", __func__, tmpfn);
+			munmap(shm_idx, idx->l_mem);
+			shm_unlink(path);
+			close(fd);
+			return -1;
+		}
 	} else {
 		memcpy(shm_idx, idx->mem, idx->l_mem);
-		free(idx->mem);
+		huge_free(idx->mem, idx->l_mem, idx->huge);
+	}
+
+	// publish; readers block on the segment lock until it is released below
+	if ((r = shm_reg_open(0, &rfd)) != 0) {
+		shm_ent_t *e = &r->ent[k];
+		if (e->state == BWA_SHM_STAGING && e->ver == ver && strcmp(e->name, name) == 0) {
+			for (i = 0; i < BWA_SHM_MAX_IDX; ++i)
+				if (r->ent[i].state == BWA_SHM_READY && strcmp(r->ent[i].name, name) == 0)
+					r->ent[i].state = BWA_SHM_RETIRED;
+			e->state = BWA_SHM_READY;
+			shm_reg_gc(r);
+			ret = 0;
+		}
+		shm_reg_close(r, rfd);
 	}
+	close(fd);
 	bwa_mem2idx(idx->l_mem, shm_idx, idx);
-	idx->is_shm = 1;
-	return 0;
+	idx->is_shm = 1, idx->huge = HUGE_NONE;
+	idx->shm_fd = -1; // the stager is not a reader
+	return ret;
 }
 
 bwaidx_t *bwa_idx_load_from_shm(const char *hint)
 {
 	const char *name;
-	uint8_t *shm, *shm_idx;
-	uint16_t *cnt, i;
-	char *p, path[PATH_MAX + 1];
-	int shmid;
+	uint8_t *shm_idx;
+	char path[PATH_MAX];
+	int rfd, fd, k, ver;
 	int64_t l_mem;
+	shm_reg_t *r;
 	bwaidx_t *idx;
 
 	if (hint == 0 || hint[0] == 0) return 0;
-	for (name = hint + strlen(hint) - 1; name >= hint && *name != '/'; --name);
-	++name;
-	if ((shmid = shm_open("/bwactl", O_RDONLY, 0)) < 0) return 0;
-	shm = mmap(0, BWA_CTL_SIZE, PROT_READ, MAP_SHARED, shmid, 0);
-	cnt = (uint16_t*)shm;
-	if (cnt[0] == 0) return 0;
-	for (i = 0, p = (char*)(shm + 4); i < cnt[0]; ++i) {
-		memcpy(&l_mem, p, 8); p += 8;
-		if (strcmp(p, name) == 0) break;
-		p += strlen(p) + 1;
-	}
-	if (i == cnt[0]) return 0;
-
-	strcat(strcpy(path, "/bwaidx-"), name);
-	if ((shmid = shm_open(path, O_RDONLY, 0)) < 0) return 0;
-	shm_idx = mmap(0, l_mem, PROT_READ, MAP_SHARED, shmid, 0);
+	name = shm_name(hint);
+	if ((r = shm_reg_open(0, &rfd)) == 0) return 0;
+	if ((k = shm_reg_find(r, name)) < 0) {
+		shm_reg_close(r, rfd);
+		return 0;
+	}
+	l_mem = r->ent[k].l_mem, ver = r->ent[k].ver;
+	shm_path(path, name, ver);
+	if ((fd = shm_open(path, O_RDONLY, 0)) < 0 || flock(fd, LOCK_SH) != 0) {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] fail to attach %s: %s\n", __func__, path, strerror(errno));
+		if (fd >= 0) close(fd);
+		shm_reg_close(r, rfd);
+		return 0;
+	}
+	++r->ent[k].n_ref;
+	shm_reg_close(r, rfd);
+
+	if ((shm_idx = mmap(0, l_mem, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] fail to map %s: %s\n", __func__, path, strerror(errno));
+		if ((r = shm_reg_open(0, &rfd)) != 0) {
+			if (r->ent[k].n_ref > 0) --r->ent[k].n_ref;
+			shm_reg_close(r, rfd);
+		}
+		close(fd);
+		return 0;
+	}
 	idx = calloc(1, sizeof(bwaidx_t));
 	bwa_mem2idx(l_mem, shm_idx, idx);
 	idx->is_shm = 1;
+	idx->shm_fd = fd, idx->shm_slot = k, idx->shm_ver = ver;
+	if (bwa_verbose >= 3) fprintf(stderr, "[M::%s] attached version %d of '%s'\n", __func__, ver, name);
 	return idx;
 }
 
-int bwa_shm_test(const char *hint)
+void bwa_shm_detach(bwaidx_t *idx)
 {
-	int shmid;
-	uint16_t *cnt, i;
-	char *p, *shm;
-	const char *name;
+	int rfd;
+	shm_reg_t *r;
+	munmap(idx->mem, idx->l_mem);
+	if (idx->shm_fd < 0) return;
+	if ((r = shm_reg_open(0, &rfd)) != 0) {
+		shm_ent_t *e = &r->ent[idx->shm_slot];
+		if (e->state != BWA_SHM_FREE && e->ver == idx->shm_ver && e->n_ref > 0) --e->n_ref;
+		close(idx->shm_fd); // release the segment before collecting it
+		shm_reg_gc(r); // the last reader of a retired version unlinks it
+		shm_reg_close(r, rfd);
+	} else close(idx->shm_fd);
+	idx->shm_fd = -1;
+}
 
+int bwa_shm_test(const char *hint)
+{
+	int rfd, k;
+	shm_reg_t *r;
 	if (hint == 0 || hint[0] == 0) return 0;
-	for (name = hint + strlen(hint) - 1; name >= hint && *name != '/'; --name);
-	++name;
-	if ((shmid = shm_open("/bwactl", O_RDONLY, 0)) < 0) return 0;
-	shm = mmap(0, BWA_CTL_SIZE, PROT_READ, MAP_SHARED, shmid, 0);
-	cnt = (uint16_t*)shm;
-	for (i = 0, p = shm + 4; i < cnt[0]; ++i) {
-		if (strcmp(p + 8, name) == 0) return 1;
-		p += strlen(p) + 9;
-	}
-	return 0;
+	if ((r = shm_reg_open(0, &rfd)) == 0) return 0;
+	k = shm_reg_find(r, shm_name(hint));
+	shm_reg_close(r, rfd);
+	return k >= 0;
 }
 
 int bwa_shm_list(void)
 {
-	int shmid;
-	uint16_t *cnt, i;
-	char *p, *shm;
-	if ((shmid = shm_open("/bwactl", O_RDONLY, 0)) < 0) return -1;
-	shm = mmap(0, BWA_CTL_SIZE, PROT_READ, MAP_SHARED, shmid, 0);
-	cnt = (uint16_t*)shm;
-	for (i = 0, p = shm + 4; i < cnt[0]; ++i) {
-		int64_t l_mem;
-		memcpy(&l_mem, p, 8); p += 8;
-		printf("%s\t%ld\n", p, (long)l_mem);
-		p += strlen(p) + 1;
+	int rfd, i;
+	shm_reg_t *r;
+	if ((r = shm_reg_open(0, &rfd)) == 0) return -1;
+	shm_reg_gc(r);
+	for (i = 0; i < BWA_SHM_MAX_IDX; ++i) {
+		shm_ent_t *e = &r->ent[i];
+		if (e->state == BWA_SHM_FREE) continue;
+		printf("%s\t%d\t%s\t%d\t%ld\n", e->name, e->ver, shm_state_str[e->state], e->n_ref, (long)e->l_mem);
 	}
+	shm_reg_close(r, rfd);
 	return 0;
 }
 
-int bwa_shm_destroy(void)
+int bwa_shm_drop(const char *hint) // retire all versions of hint, or of all indices if hint is NULL
 {
-	int shmid;
-	uint16_t *cnt, i;
-	char *p, *shm;
-	char path[PATH_MAX + 1];
-
-	if ((shmid = shm_open("/bwactl", O_RDONLY, 0)) < 0) return -1;
-	shm = mmap(0, BWA_CTL_SIZE, PROT_READ, MAP_SHARED, shmid, 0);
-	cnt = (uint16_t*)shm;
-	for (i = 0, p = shm + 4; i < cnt[0]; ++i) {
-		int64_t l_mem;
-		memcpy(&l_mem, p, 8); p += 8;
-		strcat(strcpy(path, "/bwaidx-"), p);
-		shm_unlink(path);
-		p += strlen(p) + 1;
-	}
-	munmap(shm, BWA_CTL_SIZE);
-	shm_unlink("/bwactl");
+	int rfd, i;
+	const char *name = hint? shm_name(hint) : 0;
+	shm_reg_t *r;
+	if ((r = shm_reg_open(0, &rfd)) == 0) return -1;
+	for (i = 0; i < BWA_SHM_MAX_IDX; ++i)
+		if (r->ent[i].state == BWA_SHM_READY && (name == 0 || strcmp(r->ent[i].name, name) == 0))
+			r->ent[i].state = BWA_SHM_RETIRED;
+	shm_reg_gc(r); // unlinks those without readers; the rest go with their last reader
+	shm_reg_close(r, rfd);
 	return 0;
 }
 
 int main_shm(int argc, char *argv[])
 {
-	int c, to_list = 0, to_drop = 0, ret = 0;
+	int c, to_list = 0, to_drop = 0, to_update = 0, ret = 0;
 	char *tmpfn = 0;
-	while ((c = getopt(argc, argv, "ldf:")) >= 0) {
+	while ((c = getopt(argc, argv, "ldf:u")) >= 0) {
 		if (c == 'l') to_list = 1;
 		else if (c == 'd') to_drop = 1;
+		else if (c == 'u') to_update = 1;
 		else if (c == 'f') tmpfn = optarg;
 	}
 	if (optind == argc && !to_list && !to_drop) {
-		fprintf(stderr, "\nUsage: bwa shm [-d|-l] [-f tmpFile] [idxbase]\n\n");
-		fprintf(stderr, "Options: -d       destroy all indices in shared memory\n");
-		fprintf(stderr, "         -l       list names of indices in shared memory\n");
+		fprintf(stderr, "\nUsage: bwa shm [-d|-l] [-u] [-f tmpFile] [idxbase]\n\n");
+		fprintf(stderr, "Options: -d       drop idxbase, or all indices, from shared memory\n");
+		fprintf(stderr, "         -l       list versions of indices in shared memory\n");
+		fprintf(stderr, "         -u       stage a new version of idxbase even if one is present\n");
 		fprintf(stderr, "         -f FILE  temporary file to reduce peak memory\n\n");
+		fprintf(stderr, "Note: a dropped or replaced version is freed once the last process using it exits.\n\n");
 		return 1;
 	}
-	if (optind < argc && (to_list || to_drop)) {
-		fprintf(stderr, "[E::%s] open -l or -d cannot be used when 'idxbase' is present\n", __func__);
+	if (optind < argc && to_list) {
+		fprintf(stderr, "[E::%s] option -l cannot be used when 'idxbase' is present\n", __func__);
 		return 1;
 	}
-	if (optind < argc) {
-		if (bwa_shm_test(argv[optind]) == 0) {
+	if (to_drop) {
+		if (bwa_shm_drop(optind < argc? argv[optind] : 0) < 0) fprintf(stderr, "[M::%s] no index in shared memory\n", __func__);
+	} else if (optind < argc) {
+		if (to_update || bwa_shm_test(argv[optind]) == 0) {
 			bwaidx_t *idx;
-			idx = bwa_idx_load_from_disk(argv[optind], BWA_IDX_ALL);
+			if ((idx = bwa_idx_load_from_disk(argv[optind], BWA_IDX_ALL)) == 0) return 1;
 			if (bwa_shm_stage(idx, argv[optind], tmpfn) < 0) {
 				fprintf(stderr, "[E::%s] failed to stage the index in shared memory\n", __func__);
 				ret = 1;
 			}
 			bwa_idx_destroy(idx);
-		} else fprintf(stderr, "[M::%s] index '%s' is already in shared memory\n", __func__, argv[optind]);
+		} else fprintf(stderr, "[M::%s] index '%s' is already in shared memory; use -u to stage a new version\n", __func__, argv[optind]);
 	}
 	if (to_list) bwa_shm_list();
-	if (to_drop) bwa_shm_destroy();
 	return ret;
 }
+
+int main_idx2mmap(int argc, char *argv[])
+{
+	bwaidx_t *idx;
+	char *prefix, *fn;
+	if (argc < 2) {
+		fprintf(stderr, "Usage: bwa idx2mmap <idxbase>\n");
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[1])) == 0) {
+		fprintf(stderr, "[E::%s] fail to locate the index files\n", __func__);
+		return 1;
+	}
+	if ((idx = bwa_idx_load_from_disk(argv[1], BWA_IDX_ALL)) == 0) return 1;
+	fn = calloc(strlen(prefix) + 8, 1);
+	bwa_idx_dump_mmap(strcat(strcpy(fn, prefix), ".bwaidx"), idx);
+	fprintf(stderr, "[M::%s] wrote %.1f MB to '%s'\n", __func__, idx->l_mem / 1048576., fn);
+	bwa_idx_destroy(idx);
+	free(fn); free(prefix);
+	return 0;
+}
@@ -31,6 +31,10 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "utils.h"
 #include "bwt.h"
 #include "kvec.h"
@@ -50,10 +54,52 @@ void bwt_gen_cnt_table(bwt_t *bwt)
 	}
 }
 
+/**************************
+ * Cache-line layout (CL) *
+ **************************/
+
+#ifdef __GNUC__
+#define bwt_popcount64(x) __builtin_popcountll(x)
+#else
+static inline int bwt_popcount64(uint64_t y)
+{
+	y = y - (y >> 1 & 0x5555555555555555ull);
+	y = (y & 0x3333333333333333ull) + (y >> 2 & 0x3333333333333333ull);
+	return ((y + (y >> 4)) & 0xf0f0f0f0f0f0f0full) * 0x101010101010101ull >> 56;
+}
+#endif
+
+static inline void occ_add_cnt(bwtint_t cnt[4], int r, int lo, int hi, int both)
+{ // lo/hi: #symbols with the low/high bit set; both: #T
+	cnt[0] += r + 1 - lo - hi + both;
+	cnt[1] += lo - both;
+	cnt[2] += hi - both;
+	cnt[3] += both;
+}
+
+// Occ of each base in [0,k] of the $-removed BWT; branch-free within a line
+static inline void bwt_cl_cnt4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
+{
+	bwtint_t i = k / BWT_CL_LEN;
+	const bwt_cl_t *p = (const bwt_cl_t*)bwt->bwt + i;
+	const bwtint_t *sb = bwt_cl_sb(bwt, i);
+	int j, r = k - i * BWT_CL_LEN, lo = 0, hi = 0, both = 0;
+	for (j = 0; j < 3; ++j) {
+		int keep = r + 1 - (j<<6);
+		uint64_t m = keep <= 0? 0 : keep >= 64? (uint64_t)-1 : (1ULL<<keep) - 1;
+		uint64_t x = p->lo[j] & m, y = p->hi[j] & m;
+		lo += bwt_popcount64(x);
+		hi += bwt_popcount64(y);
+		both += bwt_popcount64(x & y);
+	}
+	for (j = 0; j < 4; ++j) cnt[j] = sb[j] + p->cnt[j];
+	occ_add_cnt(cnt, r, lo, hi, both);
+}
+
 static inline bwtint_t bwt_invPsi(const bwt_t *bwt, bwtint_t k) // compute inverse CSA
 {
 	bwtint_t x = k - (k > bwt->primary);
-	x = bwt_B0(bwt, x);
+	x = bwt->fmt == BWT_FMT_CL? bwt_cl_B0(bwt, x) : bwt_B0(bwt, x);
 	x = bwt->L2[x] + bwt_occ(bwt, k, x);
 	return k == bwt->primary? 0 : x;
 }
@@ -83,9 +129,112 @@ void bwt_cal_sa(bwt_t *bwt, int intv)
 	bwt->sa[0] = (bwtint_t)-1; // before this line, bwt->sa[0] = bwt->seq_len
 }
 
+/* Multi-threaded bwt_cal_sa(). The LF cycle is cut at anchors, the ranks that
+ * are multiples of 2^shift. Each segment is walked from its anchor to the next
+ * one, storing the distance from the anchor in the SA slot and the segment in
+ * cal_sa_t::seg. As the SA value of rank 0 is known, chaining the segments
+ * gives the SA value of every anchor, after which the slots are fixed up. Only
+ * the slots in [lo,hi) are kept, such that the SA can be computed in passes. */
+
+#define CAL_SA_SEG_PER_THREAD 256 // for load balance; at most 65536 segments
+
+typedef struct {
+	const bwt_t *bwt;
+	int shift, intv;
+	bwtint_t lo, hi; // SA slots kept
+	bwtint_t *sa;    // slots [lo,hi)
+	uint16_t *seg;   // segment of each SA slot
+	bwtint_t *next;  // anchor (>>shift) where each segment ends
+	bwtint_t *len;   // length of each segment
+	bwtint_t *start; // SA value of each anchor
+	bwtint_t n_seg, n_done; // segments walked so far
+	bwt_progress_f progress; // reported from thread 0 after each of its segments
+	void *data;
+	bwtint_t pass, n_pass;   // this call is pass _pass_ of _n_pass_ over the LF cycle
+} cal_sa_t;
+
+static void cal_sa_worker(void *data, long j, int tid)
+{
+	cal_sa_t *w = (cal_sa_t*)data;
+	const bwt_t *bwt = w->bwt;
+	bwtint_t isa = (bwtint_t)j << w->shift, off = 0, mask = ((bwtint_t)1<<w->shift) - 1, intv_mask = w->intv - 1;
+	do {
+		if ((isa & intv_mask) == 0 && isa / w->intv - w->lo < w->hi - w->lo) {
+			w->sa[isa/w->intv - w->lo] = off;
+			w->seg[isa/w->intv - w->lo] = j;
+		}
+		++off;
+		isa = bwt_invPsi(bwt, isa);
+	} while (isa & mask);
+	w->next[j] = isa >> w->shift;
+	w->len[j] = off;
+	off = __sync_add_and_fetch(&w->n_done, 1);
+	if (w->progress && tid == 0)
+		w->progress(w->data, (w->pass + (double)off / w->n_seg) / w->n_pass, w->pass * bwt->seq_len + bwt->seq_len / w->n_seg * off);
+}
+
+static void cal_sa_fix_worker(void *data, long j, int tid) // 1024 slots per call
+{
+	cal_sa_t *w = (cal_sa_t*)data;
+	bwtint_t i, n = w->hi - w->lo, end = (j + 1) * 1024 < n? (j + 1) * 1024 : n;
+	for (i = j * 1024; i < end; ++i)
+		w->sa[i] = w->start[w->seg[i]] - w->sa[i];
+}
+
+static void cal_sa_range(const bwt_t *bwt, int intv, int n_threads, bwtint_t lo, bwtint_t hi, bwtint_t *sa, bwt_progress_f progress, void *data, bwtint_t pass, bwtint_t n_pass)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+	cal_sa_t w;
+	bwtint_t j, n_seg, x;
+
+	if (n_threads > 65536 / CAL_SA_SEG_PER_THREAD) n_threads = 65536 / CAL_SA_SEG_PER_THREAD;
+	w.bwt = bwt, w.intv = intv, w.lo = lo, w.hi = hi, w.sa = sa;
+	w.progress = progress, w.data = data, w.pass = pass, w.n_pass = n_pass;
+	for (w.shift = 0; (bwt->seq_len >> w.shift) + 1 > (bwtint_t)n_threads * CAL_SA_SEG_PER_THREAD; ++w.shift);
+	w.n_seg = n_seg = (bwt->seq_len >> w.shift) + 1, w.n_done = 0;
+	w.seg = (uint16_t*)malloc((hi - lo) * sizeof(uint16_t));
+	w.next = (bwtint_t*)malloc(n_seg * sizeof(bwtint_t));
+	w.len = (bwtint_t*)malloc(n_seg * sizeof(bwtint_t));
+	w.start = (bwtint_t*)malloc(n_seg * sizeof(bwtint_t));
+	kt_for(n_threads, cal_sa_worker, &w, n_seg);
+
+	// S(0) = seq_len; segment j covers text positions start[j], start[j]-1, ..., start[j]-len[j]+1
+	w.start[0] = bwt->seq_len;
+	for (j = 1, x = 0; j < n_seg; ++j) {
+		w.start[w.next[x]] = w.start[x] - w.len[x];
+		x = w.next[x];
+	}
+	xassert(w.next[x] == 0 && w.start[x] + 1 == w.len[x], "the LF-mapping is not a single cycle.");
+	kt_for(n_threads, cal_sa_fix_worker, &w, (hi - lo + 1023) / 1024);
+	free(w.seg); free(w.next); free(w.len); free(w.start);
+}
+
+void bwt_cal_sa2(bwt_t *bwt, int intv, int n_threads)
+{
+	if (n_threads <= 1) bwt_cal_sa(bwt, intv);
+	else bwt_cal_sa3(bwt, intv, n_threads, 0, 0);
+}
+
+void bwt_cal_sa3(bwt_t *bwt, int intv, int n_threads, bwt_progress_f progress, void *data)
+{
+	int intv_round = intv;
+
+	kv_roundup32(intv_round);
+	xassert(intv_round == intv, "SA sample interval is not a power of 2.");
+	xassert(bwt->bwt, "bwt_t::bwt is not initialized.");
+
+	if (bwt->sa) free(bwt->sa);
+	bwt->sa_intv = intv;
+	bwt->n_sa = (bwt->seq_len + intv) / intv;
+	bwt->sa = (bwtint_t*)calloc(bwt->n_sa, sizeof(bwtint_t));
+	cal_sa_range(bwt, intv, n_threads, 0, bwt->n_sa, bwt->sa, progress, data, 0, 1);
+	bwt->sa[0] = (bwtint_t)-1;
+}
+
 bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k)
 {
 	bwtint_t sa = 0, mask = bwt->sa_intv - 1;
+	if (mask == 0) return bwt->sa[k]; // the full SA; no LF-walk
 	while (k & mask) {
 		++sa;
 		k = bwt_invPsi(bwt, k);
@@ -95,6 +244,60 @@ bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k)
 	return sa + bwt->sa[k/bwt->sa_intv];
 }
 
+#ifdef __GNUC__
+#define bwt_prefetch(p) __builtin_prefetch(p)
+#else
+#define bwt_prefetch(p)
+#endif
+
+#define BWT_SA_BATCH 16 // number of LF-walks in flight in bwt_sa_batch()
+
+// prefetch the Occ block holding the (already $-adjusted) position _k_. These are macros, not
+// functions: GCC deems a function doing nothing but prefetches "const" and drops calls to it.
+#define bwt_occ_prefetch(b, k) do { \
+		if ((b)->fmt == BWT_FMT_CL) bwt_prefetch((const bwt_cl_t*)(b)->bwt + (k) / BWT_CL_LEN); \
+		else { const uint32_t *p_ = bwt_occ_intv(b, k); bwt_prefetch(p_); bwt_prefetch(p_ + 15); } /* a block may straddle two cache lines */ \
+	} while (0)
+
+// prefetch what the next step of bwt_sa() on _k_ reads: the Occ block of _k_, or the SA sample
+#define bwt_sa_prefetch(b, k) do { \
+		bwtint_t k_ = (k); \
+		if (k_ & ((b)->sa_intv - 1)) bwt_occ_prefetch(b, k_ - (k_ > (b)->primary)); \
+		else bwt_prefetch(&(b)->sa[k_/(b)->sa_intv]); \
+	} while (0)
+
+void bwt_sa_batch(const bwt_t *bwt, int n, const bwtint_t *k, bwtint_t *sa)
+{
+	bwtint_t x[BWT_SA_BATCH], d[BWT_SA_BATCH], mask = bwt->sa_intv - 1;
+	int i[BWT_SA_BATCH], j, m, next;
+	if (mask == 0) { // the full SA: plain lookups, prefetched ahead
+		for (j = 0; j < n && j < BWT_SA_BATCH; ++j) bwt_prefetch(&bwt->sa[k[j]]);
+		for (j = 0; j < n; ++j) {
+			if (j + BWT_SA_BATCH < n) bwt_prefetch(&bwt->sa[k[j + BWT_SA_BATCH]]);
+			sa[j] = bwt->sa[k[j]];
+		}
+		return;
+	}
+	for (m = next = 0; m < BWT_SA_BATCH && next < n; ++m, ++next) {
+		i[m] = next, x[m] = k[next], d[m] = 0;
+		bwt_sa_prefetch(bwt, x[m]);
+	}
+	while (m > 0) { // round-robin over the walks, such that memory accesses of different walks overlap
+		for (j = 0; j < m;) {
+			if (x[j] & mask) {
+				x[j] = bwt_invPsi(bwt, x[j]), ++d[j];
+				bwt_sa_prefetch(bwt, x[j++]);
+			} else { // finished; replace with a new walk or with the last one
+				sa[i[j]] = d[j] + bwt->sa[x[j]/bwt->sa_intv];
+				if (next < n) {
+					i[j] = next, x[j] = k[next++], d[j] = 0;
+					bwt_sa_prefetch(bwt, x[j++]);
+				} else --m, i[j] = i[m], x[j] = x[m], d[j] = d[m];
+			}
+		}
+	}
+}
+
 static inline int __occ_aux(uint64_t y, int c)
 {
 	// reduce nucleotide counting to bits counting
@@ -112,6 +315,11 @@ bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c)
 	if (k == bwt->seq_len) return bwt->L2[c+1] - bwt->L2[c];
 	if (k == (bwtint_t)(-1)) return 0;
 	k -= (k >= bwt->primary); // because $ is not in bwt
+	if (bwt->fmt == BWT_FMT_CL) {
+		bwtint_t cnt[4];
+		bwt_cl_cnt4(bwt, k, cnt);
+		return cnt[c];
+	}
 
 	// retrieve Occ at k/OCC_INTERVAL
 	n = ((bwtint_t*)(p = bwt_occ_intv(bwt, k)))[c];
@@ -134,7 +342,7 @@ void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok,
 	bwtint_t _k, _l;
 	_k = (k >= bwt->primary)? k-1 : k;
 	_l = (l >= bwt->primary)? l-1 : l;
-	if (_l/OCC_INTERVAL != _k/OCC_INTERVAL || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
+	if (bwt->fmt == BWT_FMT_CL || _l/OCC_INTERVAL != _k/OCC_INTERVAL || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
 		*ok = bwt_occ(bwt, k, c);
 		*ol = bwt_occ(bwt, l, c);
 	} else {
@@ -166,7 +374,7 @@ void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok,
 	((bwt)->cnt_table[(b)&0xff] + (bwt)->cnt_table[(b)>>8&0xff]		\
 	 + (bwt)->cnt_table[(b)>>16&0xff] + (bwt)->cnt_table[(b)>>24])
 
-void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
+static void bwt_occ4_scalar(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
 {
 	bwtint_t x;
 	uint32_t *p, tmp, *end;
@@ -175,6 +383,10 @@ void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
 		return;
 	}
 	k -= (k >= bwt->primary); // because $ is not in bwt
+	if (bwt->fmt == BWT_FMT_CL) {
+		bwt_cl_cnt4(bwt, k, cnt);
+		return;
+	}
 	p = bwt_occ_intv(bwt, k);
 	memcpy(cnt, p, 4 * sizeof(bwtint_t));
 	p += sizeof(bwtint_t); // sizeof(bwtint_t) = 4*(sizeof(bwtint_t)/sizeof(uint32_t))
@@ -186,14 +398,14 @@ void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
 }
 
 // an analogy to bwt_occ4() but more efficient, requiring k <= l
-void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4])
+static void bwt_2occ4_scalar(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4])
 {
 	bwtint_t _k, _l;
 	_k = k - (k >= bwt->primary);
 	_l = l - (l >= bwt->primary);
-	if (_l>>OCC_INTV_SHIFT != _k>>OCC_INTV_SHIFT || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
-		bwt_occ4(bwt, k, cntk);
-		bwt_occ4(bwt, l, cntl);
+	if (bwt->fmt == BWT_FMT_CL || _l>>OCC_INTV_SHIFT != _k>>OCC_INTV_SHIFT || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
+		bwt_occ4_scalar(bwt, k, cntk);
+		bwt_occ4_scalar(bwt, l, cntl);
 	} else {
 		bwtint_t x, y;
 		uint32_t *p, tmp, *endk, *endl;
@@ -219,11 +431,348 @@ void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtin
 	}
 }
 
+/**************************************
+ * Popcount Occ kernels with dispatch *
+ **************************************/
+
+/* The kernels below count the 2-bit symbols [0,r] in the eight BWT words of
+ * an Occ block. Symbols past r are masked to zero, i.e. to A, so instead of
+ * counting A directly we take (r+1) minus the counts of C, G and T. This
+ * gives exactly the same counts as bwt_occ4_scalar(). */
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BWT_OCC_DISPATCH
+#include <immintrin.h>
+#endif
+
+typedef void (*bwt_occ4_f)(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
+typedef void (*bwt_2occ4_f)(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
+
+#ifdef BWT_OCC_DISPATCH
+
+// instantiate bwt_occ4_SFX() and bwt_2occ4_SFX() on top of occ_blk1_SFX() and occ_blk2_SFX()
+#define BWT_OCC4_INIT(SFX, ATTR) \
+	ATTR static void bwt_occ4_##SFX(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]) \
+	{ \
+		const uint32_t *p; \
+		if (k == (bwtint_t)(-1)) { \
+			memset(cnt, 0, 4 * sizeof(bwtint_t)); \
+			return; \
+		} \
+		k -= (k >= bwt->primary); \
+		if (bwt->fmt == BWT_FMT_CL) { \
+			bwt_cl_cnt4(bwt, k, cnt); \
+			return; \
+		} \
+		p = bwt_occ_intv(bwt, k); \
+		memcpy(cnt, p, 4 * sizeof(bwtint_t)); \
+		occ_blk1_##SFX(p + sizeof(bwtint_t), k & OCC_INTV_MASK, cnt); \
+	} \
+	ATTR static void bwt_2occ4_##SFX(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]) \
+	{ \
+		bwtint_t _k, _l; \
+		_k = k - (k >= bwt->primary); \
+		_l = l - (l >= bwt->primary); \
+		if (bwt->fmt == BWT_FMT_CL || _l>>OCC_INTV_SHIFT != _k>>OCC_INTV_SHIFT || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) { \
+			bwt_occ4_##SFX(bwt, k, cntk); \
+			bwt_occ4_##SFX(bwt, l, cntl); \
+		} else { \
+			const uint32_t *p = bwt_occ_intv(bwt, _k); \
+			memcpy(cntk, p, 4 * sizeof(bwtint_t)); \
+			memcpy(cntl, p, 4 * sizeof(bwtint_t)); \
+			occ_blk2_##SFX(p + sizeof(bwtint_t), _k & OCC_INTV_MASK, _l & OCC_INTV_MASK, cntk, cntl); \
+		} \
+	}
+
+#define OCC_POPCNT __attribute__((target("popcnt")))
+#define OCC_AVX2   __attribute__((target("popcnt,avx2")))
+#define OCC_AVX512 __attribute__((target("popcnt,avx2,avx512f,avx512vl,avx512vpopcntdq")))
+
+/*** POPCNT: 64 bits at a time ***/
+
+static inline uint32_t occ_mask32(int r, int j) // mask to keep symbols [0,r] in the j-th BWT word of a block
+{
+	int keep = r + 1 - (j<<4);
+	return keep <= 0? 0 : keep >= 16? 0xffffffffU : ~((1U<<((16 - keep)<<1)) - 1);
+}
+
+OCC_POPCNT static inline void occ_blk1_popcnt(const uint32_t *p, int r, bwtint_t cnt[4])
+{
+	int j, n = (r>>5) + 1, lo = 0, hi = 0, both = 0;
+	for (j = 0; j < n; ++j) {
+		uint64_t x, y;
+		memcpy(&x, p + (j<<1), 8); // p[2j] in the lower half on little-endian
+		if (j == n - 1) x &= occ_mask32(r, j<<1) | (uint64_t)occ_mask32(r, j<<1|1) << 32;
+		y = x >> 1 & 0x5555555555555555ull;
+		x &= 0x5555555555555555ull;
+		lo += __builtin_popcountll(x);
+		hi += __builtin_popcountll(y);
+		both += __builtin_popcountll(x & y);
+	}
+	occ_add_cnt(cnt, r, lo, hi, both);
+}
+
+OCC_POPCNT static inline void occ_blk2_popcnt(const uint32_t *p, int rk, int rl, bwtint_t cntk[4], bwtint_t cntl[4])
+{
+	occ_blk1_popcnt(p, rk, cntk);
+	occ_blk1_popcnt(p, rl, cntl);
+}
+
+BWT_OCC4_INIT(popcnt, OCC_POPCNT)
+
+/*** AVX2: the whole block in one 256-bit vector ***/
+
+OCC_AVX2 static inline __m256i occ_mask256(int r)
+{
+	__m256i keep;
+	keep = _mm256_sub_epi32(_mm256_set1_epi32(r + 1), _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112));
+	keep = _mm256_min_epi32(_mm256_max_epi32(keep, _mm256_setzero_si256()), _mm256_set1_epi32(16)); // #symbols kept in each word
+	return _mm256_sllv_epi32(_mm256_set1_epi32(-1), _mm256_sub_epi32(_mm256_set1_epi32(32), _mm256_slli_epi32(keep, 1)));
+}
+
+OCC_AVX2 static inline __m256i occ_popcnt256_epi8(__m256i x) // nibble lookup (Mula et al.)
+{
+	const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i m4 = _mm256_set1_epi8(0x0f);
+	return _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, m4)), _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), m4)));
+}
+
+OCC_AVX2 static inline uint64_t occ_hsum256(__m256i x)
+{
+	__m128i y = _mm_add_epi64(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+	return _mm_cvtsi128_si64(y) + _mm_extract_epi64(y, 1);
+}
+
+OCC_AVX2 static inline uint64_t occ_cnt256_avx2(__m256i x, __m256i m) // returns lo | hi<<16 | both<<32
+{
+	const __m256i m1 = _mm256_set1_epi32(0x55555555), z = _mm256_setzero_si256();
+	__m256i lo, hi, s;
+	x = _mm256_and_si256(x, m);
+	lo = _mm256_and_si256(x, m1);
+	hi = _mm256_and_si256(_mm256_srli_epi32(x, 1), m1);
+	s = _mm256_sad_epu8(occ_popcnt256_epi8(lo), z);
+	s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_sad_epu8(occ_popcnt256_epi8(hi), z), 16));
+	s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_sad_epu8(occ_popcnt256_epi8(_mm256_and_si256(lo, hi)), z), 32));
+	return occ_hsum256(s);
+}
+
+OCC_AVX2 static inline void occ_blk1_avx2(const uint32_t *p, int r, bwtint_t cnt[4])
+{
+	uint64_t c = occ_cnt256_avx2(_mm256_loadu_si256((const __m256i*)p), occ_mask256(r));
+	occ_add_cnt(cnt, r, c&0xffff, c>>16&0xffff, c>>32);
+}
+
+OCC_AVX2 static inline void occ_blk2_avx2(const uint32_t *p, int rk, int rl, bwtint_t cntk[4], bwtint_t cntl[4])
+{
+	__m256i x = _mm256_loadu_si256((const __m256i*)p);
+	uint64_t c;
+	c = occ_cnt256_avx2(x, occ_mask256(rk));
+	occ_add_cnt(cntk, rk, c&0xffff, c>>16&0xffff, c>>32);
+	c = occ_cnt256_avx2(x, occ_mask256(rl));
+	occ_add_cnt(cntl, rl, c&0xffff, c>>16&0xffff, c>>32);
+}
+
+BWT_OCC4_INIT(avx2, OCC_AVX2)
+
+/*** AVX-512: VPOPCNTQ; bwt_2occ4() counts k and l in the two halves of a 512-bit vector ***/
+
+OCC_AVX512 static inline void occ_blk1_avx512(const uint32_t *p, int r, bwtint_t cnt[4])
+{
+	const __m256i m1 = _mm256_set1_epi32(0x55555555);
+	__m256i x, lo, hi, s;
+	uint64_t c;
+	x = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)p), occ_mask256(r));
+	lo = _mm256_and_si256(x, m1);
+	hi = _mm256_and_si256(_mm256_srli_epi32(x, 1), m1);
+	s = _mm256_popcnt_epi64(lo);
+	s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_popcnt_epi64(hi), 16));
+	s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_popcnt_epi64(_mm256_and_si256(lo, hi)), 32));
+	c = occ_hsum256(s);
+	occ_add_cnt(cnt, r, c&0xffff, c>>16&0xffff, c>>32);
+}
+
+OCC_AVX512 static inline void occ_blk2_avx512(const uint32_t *p, int rk, int rl, bwtint_t cntk[4], bwtint_t cntl[4])
+{
+	const __m512i m1 = _mm512_set1_epi32(0x55555555);
+	__m512i x, lo, hi, s;
+	uint64_t c;
+	x = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i*)p));
+	x = _mm512_and_si512(x, _mm512_inserti64x4(_mm512_castsi256_si512(occ_mask256(rk)), occ_mask256(rl), 1));
+	lo = _mm512_and_si512(x, m1);
+	hi = _mm512_and_si512(_mm512_srli_epi32(x, 1), m1);
+	s = _mm512_popcnt_epi64(lo);
+	s = _mm512_add_epi64(s, _mm512_slli_epi64(_mm512_popcnt_epi64(hi), 16));
+	s = _mm512_add_epi64(s, _mm512_slli_epi64(_mm512_popcnt_epi64(_mm512_and_si512(lo, hi)), 32));
+	c = occ_hsum256(_mm512_castsi512_si256(s));
+	occ_add_cnt(cntk, rk, c&0xffff, c>>16&0xffff, c>>32);
+	c = occ_hsum256(_mm512_extracti64x4_epi64(s, 1));
+	occ_add_cnt(cntl, rl, c&0xffff, c>>16&0xffff, c>>32);
+}
+
+BWT_OCC4_INIT(avx512, OCC_AVX512)
+
+#endif // BWT_OCC_DISPATCH
+
+static const struct {
+	const char *name;
+	bwt_occ4_f occ4;
+	bwt_2occ4_f occ4x2;
+} bwt_occ_kernels[] = {
+	{ "scalar", bwt_occ4_scalar, bwt_2occ4_scalar },
+#ifdef BWT_OCC_DISPATCH
+	{ "popcnt", bwt_occ4_popcnt, bwt_2occ4_popcnt },
+	{ "avx2",   bwt_occ4_avx2,   bwt_2occ4_avx2 },
+	{ "avx512", bwt_occ4_avx512, bwt_2occ4_avx512 }
+#else
+	{ "popcnt", 0, 0 }, { "avx2", 0, 0 }, { "avx512", 0, 0 }
+#endif
+};
+
+static void bwt_occ4_first(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
+static void bwt_2occ4_first(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
+
+static int bwt_occ_kernel = -1;
+static bwt_occ4_f bwt_occ4_core = bwt_occ4_first;
+static bwt_2occ4_f bwt_2occ4_core = bwt_2occ4_first;
+
+int bwt_occ_kernel_supported(int kernel)
+{
+#ifdef BWT_OCC_DISPATCH
+	__builtin_cpu_init();
+	switch (kernel) {
+	case BWT_OCC_SCALAR: return 1;
+	case BWT_OCC_POPCNT: return __builtin_cpu_supports("popcnt");
+	case BWT_OCC_AVX2:   return __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2");
+	case BWT_OCC_AVX512: return __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vpopcntdq");
+	}
+	return 0;
+#else
+	return kernel == BWT_OCC_SCALAR;
+#endif
+}
+
+int bwt_occ_set_kernel(int kernel)
+{
+	if (kernel < 0) { // the fastest kernel supported by the CPU
+		for (kernel = BWT_OCC_AVX512; kernel > BWT_OCC_SCALAR; --kernel)
+			if (bwt_occ_kernel_supported(kernel)) break;
+	} else if (kernel > BWT_OCC_AVX512 || !bwt_occ_kernel_supported(kernel)) return -1;
+	bwt_occ4_core = bwt_occ_kernels[kernel].occ4;
+	bwt_2occ4_core = bwt_occ_kernels[kernel].occ4x2;
+	return bwt_occ_kernel = kernel;
+}
+
+int bwt_occ_get_kernel(void)
+{
+	return bwt_occ_kernel >= 0? bwt_occ_kernel : bwt_occ_set_kernel(-1);
+}
+
+const char *bwt_occ_kernel_name(int kernel)
+{
+	return kernel >= BWT_OCC_SCALAR && kernel <= BWT_OCC_AVX512? bwt_occ_kernels[kernel].name : 0;
+}
+
+// the kernel is chosen at the first call; racing threads all pick the same one
+static void bwt_occ4_first(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
+{
+	bwt_occ_set_kernel(-1);
+	bwt_occ4_core(bwt, k, cnt);
+}
+
+static void bwt_2occ4_first(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4])
+{
+	bwt_occ_set_kernel(-1);
+	bwt_2occ4_core(bwt, k, l, cntk, cntl);
+}
+
+void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4])
+{
+	bwt_occ4_core(bwt, k, cnt);
+}
+
+void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4])
+{
+	bwt_2occ4_core(bwt, k, l, cntk, cntl);
+}
+
+/***************
+ * k-mer table *
+ ***************/
+
+#define KMER_MASK40 0xffffffffffULL
+
+static inline void bwt_kmer_get(const bwt_t *bwt, int d, uint32_t x, bwtintv_t *ik)
+{
+	const uint64_t *p = bwt->kmer + ((bwt_kmer_off(d) + x)<<1);
+	ik->x[0] = p[0] & KMER_MASK40;
+	ik->x[1] = p[0] >> 40 | (p[1] & 0xffff) << 24;
+	ik->x[2] = p[1] >> 16;
+	ik->info = 0;
+}
+
+static inline void bwt_kmer_set(uint64_t *p, const bwtintv_t *ik)
+{
+	p[0] = ik->x[0] | ik->x[1] << 40;
+	p[1] = ik->x[1] >> 24 | ik->x[2] << 16;
+}
+
+static void bwt_kmer_alloc(bwt_t *bwt, int k) // 64-byte aligned, such that each group of four siblings is in one cache line
+{
+	size_t l = bwt_kmer_off(k + 1) * 16;
+	free(bwt->kmer);
+	if (posix_memalign((void**)&bwt->kmer, 64, l) != 0)
+		err_fatal(__func__, "failed to allocate %ld bytes", (long)l);
+	bwt->kmer_k = k;
+}
+
+void bwt_kmer_intv(const bwt_t *bwt, int d, uint32_t x, bwtintv_t *ik)
+{
+	bwt_kmer_get(bwt, d, x, ik);
+}
+
+// fill level d+1 by extending each d-mer backward; empty intervals are extended too, so every entry is what bwt_extend() gives
+void bwt_gen_kmer(bwt_t *bwt, int k)
+{
+	int c, d;
+	uint32_t x;
+	xassert(k >= 1 && k <= BWT_KMER_MAX, "k-mer length out of range.");
+	xassert(bwt->seq_len <= KMER_MASK40, "the reference is too long for the k-mer table.");
+	bwt_kmer_alloc(bwt, k);
+	for (c = 0; c < 4; ++c) {
+		bwtintv_t ik;
+		bwt_set_intv(bwt, c, ik);
+		bwt_kmer_set(bwt->kmer + (c<<1), &ik);
+	}
+	for (d = 1; d < k; ++d) {
+		uint64_t *q = bwt->kmer + (bwt_kmer_off(d + 1)<<1);
+		for (x = 0; x < 1U<<(d<<1); ++x) {
+			bwtintv_t ik, ok[4];
+			bwt_kmer_get(bwt, d, x, &ik);
+			bwt_extend(bwt, &ik, ok, 1);
+			for (c = 0; c < 4; ++c) // prepend c to the d-mer
+				bwt_kmer_set(q + (((uint64_t)x<<2 | c)<<1), &ok[c]);
+		}
+	}
+}
+
 int bwt_match_exact(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *sa_begin, bwtint_t *sa_end)
 {
 	bwtint_t k, l, ok, ol;
 	int i;
 	k = 0; l = bwt->seq_len;
+	if (bwt->kmer_k > 0 && len > 0) { // look up the last d bases in the k-mer table
+		int d = len < bwt->kmer_k? len : bwt->kmer_k;
+		uint32_t x = 0;
+		bwtintv_t ik;
+		for (i = len - d; i < len; ++i) {
+			if (str[i] > 3) return 0; // no match
+			x |= (uint32_t)str[i] << ((i - (len - d))<<1);
+		}
+		bwt_kmer_get(bwt, d, x, &ik);
+		if (ik.x[2] == 0) return 0; // no match
+		k = ik.x[0]; l = ik.x[0] + ik.x[2] - 1;
+		len -= d;
+	}
 	for (i = len - 1; i >= 0; --i) {
 		ubyte_t c = str[i];
 		if (c > 3) return 0; // no match
@@ -274,6 +823,13 @@ void bwt_extend(const bwt_t *bwt, const bwtintv_t *ik, bwtintv_t ok[4], int is_b
 	ok[0].x[is_back] = ok[1].x[is_back] + ok[1].x[2];
 }
 
+void bwt_extend_prefetch(const bwt_t *bwt, const bwtintv_t *ik, int is_back)
+{
+	bwtint_t k = ik->x[!is_back] - 1, l = k + ik->x[2];
+	if (k != (bwtint_t)-1) bwt_occ_prefetch(bwt, k - (k >= bwt->primary));
+	bwt_occ_prefetch(bwt, l - (l >= bwt->primary));
+}
+
 static void bwt_reverse_intvs(bwtintv_v *p)
 {
 	if (p->n > 1) {
@@ -289,6 +845,7 @@ static void bwt_reverse_intvs(bwtintv_v *p)
 int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv, uint64_t max_intv, bwtintv_v *mem, bwtintv_v *tmpvec[2])
 {
 	int i, j, c, ret;
+	uint32_t kmer;
 	bwtintv_t ik, ok[4];
 	bwtintv_v a[2], *prev, *curr, *swap;
 
@@ -300,6 +857,7 @@ int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv,
 	curr = tmpvec && tmpvec[1]? tmpvec[1] : &a[1];
 	bwt_set_intv(bwt, q[x], ik); // the initial interval of a single base
 	ik.info = x + 1;
+	kmer = q[x];
 
 	for (i = x + 1, curr->n = 0; i < len; ++i) { // forward search
 		if (ik.x[2] < max_intv) { // an interval small enough
@@ -307,7 +865,11 @@ int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv,
 			break;
 		} else if (q[i] < 4) { // an A/C/G/T base
 			c = 3 - q[i]; // complement of q[i]
-			bwt_extend(bwt, &ik, ok, 0);
+			if (i - x < bwt->kmer_k) { // q[x..i] is in the k-mer table; only ok[c] is used below
+				kmer |= (uint32_t)q[i] << ((i - x)<<1);
+				bwt_kmer_get(bwt, i - x + 1, kmer, &ok[c]);
+				if (ok[c].x[2] == 0) bwt_extend(bwt, &ik, ok, 0); // an empty interval is only defined by extension
+			} else bwt_extend(bwt, &ik, ok, 0);
 			if (ok[c].x[2] != ik.x[2]) { // change of the interval size
 				kv_push(bwtintv_t, *curr, ik);
 				if (ok[c].x[2] < min_intv) break; // the interval size is too small to be extended further
@@ -363,7 +925,22 @@ int bwt_seed_strategy1(const bwt_t *bwt, int len, const uint8_t *q, int x, int m
 	memset(mem, 0, sizeof(bwtintv_t));
 	if (q[x] > 3) return x + 1;
 	bwt_set_intv(bwt, q[x], ik); // the initial interval of a single base
-	for (i = x + 1; i < len; ++i) { // forward search
+	i = x + 1;
+	if (bwt->kmer_k > 1) { // no seed ends within the first min_len bases, so jump over them with the k-mer table
+		int d = bwt->kmer_k < min_len? bwt->kmer_k : min_len;
+		uint32_t kmer = 0;
+		bwtintv_t tk;
+		if (x + d <= len) {
+			for (i = x; i < x + d; ++i) {
+				if (q[i] > 3) return i + 1;
+				kmer |= (uint32_t)q[i] << ((i - x)<<1);
+			}
+			bwt_kmer_get(bwt, d, kmer, &tk);
+			if (tk.x[2] > 0) ik = tk; // for an empty interval, extend as usual to get the same output
+			else i = x + 1;
+		}
+	}
+	for (; i < len; ++i) { // forward search
 		if (q[i] < 4) { // an A/C/G/T base
 			c = 3 - q[i]; // complement of q[i]
 			bwt_extend(bwt, &ik, ok, 0);
@@ -386,6 +963,10 @@ void bwt_dump_bwt(const char *fn, const bwt_t *bwt)
 {
 	FILE *fp;
 	fp = xopen(fn, "wb");
+	if (bwt->fmt == BWT_FMT_CL) {
+		uint64_t magic = BWT_CL_MAGIC;
+		err_fwrite(&magic, sizeof(uint64_t), 1, fp);
+	}
 	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
 	err_fwrite(bwt->L2+1, sizeof(bwtint_t), 4, fp);
 	err_fwrite(bwt->bwt, 4, bwt->bwt_size, fp);
@@ -406,6 +987,34 @@ void bwt_dump_sa(const char *fn, const bwt_t *bwt)
 	err_fclose(fp);
 }
 
+void bwt_dump_sa2(const char *fn, const bwt_t *bwt, int intv, int n_threads, bwtint_t max_n, bwt_progress_f progress, void *data)
+{
+	FILE *fp;
+	bwtint_t lo, hi, n_sa, n_pass, x = intv, *sa;
+	int intv_round = intv;
+
+	kv_roundup32(intv_round);
+	xassert(intv_round == intv, "SA sample interval is not a power of 2.");
+	n_sa = (bwt->seq_len + intv) / intv;
+	if (max_n < 1) max_n = 1;
+	if (max_n > n_sa) max_n = n_sa;
+	n_pass = (n_sa + max_n - 1) / max_n;
+	sa = (bwtint_t*)malloc(max_n * sizeof(bwtint_t));
+	fp = xopen(fn, "wb");
+	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fwrite(bwt->L2+1, sizeof(bwtint_t), 4, fp);
+	err_fwrite(&x, sizeof(bwtint_t), 1, fp);
+	err_fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
+	for (lo = 0; lo < n_sa; lo = hi) { // each pass walks the whole LF cycle
+		hi = lo + max_n < n_sa? lo + max_n : n_sa;
+		cal_sa_range(bwt, intv, n_threads, lo, hi, sa, progress, data, lo / max_n, n_pass);
+		err_fwrite(sa + (lo == 0), sizeof(bwtint_t), hi - lo - (lo == 0), fp); // slot 0 is not stored
+	}
+	err_fflush(fp);
+	err_fclose(fp);
+	free(sa);
+}
+
 static bwtint_t fread_fix(FILE *fp, bwtint_t size, void *a)
 { // Mac/Darwin has a bug when reading data longer than 2GB. This function fixes this issue by reading data in small chunks
 	const int bufsize = 0x1000000; // 16M block
@@ -418,7 +1027,7 @@ static bwtint_t fread_fix(FILE *fp, bwtint_t size, void *a)
 	return offset;
 }
 
-void bwt_restore_sa(const char *fn, bwt_t *bwt)
+int64_t bwt_restore_sa_hdr(const char *fn, bwt_t *bwt)
 {
 	char skipped[256];
 	FILE *fp;
@@ -431,39 +1040,155 @@ void bwt_restore_sa(const char *fn, bwt_t *bwt)
 	err_fread_noeof(&bwt->sa_intv, sizeof(bwtint_t), 1, fp);
 	err_fread_noeof(&primary, sizeof(bwtint_t), 1, fp);
 	xassert(primary == bwt->seq_len, "SA-BWT inconsistency: seq_len is not the same.");
+	err_fclose(fp);
 
 	bwt->n_sa = (bwt->seq_len + bwt->sa_intv) / bwt->sa_intv;
 	bwt->sa = (bwtint_t*)calloc(bwt->n_sa, sizeof(bwtint_t));
 	bwt->sa[0] = -1;
+	return sizeof(bwtint_t) * 7;
+}
 
+void bwt_restore_sa(const char *fn, bwt_t *bwt)
+{
+	FILE *fp;
+	int64_t off;
+	off = bwt_restore_sa_hdr(fn, bwt);
+	fp = xopen(fn, "rb");
+	err_fseek(fp, off, SEEK_SET);
 	fread_fix(fp, sizeof(bwtint_t) * (bwt->n_sa - 1), bwt->sa + 1);
 	err_fclose(fp);
 }
 
-bwt_t *bwt_restore_bwt(const char *fn)
+#define BWT_SA_MAP_OFF (sizeof(bwtint_t) * 6) // bwt->sa[0] overlays the last header word of a mapped .sa
+
+int bwt_map_sa(const char *fn, bwt_t *bwt)
+{
+	int fd;
+	struct stat st;
+	bwtint_t hdr[7];
+	uint8_t *p;
+
+	if ((fd = open(fn, O_RDONLY)) < 0) return -1;
+	if (fstat(fd, &st) < 0 || pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+	xassert(hdr[0] == bwt->primary, "SA-BWT inconsistency: primary is not the same.");
+	xassert(hdr[6] == bwt->seq_len, "SA-BWT inconsistency: seq_len is not the same.");
+	bwt->sa_intv = hdr[5];
+	bwt->n_sa = (bwt->seq_len + bwt->sa_intv) / bwt->sa_intv;
+	xassert(st.st_size >= sizeof(hdr) + (bwt->n_sa - 1) * sizeof(bwtint_t), "truncated SA file.");
+	p = mmap(0, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0); // writable for sa[0] only, which stays private
+	close(fd);
+	if (p == MAP_FAILED) return -1;
+#ifdef MADV_RANDOM
+	madvise(p, st.st_size, MADV_RANDOM); // locate touches a few scattered entries; read ahead would load them all
+#endif
+	bwt->sa = (bwtint_t*)(p + BWT_SA_MAP_OFF);
+	bwt->sa[0] = -1;
+	bwt->l_sa_map = st.st_size;
+	return 0;
+}
+
+void bwt_free_sa(bwt_t *bwt)
+{
+	if (bwt->l_sa_map) munmap((uint8_t*)bwt->sa - BWT_SA_MAP_OFF, bwt->l_sa_map);
+	else free(bwt->sa);
+	bwt->sa = 0, bwt->l_sa_map = 0;
+}
+
+void bwt_dump_kmer(const char *fn, const bwt_t *bwt)
+{
+	FILE *fp;
+	uint64_t k = bwt->kmer_k;
+	fp = xopen(fn, "wb");
+	err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	err_fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
+	err_fwrite(&k, sizeof(uint64_t), 1, fp);
+	err_fwrite(bwt->kmer, 16, bwt_kmer_off(bwt->kmer_k + 1), fp);
+	err_fflush(fp);
+	err_fclose(fp);
+}
+
+int64_t bwt_restore_kmer_hdr(const char *fn, bwt_t *bwt)
+{
+	FILE *fp;
+	bwtint_t x;
+	uint64_t k;
+
+	if ((fp = fopen(fn, "rb")) == 0) return -1; // the table is optional
+	err_fread_noeof(&x, sizeof(bwtint_t), 1, fp);
+	xassert(x == bwt->primary, "kmer-BWT inconsistency: primary is not the same.");
+	err_fread_noeof(&x, sizeof(bwtint_t), 1, fp);
+	xassert(x == bwt->seq_len, "kmer-BWT inconsistency: seq_len is not the same.");
+	err_fread_noeof(&k, sizeof(uint64_t), 1, fp);
+	xassert(k >= 1 && k <= BWT_KMER_MAX, "invalid k-mer length.");
+	err_fclose(fp);
+	bwt_kmer_alloc(bwt, k);
+	return sizeof(bwtint_t) * 2 + sizeof(uint64_t);
+}
+
+int bwt_restore_kmer(const char *fn, bwt_t *bwt)
+{
+	FILE *fp;
+	int64_t off;
+	if ((off = bwt_restore_kmer_hdr(fn, bwt)) < 0) return -1;
+	fp = xopen(fn, "rb");
+	err_fseek(fp, off, SEEK_SET);
+	fread_fix(fp, bwt_kmer_off(bwt->kmer_k + 1) * 16, bwt->kmer);
+	err_fclose(fp);
+	return 0;
+}
+
+bwt_t *bwt_restore_bwt_hdr(const char *fn, int64_t *off)
 {
 	bwt_t *bwt;
 	FILE *fp;
+	int64_t l_hdr = sizeof(bwtint_t) * 5;
 
 	bwt = (bwt_t*)calloc(1, sizeof(bwt_t));
 	fp = xopen(fn, "rb");
+	err_fread_noeof(&bwt->primary, sizeof(bwtint_t), 1, fp);
+	if (bwt->primary == BWT_CL_MAGIC) { // the cache-line layout
+		bwt->fmt = BWT_FMT_CL;
+		l_hdr += sizeof(uint64_t);
+	}
 	err_fseek(fp, 0, SEEK_END);
-	bwt->bwt_size = (err_ftell(fp) - sizeof(bwtint_t) * 5) >> 2;
-	bwt->bwt = (uint32_t*)calloc(bwt->bwt_size, 4);
-	err_fseek(fp, 0, SEEK_SET);
+	bwt->bwt_size = (err_ftell(fp) - l_hdr) >> 2;
+	if (bwt->fmt == BWT_FMT_CL) { // keep each line in one cache line
+		if (posix_memalign((void**)&bwt->bwt, 64, bwt->bwt_size<<2) != 0)
+			err_fatal(__func__, "failed to allocate %ld bytes", (long)(bwt->bwt_size<<2));
+	} else bwt->bwt = (uint32_t*)calloc(bwt->bwt_size, 4);
+	err_fseek(fp, l_hdr - sizeof(bwtint_t) * 5, SEEK_SET);
 	err_fread_noeof(&bwt->primary, sizeof(bwtint_t), 1, fp);
 	err_fread_noeof(bwt->L2+1, sizeof(bwtint_t), 4, fp);
-	fread_fix(fp, bwt->bwt_size<<2, bwt->bwt);
 	bwt->seq_len = bwt->L2[4];
+	if (bwt->fmt == BWT_FMT_CL)
+		xassert(bwt->bwt_size == bwt_cl_n_lines(bwt) * 16 + ((bwt_cl_n_lines(bwt) - 1) >> BWT_CL_SB_SHIFT) * 8 + 8, "inconsistent bwt_size");
 	err_fclose(fp);
 	bwt_gen_cnt_table(bwt);
+	*off = l_hdr;
+	return bwt;
+}
 
+bwt_t *bwt_restore_bwt(const char *fn)
+{
+	bwt_t *bwt;
+	FILE *fp;
+	int64_t off;
+
+	bwt = bwt_restore_bwt_hdr(fn, &off);
+	fp = xopen(fn, "rb");
+	err_fseek(fp, off, SEEK_SET);
+	fread_fix(fp, bwt->bwt_size<<2, bwt->bwt);
+	err_fclose(fp);
 	return bwt;
 }
 
 void bwt_destroy(bwt_t *bwt)
 {
 	if (bwt == 0) return;
-	free(bwt->sa); free(bwt->bwt);
+	bwt_free_sa(bwt);
+	free(bwt->bwt); free(bwt->kmer);
 	free(bwt);
 }
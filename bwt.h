@@ -55,6 +55,11 @@ typedef struct {
 	int sa_intv;
 	bwtint_t n_sa;
 	bwtint_t *sa;
+	int fmt; // layout of bwt_t::bwt: BWT_FMT_OCC or BWT_FMT_CL
+	// k-mer table: bi-intervals of all d-mers for d in [1,kmer_k]; see bwt_kmer_intv()
+	int kmer_k;
+	uint64_t *kmer;
+	int64_t l_sa_map; // if >0, sa lies in a private mapping of the .sa file of this size; see bwt_map_sa()
 } bwt_t;
 
 typedef struct {
@@ -77,6 +82,49 @@ typedef struct { size_t n, m; bwtintv_t *a; } bwtintv_v;
  * called bwt_B0 instead of bwt_B */
 #define bwt_B0(b, k) (bwt_bwt(b, k)>>((~(k)&0xf)<<1)&3)
 
+/* BWT_FMT_CL: the BWT is stored in 64-byte cache lines, each holding 192
+ * bases as two bit-planes plus the Occ before the line relative to its
+ * superblock of 1<<BWT_CL_SB_SHIFT lines. The absolute Occ of superblocks
+ * follows the lines. On disk, such a .bwt starts with BWT_CL_MAGIC. */
+#define BWT_FMT_OCC 0
+#define BWT_FMT_CL  1
+
+#define BWT_CL_LEN      192
+#define BWT_CL_SB_SHIFT 22
+#define BWT_CL_MAGIC    0xffff014c43545742ULL // "BWTCL\1\xff\xff"; not a valid primary
+
+typedef struct {
+	uint32_t cnt[4]; // Occ before the line, relative to the superblock
+	uint64_t lo[3], hi[3]; // the low and high bits of base i are at bit i%64 of lo[i/64] and hi[i/64]
+} bwt_cl_t;
+
+#define bwt_cl_n_lines(b) ((b)->seq_len / BWT_CL_LEN + 1)
+#define bwt_cl_sb(b, i) ((const bwtint_t*)((const bwt_cl_t*)(b)->bwt + bwt_cl_n_lines(b)) + ((i)>>BWT_CL_SB_SHIFT<<2))
+
+static inline int bwt_cl_B0(const bwt_t *bwt, bwtint_t k) // bwt_B0() for BWT_FMT_CL
+{
+	const bwt_cl_t *p = (const bwt_cl_t*)bwt->bwt + k / BWT_CL_LEN;
+	int r = k % BWT_CL_LEN;
+	return (p->lo[r>>6] >> (r&63) & 1) | (p->hi[r>>6] >> (r&63) & 1) << 1;
+}
+
+/* The k-mer table keeps the bi-interval of each d-mer in two 64-bit words:
+ * x[0] in bits 0-39, x[1] in bits 40-79 and x[2] in bits 80-119. Level d
+ * starts at entry bwt_kmer_off(d); a d-mer is indexed by its 2-bit encoding
+ * with the first base in the lowest bits, such that the four backward
+ * extensions of a (d-1)-mer share a 64-byte cache line. */
+#define BWT_KMER_MAX 14
+#define bwt_kmer_off(d) (((1ULL<<((d)<<1)) - 4) / 3)
+
+// Occ kernels for bwt_occ4() and bwt_2occ4(); see bwt_occ_set_kernel()
+#define BWT_OCC_SCALAR 0
+#define BWT_OCC_POPCNT 1
+#define BWT_OCC_AVX2   2
+#define BWT_OCC_AVX512 3
+
+// called with the fraction done of a long step, from one thread at a time
+typedef void (*bwt_progress_f)(void *data, double done, int64_t n); // n: bases processed so far
+
 #define bwt_set_intv(bwt, c, ik) ((ik).x[0] = (bwt)->L2[(int)(c)]+1, (ik).x[2] = (bwt)->L2[(int)(c)+1]-(bwt)->L2[(int)(c)], (ik).x[1] = (bwt)->L2[3-(c)]+1, (ik).info = 0)
 
 #ifdef __cplusplus
@@ -88,24 +136,67 @@ extern "C" {
 
 	bwt_t *bwt_restore_bwt(const char *fn);
 	void bwt_restore_sa(const char *fn, bwt_t *bwt);
+	void bwt_dump_kmer(const char *fn, const bwt_t *bwt);
+	int bwt_restore_kmer(const char *fn, bwt_t *bwt); // return -1 if fn does not exist
+	// read only the header and allocate the array; return the array offset in fn, for reading it elsewhere
+	bwt_t *bwt_restore_bwt_hdr(const char *fn, int64_t *off);
+	int64_t bwt_restore_sa_hdr(const char *fn, bwt_t *bwt);
+	int64_t bwt_restore_kmer_hdr(const char *fn, bwt_t *bwt); // -1 if fn does not exist
+	// map the .sa instead of reading it; only the pages locate touches are read. -1 on failure
+	int bwt_map_sa(const char *fn, bwt_t *bwt);
+	void bwt_free_sa(bwt_t *bwt);
 
 	void bwt_destroy(bwt_t *bwt);
 
 	void bwt_bwtgen(const char *fn_pac, const char *fn_bwt); // from BWT-SW
 	void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size); // from BWT-SW
+	void bwt_bwtgen3(const char *fn_pac, const char *fn_bwt, int block_size, int n_threads); // same .bwt as bwt_bwtgen2()
+	void bwt_bwtgen4(const char *fn_pac, const char *fn_bwt, int block_size, int n_threads, bwt_progress_f progress, void *data);
 	void bwt_cal_sa(bwt_t *bwt, int intv);
+	void bwt_cal_sa2(bwt_t *bwt, int intv, int n_threads); // same .sa as bwt_cal_sa()
+	void bwt_cal_sa3(bwt_t *bwt, int intv, int n_threads, bwt_progress_f progress, void *data);
+	// write the .sa of bwt_cal_sa() without keeping it in memory: computed in passes of at most max_n samples
+	void bwt_dump_sa2(const char *fn, const bwt_t *bwt, int intv, int n_threads, bwtint_t max_n, bwt_progress_f progress, void *data);
+	void bwt_gen_kmer(bwt_t *bwt, int k);
 
 	void bwt_bwtupdate_core(bwt_t *bwt);
+	void bwt_bwtupdate_core2(bwt_t *bwt, int fmt);
 
 	bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c);
 	void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
 	bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k);
 
+	/**
+	 * Compute sa[i] = bwt_sa(bwt, k[i]) for i in [0,n). The LF-walks of
+	 * several ranks are interleaved and their memory accesses prefetched.
+	 * _sa_ may be the same array as _k_.
+	 */
+	void bwt_sa_batch(const bwt_t *bwt, int n, const bwtint_t *k, bwtint_t *sa);
+
 	// more efficient version of bwt_occ/bwt_occ4 for retrieving two close Occ values
 	void bwt_gen_cnt_table(bwt_t *bwt);
 	void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol);
 	void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
 
+	/**
+	 * Select the kernel behind bwt_occ4() and bwt_2occ4(). All kernels return
+	 * identical counts. By default, the fastest one supported by the CPU is
+	 * picked at the first call. A negative _kernel_ restores the default.
+	 *
+	 * @return the kernel in use, or -1 if _kernel_ is not supported
+	 */
+	int bwt_occ_set_kernel(int kernel);
+	int bwt_occ_get_kernel(void);
+	int bwt_occ_kernel_supported(int kernel);
+	const char *bwt_occ_kernel_name(int kernel);
+
+	/**
+	 * Get the bi-interval of the d-mer _x_ from the k-mer table, where
+	 * 1 <= d <= bwt->kmer_k. This is the same as d-1 rounds of bwt_extend()
+	 * unless the interval is empty.
+	 */
+	void bwt_kmer_intv(const bwt_t *bwt, int d, uint32_t x, bwtintv_t *ik);
+
 	int bwt_match_exact(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *sa_begin, bwtint_t *sa_end);
 	int bwt_match_exact_alt(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *k0, bwtint_t *l0);
 
@@ -113,6 +204,8 @@ extern "C" {
 	 * Extend bi-SA-interval _ik_
 	 */
 	void bwt_extend(const bwt_t *bwt, const bwtintv_t *ik, bwtintv_t ok[4], int is_back);
+	// prefetch the Occ data bwt_extend() will read, to overlap the misses of independent extensions
+	void bwt_extend_prefetch(const bwt_t *bwt, const bwtintv_t *ik, int is_back);
 
 	/**
 	 * Given a query _q_, collect potential SMEMs covering position _x_ and store them in _mem_.
@@ -28,6 +28,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
 #include "QSufSort.h"
 
 #ifdef USE_MALLOC_WRAPPERS
@@ -61,6 +62,9 @@ typedef int64_t sbgint_t;
 
 #define MIN_AVAILABLE_WORD 0x10000
 
+#define BWTINC_MT_MIN_SORT_ITEM 0x10000	// groups smaller than this are not split further for sorting on threads
+#define BWTINC_MT_MERGE_CHAR    0x1000000	// old BWT characters merged by one thread in one round
+
 #define average(value1, value2)					( ((value1) & (value2)) + ((value1) ^ (value2)) / 2 )
 #define min(value1, value2)						( ((value1) < (value2)) ? (value1) : (value2) )
 #define max(value1, value2)						( ((value1) > (value2)) ? (value1) : (value2) )
@@ -96,6 +100,7 @@ typedef struct BWTInc {
 	unsigned int *packedText;
 	unsigned char *textBuffer;
 	unsigned int *packedShift;
+	int n_threads;
 } BWTInc;
 
 static bgint_t TextLengthFromBytePacked(bgint_t bytePackedLength, unsigned int bitPerChar,
@@ -947,31 +952,26 @@ static void BWTIncBuildBwt(unsigned int* insertBwt, const bgint_t *relativeRank,
 	}
 }
 
-static void BWTIncMergeBwt(const bgint_t *sortedRank, const unsigned int* oldBwt, const unsigned int *insertBwt,
-						   unsigned int* __restrict mergedBwt, const bgint_t numOldBwt, const bgint_t numInsertBwt)
+// Merge old characters [oIndex,oEnd) and insertions [iIndex,iEnd) to mergedBwt, starting at character mChar of its first word
+static void BWTIncMergeBwtRange(const bgint_t *sortedRank, const unsigned int* oldBwt, const unsigned int *insertBwt,
+								unsigned int* __restrict mergedBwt, bgint_t oIndex, const bgint_t oEnd,
+								bgint_t iIndex, const bgint_t iEnd, bgint_t mChar)
 {
-	unsigned int bitsInWordMinusBitPerChar;
 	bgint_t leftShift, rightShift;
 	bgint_t o;
-	bgint_t oIndex, iIndex, mIndex;
-	bgint_t mWord, mChar, oWord, oChar;
+	bgint_t mIndex;
+	bgint_t mWord, oWord, oChar;
 	bgint_t numInsert;
 
-	bitsInWordMinusBitPerChar = BITS_IN_WORD - BIT_PER_CHAR;
-
-	oIndex = 0;
-	iIndex = 0;
-	mIndex = 0;
-
+	mIndex = mChar;
 	mWord = 0;
-	mChar = 0;
 
 	mergedBwt[0] = 0;	// this can be cleared as merged Bwt slightly shift to the left in each iteration
 
-	while (oIndex < numOldBwt) {
+	while (oIndex < oEnd) {
 
 		// copy from insertBwt
-		while (iIndex <= numInsertBwt && sortedRank[iIndex] <= oIndex) {
+		while (iIndex < iEnd && sortedRank[iIndex] <= oIndex) {
 			if (sortedRank[iIndex] != 0) {	// special value to indicate that this is for new inverseSa0
 				mergedBwt[mWord] |= insertBwt[iIndex] << (BITS_IN_WORD - (mChar + 1) * BIT_PER_CHAR);
 				mIndex++;
@@ -986,10 +986,10 @@ static void BWTIncMergeBwt(const bgint_t *sortedRank, const unsigned int* oldBwt
 		}
 
 		// Copy from oldBwt to mergedBwt
-		if (iIndex <= numInsertBwt) {
+		if (iIndex < iEnd) {
 			o = sortedRank[iIndex];
 		} else {
-			o = numOldBwt;
+			o = oEnd;
 		}
 		numInsert = o - oIndex;
 
@@ -1045,7 +1045,7 @@ static void BWTIncMergeBwt(const bgint_t *sortedRank, const unsigned int* oldBwt
 	}
 
 	// copy from insertBwt
-	while (iIndex <= numInsertBwt) {
+	while (iIndex < iEnd) {
 		if (sortedRank[iIndex] != 0) {
 			mergedBwt[mWord] |= insertBwt[iIndex] << (BITS_IN_WORD - (mChar + 1) * BIT_PER_CHAR);
 			mIndex++;
@@ -1059,6 +1059,135 @@ static void BWTIncMergeBwt(const bgint_t *sortedRank, const unsigned int* oldBwt
 		iIndex++;
 	}
 }
+static void BWTIncMergeBwt(const bgint_t *sortedRank, const unsigned int* oldBwt, const unsigned int *insertBwt,
+						   unsigned int* __restrict mergedBwt, const bgint_t numOldBwt, const bgint_t numInsertBwt)
+{
+	BWTIncMergeBwtRange(sortedRank, oldBwt, insertBwt, mergedBwt, 0, numOldBwt, 0, numInsertBwt + 1, 0);
+}
+
+typedef struct {
+	bgint_t oIndex, oEnd, iIndex, iEnd;
+	bgint_t mWord, mChar, numWord;
+	unsigned int *buf;
+	bgint_t maxWord;
+} BWTIncMergeTask;
+
+typedef struct {
+	const bgint_t *sortedRank;
+	const unsigned int *oldBwt, *insertBwt;
+	BWTIncMergeTask *task;
+} BWTIncMergeWorker;
+
+static void BWTIncMergeWorker1(void *data, long i, int tid)
+{
+	BWTIncMergeWorker *w = (BWTIncMergeWorker*)data;
+	BWTIncMergeTask *t = &w->task[i];
+	BWTIncMergeBwtRange(w->sortedRank, w->oldBwt, w->insertBwt, t->buf, t->oIndex, t->oEnd, t->iIndex, t->iEnd, t->mChar);
+}
+
+// the first insertion before or at old character o; sortedRank[z] has been zeroed and was zRank
+static bgint_t BWTIncFirstInsert(const bgint_t *sortedRank, bgint_t n, bgint_t z, bgint_t zRank, bgint_t o)
+{
+	bgint_t lo = 0, hi = n, mid;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((mid == z? zRank : sortedRank[mid]) < o) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+/* Same result as BWTIncMergeBwt(). mergedBwt overlaps oldBwt, with writes
+ * trailing reads, so it is merged in rounds: in a round, each thread merges
+ * a slice of oldBwt to its own buffer; the buffers are then copied in place. */
+static void BWTIncMergeBwtMT(const bgint_t *sortedRank, bgint_t z, bgint_t zRank, const unsigned int* oldBwt,
+							 const unsigned int *insertBwt, unsigned int* __restrict mergedBwt,
+							 const bgint_t numOldBwt, const bgint_t numInsertBwt, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+	BWTIncMergeWorker w;
+	BWTIncMergeTask *t;
+	bgint_t oIndex, numChar, mIndex;
+	int i, n;
+
+	w.sortedRank = sortedRank, w.oldBwt = oldBwt, w.insertBwt = insertBwt;
+	w.task = (BWTIncMergeTask*)calloc(n_threads, sizeof(BWTIncMergeTask));
+	for (oIndex = 0; oIndex < numOldBwt;) {
+		for (n = 0; n < n_threads && oIndex < numOldBwt; ++n) {
+			t = &w.task[n];
+			t->oIndex = oIndex;
+			t->oEnd = numOldBwt - oIndex > BWTINC_MT_MERGE_CHAR? oIndex + BWTINC_MT_MERGE_CHAR : numOldBwt;
+			t->iIndex = BWTIncFirstInsert(sortedRank, numInsertBwt + 1, z, zRank, t->oIndex);
+			t->iEnd = t->oEnd == numOldBwt? numInsertBwt + 1 : BWTIncFirstInsert(sortedRank, numInsertBwt + 1, z, zRank, t->oEnd);
+			mIndex = t->oIndex + t->iIndex - (z < t->iIndex);
+			numChar = t->oEnd - t->oIndex + t->iEnd - t->iIndex - (t->iIndex <= z && z < t->iEnd);
+			t->mWord = mIndex / CHAR_PER_WORD;
+			t->mChar = mIndex - t->mWord * CHAR_PER_WORD;
+			t->numWord = (t->mChar + numChar + CHAR_PER_WORD - 1) / CHAR_PER_WORD;
+			if (t->numWord + 2 > t->maxWord) {
+				t->maxWord = t->numWord + 2;
+				t->buf = (unsigned*)realloc(t->buf, t->maxWord * BYTES_IN_WORD);
+			}
+			oIndex = t->oEnd;
+		}
+		kt_for(n, BWTIncMergeWorker1, &w, n);
+		for (i = 0; i < n; ++i) { // in order, as a slice may share its first word with the previous one
+			t = &w.task[i];
+			if (t->numWord == 0) continue;
+			if (t->mChar) mergedBwt[t->mWord] |= t->buf[0];
+			else mergedBwt[t->mWord] = t->buf[0];
+			memcpy(mergedBwt + t->mWord + 1, t->buf + 1, (t->numWord - 1) * BYTES_IN_WORD);
+		}
+	}
+	for (i = 0; i < n_threads; ++i) free(w.task[i].buf);
+	free(w.task);
+}
+
+/* The groups of sortedRank are independent. Large ones are split by
+ * partitioning around a pivot before the parts are sorted on threads. Keys
+ * equal to the pivot need no sorting; their order within the group is not
+ * significant as QSufSort() later sorts the suffixes of tied ranks. */
+typedef struct {
+	bgint_t *key, *seq;
+	bgint_t n;
+} BWTIncSortTask;
+
+static void BWTIncSortWorker(void *data, long i, int tid)
+{
+	BWTIncSortTask *t = (BWTIncSortTask*)data + i;
+	BWTIncSortKey(t->key, t->seq, t->n);
+}
+
+static void BWTIncSortKeyMT(BWTIncSortTask *task, int n_task, int max_task, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+	bgint_t *key, *seq, n, lt, gt, i, p, t;
+	int j, k;
+
+	while (n_task < max_task) {
+		for (j = 0, k = 1; k < n_task; ++k)
+			if (task[k].n > task[j].n) j = k;
+		if (task[j].n < BWTINC_MT_MIN_SORT_ITEM) break;
+		key = task[j].key, seq = task[j].seq, n = task[j].n;
+		p = med3(key[0], key[n/2], key[n-1]);
+		for (lt = i = 0, gt = n; i < gt;) { // [0,lt): <p; [lt,i): ==p; [gt,n): >p
+			if (key[i] < p) {
+				t = key[i], key[i] = key[lt], key[lt] = t;
+				t = seq[i], seq[i] = seq[lt], seq[lt] = t;
+				++lt, ++i;
+			} else if (key[i] > p) {
+				--gt;
+				t = key[i], key[i] = key[gt], key[gt] = t;
+				t = seq[i], seq[i] = seq[gt], seq[gt] = t;
+			} else ++i;
+		}
+		task[j].n = lt;
+		task[n_task].key = key + gt, task[n_task].seq = seq + gt, task[n_task].n = n - gt;
+		++n_task;
+	}
+	kt_for(n_threads, BWTIncSortWorker, task, n_task);
+}
+
 
 void BWTClearTrailingBwtCode(BWT *bwt)
 {
@@ -1304,7 +1433,9 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar)
 
 	bgint_t *relativeRank, *seq, *sortedRank;
 	unsigned int *insertBwt, *mergedBwt;
-	bgint_t newInverseSa0RelativeRank, oldInverseSa0RelativeRank, newInverseSa0;
+	bgint_t newInverseSa0RelativeRank, oldInverseSa0RelativeRank, newInverseSa0, newInverseSa0SortedRank;
+	BWTIncSortTask *task;
+	unsigned int n_task;
 
 	mergedBwtSizeInWord = BWTResidentSizeInWord(bwtInc->bwt->textLength + numChar);
 	mergedOccSizeInWord = BWTOccValueMinorSizeInWord(bwtInc->bwt->textLength + numChar);
@@ -1365,23 +1496,35 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar)
 		// Get rank of new suffix among processed suffix
 		// The seq array is built into ALPHABET_SIZE + 2 groups; ALPHABET_SIZE groups + 1 group divided into 2 by inverseSa0 + inverseSa0 as 1 group
 		// ->packedText is not used any more and will be overwritten by relativeRank
+		task = (BWTIncSortTask*)calloc(ALPHABET_SIZE + 1, sizeof(BWTIncSortTask));
 		oldInverseSa0RelativeRank = BWTIncGetAbsoluteRank(bwtInc->bwt, sortedRank, seq, bwtInc->packedText, 
 														  numChar, bwtInc->cumulativeCountInCurrentBuild, bwtInc->firstCharInLastIteration);
 
 		// Sort rank by ALPHABET_SIZE + 2 groups (or ALPHABET_SIZE + 1 groups when inverseSa0 sit on the border of a group)
-		for (i=0; i<ALPHABET_SIZE; i++) {
+		for (i=0, n_task=0; i<ALPHABET_SIZE; i++) {
 			if (bwtInc->cumulativeCountInCurrentBuild[i] > oldInverseSa0RelativeRank ||
 				bwtInc->cumulativeCountInCurrentBuild[i+1] <= oldInverseSa0RelativeRank) {
-				BWTIncSortKey(sortedRank + bwtInc->cumulativeCountInCurrentBuild[i], seq + bwtInc->cumulativeCountInCurrentBuild[i], bwtInc->cumulativeCountInCurrentBuild[i+1] - bwtInc->cumulativeCountInCurrentBuild[i]);
+				task[n_task].key = sortedRank + bwtInc->cumulativeCountInCurrentBuild[i], task[n_task].seq = seq + bwtInc->cumulativeCountInCurrentBuild[i];
+				task[n_task++].n = bwtInc->cumulativeCountInCurrentBuild[i+1] - bwtInc->cumulativeCountInCurrentBuild[i];
 			} else {
 				if (bwtInc->cumulativeCountInCurrentBuild[i] < oldInverseSa0RelativeRank) {
-					BWTIncSortKey(sortedRank + bwtInc->cumulativeCountInCurrentBuild[i], seq + bwtInc->cumulativeCountInCurrentBuild[i], oldInverseSa0RelativeRank - bwtInc->cumulativeCountInCurrentBuild[i]);
+					task[n_task].key = sortedRank + bwtInc->cumulativeCountInCurrentBuild[i], task[n_task].seq = seq + bwtInc->cumulativeCountInCurrentBuild[i];
+					task[n_task++].n = oldInverseSa0RelativeRank - bwtInc->cumulativeCountInCurrentBuild[i];
 				}
 				if (bwtInc->cumulativeCountInCurrentBuild[i+1] > oldInverseSa0RelativeRank + 1) {
-					BWTIncSortKey(sortedRank + oldInverseSa0RelativeRank + 1, seq + oldInverseSa0RelativeRank + 1, bwtInc->cumulativeCountInCurrentBuild[i+1] - oldInverseSa0RelativeRank - 1);
+					task[n_task].key = sortedRank + oldInverseSa0RelativeRank + 1, task[n_task].seq = seq + oldInverseSa0RelativeRank + 1;
+					task[n_task++].n = bwtInc->cumulativeCountInCurrentBuild[i+1] - oldInverseSa0RelativeRank - 1;
 				}
 			}
 		}
+		if (bwtInc->n_threads > 1) {
+			task = (BWTIncSortTask*)realloc(task, (bwtInc->n_threads * 4 + n_task) * sizeof(BWTIncSortTask));
+			BWTIncSortKeyMT(task, n_task, bwtInc->n_threads * 4 + n_task, bwtInc->n_threads);
+		} else {
+			for (i=0; i<n_task; i++)
+				BWTIncSortKey(task[i].key, task[i].seq, task[i].n);
+		}
+		free(task);
 
 		// build relative rank; sortedRank is updated for merging to cater for the fact that $ is not encoded in bwt
 		// the cumulative freq information is used to make sure that inverseSa0 and suffix beginning with different characters are kept in different unsorted groups)
@@ -1394,6 +1537,7 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar)
 		newInverseSa0RelativeRank = relativeRank[0];
 		newInverseSa0 = sortedRank[newInverseSa0RelativeRank] + newInverseSa0RelativeRank;
 
+		newInverseSa0SortedRank = sortedRank[newInverseSa0RelativeRank];
 		sortedRank[newInverseSa0RelativeRank] = 0;	// a special value so that this is skipped in the merged bwt
 
 		// Build BWT; seq is overwritten by insertBwt
@@ -1403,7 +1547,10 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar)
 		mergedBwt = bwtInc->workingMemory + bwtInc->availableWord - mergedBwtSizeInWord 
 				    - bwtInc->numberOfIterationDone * OCC_INTERVAL / BIT_PER_CHAR * (sizeof(bgint_t) / 4); // minus numberOfIteration * occInterval to create a buffer for merging
 		assert(mergedBwt >= insertBwt + numChar);
-		BWTIncMergeBwt(sortedRank, bwtInc->bwt->bwtCode, insertBwt, mergedBwt, bwtInc->bwt->textLength, numChar);
+		if (bwtInc->n_threads > 1)
+			BWTIncMergeBwtMT(sortedRank, newInverseSa0RelativeRank, newInverseSa0SortedRank, bwtInc->bwt->bwtCode, insertBwt, mergedBwt,
+							 bwtInc->bwt->textLength, numChar, bwtInc->n_threads);
+		else BWTIncMergeBwt(sortedRank, bwtInc->bwt->bwtCode, insertBwt, mergedBwt, bwtInc->bwt->textLength, numChar);
 	}
 
 	// Build auxiliary structure and update info and pointers in BWT
@@ -1434,7 +1581,8 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar)
 
 }
 
-BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxBuildSize, bgint_t incMaxBuildSize)
+BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxBuildSize, bgint_t incMaxBuildSize, int n_threads,
+								   void (*progress)(void*,double,int64_t), void *data)
 {
 
 	FILE *packedFile;
@@ -1475,6 +1623,7 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxB
 	totalTextLength = TextLengthFromBytePacked(packedFileLen, BIT_PER_CHAR, lastByteLength);
 
 	bwtInc = BWTIncCreate(totalTextLength, initialMaxBuildSize, incMaxBuildSize);
+	bwtInc->n_threads = n_threads;
 
 	BWTIncSetBuildSizeAndTextAddr(bwtInc);
 
@@ -1507,6 +1656,7 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxB
 	BWTIncConstruct(bwtInc, textToLoad);
 
 	processedTextLength = textToLoad;
+	if (progress) progress(data, (double)processedTextLength / totalTextLength, processedTextLength);
 
 	while (processedTextLength < totalTextLength) {
 		textToLoad = bwtInc->buildSize / CHAR_PER_WORD * CHAR_PER_WORD;
@@ -1534,6 +1684,7 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxB
 		ConvertBytePackedToWordPacked(bwtInc->textBuffer, bwtInc->packedText, ALPHABET_SIZE, textToLoad);
 		BWTIncConstruct(bwtInc, textToLoad);
 		processedTextLength += textToLoad;
+		if (progress) progress(data, (double)processedTextLength / totalTextLength, processedTextLength);
 		// if (bwtInc->numberOfIterationDone % 10 == 0) {
 		//	fprintf(stderr, "[BWTIncConstructFromPacked] %lu iterations done. %lu characters processed.\n",
 		//			(long)bwtInc->numberOfIterationDone, (long)processedTextLength);
@@ -1595,15 +1746,25 @@ void BWTSaveBwtCodeAndOcc(const BWT *bwt, const char *bwtFileName, const char *o
 	}
 }
 
-void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size)
+void bwt_bwtgen4(const char *fn_pac, const char *fn_bwt, int block_size, int n_threads, void (*progress)(void*,double,int64_t), void *data)
 {
 	BWTInc *bwtInc;
-	bwtInc = BWTIncConstructFromPacked(fn_pac, block_size, block_size);
+	bwtInc = BWTIncConstructFromPacked(fn_pac, block_size, block_size, n_threads, progress, data);
 	// fprintf(stderr, "[bwt_gen] Finished constructing BWT in %u iterations.\n", bwtInc->numberOfIterationDone);
 	BWTSaveBwtCodeAndOcc(bwtInc->bwt, fn_bwt, 0);
 	BWTIncFree(bwtInc);
 }
 
+void bwt_bwtgen3(const char *fn_pac, const char *fn_bwt, int block_size, int n_threads)
+{
+	bwt_bwtgen4(fn_pac, fn_bwt, block_size, n_threads, 0, 0);
+}
+
+void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size)
+{
+	bwt_bwtgen3(fn_pac, fn_bwt, block_size, 1);
+}
+
 void bwt_bwtgen(const char *fn_pac, const char *fn_bwt)
 {
 	bwt_bwtgen2(fn_pac, fn_bwt, 10000000);
@@ -1611,11 +1772,14 @@ void bwt_bwtgen(const char *fn_pac, const char *fn_bwt)
 
 int bwt_bwtgen_main(int argc, char *argv[])
 {
-	if (argc < 3) {
-		fprintf(stderr, "Usage: bwtgen <in.pac> <out.bwt>\n");
+	int c, n_threads = 1;
+	while ((c = getopt(argc, argv, "t:")) >= 0)
+		if (c == 't') n_threads = atoi(optarg) > 1? atoi(optarg) : 1;
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Usage: bwtgen [-t nThreads] <in.pac> <out.bwt>\n");
 		return 1;
 	}
-	bwt_bwtgen(argv[1], argv[2]);
+	bwt_bwtgen3(argv[optind], argv[optind+1], 10000000, n_threads);
 	return 0;
 }
 
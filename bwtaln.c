@@ -171,6 +171,7 @@ void bwa_aln_core(const char *prefix, const char *fn_fa, const gap_opt_t *opt)
 	{ // load BWT
 		char *str = (char*)calloc(strlen(prefix) + 10, 1);
 		strcpy(str, prefix); strcat(str, ".bwt");  bwt = bwt_restore_bwt(str);
+		strcpy(str, prefix); strcat(str, ".kmer"); bwt_restore_kmer(str, bwt);
 		free(str);
 	}
 
@@ -45,7 +45,16 @@ static void gap_reset_stack(gap_stack_t *stack)
 	stack->n_entries = 0;
 }
 
-static inline void gap_push(gap_stack_t *stack, int i, bwtint_t k, bwtint_t l, int n_mm, int n_gapo, int n_gape, int n_ins, int n_del,
+#define GAP_NO_KMER 0xffffffffu
+
+// the k-mer code of c prepended to the matched string of $kmer
+static inline uint32_t gap_kmer_prepend(uint32_t kmer, int c)
+{
+	uint32_t n = kmer>>28;
+	return n < BWT_KMER_MAX? (n + 1)<<28 | (kmer & 0xfffffff)<<2 | c : GAP_NO_KMER;
+}
+
+static inline void gap_push(gap_stack_t *stack, int i, bwtint_t k, bwtint_t l, uint32_t kmer, int n_mm, int n_gapo, int n_gape, int n_ins, int n_del,
 							int state, int is_diff, const gap_opt_t *opt)
 {
 	int score;
@@ -58,7 +67,7 @@ static inline void gap_push(gap_stack_t *stack, int i, bwtint_t k, bwtint_t l, i
 		q->stack = (gap_entry_t*)realloc(q->stack, sizeof(gap_entry_t) * q->m_entries);
 	}
 	p = q->stack + q->n_entries;
-	p->info = (uint32_t)score<<21 | i; p->k = k; p->l = l;
+	p->info = (uint32_t)score<<21 | i; p->k = k; p->l = l; p->kmer = kmer;
 	p->n_mm = n_mm; p->n_gapo = n_gapo; p->n_gape = n_gape;
 	p->n_ins = n_ins; p->n_del = n_del;
 	p->state = state; 
@@ -128,12 +137,12 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwt, int len, const ubyte_t *seq, bwt_wid
 
 	//for (j = 0; j != len; ++j) printf("#0 %d: [%d,%u]\t[%d,%u]\n", j, w[0][j].bid, w[0][j].w, w[1][j].bid, w[1][j].w);
 	gap_reset_stack(stack); // reset stack
-	gap_push(stack, len, 0, bwt->seq_len, 0, 0, 0, 0, 0, 0, 0, opt);
+	gap_push(stack, len, 0, bwt->seq_len, 0, 0, 0, 0, 0, 0, 0, 0, opt);
 
 	while (stack->n_entries) {
 		gap_entry_t e;
 		int i, m, m_seed = 0, hit_found, allow_diff, allow_M, tmp;
-		bwtint_t k, l, cnt_k[4], cnt_l[4], occ;
+		bwtint_t k, l, kk[4], ll[4], occ;
 
 		if (max_entries < stack->n_entries) max_entries = stack->n_entries;
 		if (stack->n_entries > opt->max_entries) break;
@@ -198,7 +207,18 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwt, int len, const ubyte_t *seq, bwt_wid
 		}
 
 		--i;
-		bwt_2occ4(bwt, k - 1, l, cnt_k, cnt_l); // retrieve Occ values
+		if ((int)(e.kmer>>28) < bwt->kmer_k) { // the SA intervals of all four extensions are in the k-mer table
+			for (j = 0; j != 4; ++j) {
+				bwtintv_t ik;
+				uint32_t x = gap_kmer_prepend(e.kmer, j);
+				bwt_kmer_intv(bwt, x>>28, x & 0xfffffff, &ik);
+				kk[j] = ik.x[0]; ll[j] = ik.x[0] + ik.x[2] - 1;
+			}
+		} else {
+			bwt_2occ4(bwt, k - 1, l, kk, ll); // retrieve Occ values
+			for (j = 0; j != 4; ++j)
+				kk[j] += bwt->L2[j] + 1, ll[j] += bwt->L2[j];
+		}
 		occ = l - k + 1;
 		// test whether diff is allowed
 		allow_diff = allow_M = 1;
@@ -218,25 +238,19 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwt, int len, const ubyte_t *seq, bwt_wid
 			if (e.state == STATE_M) { // gap open
 				if (e.n_gapo < opt->max_gapo) { // gap open is allowed
 					// insertion
-					gap_push(stack, i, k, l, e.n_mm, e.n_gapo + 1, e.n_gape, e.n_ins + 1, e.n_del, STATE_I, 1, opt);
+					gap_push(stack, i, k, l, e.kmer, e.n_mm, e.n_gapo + 1, e.n_gape, e.n_ins + 1, e.n_del, STATE_I, 1, opt);
 					// deletion
-					for (j = 0; j != 4; ++j) {
-						k = bwt->L2[j] + cnt_k[j] + 1;
-						l = bwt->L2[j] + cnt_l[j];
-						if (k <= l) gap_push(stack, i + 1, k, l, e.n_mm, e.n_gapo + 1, e.n_gape, e.n_ins, e.n_del + 1, STATE_D, 1, opt);
-					}
+					for (j = 0; j != 4; ++j)
+						if (kk[j] <= ll[j]) gap_push(stack, i + 1, kk[j], ll[j], gap_kmer_prepend(e.kmer, j), e.n_mm, e.n_gapo + 1, e.n_gape, e.n_ins, e.n_del + 1, STATE_D, 1, opt);
 				}
 			} else if (e.state == STATE_I) { // extention of an insertion
 				if (e.n_gape < opt->max_gape) // gap extention is allowed
-					gap_push(stack, i, k, l, e.n_mm, e.n_gapo, e.n_gape + 1, e.n_ins + 1, e.n_del, STATE_I, 1, opt);
+					gap_push(stack, i, k, l, e.kmer, e.n_mm, e.n_gapo, e.n_gape + 1, e.n_ins + 1, e.n_del, STATE_I, 1, opt);
 			} else if (e.state == STATE_D) { // extention of a deletion
 				if (e.n_gape < opt->max_gape) { // gap extention is allowed
 					if (e.n_gape + e.n_gapo < max_diff || occ < opt->max_del_occ) {
-						for (j = 0; j != 4; ++j) {
-							k = bwt->L2[j] + cnt_k[j] + 1;
-							l = bwt->L2[j] + cnt_l[j];
-							if (k <= l) gap_push(stack, i + 1, k, l, e.n_mm, e.n_gapo, e.n_gape + 1, e.n_ins, e.n_del + 1, STATE_D, 1, opt);
-						}
+						for (j = 0; j != 4; ++j)
+							if (kk[j] <= ll[j]) gap_push(stack, i + 1, kk[j], ll[j], gap_kmer_prepend(e.kmer, j), e.n_mm, e.n_gapo, e.n_gape + 1, e.n_ins, e.n_del + 1, STATE_D, 1, opt);
 					}
 				}
 			}
@@ -246,15 +260,11 @@ bwt_aln1_t *bwt_match_gap(bwt_t *const bwt, int len, const ubyte_t *seq, bwt_wid
 			for (j = 1; j <= 4; ++j) {
 				int c = (seq[i] + j) & 3;
 				int is_mm = (j != 4 || seq[i] > 3);
-				k = bwt->L2[c] + cnt_k[c] + 1;
-				l = bwt->L2[c] + cnt_l[c];
-				if (k <= l) gap_push(stack, i, k, l, e.n_mm + is_mm, e.n_gapo, e.n_gape, e.n_ins, e.n_del, STATE_M, is_mm, opt);
+				if (kk[c] <= ll[c]) gap_push(stack, i, kk[c], ll[c], gap_kmer_prepend(e.kmer, c), e.n_mm + is_mm, e.n_gapo, e.n_gape, e.n_ins, e.n_del, STATE_M, is_mm, opt);
 			}
 		} else if (seq[i] < 4) { // try exact match only
 			int c = seq[i] & 3;
-			k = bwt->L2[c] + cnt_k[c] + 1;
-			l = bwt->L2[c] + cnt_l[c];
-			if (k <= l) gap_push(stack, i, k, l, e.n_mm, e.n_gapo, e.n_gape, e.n_ins, e.n_del, STATE_M, 0, opt);
+			if (kk[c] <= ll[c]) gap_push(stack, i, kk[c], ll[c], gap_kmer_prepend(e.kmer, c), e.n_mm, e.n_gapo, e.n_gape, e.n_ins, e.n_del, STATE_M, 0, opt);
 		}
 	}
 
@@ -9,6 +9,7 @@ typedef struct { // recursion stack
 	uint32_t n_mm:8, n_gapo:8, n_gape:8, state:2, n_seed_mm:6;
 	uint32_t n_ins:16, n_del:16;
 	int last_diff_pos;
+	uint32_t kmer; // the matched string as len<<28 | 2-bit code, or 0xffffffff if longer than BWT_KMER_MAX
 	bwtint_t k, l; // (k,l) is the SA region of [i,n-1]
 } gap_entry_t;
 
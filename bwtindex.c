@@ -31,8 +31,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
-#include <time.h>
 #include <zlib.h>
 #include "bntseq.h"
 #include "bwa.h"
@@ -50,7 +50,8 @@
 #endif
 
 
-int is_bwt(ubyte_t *T, int n);
+int64_t is_bwt64(ubyte_t *T, int64_t n, int sa_intv, uint64_t *sa);
+int is_sa_int(const int *T, int *SA, int n, int k);
 
 int64_t bwa_seq_len(const char *fn_pac)
 {
@@ -66,6 +67,11 @@ int64_t bwa_seq_len(const char *fn_pac)
 }
 
 bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is)
+{
+	return bwt_pac2bwt2(fn_pac, use_is, 0);
+}
+
+bwt_t *bwt_pac2bwt2(const char *fn_pac, int use_is, int sa_intv)
 {
 	bwt_t *bwt;
 	ubyte_t *buf, *buf2;
@@ -94,7 +100,16 @@ bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is)
 
 	// Burrows-Wheeler Transform
 	if (use_is) {
-		bwt->primary = is_bwt(buf, bwt->seq_len);
+		int64_t primary;
+		if (sa_intv > 0) {
+			bwt->sa_intv = sa_intv;
+			bwt->n_sa = (bwt->seq_len + sa_intv) / sa_intv;
+			bwt->sa = (bwtint_t*)malloc(bwt->n_sa * sizeof(bwtint_t));
+		}
+		if ((primary = is_bwt64(buf, bwt->seq_len, sa_intv, bwt->sa)) < 0)
+			err_fatal(__func__, "fail to construct the suffix array of %lld bases", (long long)bwt->seq_len);
+		bwt->primary = primary;
+		if (bwt->sa) bwt->sa[0] = (bwtint_t)-1; // as in bwt_cal_sa()
 	} else {
 		rope_t *r;
 		int64_t x;
@@ -151,6 +166,46 @@ int bwa_pac2bwt(int argc, char *argv[]) // the "pac2bwt" command; IMPORTANT: bwt
 
 #define bwt_B00(b, k) ((b)->bwt[(k)>>4]>>((~(k)&0xf)<<1)&3)
 
+static void bwt_bwtupdate_cl(bwt_t *bwt) // convert the raw BWT to BWT_FMT_CL
+{
+	bwtint_t i, l, n_lines, n_sb, c[4], *sb;
+	bwt_cl_t *buf;
+	int j, r;
+
+	n_lines = bwt_cl_n_lines(bwt);
+	n_sb = ((n_lines - 1) >> BWT_CL_SB_SHIFT) + 1;
+	bwt->bwt_size = (n_lines * sizeof(bwt_cl_t) + n_sb * 4 * sizeof(bwtint_t)) >> 2;
+	if (posix_memalign((void**)&buf, 64, bwt->bwt_size<<2) != 0)
+		err_fatal(__func__, "failed to allocate %ld bytes", (long)(bwt->bwt_size<<2));
+	memset(buf, 0, bwt->bwt_size<<2);
+	sb = (bwtint_t*)(buf + n_lines);
+	c[0] = c[1] = c[2] = c[3] = 0;
+	for (i = l = 0, r = 0; i <= bwt->seq_len; ++i, ++r) {
+		if (r == BWT_CL_LEN) ++l, r = 0;
+		if (r == 0) { // a new line; the last one may be empty
+			if ((l & ((1<<BWT_CL_SB_SHIFT) - 1)) == 0)
+				memcpy(sb + (l>>BWT_CL_SB_SHIFT<<2), c, 4 * sizeof(bwtint_t));
+			for (j = 0; j < 4; ++j)
+				buf[l].cnt[j] = c[j] - sb[(l>>BWT_CL_SB_SHIFT<<2) + j];
+		}
+		if (i < bwt->seq_len) {
+			int b = bwt_B00(bwt, i);
+			buf[l].lo[r>>6] |= (uint64_t)(b&1) << (r&63);
+			buf[l].hi[r>>6] |= (uint64_t)(b>>1) << (r&63);
+			++c[b];
+		}
+	}
+	xassert(l + 1 == n_lines, "inconsistent number of lines");
+	free(bwt->bwt); bwt->bwt = (uint32_t*)buf;
+	bwt->fmt = BWT_FMT_CL;
+}
+
+void bwt_bwtupdate_core2(bwt_t *bwt, int fmt)
+{
+	if (fmt == BWT_FMT_CL) bwt_bwtupdate_cl(bwt);
+	else bwt_bwtupdate_core(bwt);
+}
+
 void bwt_bwtupdate_core(bwt_t *bwt)
 {
 	bwtint_t i, k, c[4], n_occ;
@@ -178,13 +233,20 @@ void bwt_bwtupdate_core(bwt_t *bwt)
 int bwa_bwtupdate(int argc, char *argv[]) // the "bwtupdate" command
 {
 	bwt_t *bwt;
-	if (argc != 2) {
-		fprintf(stderr, "Usage: bwa bwtupdate <the.bwt>\n");
+	int c, fmt = BWT_FMT_OCC;
+	while ((c = getopt(argc, argv, "c")) >= 0) {
+		switch (c) {
+		case 'c': fmt = BWT_FMT_CL; break;
+		default: return 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		fprintf(stderr, "Usage: bwa bwtupdate [-c] <the.bwt>\n");
 		return 1;
 	}
-	bwt = bwt_restore_bwt(argv[1]);
-	bwt_bwtupdate_core(bwt);
-	bwt_dump_bwt(argv[1], bwt);
+	bwt = bwt_restore_bwt(argv[optind]);
+	bwt_bwtupdate_core2(bwt, fmt);
+	bwt_dump_bwt(argv[optind], bwt);
 	bwt_destroy(bwt);
 	return 0;
 }
@@ -192,43 +254,87 @@ int bwa_bwtupdate(int argc, char *argv[]) // the "bwtupdate" command
 int bwa_bwt2sa(int argc, char *argv[]) // the "bwt2sa" command
 {
 	bwt_t *bwt;
-	int c, sa_intv = 32;
-	while ((c = getopt(argc, argv, "i:")) >= 0) {
+	int c, sa_intv = 32, n_threads = 1;
+	while ((c = getopt(argc, argv, "i:t:")) >= 0) {
 		switch (c) {
 		case 'i': sa_intv = atoi(optarg); break;
+		case 't': n_threads = atoi(optarg); break;
 		default: return 1;
 		}
 	}
 	if (optind + 2 > argc) {
-		fprintf(stderr, "Usage: bwa bwt2sa [-i %d] <in.bwt> <out.sa>\n", sa_intv);
+		fprintf(stderr, "Usage: bwa bwt2sa [-i %d] [-t %d] <in.bwt> <out.sa>\n", sa_intv, n_threads);
 		return 1;
 	}
 	bwt = bwt_restore_bwt(argv[optind]);
-	bwt_cal_sa(bwt, sa_intv);
+	bwt_cal_sa2(bwt, sa_intv, n_threads);
 	bwt_dump_sa(argv[optind+1], bwt);
 	bwt_destroy(bwt);
 	return 0;
 }
 
+int bwa_bwt2kmer(int argc, char *argv[]) // the "bwt2kmer" command
+{
+	bwt_t *bwt;
+	int c, k = 12;
+	while ((c = getopt(argc, argv, "k:")) >= 0) {
+		switch (c) {
+		case 'k': k = atoi(optarg); break;
+		default: return 1;
+		}
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "Usage: bwa bwt2kmer [-k %d] <in.bwt> <out.kmer>\n", k);
+		return 1;
+	}
+	if (k < 1 || k > BWT_KMER_MAX) err_fatal(__func__, "the k-mer length must be between 1 and %d.", BWT_KMER_MAX);
+	bwt = bwt_restore_bwt(argv[optind]);
+	bwt_gen_kmer(bwt, k);
+	bwt_dump_kmer(argv[optind+1], bwt);
+	bwt_destroy(bwt);
+	return 0;
+}
+
 int bwa_index(int argc, char *argv[]) // the "index" command
 {
-	int c, algo_type = BWTALGO_AUTO, is_64 = 0, block_size = 10000000;
+	int c, is_64 = 0;
 	char *prefix = 0, *str;
-	while ((c = getopt(argc, argv, "6a:p:b:")) >= 0) {
+	bwa_idxopt_t opt;
+
+	bwa_idxopt_init(&opt);
+	while ((c = getopt(argc, argv, "6a:p:b:ci:k:m:t:")) >= 0) {
 		switch (c) {
 		case 'a': // if -a is not set, algo_type will be determined later
-			if (strcmp(optarg, "rb2") == 0) algo_type = BWTALGO_RB2;
-			else if (strcmp(optarg, "bwtsw") == 0) algo_type = BWTALGO_BWTSW;
-			else if (strcmp(optarg, "is") == 0) algo_type = BWTALGO_IS;
+			if (strcmp(optarg, "rb2") == 0) opt.algo_type = BWTALGO_RB2;
+			else if (strcmp(optarg, "bwtsw") == 0) opt.algo_type = BWTALGO_BWTSW;
+			else if (strcmp(optarg, "is") == 0) opt.algo_type = BWTALGO_IS;
 			else err_fatal(__func__, "unknown algorithm: '%s'.", optarg);
 			break;
 		case 'p': prefix = strdup(optarg); break;
 		case '6': is_64 = 1; break;
+		case 'c': opt.bwt_fmt = BWT_FMT_CL; break;
+		case 'i':
+			opt.sa_intv = atoi(optarg);
+			if (opt.sa_intv < 1 || opt.sa_intv > 32 || (opt.sa_intv & (opt.sa_intv - 1)))
+				err_fatal(__func__, "the SA sampling interval must be 1, 2, 4, 8, 16 or 32: '%s'.", optarg);
+			break;
+		case 'k':
+			opt.kmer_k = atoi(optarg);
+			if (opt.kmer_k < 0 || opt.kmer_k > BWT_KMER_MAX)
+				err_fatal(__func__, "the k-mer length must be between 0 and %d: '%s'.", BWT_KMER_MAX, optarg);
+			break;
+		case 't': opt.n_threads = atoi(optarg) > 1? atoi(optarg) : 1; break;
 		case 'b':
-			block_size = strtol(optarg, &str, 10);
-			if (*str == 'G' || *str == 'g') block_size *= 1024 * 1024 * 1024;
-			else if (*str == 'M' || *str == 'm') block_size *= 1024 * 1024;
-			else if (*str == 'K' || *str == 'k') block_size *= 1024;
+			opt.block_size = strtol(optarg, &str, 10);
+			if (*str == 'G' || *str == 'g') opt.block_size *= 1024 * 1024 * 1024;
+			else if (*str == 'M' || *str == 'm') opt.block_size *= 1024 * 1024;
+			else if (*str == 'K' || *str == 'k') opt.block_size *= 1024;
+			break;
+		case 'm':
+			opt.max_mem = strtol(optarg, &str, 10);
+			if (*str == 'G' || *str == 'g') opt.max_mem <<= 30;
+			else if (*str == 'M' || *str == 'm') opt.max_mem <<= 20;
+			else if (*str == 'K' || *str == 'k') opt.max_mem <<= 10;
 			break;
 		default: return 1;
 		}
@@ -239,11 +345,17 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 		fprintf(stderr, "Usage:   bwa index [options] <in.fasta>\n\n");
 		fprintf(stderr, "Options: -a STR    BWT construction algorithm: bwtsw, is or rb2 [auto]\n");
 		fprintf(stderr, "         -p STR    prefix of the index [same as fasta name]\n");
-		fprintf(stderr, "         -b INT    block size for the bwtsw algorithm (effective with -a bwtsw) [%d]\n", block_size);
+		fprintf(stderr, "         -b INT    block size for the bwtsw algorithm (effective with -a bwtsw) [%d]\n", opt.block_size);
+		fprintf(stderr, "         -m INT    memory budget; sets the algorithm, the bwtsw block size (overriding -b)\n");
+		fprintf(stderr, "                   and the passes over the SA; 0 for no limit [0]\n");
+		fprintf(stderr, "         -i INT    SA sampling interval: 1, 2, 4, 8, 16 or 32; smaller is faster but larger [%d]\n", opt.sa_intv);
+		fprintf(stderr, "         -k INT    also store the SA intervals of all k-mers for faster seeding; 0 to disable [%d]\n", opt.kmer_k);
+		fprintf(stderr, "         -t INT    number of threads [%d]\n", opt.n_threads);
 		fprintf(stderr, "         -6        index files named as <in.fasta>.64.* instead of <in.fasta>.* \n");
+		fprintf(stderr, "         -c        store the BWT in 64-byte cache lines with bit-plane Occ (smaller, not readable by older bwa)\n");
 		fprintf(stderr, "\n");
-		fprintf(stderr,	"Warning: `-a bwtsw' does not work for short genomes, while `-a is' and\n");
-		fprintf(stderr, "         `-a div' do not work not for long genomes.\n\n");
+		fprintf(stderr,	"Warning: `-a bwtsw' does not work for short genomes, while `-a is' needs 5 to\n");
+		fprintf(stderr, "         9 bytes of RAM per base of both strands for long genomes.\n\n");
 		return 1;
 	}
 	if (prefix == 0) {
@@ -251,77 +363,563 @@ int bwa_index(int argc, char *argv[]) // the "index" command
 		strcpy(prefix, argv[optind]);
 		if (is_64) strcat(prefix, ".64");
 	}
-	bwa_idx_build(argv[optind], prefix, algo_type, block_size);
+	c = bwa_idx_build2(argv[optind], prefix, &opt);
 	free(prefix);
-	return 0;
+	return c == 0? 0 : 1;
+}
+
+int bwa_append(int argc, char *argv[]) // the "append" command
+{
+	int c, n_threads = 1;
+	while ((c = getopt(argc, argv, "t:")) >= 0) {
+		switch (c) {
+		case 't': n_threads = atoi(optarg) > 1? atoi(optarg) : 1; break;
+		default: return 1;
+		}
+	}
+	if (optind + 2 > argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   bwa append [-t %d] <idxbase> <in.fasta>\n\n", n_threads);
+		fprintf(stderr, "Note: The index is updated in place and is the same as indexing all sequences\n");
+		fprintf(stderr, "      at once. The BWT and the SA are rewritten, but only the suffixes of the\n");
+		fprintf(stderr, "      new sequences are sorted.\n\n");
+		return 1;
+	}
+	return bwa_idx_append(argv[optind], argv[optind+1], n_threads) == 0? 0 : 1;
+}
+
+void bwa_idxopt_init(bwa_idxopt_t *opt)
+{
+	memset(opt, 0, sizeof(bwa_idxopt_t));
+	opt->algo_type = BWTALGO_AUTO;
+	opt->block_size = 10000000;
+	opt->bwt_fmt = BWT_FMT_OCC;
+	opt->sa_intv = 32;
+	opt->n_threads = 1;
+}
+
+/* Peak memory of the steps of bwa_idx_build2() for n bases of both strands, in
+ * bytes. Sizes fixed in n, such as the Occ of the CL format, go to the slack. */
+
+#define IDX_MEM_SLACK      (64LL<<20)
+#define IDX_MIN_BLOCK      1000000
+#define IDX_MAX_BLOCK      (1<<30)
+#define IDX_MAX_SA_PASS    16
+
+static int64_t idx_mem_bwt(int64_t n, int fmt) // the BWT with Occ
+{
+	return fmt == BWT_FMT_CL? n / 3 : n / 2;
+}
+
+static int64_t idx_mem_is(int64_t n, int sa_intv) // the text, its suffix array and the samples; see bwt_pac2bwt2()
+{
+	return n * (1 + (n < INT_MAX? sizeof(int) : sizeof(int64_t))) + n / sa_intv * sizeof(bwtint_t);
+}
+
+static int64_t idx_mem_bwtsw(int64_t n, int64_t block, int n_threads) // see BWTIncCreate() and BWTIncMergeBwtMT()
+{
+	return n / 4 + n / 32 + block * 24 / 5 + (n / block + 1) * 2048 + block / 4 + (int64_t)n_threads * (4<<20);
+}
+
+static int64_t idx_mem_kmer(int k)
+{
+	return k > 0? bwt_kmer_off(k + 1) * 16 : 0;
+}
+
+int bwa_idx_auto_algo(int64_t l_pac, int sa_intv)
+{
+	int64_t avail, need = idx_mem_is(l_pac, sa_intv) + IDX_MEM_SLACK;
+	if (l_pac <= 50000000) return BWTALGO_IS; // bwtsw does not work for short genomes
+	avail = mem_available();
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] is needs %.1f GB; %.1f GB available\n", __func__, need / 1e9, avail / 1e9);
+	return avail >= need? BWTALGO_IS : BWTALGO_BWTSW;
+}
+
+/* Choose the algorithm and the bwtsw block size such that no step takes more
+ * than opt->max_mem. Return the number of SA samples that may be held at once,
+ * or -1 if the budget is too small. */
+static int64_t idx_plan(int64_t n, const bwa_idxopt_t *opt, int *algo_type, int *block_size)
+{
+	int64_t budget = opt->max_mem, bwt = idx_mem_bwt(n, opt->bwt_fmt), n_sa = n / opt->sa_intv + 1, need, b;
+	*algo_type = opt->algo_type, *block_size = opt->block_size;
+	if (budget <= 0) {
+		if (*algo_type == BWTALGO_AUTO) *algo_type = bwa_idx_auto_algo(n, opt->sa_intv);
+		return n_sa;
+	}
+	need = n / 4 + bwt; // bwt_bwtupdate_core2() keeps both BWTs
+	if (need < bwt + idx_mem_kmer(opt->kmer_k)) need = bwt + idx_mem_kmer(opt->kmer_k);
+	if (need < bwt + (n_sa + IDX_MAX_SA_PASS - 1) / IDX_MAX_SA_PASS * 10) need = bwt + (n_sa + IDX_MAX_SA_PASS - 1) / IDX_MAX_SA_PASS * 10;
+	if (*algo_type == BWTALGO_AUTO) {
+		*algo_type = bwa_idx_auto_algo(n, opt->sa_intv);
+		if (*algo_type == BWTALGO_IS && n > 50000000 && idx_mem_is(n, opt->sa_intv) + IDX_MEM_SLACK > budget)
+			*algo_type = BWTALGO_BWTSW;
+	}
+	if (*algo_type == BWTALGO_BWTSW) {
+		b = (budget - IDX_MEM_SLACK - n / 4 - n / 32 - (n / IDX_MIN_BLOCK + 1) * 2048 - (int64_t)opt->n_threads * (4<<20)) * 20 / 101; // the inverse of idx_mem_bwtsw()
+		b = b < IDX_MIN_BLOCK? IDX_MIN_BLOCK : b < n? b : n;
+		*block_size = b < IDX_MAX_BLOCK? b : IDX_MAX_BLOCK;
+		if (need < idx_mem_bwtsw(n, *block_size, opt->n_threads)) need = idx_mem_bwtsw(n, *block_size, opt->n_threads);
+	} else if (*algo_type == BWTALGO_IS && need < idx_mem_is(n, opt->sa_intv)) need = idx_mem_is(n, opt->sa_intv);
+	need += IDX_MEM_SLACK;
+	if (need > budget) {
+		fprintf(stderr, "[E::%s] %.3f GB is needed for %ld bases; the budget is %.3f GB\n", __func__, need / 1e9, (long)n, budget / 1e9);
+		return -1;
+	}
+	b = (budget - IDX_MEM_SLACK - bwt) / (sizeof(bwtint_t) + sizeof(uint16_t)); // see bwt_dump_sa2()
+	b = b < n_sa? b : n_sa;
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] algorithm %s, block size %d, %ld SA pass(es); %.3f GB estimated\n", __func__, *algo_type == BWTALGO_BWTSW? "bwtsw" : *algo_type == BWTALGO_IS? "is" : "rb2",
+				*block_size, (long)((n_sa + b - 1) / b), need / 1e9);
+	return b;
 }
 
 int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_size)
+{
+	bwa_idxopt_t opt;
+	bwa_idxopt_init(&opt);
+	opt.algo_type = algo_type;
+	opt.block_size = block_size;
+	return bwa_idx_build2(fa, prefix, &opt);
+}
+
+typedef struct {
+	const bwa_idxopt_t *opt;
+	bwa_idxstat_t st;
+	double t_real, t_cpu; // at the start of the phase
+} idx_stat_t;
+
+static void idx_report(idx_stat_t *p, double done, int64_t bytes)
+{
+	p->st.done = done, p->st.bytes = bytes;
+	p->st.real = realtime() - p->t_real, p->st.cpu = cputime() - p->t_cpu;
+	p->st.peak_rss = peakrss();
+	if (p->opt->progress) p->opt->progress(&p->st, p->opt->progress_data);
+}
+
+static void idx_progress(void *data, double done, int64_t n) // bwt_progress_f
+{
+	idx_report((idx_stat_t*)data, done, n / 4);
+}
+
+static void idx_phase(idx_stat_t *p, int phase)
+{
+	p->st.phase = phase;
+	p->t_real = realtime(), p->t_cpu = cputime();
+	idx_report(p, 0., 0);
+}
+
+int bwa_idx_build2(const char *fa, const char *prefix, const bwa_idxopt_t *opt)
 {
 	extern void bwa_pac_rev_core(const char *fn, const char *fn_rev);
 
 	char *str, *str2, *str3;
-	clock_t t;
-	int64_t l_pac;
+	idx_stat_t st;
+	int64_t l_pac, max_sa;
+	int algo_type, block_size, has_sa = 0;
 
 	str  = (char*)calloc(strlen(prefix) + 10, 1);
 	str2 = (char*)calloc(strlen(prefix) + 10, 1);
 	str3 = (char*)calloc(strlen(prefix) + 10, 1);
+	memset(&st, 0, sizeof(idx_stat_t));
+	st.opt = opt;
 
-	{ // nucleotide indexing
+	{ // nucleotide indexing: the forward-only .pac for the index, and the forward-reverse one for the BWT
 		gzFile fp = xzopen(fa, "r");
-		t = clock();
+		strcpy(str, prefix); strcat(str, ".fr.pac");
+		idx_phase(&st, BWA_BUILD_PACK);
 		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Pack FASTA... ");
-		l_pac = bns_fasta2bntseq(fp, prefix, 0);
-		if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		l_pac = bns_fasta2bntseq2(fp, prefix, str) * 2;
+		idx_report(&st, 1., l_pac / 8);
+		if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec, %.2f CPU sec\n", st.st.real, st.st.cpu);
 		err_gzclose(fp);
 	}
-	if (algo_type == 0) algo_type = l_pac > 50000000? 2 : 3; // set the algorithm for generating BWT
+	if ((max_sa = idx_plan(l_pac, opt, &algo_type, &block_size)) < 0) { // set the algorithm for generating BWT
+		static const char *sfx[] = { ".fr.pac", ".pac", ".ann", ".amb" }; // leave no partial index behind
+		int i;
+		for (i = 0; i < 4; ++i) {
+			strcpy(str, prefix); strcat(str, sfx[i]);
+			unlink(str);
+		}
+		free(str3); free(str2); free(str);
+		return -1;
+	}
 	{
-		strcpy(str, prefix); strcat(str, ".pac");
+		strcpy(str, prefix); strcat(str, ".fr.pac");
 		strcpy(str2, prefix); strcat(str2, ".bwt");
-		t = clock();
+		idx_phase(&st, BWA_BUILD_BWT);
 		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Construct BWT for the packed sequence...\n");
-		if (algo_type == 2) bwt_bwtgen2(str, str2, block_size);
+		if (algo_type == 2) bwt_bwtgen4(str, str2, block_size, opt->n_threads, idx_progress, &st);
 		else if (algo_type == 1 || algo_type == 3) {
 			bwt_t *bwt;
-			bwt = bwt_pac2bwt(str, algo_type == 3);
+			bwt = bwt_pac2bwt2(str, algo_type == 3, opt->sa_intv);
 			bwt_dump_bwt(str2, bwt);
+			if (bwt->sa) { // IS sorts all suffixes; keep the samples rather than recomputing them from the BWT
+				strcpy(str3, prefix); strcat(str3, ".sa");
+				bwt_dump_sa(str3, bwt);
+				has_sa = 1;
+			}
 			bwt_destroy(bwt);
 		}
-		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] %.2f seconds elapse.\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		unlink(str);
+		idx_report(&st, 1., l_pac / 4);
+		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] %.2f seconds elapse, %.2f CPU sec.\n", st.st.real, st.st.cpu);
 	}
 	{
 		bwt_t *bwt;
 		strcpy(str, prefix); strcat(str, ".bwt");
-		t = clock();
+		idx_phase(&st, BWA_BUILD_UPDATE);
 		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Update BWT... ");
 		bwt = bwt_restore_bwt(str);
-		bwt_bwtupdate_core(bwt);
+		bwt_bwtupdate_core2(bwt, opt->bwt_fmt);
 		bwt_dump_bwt(str, bwt);
 		bwt_destroy(bwt);
-		if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+		idx_report(&st, 1., l_pac / 4);
+		if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec, %.2f CPU sec\n", st.st.real, st.st.cpu);
 	}
-	{
-		gzFile fp = xzopen(fa, "r");
-		t = clock();
-		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Pack forward-only FASTA... ");
-		l_pac = bns_fasta2bntseq(fp, prefix, 1);
-		if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
-		err_gzclose(fp);
-	}
-	{
+	if (!has_sa || opt->kmer_k > 0) {
 		bwt_t *bwt;
 		strcpy(str, prefix); strcat(str, ".bwt");
 		strcpy(str3, prefix); strcat(str3, ".sa");
-		t = clock();
-		if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Construct SA from BWT and Occ... ");
 		bwt = bwt_restore_bwt(str);
-		bwt_cal_sa(bwt, 32);
-		bwt_dump_sa(str3, bwt);
+		if (!has_sa) {
+			idx_phase(&st, BWA_BUILD_SA);
+			if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Construct SA from BWT and Occ... ");
+			if (max_sa < l_pac / opt->sa_intv + 1) { // over the budget; write the samples in passes
+				bwt_dump_sa2(str3, bwt, opt->sa_intv, opt->n_threads, max_sa, idx_progress, &st);
+			} else {
+				if (opt->progress) bwt_cal_sa3(bwt, opt->sa_intv, opt->n_threads, idx_progress, &st);
+				else bwt_cal_sa2(bwt, opt->sa_intv, opt->n_threads);
+				bwt_dump_sa(str3, bwt);
+			}
+			idx_report(&st, 1., st.st.bytes > l_pac / 4? st.st.bytes : l_pac / 4);
+			if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec, %.2f CPU sec\n", st.st.real, st.st.cpu);
+		}
+		if (opt->kmer_k > 0) {
+			strcpy(str3, prefix); strcat(str3, ".kmer");
+			idx_phase(&st, BWA_BUILD_KMER);
+			if (bwa_verbose >= 3) fprintf(stderr, "[bwa_index] Construct the %d-mer table... ", opt->kmer_k);
+			bwt_gen_kmer(bwt, opt->kmer_k);
+			bwt_dump_kmer(str3, bwt);
+			idx_report(&st, 1., l_pac / 4);
+			if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec, %.2f CPU sec\n", st.st.real, st.st.cpu);
+		}
 		bwt_destroy(bwt);
-		if (bwa_verbose >= 3) fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+	}
+	if (bwa_verbose >= 3) {
+		fprintf(stderr, "[bwa_index] Peak memory: %.3f GB", peakrss() / 1e9);
+		if (opt->max_mem > 0) fprintf(stderr, " (budget %.3f GB)", opt->max_mem / 1e9);
+		fputc('\n', stderr);
 	}
 	free(str3); free(str2); free(str);
 	return 0;
 }
+
+/************************
+ * Incremental indexing *
+ ************************/
+
+/* Appending N to the forward strand F of length p turns the text F.R$ of the
+ * BWT, with R the reverse complement of F, into F.N.M.R$, with M that of N.
+ * Let Q=F[p-L-1,p) be a suffix of F occurring once in either text. Then the
+ * suffixes starting before Q, and those in R$, keep their order; only the
+ * suffixes of W=F[p-L,p).N.M, followed by R$, are to be ranked. Each of them
+ * is ranked among the kept suffixes by backward search from R$ in the old
+ * BWT, and among the others by suffix sorting W with each base tagged with
+ * that rank. The BWT is then rewritten in one pass, with the rows of the
+ * suffixes of F[p-L,p) removed and those of W inserted. */
+
+// base i of the forward-reverse text of the forward pac of l_pac bases
+static inline int append_fr_base(const uint8_t *pac, int64_t l_pac, int64_t i)
+{
+	return i < l_pac? pac[i>>2] >> ((~i&3)<<1) & 3 : 3 - (pac[(2*l_pac-1-i)>>2] >> ((~(2*l_pac-1-i)&3)<<1) & 3);
+}
+
+// whether the suffix of length l of the old forward strand, [p-l,p), occurs again in the new text; with q bases appended
+static int append_occ_again(const uint8_t *pac, int64_t p, int64_t q, int64_t l)
+{
+	int64_t i, j, n, *fail;
+	uint8_t *x, *t;
+	int found = 0;
+	// t is the part of the new text where another occurrence could start: F[p-l+1,p).N.M.R[0,l-1)
+	n = 2 * (l - 1) + 2 * q;
+	x = malloc(l + n);
+	t = x + l;
+	for (i = 0; i < l; ++i) x[i] = append_fr_base(pac, p + q, p - l + i);
+	for (i = 0; i < n; ++i) t[i] = append_fr_base(pac, p + q, p - l + 1 + i);
+	fail = malloc(l * sizeof(int64_t)); // Knuth-Morris-Pratt
+	fail[0] = -1;
+	for (i = 1, j = -1; i < l; ++i) {
+		while (j >= 0 && x[j+1] != x[i]) j = fail[j];
+		if (x[j+1] == x[i]) ++j;
+		fail[i] = j;
+	}
+	for (i = 0, j = -1; i < n; ++i) {
+		while (j >= 0 && x[j+1] != t[i]) j = fail[j];
+		if (x[j+1] == t[i]) ++j;
+		if (j == l - 1) {
+			found = 1;
+			break;
+		}
+	}
+	free(fail); free(x);
+	return found;
+}
+
+static inline int64_t append_n_lt(int64_t n, const uint64_t *a, uint64_t x) // the number of elements smaller than x in sorted a[]
+{
+	int64_t lo = 0, hi = n;
+	while (lo < hi) {
+		int64_t mid = (lo + hi) >> 1;
+		if (a[mid] < x) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+#define append_put(bwt, o, c) ((bwt)->bwt[(o)>>4] |= (uint32_t)(c) << ((~(o)&0xf)<<1))
+
+#define APPEND_NEW (1ULL<<63) // an SA sample of a new suffix, or else the old rank to locate
+
+/* Merge the old BWT with the rows of the suffixes of W, starting at w_beg and
+ * given in sorted order in sa[], skipping w_end, with their ranks among the
+ * kept suffixes in r[]. The old rows in tail[] are dropped, and row isa_p,
+ * that of R$, gets the last base of W. Every sa_intv-th row also goes to
+ * bwt_t::sa, as the old rank or the position ORed with APPEND_NEW. */
+static bwt_t *append_merge(const bwt_t *old, int64_t n_tail, const uint64_t *tail, bwtint_t isa_p, bwtint_t w_beg, int64_t w_end,
+						   const uint8_t *w, const int *sa, const uint64_t *r, int c0, int sa_intv)
+{
+	bwt_t *bwt;
+	bwtint_t k, i, o, kc, cnt[4];
+	int64_t s, t;
+	int c;
+
+	bwt = (bwt_t*)calloc(1, sizeof(bwt_t));
+	bwt->seq_len = old->seq_len - n_tail + w_end;
+	bwt->bwt_size = (bwt->seq_len + 15) >> 4;
+	bwt->bwt = (uint32_t*)calloc(bwt->bwt_size, 4);
+	bwt->sa_intv = sa_intv;
+	bwt->n_sa = (bwt->seq_len + sa_intv) / sa_intv;
+	bwt->sa = (bwtint_t*)malloc(bwt->n_sa * sizeof(bwtint_t));
+	cnt[0] = cnt[1] = cnt[2] = cnt[3] = 0;
+#define append_emit(_c, _x) do { \
+		if ((i & (sa_intv - 1)) == 0) bwt->sa[i / sa_intv] = (_x); \
+		if ((_c) < 0) bwt->primary = i; \
+		else append_put(bwt, o, (_c)), ++cnt[(_c)], ++o; \
+		++i; \
+	} while (0)
+#define append_emit_new() do { \
+		for (; s <= w_end + 1 && (sa[s] == w_end || r[sa[s]] == kc); ++s) \
+			if (sa[s] != w_end) append_emit(sa[s] > 0? w[sa[s] - 1] : c0, (w_beg + sa[s]) | APPEND_NEW); \
+	} while (0)
+	for (k = i = o = kc = 0, s = 1, t = 0; k <= old->seq_len; ++k) {
+		if (t < n_tail && tail[t] == k) { // the suffix now starts in W
+			++t;
+			continue;
+		}
+		append_emit_new();
+		if (k == old->primary) c = -1;
+		else if (k == isa_p) c = w[w_end - 1];
+		else {
+			bwtint_t x = k - (k > old->primary);
+			c = old->fmt == BWT_FMT_CL? bwt_cl_B0(old, x) : bwt_B0(old, x);
+		}
+		append_emit(c, k);
+		++kc;
+	}
+	append_emit_new();
+#undef append_emit_new
+#undef append_emit
+	xassert(o == bwt->seq_len && i == bwt->seq_len + 1 && s == w_end + 2, "inconsistent merge");
+	bwt->L2[0] = 0;
+	for (c = 0; c < 4; ++c) bwt->L2[c+1] = bwt->L2[c] + cnt[c];
+	return bwt;
+}
+
+typedef struct {
+	const bwt_t *old;
+	bwt_t *bwt;
+	bwtint_t p, q2; // old positions from p on are now q2 bases further
+} append_sa_t;
+
+#define APPEND_SA_CHUNK 0x10000
+
+static void append_sa_worker(void *data, long j, int tid) // locate the old ranks in a chunk of SA samples
+{
+	append_sa_t *a = (append_sa_t*)data;
+	bwtint_t i, *x = a->bwt->sa, *k, beg = (bwtint_t)j * APPEND_SA_CHUNK;
+	bwtint_t end = beg + APPEND_SA_CHUNK < a->bwt->n_sa? beg + APPEND_SA_CHUNK : a->bwt->n_sa;
+	int m = 0;
+	k = (bwtint_t*)calloc(end - beg, sizeof(bwtint_t));
+	for (i = beg; i < end; ++i)
+		if (!(x[i] & APPEND_NEW)) k[m++] = x[i];
+	bwt_sa_batch(a->old, m, k, k);
+	for (i = beg, m = 0; i < end; ++i) {
+		if (x[i] & APPEND_NEW) x[i] ^= APPEND_NEW;
+		else x[i] = k[m] >= a->p? k[m] + a->q2 : k[m], ++m;
+	}
+	free(k);
+}
+
+/* Rank the suffixes of W, followed by R$, against the old BWT, and merge. The
+ * forward pac holds the p old and q new bases. */
+static bwt_t *append_bwt(const bwt_t *old, const uint8_t *pac, int64_t p, int64_t q, int n_threads)
+{
+	extern void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+	append_sa_t a;
+	bwtintv_t ik, ok[4];
+	bwtint_t isa_p, k;
+	int64_t i, j, l, n_tail, w_end, n_key;
+	uint64_t *tail, *r, *key;
+	uint8_t *w;
+	int *T, *sa;
+	bwt_t *bwt;
+
+	// the shortest suffix of F occurring once in the old text; the rc-interval is then that of R$
+	bwt_set_intv(old, append_fr_base(pac, p, p - 1), ik);
+	for (l = 1; ik.x[2] > 1 && l < p; ++l) {
+		bwt_extend(old, &ik, ok, 1);
+		ik = ok[append_fr_base(pac, p, p - l - 1)];
+	}
+	isa_p = ik.x[1]; // R$ is the smallest suffix starting with R[0,l), even if it is not unique
+	if (ik.x[2] == 1) { // extend Q until it is unique in the new text as well
+		for (;; l = l<<1 < p? l<<1 : p) {
+			if (!append_occ_again(pac, p, q, l)) {
+				n_tail = l - 1;
+				break;
+			}
+			if (l == p) {
+				n_tail = p;
+				break;
+			}
+		}
+	} else n_tail = p;
+	w_end = n_tail + 2 * q;
+	if (w_end + 2 > INT_MAX) {
+		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] too many bases to insert; please rebuild the index\n", __func__);
+		return 0;
+	}
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] %lld old suffixes to re-rank\n", __func__, (long long)n_tail);
+
+	// the ranks of the suffixes of F[p-L,p): LF from R$
+	tail = (uint64_t*)malloc((n_tail + 1) * sizeof(uint64_t));
+	for (i = 0, k = isa_p; i < n_tail; ++i) {
+		int c = append_fr_base(pac, p, p - 1 - i);
+		tail[i] = k = old->L2[c] + bwt_occ(old, k, c);
+	}
+	ks_introsort_64(n_tail, tail);
+
+	// the ranks of the suffixes of W.R$ among the old ones, and then among the kept ones
+	w = (uint8_t*)malloc(w_end);
+	for (j = 0; j < w_end; ++j) w[j] = append_fr_base(pac, p + q, p - n_tail + j);
+	r = (uint64_t*)malloc((w_end + 1) * sizeof(uint64_t));
+	r[w_end] = isa_p;
+	for (j = w_end - 1; j >= 0; --j)
+		r[j] = 1 + old->L2[w[j]] + bwt_occ(old, r[j+1] - 1, w[j]);
+	for (j = 0; j <= w_end; ++j)
+		r[j] -= append_n_lt(n_tail, tail, r[j]);
+
+	/* Sort the suffixes of W by the string of (r[j],w[j]). As r[] is monotone
+	 * in the order of the suffixes, this is their order; the terminator is
+	 * R$, after those with r[j]<=r[w_end] and before the others. */
+	key = (uint64_t*)malloc((w_end + 1) * sizeof(uint64_t));
+	for (j = 0; j < w_end; ++j) key[j] = (r[j]<<2 | w[j]) << 1;
+	key[w_end] = (r[w_end]<<2 | 3) << 1 | 1;
+	T = (int*)malloc((w_end + 1) * sizeof(int));
+	{
+		uint64_t *srt = (uint64_t*)malloc((w_end + 1) * sizeof(uint64_t));
+		memcpy(srt, key, (w_end + 1) * sizeof(uint64_t));
+		ks_introsort_64(w_end + 1, srt);
+		for (i = j = 1; i <= w_end; ++i)
+			if (srt[i] != srt[j-1]) srt[j++] = srt[i];
+		n_key = j;
+		for (j = 0; j <= w_end; ++j)
+			T[j] = append_n_lt(n_key, srt, key[j]);
+		free(srt);
+	}
+	free(key);
+	sa = (int*)malloc((w_end + 2) * sizeof(int));
+	if (is_sa_int(T, sa, w_end + 1, n_key) != 0)
+		err_fatal(__func__, "fail to sort %lld suffixes", (long long)w_end);
+	free(T);
+
+	bwt = append_merge(old, n_tail, tail, isa_p, p - n_tail, w_end, w, sa, r, n_tail < p? append_fr_base(pac, p, p - n_tail - 1) : -1, old->sa_intv);
+	free(sa); free(r); free(w); free(tail);
+
+	/* The samples are at ranks, which have shifted, so each kept one is
+	 * located in the old index. This is linear in the genome, though the walks
+	 * are interleaved and cheaper than sampling the new BWT from scratch. */
+	a.old = old, a.bwt = bwt, a.p = p, a.q2 = 2 * q;
+	kt_for(n_threads, append_sa_worker, &a, (bwt->n_sa + APPEND_SA_CHUNK - 1) / APPEND_SA_CHUNK);
+	bwt->sa[0] = (bwtint_t)-1;
+	return bwt;
+}
+
+int bwa_idx_append(const char *prefix, const char *fa, int n_threads)
+{
+	char *fn;
+	bntseq_t *bns;
+	bwt_t *old, *bwt;
+	uint8_t *pac;
+	int64_t p, q;
+	int fmt, kmer_k = 0;
+	FILE *fp;
+	gzFile fp_fa;
+	double t;
+
+	t = realtime();
+	fn = (char*)calloc(strlen(prefix) + 10, 1);
+	old = bwt_restore_bwt(strcat(strcpy(fn, prefix), ".bwt"));
+	bwt_restore_sa(strcat(strcpy(fn, prefix), ".sa"), old);
+	if (bwt_restore_kmer_hdr(strcat(strcpy(fn, prefix), ".kmer"), old) >= 0) { // regenerate the table with the same k
+		kmer_k = old->kmer_k;
+		free(old->kmer); old->kmer = 0;
+	}
+	fmt = old->fmt;
+	bns = bns_restore(prefix);
+	p = bns->l_pac;
+	if (old->seq_len != (bwtint_t)p * 2) {
+		if (bwa_verbose >= 1) fprintf(stderr, "[E::%s] '%s' is not the index of both strands\n", __func__, prefix);
+		bns_destroy(bns); bwt_destroy(old); free(fn);
+		return -1;
+	}
+	pac = (uint8_t*)calloc(p/4 + 1, 1);
+	fp = xopen(strcat(strcpy(fn, prefix), ".pac"), "rb");
+	err_fread_noeof(pac, 1, p/4 + 1, fp);
+	err_fclose(fp);
+
+	fp_fa = xzopen(fa, "r");
+	pac = bns_fasta_append(fp_fa, bns, pac);
+	err_gzclose(fp_fa);
+	q = bns->l_pac - p;
+	if (q == 0) {
+		if (bwa_verbose >= 2) fprintf(stderr, "[W::%s] no sequences in '%s'; the index is unchanged\n", __func__, fa);
+		free(pac); bns_destroy(bns); bwt_destroy(old); free(fn);
+		return 0;
+	}
+	bwt = append_bwt(old, pac, p, q, n_threads);
+	bwt_destroy(old);
+	if (bwt == 0) {
+		free(pac); bns_destroy(bns); free(fn);
+		return -1;
+	}
+	bwt_bwtupdate_core2(bwt, fmt);
+
+	bns_dump_pac(strcat(strcpy(fn, prefix), ".pac"), pac, bns->l_pac);
+	bns_dump(bns, prefix);
+	free(pac); bns_destroy(bns);
+	bwt_dump_bwt(strcat(strcpy(fn, prefix), ".bwt"), bwt);
+	bwt_dump_sa(strcat(strcpy(fn, prefix), ".sa"), bwt);
+	if (kmer_k > 0) {
+		bwt_gen_cnt_table(bwt);
+		bwt_gen_kmer(bwt, kmer_k);
+		bwt_dump_kmer(strcat(strcpy(fn, prefix), ".kmer"), bwt);
+	}
+	unlink(strcat(strcpy(fn, prefix), ".bwaidx")); // stale
+	if (bwa_verbose >= 3)
+		fprintf(stderr, "[M::%s] added %lld bases in %.2f sec\n", __func__, (long long)q, realtime() - t);
+	bwt_destroy(bwt);
+	free(fn);
+	return 0;
+}
@@ -26,5 +26,7 @@
 
 int64_t bwa_seq_len(const char *fn_pac);
 bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is);
+// with IS and sa_intv > 0, also fill bwt_t::sa with the samples bwt_cal_sa() would compute
+bwt_t *bwt_pac2bwt2(const char *fn_pac, int use_is, int sa_intv);
 
 #endif
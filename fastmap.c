@@ -27,6 +27,7 @@ typedef struct {
 	int64_t n_processed;
 	int copy_comment, actual_chunk_size;
 	bwaidx_t *idx;
+	bwa_numa_t *numa;
 } ktp_aux_t;
 
 typedef struct {
@@ -70,18 +71,18 @@ static void *process(void *shared, int step, void *_data)
 				fprintf(stderr, "[M::%s] %d single-end sequences; %d paired-end sequences\n", __func__, n_sep[0], n_sep[1]);
 			if (n_sep[0]) {
 				tmp_opt.flag &= ~MEM_F_PE;
-				mem_process_seqs(&tmp_opt, idx->bwt, idx->bns, idx->pac, aux->n_processed, n_sep[0], sep[0], 0);
+				mem_process_seqs2(&tmp_opt, idx->bwt, idx->bns, idx->pac, aux->n_processed, n_sep[0], sep[0], 0, aux->numa);
 				for (i = 0; i < n_sep[0]; ++i)
 					data->seqs[sep[0][i].id].sam = sep[0][i].sam;
 			}
 			if (n_sep[1]) {
 				tmp_opt.flag |= MEM_F_PE;
-				mem_process_seqs(&tmp_opt, idx->bwt, idx->bns, idx->pac, aux->n_processed + n_sep[0], n_sep[1], sep[1], aux->pes0);
+				mem_process_seqs2(&tmp_opt, idx->bwt, idx->bns, idx->pac, aux->n_processed + n_sep[0], n_sep[1], sep[1], aux->pes0, aux->numa);
 				for (i = 0; i < n_sep[1]; ++i)
 					data->seqs[sep[1][i].id].sam = sep[1][i].sam;
 			}
 			free(sep[0]); free(sep[1]);
-		} else mem_process_seqs(opt, idx->bwt, idx->bns, idx->pac, aux->n_processed, data->n_seqs, data->seqs, aux->pes0);
+		} else mem_process_seqs2(opt, idx->bwt, idx->bns, idx->pac, aux->n_processed, data->n_seqs, data->seqs, aux->pes0, aux->numa);
 		aux->n_processed += data->n_seqs;
 		return data;
 	} else if (step == 2) {
@@ -115,7 +116,7 @@ static void update_a(mem_opt_t *opt, const mem_opt_t *opt0)
 int main_mem(int argc, char *argv[])
 {
 	mem_opt_t *opt, opt0;
-	int fd, fd2, i, c, ignore_alt = 0, no_mt_io = 0;
+	int fd, fd2, i, c, ignore_alt = 0, no_mt_io = 0, use_huge = 0, numa_mode = BWA_NUMA_OFF;
 	int fixed_chunk_size = -1;
 	gzFile fp, fp2 = 0;
 	char *p, *rg_line = 0, *hdr_line = 0;
@@ -130,7 +131,7 @@ int main_mem(int argc, char *argv[])
 
 	aux.opt = opt = mem_opt_init();
 	memset(&opt0, 0, sizeof(mem_opt_t));
-	while ((c = getopt(argc, argv, "51qpaMCSPVYjk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:o:f:W:x:G:h:y:K:X:H:")) >= 0) {
+	while ((c = getopt(argc, argv, "51qpaMCSPVYjZu:k:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:o:f:W:x:G:h:y:K:X:H:")) >= 0) {
 		if (c == 'k') opt->min_seed_len = atoi(optarg), opt0.min_seed_len = 1;
 		else if (c == '1') no_mt_io = 1;
 		else if (c == 'x') mode = optarg;
@@ -153,6 +154,16 @@ int main_mem(int argc, char *argv[])
 		else if (c == 'd') opt->zdrop = atoi(optarg), opt0.zdrop = 1;
 		else if (c == 'v') bwa_verbose = atoi(optarg);
 		else if (c == 'j') ignore_alt = 1;
+		else if (c == 'Z') use_huge = 1;
+		else if (c == 'u') {
+			if (strcmp(optarg, "replicate") == 0) numa_mode = BWA_NUMA_REPLICATE;
+			else if (strcmp(optarg, "interleave") == 0) numa_mode = BWA_NUMA_INTERLEAVE;
+			else if (strcmp(optarg, "none") == 0) numa_mode = BWA_NUMA_OFF;
+			else {
+				fprintf(stderr, "[E::%s] unknown NUMA policy '%s'\n", __func__, optarg);
+				return 1;
+			}
+		}
 		else if (c == 'r') opt->split_factor = atof(optarg), opt0.split_factor = 1.;
 		else if (c == 'D') opt->drop_ratio = atof(optarg), opt0.drop_ratio = 1.;
 		else if (c == 'm') opt->max_matesw = atoi(optarg), opt0.max_matesw = 1;
@@ -272,6 +283,8 @@ int main_mem(int argc, char *argv[])
 		fprintf(stderr, "       -5            for split alignment, take the alignment with the smallest coordinate as primary\n");
 		fprintf(stderr, "       -q            don't modify mapQ of supplementary alignments\n");
 		fprintf(stderr, "       -K INT        process INT input bases in each batch regardless of nThreads (for reproducibility) []\n");
+		fprintf(stderr, "       -Z            put the index on huge pages to cut TLB misses\n");
+		fprintf(stderr, "       -u STR        NUMA policy: replicate or interleave the index over the nodes, pinning threads per node [none]\n");
 		fprintf(stderr, "\n");
 		fprintf(stderr, "       -v INT        verbosity level: 1=error, 2=warning, 3=message, 4+=debugging [%d]\n", bwa_verbose);
 		fprintf(stderr, "       -T INT        minimum score to output [%d]\n", opt->T);
@@ -326,12 +339,15 @@ int main_mem(int argc, char *argv[])
 
 	aux.idx = bwa_idx_load_from_shm(argv[optind]);
 	if (aux.idx == 0) {
-		if ((aux.idx = bwa_idx_load(argv[optind], BWA_IDX_ALL)) == 0) return 1; // FIXME: memory leak
-	} else if (bwa_verbose >= 3)
-		fprintf(stderr, "[M::%s] load the bwa index from shared memory\n", __func__);
+		if ((aux.idx = bwa_idx_load(argv[optind], BWA_IDX_ALL | (use_huge? BWA_IDX_HUGE : 0))) == 0) return 1; // FIXME: memory leak
+	} else {
+		if (bwa_verbose >= 3) fprintf(stderr, "[M::%s] load the bwa index from shared memory\n", __func__);
+		if (use_huge) bwa_idx_hugepage(aux.idx);
+	}
 	if (ignore_alt)
 		for (i = 0; i < aux.idx->bns->n_seqs; ++i)
 			aux.idx->bns->anns[i].is_alt = 0;
+	if (numa_mode != BWA_NUMA_OFF) aux.numa = bwa_numa_init(aux.idx, numa_mode, 0);
 
 	ko = kopen(argv[optind + 1], &fd);
 	if (ko == 0) {
@@ -360,6 +376,7 @@ int main_mem(int argc, char *argv[])
 	kt_pipeline(no_mt_io? 1 : 2, process, &aux, 3);
 	free(hdr_line);
 	free(opt);
+	bwa_numa_destroy(aux.numa);
 	bwa_idx_destroy(aux.idx);
 	kseq_destroy(aux.ks);
 	err_gzclose(fp); kclose(ko);
@@ -376,6 +393,8 @@ int main_fastmap(int argc, char *argv[])
 	uint64_t max_intv = 0;
 	kseq_t *seq;
 	bwtint_t k;
+	kvec_t(bwtint_t) sa = {0,0,0};
+	size_t j;
 	gzFile fp;
 	smem_i *itr;
 	const bwtintv_v *a;
@@ -406,7 +425,7 @@ int main_fastmap(int argc, char *argv[])
 
 	fp = xzopen(argv[optind + 1], "r");
 	seq = kseq_init(fp);
-	if ((idx = bwa_idx_load(argv[optind], BWA_IDX_BWT|BWA_IDX_BNS)) == 0) return 1;
+	if ((idx = bwa_idx_load(argv[optind], BWA_IDX_BWT|BWA_IDX_BNS|BWA_IDX_LAZY)) == 0) return 1;
 	itr = smem_itr_init(idx->bwt);
 	smem_config(itr, min_intv, max_len, max_intv);
 	while (kseq_read(seq) >= 0) {
@@ -419,7 +438,13 @@ int main_fastmap(int argc, char *argv[])
 			seq->seq.s[i] = nst_nt4_table[(int)seq->seq.s[i]];
 		smem_set_query(itr, seq->seq.l, (uint8_t*)seq->seq.s);
 		while ((a = smem_next(itr)) != 0) {
-			for (i = 0; i < a->n; ++i) {
+			for (i = 0, sa.n = 0; i < a->n; ++i) { // locate all occurrences to be printed in one batch
+				bwtintv_t *p = &a->a[i];
+				if ((uint32_t)p->info - (p->info>>32) < min_len || p->x[2] > min_iwidth) continue;
+				for (k = 0; k < p->x[2]; ++k) kv_push(bwtint_t, sa, p->x[0] + k);
+			}
+			bwt_sa_batch(idx->bwt, sa.n, sa.a, sa.a);
+			for (i = 0, j = 0; i < a->n; ++i) {
 				bwtintv_t *p = &a->a[i];
 				if ((uint32_t)p->info - (p->info>>32) < min_len) continue;
 				err_printf("EM\t%d\t%d\t%ld", (uint32_t)(p->info>>32), (uint32_t)p->info, (long)p->x[2]);
@@ -428,7 +453,7 @@ int main_fastmap(int argc, char *argv[])
 						bwtint_t pos;
 						int len, is_rev, ref_id;
 						len  = (uint32_t)p->info - (p->info>>32);
-						pos = bns_depos(idx->bns, bwt_sa(idx->bwt, p->x[0] + k), &is_rev);
+						pos = bns_depos(idx->bns, sa.a[j++], &is_rev);
 						if (is_rev) pos -= len - 1;
 						bns_cnt_ambi(idx->bns, pos, len, &ref_id);
 						err_printf("\t%s:%c%ld", idx->bns->anns[ref_id].name, "+-"[is_rev], (long)(pos - idx->bns->anns[ref_id].offset) + 1);
@@ -440,6 +465,7 @@ int main_fastmap(int argc, char *argv[])
 		err_puts("//");
 	}
 
+	free(sa.a);
 	smem_itr_destroy(itr);
 	bwa_idx_destroy(idx);
 	kseq_destroy(seq);
@@ -25,161 +25,170 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 
 #ifdef USE_MALLOC_WRAPPERS
 #  include "malloc_wrap.h"
 #endif
 
 typedef unsigned char ubyte_t;
-#define chr(i) (cs == sizeof(int) ? ((const int *)T)[i]:((const unsigned char *)T)[i])
+#define SAIS_CHR(saint_t, i) (cs == sizeof(saint_t) ? ((const saint_t *)T)[i]:((const unsigned char *)T)[i])
 
-/* find the start or end of each bucket */
-static void getCounts(const unsigned char *T, int *C, int n, int k, int cs)
-{
-	int i;
-	for (i = 0; i < k; ++i) C[i] = 0;
-	for (i = 0; i < n; ++i) ++C[chr(i)];
-}
-static void getBuckets(const int *C, int *B, int k, int end)
-{
-	int i, sum = 0;
-	if (end) {
-		for (i = 0; i < k; ++i) {
-			sum += C[i];
-			B[i] = sum;
-		}
-	} else {
-		for (i = 0; i < k; ++i) {
-			sum += C[i];
-			B[i] = sum - C[i];
-		}
-	}
-}
+/* The functions below are instantiated for int and for int64_t suffix
+ * arrays. The int version takes half the memory and is used whenever the
+ * text is shorter than INT_MAX. */
+#define SAIS_INIT(SFX, saint_t) \
+/* find the start or end of each bucket */ \
+static void getCounts_##SFX(const unsigned char *T, saint_t *C, saint_t n, saint_t k, int cs) \
+{ \
+	saint_t i; \
+	for (i = 0; i < k; ++i) C[i] = 0; \
+	for (i = 0; i < n; ++i) ++C[SAIS_CHR(saint_t, i)]; \
+} \
+static void getBuckets_##SFX(const saint_t *C, saint_t *B, saint_t k, int end) \
+{ \
+	saint_t i, sum = 0; \
+	if (end) { \
+		for (i = 0; i < k; ++i) { \
+			sum += C[i]; \
+			B[i] = sum; \
+		} \
+	} else { \
+		for (i = 0; i < k; ++i) { \
+			sum += C[i]; \
+			B[i] = sum - C[i]; \
+		} \
+	} \
+} \
+\
+/* compute SA */ \
+static void induceSA_##SFX(const unsigned char *T, saint_t *SA, saint_t *C, saint_t *B, saint_t n, saint_t k, int cs) \
+{ \
+	saint_t *b, i, j; \
+	saint_t c0, c1; \
+	/* compute SAl */ \
+	if (C == B) getCounts_##SFX(T, C, n, k, cs); \
+	getBuckets_##SFX(C, B, k, 0);	/* find starts of buckets */ \
+	j = n - 1; \
+	b = SA + B[c1 = SAIS_CHR(saint_t, j)]; \
+	*b++ = ((0 < j) && (SAIS_CHR(saint_t, j - 1) < c1)) ? ~j : j; \
+	for (i = 0; i < n; ++i) { \
+		j = SA[i], SA[i] = ~j; \
+		if (0 < j) { \
+			--j; \
+			if ((c0 = SAIS_CHR(saint_t, j)) != c1) { \
+				B[c1] = b - SA; \
+				b = SA + B[c1 = c0]; \
+			} \
+			*b++ = ((0 < j) && (SAIS_CHR(saint_t, j - 1) < c1)) ? ~j : j; \
+		} \
+	} \
+	/* compute SAs */ \
+	if (C == B) getCounts_##SFX(T, C, n, k, cs); \
+	getBuckets_##SFX(C, B, k, 1);	/* find ends of buckets */ \
+	for (i = n - 1, b = SA + B[c1 = 0]; 0 <= i; --i) { \
+		if (0 < (j = SA[i])) { \
+			--j; \
+			if ((c0 = SAIS_CHR(saint_t, j)) != c1) { \
+				B[c1] = b - SA; \
+				b = SA + B[c1 = c0]; \
+			} \
+			*--b = ((j == 0) || (SAIS_CHR(saint_t, j - 1) > c1)) ? ~j : j; \
+		} else SA[i] = ~j; \
+	} \
+} \
+\
+/* \
+ * find the suffix array SA of T[0..n-1] in {0..k-1}^n use a working \
+ * space (excluding T and SA) of at most 2n+O(1) for a constant alphabet \
+ */ \
+static int sais_main_##SFX(const unsigned char *T, saint_t *SA, saint_t fs, saint_t n, saint_t k, int cs) \
+{ \
+	saint_t *C, *B, *RA; \
+	saint_t i, j, c, m, p, q, plen, qlen, name; \
+	saint_t c0, c1; \
+	int diff; \
+\
+	/* stage 1: reduce the problem by at least 1/2 sort all the \
+	 * S-substrings */ \
+	if (k <= fs) { \
+		C = SA + n; \
+		B = (k <= (fs - k)) ? C + k : C; \
+	} else if ((C = B = (saint_t *) malloc(k * sizeof(saint_t))) == NULL) return -2; \
+	getCounts_##SFX(T, C, n, k, cs); \
+	getBuckets_##SFX(C, B, k, 1);	/* find ends of buckets */ \
+	for (i = 0; i < n; ++i) SA[i] = 0; \
+	for (i = n - 2, c = 0, c1 = SAIS_CHR(saint_t, n - 1); 0 <= i; --i, c1 = c0) { \
+		if ((c0 = SAIS_CHR(saint_t, i)) < (c1 + c)) c = 1; \
+		else if (c != 0) SA[--B[c1]] = i + 1, c = 0; \
+	} \
+	induceSA_##SFX(T, SA, C, B, n, k, cs); \
+	if (fs < k) free(C); \
+	/* compact all the sorted substrings into the first m items of SA \
+	 * 2*m must be not larger than n (proveable) */ \
+	for (i = 0, m = 0; i < n; ++i) { \
+		p = SA[i]; \
+		if ((0 < p) && (SAIS_CHR(saint_t, p - 1) > (c0 = SAIS_CHR(saint_t, p)))) { \
+			for (j = p + 1; (j < n) && (c0 == (c1 = SAIS_CHR(saint_t, j))); ++j); \
+			if ((j < n) && (c0 < c1)) SA[m++] = p; \
+		} \
+	} \
+	for (i = m; i < n; ++i) SA[i] = 0;	/* init the name array buffer */ \
+	/* store the length of all substrings */ \
+	for (i = n - 2, j = n, c = 0, c1 = SAIS_CHR(saint_t, n - 1); 0 <= i; --i, c1 = c0) { \
+		if ((c0 = SAIS_CHR(saint_t, i)) < (c1 + c)) c = 1; \
+		else if (c != 0) { \
+			SA[m + ((i + 1) >> 1)] = j - i - 1; \
+			j = i + 1; \
+			c = 0; \
+		} \
+	} \
+	/* find the lexicographic names of all substrings */ \
+	for (i = 0, name = 0, q = n, qlen = 0; i < m; ++i) { \
+		p = SA[i], plen = SA[m + (p >> 1)], diff = 1; \
+		if (plen == qlen) { \
+			for (j = 0; (j < plen) && (SAIS_CHR(saint_t, p + j) == SAIS_CHR(saint_t, q + j)); j++); \
+			if (j == plen) diff = 0; \
+		} \
+		if (diff != 0) ++name, q = p, qlen = plen; \
+		SA[m + (p >> 1)] = name; \
+	} \
+\
+	/* stage 2: solve the reduced problem recurse if names are not yet \
+	 * unique */ \
+	if (name < m) { \
+		RA = SA + n + fs - m; \
+		for (i = n - 1, j = m - 1; m <= i; --i) { \
+			if (SA[i] != 0) RA[j--] = SA[i] - 1; \
+		} \
+		if (sais_main_##SFX((unsigned char *) RA, SA, fs + n - m * 2, m, name, sizeof(saint_t)) != 0) return -2; \
+		for (i = n - 2, j = m - 1, c = 0, c1 = SAIS_CHR(saint_t, n - 1); 0 <= i; --i, c1 = c0) { \
+			if ((c0 = SAIS_CHR(saint_t, i)) < (c1 + c)) c = 1; \
+			else if (c != 0) RA[j--] = i + 1, c = 0; /* get p1 */ \
+		} \
+		for (i = 0; i < m; ++i) SA[i] = RA[SA[i]]; /* get index */ \
+	} \
+	/* stage 3: induce the result for the original problem */ \
+	if (k <= fs) { \
+		C = SA + n; \
+		B = (k <= (fs - k)) ? C + k : C; \
+	} else if ((C = B = (saint_t *) malloc(k * sizeof(saint_t))) == NULL) return -2; \
+	/* put all left-most S characters into their buckets */ \
+	getCounts_##SFX(T, C, n, k, cs); \
+	getBuckets_##SFX(C, B, k, 1);	/* find ends of buckets */ \
+	for (i = m; i < n; ++i) SA[i] = 0; /* init SA[m..n-1] */ \
+	for (i = m - 1; 0 <= i; --i) { \
+		j = SA[i], SA[i] = 0; \
+		SA[--B[SAIS_CHR(saint_t, j)]] = j; \
+	} \
+	induceSA_##SFX(T, SA, C, B, n, k, cs); \
+	if (fs < k) free(C); \
+	return 0; \
+} \
 
-/* compute SA */
-static void induceSA(const unsigned char *T, int *SA, int *C, int *B, int n, int k, int cs)
-{
-	int *b, i, j;
-	int  c0, c1;
-	/* compute SAl */
-	if (C == B) getCounts(T, C, n, k, cs);
-	getBuckets(C, B, k, 0);	/* find starts of buckets */
-	j = n - 1;
-	b = SA + B[c1 = chr(j)];
-	*b++ = ((0 < j) && (chr(j - 1) < c1)) ? ~j : j;
-	for (i = 0; i < n; ++i) {
-		j = SA[i], SA[i] = ~j;
-		if (0 < j) {
-			--j;
-			if ((c0 = chr(j)) != c1) {
-				B[c1] = b - SA;
-				b = SA + B[c1 = c0];
-			}
-			*b++ = ((0 < j) && (chr(j - 1) < c1)) ? ~j : j;
-		}
-	}
-	/* compute SAs */
-	if (C == B) getCounts(T, C, n, k, cs);
-	getBuckets(C, B, k, 1);	/* find ends of buckets */
-	for (i = n - 1, b = SA + B[c1 = 0]; 0 <= i; --i) {
-		if (0 < (j = SA[i])) {
-			--j;
-			if ((c0 = chr(j)) != c1) {
-				B[c1] = b - SA;
-				b = SA + B[c1 = c0];
-			}
-			*--b = ((j == 0) || (chr(j - 1) > c1)) ? ~j : j;
-		} else SA[i] = ~j;
-	}
-}
-
-/*
- * find the suffix array SA of T[0..n-1] in {0..k-1}^n use a working
- * space (excluding T and SA) of at most 2n+O(1) for a constant alphabet
- */
-static int sais_main(const unsigned char *T, int *SA, int fs, int n, int k, int cs)
-{
-	int *C, *B, *RA;
-	int  i, j, c, m, p, q, plen, qlen, name;
-	int  c0, c1;
-	int  diff;
-
-	/* stage 1: reduce the problem by at least 1/2 sort all the
-	 * S-substrings */
-	if (k <= fs) {
-		C = SA + n;
-		B = (k <= (fs - k)) ? C + k : C;
-	} else if ((C = B = (int *) malloc(k * sizeof(int))) == NULL) return -2;
-	getCounts(T, C, n, k, cs);
-	getBuckets(C, B, k, 1);	/* find ends of buckets */
-	for (i = 0; i < n; ++i) SA[i] = 0;
-	for (i = n - 2, c = 0, c1 = chr(n - 1); 0 <= i; --i, c1 = c0) {
-		if ((c0 = chr(i)) < (c1 + c)) c = 1;
-		else if (c != 0) SA[--B[c1]] = i + 1, c = 0;
-	}
-	induceSA(T, SA, C, B, n, k, cs);
-	if (fs < k) free(C);
-	/* compact all the sorted substrings into the first m items of SA
-	 * 2*m must be not larger than n (proveable) */
-	for (i = 0, m = 0; i < n; ++i) {
-		p = SA[i];
-		if ((0 < p) && (chr(p - 1) > (c0 = chr(p)))) {
-			for (j = p + 1; (j < n) && (c0 == (c1 = chr(j))); ++j);
-			if ((j < n) && (c0 < c1)) SA[m++] = p;
-		}
-	}
-	for (i = m; i < n; ++i) SA[i] = 0;	/* init the name array buffer */
-	/* store the length of all substrings */
-	for (i = n - 2, j = n, c = 0, c1 = chr(n - 1); 0 <= i; --i, c1 = c0) {
-		if ((c0 = chr(i)) < (c1 + c)) c = 1;
-		else if (c != 0) {
-			SA[m + ((i + 1) >> 1)] = j - i - 1;
-			j = i + 1;
-			c = 0;
-		}
-	}
-	/* find the lexicographic names of all substrings */
-	for (i = 0, name = 0, q = n, qlen = 0; i < m; ++i) {
-		p = SA[i], plen = SA[m + (p >> 1)], diff = 1;
-		if (plen == qlen) {
-			for (j = 0; (j < plen) && (chr(p + j) == chr(q + j)); j++);
-			if (j == plen) diff = 0;
-		}
-		if (diff != 0) ++name, q = p, qlen = plen;
-		SA[m + (p >> 1)] = name;
-	}
-
-	/* stage 2: solve the reduced problem recurse if names are not yet
-	 * unique */
-	if (name < m) {
-		RA = SA + n + fs - m;
-		for (i = n - 1, j = m - 1; m <= i; --i) {
-			if (SA[i] != 0) RA[j--] = SA[i] - 1;
-		}
-		if (sais_main((unsigned char *) RA, SA, fs + n - m * 2, m, name, sizeof(int)) != 0) return -2;
-		for (i = n - 2, j = m - 1, c = 0, c1 = chr(n - 1); 0 <= i; --i, c1 = c0) {
-			if ((c0 = chr(i)) < (c1 + c)) c = 1;
-			else if (c != 0) RA[j--] = i + 1, c = 0; /* get p1 */
-		}
-		for (i = 0; i < m; ++i) SA[i] = RA[SA[i]]; /* get index */
-	}
-	/* stage 3: induce the result for the original problem */
-	if (k <= fs) {
-		C = SA + n;
-		B = (k <= (fs - k)) ? C + k : C;
-	} else if ((C = B = (int *) malloc(k * sizeof(int))) == NULL) return -2;
-	/* put all left-most S characters into their buckets */
-	getCounts(T, C, n, k, cs);
-	getBuckets(C, B, k, 1);	/* find ends of buckets */
-	for (i = m; i < n; ++i) SA[i] = 0; /* init SA[m..n-1] */
-	for (i = m - 1; 0 <= i; --i) {
-		j = SA[i], SA[i] = 0;
-		SA[--B[chr(j)]] = j;
-	}
-	induceSA(T, SA, C, B, n, k, cs);
-	if (fs < k) free(C);
-	return 0;
-}
+SAIS_INIT(32, int)
+SAIS_INIT(64, int64_t)
 
 /**
  * Constructs the suffix array of a given string.
@@ -196,7 +205,7 @@ int is_sa(const ubyte_t *T, int *SA, int n)
 		if (n == 1) SA[1] = 0;
 		return 0;
 	}
-	return sais_main(T, SA+1, 0, n, 256, 1);
+	return sais_main_32(T, SA+1, 0, n, 256, 1);
 }
 
 /**
@@ -221,3 +230,69 @@ int is_bwt(ubyte_t *T, int n)
 	free(SA);
 	return primary;
 }
+
+int is_sa64(const ubyte_t *T, int64_t *SA, int64_t n)
+{
+	if ((T == NULL) || (SA == NULL) || (n < 0)) return -1;
+	SA[0] = n;
+	if (n <= 1) {
+		if (n == 1) SA[1] = 0;
+		return 0;
+	}
+	return sais_main_64(T, SA+1, 0, n, 256, 1);
+}
+
+/**
+ * Same as is_sa() for a string of integers in [0,k).
+ */
+int is_sa_int(const int *T, int *SA, int n, int k)
+{
+	if ((T == NULL) || (SA == NULL) || (n < 0) || (k < 1)) return -1;
+	SA[0] = n;
+	if (n <= 1) {
+		if (n == 1) SA[1] = 0;
+		return 0;
+	}
+	return sais_main_32((const unsigned char*)T, SA+1, 0, n, k, sizeof(int));
+}
+
+/**
+ * Same as is_bwt() for any n. The 64-bit suffix array, 8 bytes per
+ * character, is only used if n >= INT_MAX. If sa is not NULL, also store
+ * SA[i*sa_intv] in sa[i] for i in [0,n/sa_intv]; sa[0] is n.
+ */
+int64_t is_bwt64(ubyte_t *T, int64_t n, int sa_intv, uint64_t *sa)
+{
+	int64_t i, primary = 0;
+#define is_sa2bwt(SA) do { \
+		for (i = 0; i <= n; ++i) { \
+			if (sa && i % sa_intv == 0) sa[i / sa_intv] = SA[i]; \
+			if (SA[i] == 0) primary = i; \
+			else SA[i] = T[SA[i] - 1]; \
+		} \
+		for (i = 0; i < primary; ++i) T[i] = SA[i]; \
+		for (; i < n; ++i) T[i] = SA[i + 1]; \
+	} while (0)
+
+	if (n < INT_MAX) {
+		int *SA;
+		if ((SA = (int*)malloc((n+1) * sizeof(int))) == NULL) return -2;
+		if (is_sa(T, SA, n)) {
+			free(SA);
+			return -1;
+		}
+		is_sa2bwt(SA);
+		free(SA);
+	} else {
+		int64_t *SA;
+		if ((SA = (int64_t*)malloc((n+1) * sizeof(int64_t))) == NULL) return -2;
+		if (is_sa64(T, SA, n)) {
+			free(SA);
+			return -1;
+		}
+		is_sa2bwt(SA);
+		free(SA);
+	}
+#undef is_sa2bwt
+	return primary;
+}
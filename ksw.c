@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <emmintrin.h>
 #include "ksw.h"
@@ -43,12 +44,87 @@
 
 const kswr_t g_defr = { 0, -1, -1, -1, -1, -1, -1 };
 
+/* With the AVX2 and AVX-512 kernels, a vector holds 32 or 64 bytes, and the
+ * vectors pointed to by kswq_t are that wide. The query is padded with zero
+ * scores to a multiple of the SSE2 lanes, as by the SSE2 kernels, and cells
+ * past that are left out of the maxima with kswq_t::M, such that all kernels
+ * give the same kswr_t. In segment j, lane jq_lane is masked by M[j >= jq]. */
+
 struct _kswq_t {
 	int qlen, slen;
 	uint8_t shift, mdiff, max, size;
 	__m128i *qp, *H0, *H1, *E, *Hmax;
+	int kernel, width; // KSW_KERNEL_*; bytes per vector
+	int plen, jq;      // query length padded for SSE2; the first segment where the lane with query position plen-1 is masked
+	__m128i *M;        // two masks of the cells before plen
 };
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KSW_DISPATCH
+#include <immintrin.h>
+#endif
+
+#define KSW_MIN_SEG 4 // by default, AVX2 is used only if the query fills this many vectors, and AVX-512 twice as many
+
+static int ksw_kernel = -1, ksw_auto = 1;
+
+// at least n bytes of scratch memory held in *a; the content is not kept
+static void *ksw_grow(size_t *m, void **a, size_t n)
+{
+	if (*m < n) {
+		*m = n + (n>>1);
+		free(*a);
+		*a = malloc(*m);
+	}
+	return *a;
+}
+
+// scratch memory for the DP, from buf or from malloc() if buf is NULL; free it with "if (!buf) free(p)"
+#define ksw_buf_dp(buf, n) ((buf)? ksw_grow(&(buf)->m_dp, &(buf)->dp, (n)) : malloc(n))
+
+void ksw_buf_destroy(kswbuf_t *buf)
+{
+	free(buf->dp); free(buf->ptr);
+	buf->m_dp = buf->m_ptr = 0, buf->dp = buf->ptr = 0;
+}
+
+int ksw_kernel_supported(int kernel)
+{
+#ifdef KSW_DISPATCH
+	__builtin_cpu_init();
+	switch (kernel) {
+	case KSW_KERNEL_SSE2:   return 1;
+	case KSW_KERNEL_AVX2:   return __builtin_cpu_supports("avx2");
+	case KSW_KERNEL_AVX512: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	}
+	return 0;
+#else
+	return kernel == KSW_KERNEL_SSE2;
+#endif
+}
+
+int ksw_set_kernel(int kernel)
+{
+	if (kernel < 0) { // the widest kernel supported by the CPU
+		for (kernel = KSW_KERNEL_AVX512; kernel > KSW_KERNEL_SSE2; --kernel)
+			if (ksw_kernel_supported(kernel)) break;
+		ksw_auto = 1;
+	} else if (kernel > KSW_KERNEL_AVX512 || !ksw_kernel_supported(kernel)) return -1;
+	else ksw_auto = 0;
+	return ksw_kernel = kernel;
+}
+
+int ksw_get_kernel(void)
+{
+	return ksw_kernel >= 0? ksw_kernel : ksw_set_kernel(-1);
+}
+
+const char *ksw_kernel_name(int kernel)
+{
+	static const char *names[] = { "sse2", "avx2", "avx512" };
+	return kernel >= KSW_KERNEL_SSE2 && kernel <= KSW_KERNEL_AVX512? names[kernel] : 0;
+}
+
 /**
  * Initialize the query data structure
  *
@@ -63,18 +139,31 @@ struct _kswq_t {
 kswq_t *ksw_qinit(int size, int qlen, const uint8_t *query, int m, const int8_t *mat)
 {
 	kswq_t *q;
-	int slen, a, tmp, p;
+	int slen, a, tmp, p, kernel, width, lane;
 
 	size = size > 1? 2 : 1;
-	p = 8 * (3 - size); // # values per __m128i
+	kernel = ksw_get_kernel();
+	if (ksw_auto) // short queries are faster with narrow vectors: the profile and the lazy-F loop scale with the width
+		while (kernel > KSW_KERNEL_SSE2 && qlen < KSW_MIN_SEG * kernel * (16 << kernel) / size) --kernel;
+	width = 16 << kernel; // bytes per vector
+	p = width / size; // # values per vector
 	slen = (qlen + p - 1) / p; // segmented length
-	q = (kswq_t*)malloc(sizeof(kswq_t) + 256 + 16 * slen * (m + 4)); // a single block of memory
-	q->qp = (__m128i*)(((size_t)q + sizeof(kswq_t) + 15) >> 4 << 4); // align memory
-	q->H0 = q->qp + slen * m;
-	q->H1 = q->H0 + slen;
-	q->E  = q->H1 + slen;
-	q->Hmax = q->E + slen;
+	q = (kswq_t*)malloc(sizeof(kswq_t) + 256 + width * (slen * (m + 4) + 2)); // a single block of memory
+	q->qp = (__m128i*)(((size_t)q + sizeof(kswq_t) + width - 1) / width * width); // align memory
+	q->H0 = (__m128i*)((uint8_t*)q->qp + width * slen * m);
+	q->H1 = (__m128i*)((uint8_t*)q->H0 + width * slen);
+	q->E  = (__m128i*)((uint8_t*)q->H1 + width * slen);
+	q->Hmax = (__m128i*)((uint8_t*)q->E + width * slen);
+	q->M = (__m128i*)((uint8_t*)q->Hmax + width * slen);
 	q->slen = slen; q->qlen = qlen; q->size = size;
+	q->kernel = kernel, q->width = width;
+	q->plen = (qlen + 16 / size - 1) / (16 / size) * (16 / size);
+	lane = slen? (q->plen - 1) / slen : 0;
+	q->jq = q->plen - lane * slen;
+	for (a = 0; a < width; ++a) { // M[0] keeps lanes [0,lane] and M[1] lanes [0,lane)
+		((uint8_t*)q->M)[a] = a / size <= lane? 0xff : 0;
+		((uint8_t*)q->M)[width + a] = a / size < lane? 0xff : 0;
+	}
 	// compute shift
 	tmp = m * m;
 	for (a = 0, q->shift = 127, q->mdiff = 0; a < tmp; ++a) { // find the minimum and maximum score
@@ -108,7 +197,7 @@ kswq_t *ksw_qinit(int size, int qlen, const uint8_t *query, int m, const int8_t
 	return q;
 }
 
-kswr_t ksw_u8(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) // the first gap costs -(_o+_e)
+static kswr_t ksw_u8_sse2(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) // the first gap costs -(_o+_e)
 {
 	int slen, i, m_b, n_b, te = -1, gmax = 0, minsc, endsc;
 	uint64_t *b;
@@ -173,16 +262,18 @@ kswr_t ksw_u8(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del
 			// get H'(i-1,j) and prepare for the next j
 			h = _mm_load_si128(H0 + j); // h=H'(i-1,j)
 		}
-		// NB: we do not need to set E(i,j) as we disallow adjecent insertion and then deletion
+		// E(i+1,j) is updated along with H(i,j): with cheap gaps, an insertion directly followed by a deletion may beat a mismatch
 		for (k = 0; LIKELY(k < 16); ++k) { // this block mimics SWPS3; NB: H(i,j) updated in the lazy-F loop cannot exceed max
 			f = _mm_slli_si128(f, 1);
 			for (j = 0; LIKELY(j < slen); ++j) {
-				h = _mm_load_si128(H1 + j);
-				h = _mm_max_epu8(h, f); // h=H'(i,j)
+				t = _mm_load_si128(H1 + j);
+				h = _mm_max_epu8(t, f); // h=H'(i,j)
 				_mm_store_si128(H1 + j, h);
-				h = _mm_subs_epu8(h, oe_ins);
+				e = _mm_max_epu8(_mm_load_si128(E + j), _mm_subs_epu8(h, oe_del));
+				_mm_store_si128(E + j, e); // E'(i+1,j) from the updated H'(i,j)
+				t = _mm_subs_epu8(t, oe_ins); // against H' before the update: with o_ins=0, f never exceeds the updated one
 				f = _mm_subs_epu8(f, e_ins);
-				cmp = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(f, h), zero));
+				cmp = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(f, t), zero));
 				if (UNLIKELY(cmp == 0xffff)) goto end_loop16;
 			}
 		}
@@ -229,7 +320,7 @@ end_loop16:
 	return r;
 }
 
-kswr_t ksw_i16(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) // the first gap costs -(_o+_e)
+static kswr_t ksw_i16_sse2(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) // the first gap costs -(_o+_e)
 {
 	int slen, i, m_b, n_b, te = -1, gmax = 0, minsc, endsc;
 	uint64_t *b;
@@ -285,12 +376,14 @@ kswr_t ksw_i16(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_de
 		for (k = 0; LIKELY(k < 16); ++k) {
 			f = _mm_slli_si128(f, 2);
 			for (j = 0; LIKELY(j < slen); ++j) {
-				h = _mm_load_si128(H1 + j);
-				h = _mm_max_epi16(h, f);
+				t = _mm_load_si128(H1 + j);
+				h = _mm_max_epi16(t, f);
 				_mm_store_si128(H1 + j, h);
-				h = _mm_subs_epu16(h, oe_ins);
+				e = _mm_max_epi16(_mm_load_si128(E + j), _mm_subs_epu16(h, oe_del));
+				_mm_store_si128(E + j, e);
+				t = _mm_subs_epu16(t, oe_ins);
 				f = _mm_subs_epu16(f, e_ins);
-				if(UNLIKELY(!_mm_movemask_epi8(_mm_cmpgt_epi16(f, h)))) goto end_loop8;
+				if(UNLIKELY(!_mm_movemask_epi8(_mm_cmpgt_epi16(f, t)))) goto end_loop8;
 			}
 		}
 end_loop8:
@@ -333,6 +426,252 @@ end_loop8:
 	return r;
 }
 
+/*********************************
+ *** AVX2 and AVX-512 kernels ***
+ *********************************/
+
+#ifdef KSW_DISPATCH
+
+#define KSW_AVX2   __attribute__((target("avx2")))
+#define KSW_AVX512 __attribute__((target("avx2,avx512f,avx512bw")))
+
+static inline int ksw_hmax_u8_128(__m128i x)
+{
+	x = _mm_max_epu8(x, _mm_srli_si128(x, 8));
+	x = _mm_max_epu8(x, _mm_srli_si128(x, 4));
+	x = _mm_max_epu8(x, _mm_srli_si128(x, 2));
+	x = _mm_max_epu8(x, _mm_srli_si128(x, 1));
+	return _mm_extract_epi16(x, 0) & 0x00ff;
+}
+
+static inline int ksw_hmax_i16_128(__m128i x)
+{
+	x = _mm_max_epi16(x, _mm_srli_si128(x, 8));
+	x = _mm_max_epi16(x, _mm_srli_si128(x, 4));
+	x = _mm_max_epi16(x, _mm_srli_si128(x, 2));
+	return _mm_extract_epi16(x, 0);
+}
+
+/* 256 bits; a byte shift crosses the 128-bit lanes with a permute */
+typedef __m256i ksw_v_avx2;
+#define ksw_set8_avx2(x)     _mm256_set1_epi8(x)
+#define ksw_set16_avx2(x)    _mm256_set1_epi16(x)
+#define ksw_adds_u8_avx2     _mm256_adds_epu8
+#define ksw_subs_u8_avx2     _mm256_subs_epu8
+#define ksw_max_u8_avx2      _mm256_max_epu8
+#define ksw_adds_i16_avx2    _mm256_adds_epi16
+#define ksw_subs_u16_avx2    _mm256_subs_epu16
+#define ksw_max_i16_avx2     _mm256_max_epi16
+#define ksw_and_avx2         _mm256_and_si256
+#define ksw_sl1_avx2(x)      _mm256_alignr_epi8((x), _mm256_permute2x128_si256((x), (x), 0x08), 15)
+#define ksw_sl2_avx2(x)      _mm256_alignr_epi8((x), _mm256_permute2x128_si256((x), (x), 0x08), 14)
+#define ksw_le_u8_avx2(a, b) (_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8((a), (b)), _mm256_setzero_si256())) == -1)
+#define ksw_le_i16_avx2(a, b) (_mm256_movemask_epi8(_mm256_cmpgt_epi16((a), (b))) == 0)
+#define ksw_hmax_u8_avx2(x)  ksw_hmax_u8_128(_mm_max_epu8(_mm256_castsi256_si128(x), _mm256_extracti128_si256((x), 1)))
+#define ksw_hmax_i16_avx2(x) ksw_hmax_i16_128(_mm_max_epi16(_mm256_castsi256_si128(x), _mm256_extracti128_si256((x), 1)))
+
+/* 512 bits; valignd moves a whole 128-bit lane, then vpalignr shifts bytes across */
+typedef __m512i ksw_v_avx512;
+#define ksw_set8_avx512(x)     _mm512_set1_epi8(x)
+#define ksw_set16_avx512(x)    _mm512_set1_epi16(x)
+#define ksw_adds_u8_avx512     _mm512_adds_epu8
+#define ksw_subs_u8_avx512     _mm512_subs_epu8
+#define ksw_max_u8_avx512      _mm512_max_epu8
+#define ksw_adds_i16_avx512    _mm512_adds_epi16
+#define ksw_subs_u16_avx512    _mm512_subs_epu16
+#define ksw_max_i16_avx512     _mm512_max_epi16
+#define ksw_and_avx512         _mm512_and_si512
+#define ksw_sl1_avx512(x)      _mm512_alignr_epi8((x), _mm512_alignr_epi32((x), _mm512_setzero_si512(), 12), 15)
+#define ksw_sl2_avx512(x)      _mm512_alignr_epi8((x), _mm512_alignr_epi32((x), _mm512_setzero_si512(), 12), 14)
+#define ksw_le_u8_avx512(a, b) (_mm512_cmpgt_epu8_mask((a), (b)) == 0)
+#define ksw_le_i16_avx512(a, b) (_mm512_cmpgt_epi16_mask((a), (b)) == 0)
+#define ksw_hmax_u8_avx512(x)  ksw_hmax_u8_avx2(_mm256_max_epu8(_mm512_castsi512_si256(x), _mm512_extracti64x4_epi64((x), 1)))
+#define ksw_hmax_i16_avx512(x) ksw_hmax_i16_avx2(_mm256_max_epi16(_mm512_castsi512_si256(x), _mm512_extracti64x4_epi64((x), 1)))
+
+static inline uint64_t *ksw_push_b(uint64_t *b, int *n_b, int *m_b, int imax, int i) // as in ksw_u8_sse2()
+{
+	if (*n_b == 0 || (int32_t)b[*n_b-1] + 1 != i) { // then append
+		if (*n_b == *m_b) {
+			*m_b = *m_b? *m_b<<1 : 8;
+			b = (uint64_t*)realloc(b, 8 * *m_b);
+		}
+		b[(*n_b)++] = (uint64_t)imax<<32 | i;
+	} else if ((int)(b[*n_b-1]>>32) < imax) b[*n_b-1] = (uint64_t)imax<<32 | i; // modify the last
+	return b;
+}
+
+static void ksw_finish(const kswq_t *q, kswr_t *r, const uint64_t *b, int n_b) // r->qe from Hmax and the 2nd best from b
+{
+	int i, max = -1, tmp, low, high, p = q->width / q->size;
+	for (i = 0, r->qe = -1; i < q->slen * p; ++i) {
+		int k = i / p + i % p * q->slen, x; // query position
+		if (k >= q->plen) continue; // not a cell of the SSE2 kernels
+		x = q->size == 1? ((uint8_t*)q->Hmax)[i] : ((uint16_t*)q->Hmax)[i];
+		if (x > max) max = x, r->qe = k;
+		else if (x == max && (tmp = k) < r->qe) r->qe = tmp;
+	}
+	if (b) {
+		i = (r->score + q->max - 1) / q->max;
+		low = r->te - i; high = r->te + i;
+		for (i = 0; i < n_b; ++i) {
+			int e = (int32_t)b[i];
+			if ((e < low || e > high) && (int)(b[i]>>32) > r->score2)
+				r->score2 = b[i]>>32, r->te2 = e;
+		}
+	}
+}
+
+/* The same algorithm as ksw_u8_sse2() and ksw_i16_sse2(); the lazy-F loop
+ * makes as many passes as there are lanes and, as there, also updates E. */
+#define KSW_INIT(SFX, ATTR) \
+	ATTR static kswr_t ksw_u8_##SFX(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) \
+	{ \
+		int slen = q->slen, i, m_b = 0, n_b = 0, te = -1, gmax = 0, minsc, endsc; \
+		uint64_t *b = 0; \
+		ksw_v_##SFX zero, oe_del, e_del, oe_ins, e_ins, shift, *H0, *H1, *E, *Hmax, *M = (ksw_v_##SFX*)q->M; \
+		kswr_t r = g_defr; \
+		minsc = (xtra&KSW_XSUBO)? xtra&0xffff : 0x10000; \
+		endsc = (xtra&KSW_XSTOP)? xtra&0xffff : 0x10000; \
+		zero = ksw_set8_##SFX(0); \
+		oe_del = ksw_set8_##SFX(_o_del + _e_del); \
+		e_del = ksw_set8_##SFX(_e_del); \
+		oe_ins = ksw_set8_##SFX(_o_ins + _e_ins); \
+		e_ins = ksw_set8_##SFX(_e_ins); \
+		shift = ksw_set8_##SFX(q->shift); \
+		H0 = (ksw_v_##SFX*)q->H0; H1 = (ksw_v_##SFX*)q->H1; E = (ksw_v_##SFX*)q->E; Hmax = (ksw_v_##SFX*)q->Hmax; \
+		for (i = 0; i < slen; ++i) E[i] = H0[i] = Hmax[i] = zero; \
+		for (i = 0; i < tlen; ++i) { \
+			int j, k, imax; \
+			ksw_v_##SFX e, h, t, f = zero, max = zero, *S = (ksw_v_##SFX*)q->qp + target[i] * slen; \
+			h = ksw_sl1_##SFX(H0[slen - 1]); \
+			for (j = 0; LIKELY(j < slen); ++j) { \
+				h = ksw_subs_u8_##SFX(ksw_adds_u8_##SFX(h, S[j]), shift); \
+				e = E[j]; \
+				h = ksw_max_u8_##SFX(h, e); \
+				h = ksw_max_u8_##SFX(h, f); \
+				max = ksw_max_u8_##SFX(max, ksw_and_##SFX(h, M[j >= q->jq])); \
+				H1[j] = h; \
+				e = ksw_subs_u8_##SFX(e, e_del); \
+				t = ksw_subs_u8_##SFX(h, oe_del); \
+				E[j] = ksw_max_u8_##SFX(e, t); \
+				f = ksw_subs_u8_##SFX(f, e_ins); \
+				t = ksw_subs_u8_##SFX(h, oe_ins); \
+				f = ksw_max_u8_##SFX(f, t); \
+				h = H0[j]; \
+			} \
+			for (k = 0; LIKELY(k < q->width); ++k) { \
+				f = ksw_sl1_##SFX(f); \
+				for (j = 0; LIKELY(j < slen); ++j) { \
+					t = H1[j]; \
+					h = ksw_max_u8_##SFX(t, f); \
+					H1[j] = h; \
+					E[j] = ksw_max_u8_##SFX(E[j], ksw_subs_u8_##SFX(h, oe_del)); \
+					t = ksw_subs_u8_##SFX(t, oe_ins); \
+					f = ksw_subs_u8_##SFX(f, e_ins); \
+					if (UNLIKELY(ksw_le_u8_##SFX(f, t))) goto end_loop; \
+				} \
+			} \
+end_loop: \
+			imax = ksw_hmax_u8_##SFX(max); \
+			if (imax >= minsc) b = ksw_push_b(b, &n_b, &m_b, imax, i); \
+			if (imax > gmax) { \
+				gmax = imax; te = i; \
+				for (j = 0; LIKELY(j < slen); ++j) Hmax[j] = H1[j]; \
+				if (gmax + q->shift >= 255 || gmax >= endsc) break; \
+			} \
+			S = H1; H1 = H0; H0 = S; \
+		} \
+		r.score = gmax + q->shift < 255? gmax : 255; \
+		r.te = te; \
+		if (r.score != 255) ksw_finish(q, &r, b, n_b); \
+		free(b); \
+		return r; \
+	} \
+	ATTR static kswr_t ksw_i16_##SFX(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) \
+	{ \
+		int slen = q->slen, i, m_b = 0, n_b = 0, te = -1, gmax = 0, minsc, endsc; \
+		uint64_t *b = 0; \
+		ksw_v_##SFX zero, oe_del, e_del, oe_ins, e_ins, *H0, *H1, *E, *Hmax, *M = (ksw_v_##SFX*)q->M; \
+		kswr_t r = g_defr; \
+		minsc = (xtra&KSW_XSUBO)? xtra&0xffff : 0x10000; \
+		endsc = (xtra&KSW_XSTOP)? xtra&0xffff : 0x10000; \
+		zero = ksw_set16_##SFX(0); \
+		oe_del = ksw_set16_##SFX(_o_del + _e_del); \
+		e_del = ksw_set16_##SFX(_e_del); \
+		oe_ins = ksw_set16_##SFX(_o_ins + _e_ins); \
+		e_ins = ksw_set16_##SFX(_e_ins); \
+		H0 = (ksw_v_##SFX*)q->H0; H1 = (ksw_v_##SFX*)q->H1; E = (ksw_v_##SFX*)q->E; Hmax = (ksw_v_##SFX*)q->Hmax; \
+		for (i = 0; i < slen; ++i) E[i] = H0[i] = Hmax[i] = zero; \
+		for (i = 0; i < tlen; ++i) { \
+			int j, k, imax; \
+			ksw_v_##SFX e, t, h, f = zero, max = zero, *S = (ksw_v_##SFX*)q->qp + target[i] * slen; \
+			h = ksw_sl2_##SFX(H0[slen - 1]); \
+			for (j = 0; LIKELY(j < slen); ++j) { \
+				h = ksw_adds_i16_##SFX(h, S[j]); \
+				e = E[j]; \
+				h = ksw_max_i16_##SFX(h, e); \
+				h = ksw_max_i16_##SFX(h, f); \
+				max = ksw_max_i16_##SFX(max, ksw_and_##SFX(h, M[j >= q->jq])); \
+				H1[j] = h; \
+				e = ksw_subs_u16_##SFX(e, e_del); \
+				t = ksw_subs_u16_##SFX(h, oe_del); \
+				E[j] = ksw_max_i16_##SFX(e, t); \
+				f = ksw_subs_u16_##SFX(f, e_ins); \
+				t = ksw_subs_u16_##SFX(h, oe_ins); \
+				f = ksw_max_i16_##SFX(f, t); \
+				h = H0[j]; \
+			} \
+			for (k = 0; LIKELY(k < q->width / 2); ++k) { \
+				f = ksw_sl2_##SFX(f); \
+				for (j = 0; LIKELY(j < slen); ++j) { \
+					t = H1[j]; \
+					h = ksw_max_i16_##SFX(t, f); \
+					H1[j] = h; \
+					E[j] = ksw_max_i16_##SFX(E[j], ksw_subs_u16_##SFX(h, oe_del)); \
+					t = ksw_subs_u16_##SFX(t, oe_ins); \
+					f = ksw_subs_u16_##SFX(f, e_ins); \
+					if (UNLIKELY(ksw_le_i16_##SFX(f, t))) goto end_loop; \
+				} \
+			} \
+end_loop: \
+			imax = ksw_hmax_i16_##SFX(max); \
+			if (imax >= minsc) b = ksw_push_b(b, &n_b, &m_b, imax, i); \
+			if (imax > gmax) { \
+				gmax = imax; te = i; \
+				for (j = 0; LIKELY(j < slen); ++j) Hmax[j] = H1[j]; \
+				if (gmax >= endsc) break; \
+			} \
+			S = H1; H1 = H0; H0 = S; \
+		} \
+		r.score = gmax; r.te = te; \
+		ksw_finish(q, &r, b, n_b); \
+		free(b); \
+		return r; \
+	}
+
+KSW_INIT(avx2, KSW_AVX2)
+KSW_INIT(avx512, KSW_AVX512)
+
+#endif // KSW_DISPATCH
+
+kswr_t ksw_u8(kswq_t *q, int tlen, const uint8_t *target, int o_del, int e_del, int o_ins, int e_ins, int xtra)
+{
+#ifdef KSW_DISPATCH
+	if (q->kernel == KSW_KERNEL_AVX512) return ksw_u8_avx512(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+	if (q->kernel == KSW_KERNEL_AVX2) return ksw_u8_avx2(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+#endif
+	return ksw_u8_sse2(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+}
+
+kswr_t ksw_i16(kswq_t *q, int tlen, const uint8_t *target, int o_del, int e_del, int o_ins, int e_ins, int xtra)
+{
+#ifdef KSW_DISPATCH
+	if (q->kernel == KSW_KERNEL_AVX512) return ksw_i16_avx512(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+	if (q->kernel == KSW_KERNEL_AVX2) return ksw_i16_avx2(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+#endif
+	return ksw_i16_sse2(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+}
+
 static inline void revseq(int l, uint8_t *s)
 {
 	int i, t;
@@ -377,11 +716,26 @@ typedef struct {
 	int32_t h, e;
 } eh_t;
 
-int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off)
+static int ksw_ext_band(int qlen, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int *_max)
+{
+	int i, k = m * m, max, max_ins, max_del;
+	for (i = 0, max = 0; i < k; ++i) // get the max score
+		max = max > mat[i]? max : mat[i];
+	max_ins = (int)((double)(qlen * max + end_bonus - o_ins) / e_ins + 1.);
+	max_ins = max_ins > 1? max_ins : 1;
+	w = w < max_ins? w : max_ins;
+	max_del = (int)((double)(qlen * max + end_bonus - o_del) / e_del + 1.);
+	max_del = max_del > 1? max_del : 1;
+	w = w < max_del? w : max_del; // TODO: is this necessary?
+	*_max = max;
+	return w;
+}
+
+int ksw_extend2_scalar(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off)
 {
 	eh_t *eh; // score array
 	int8_t *qp; // query profile
-	int i, j, k, oe_del = o_del + e_del, oe_ins = o_ins + e_ins, beg, end, max, max_i, max_j, max_ins, max_del, max_ie, gscore, max_off;
+	int i, j, k, oe_del = o_del + e_del, oe_ins = o_ins + e_ins, beg, end, max, max_i, max_j, max_ie, gscore, max_off;
 	assert(h0 > 0);
 	// allocate memory
 	qp = malloc(qlen * m);
@@ -396,15 +750,7 @@ int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	for (j = 2; j <= qlen && eh[j-1].h > e_ins; ++j)
 		eh[j].h = eh[j-1].h - e_ins;
 	// adjust $w if it is too large
-	k = m * m;
-	for (i = 0, max = 0; i < k; ++i) // get the max score
-		max = max > mat[i]? max : mat[i];
-	max_ins = (int)((double)(qlen * max + end_bonus - o_ins) / e_ins + 1.);
-	max_ins = max_ins > 1? max_ins : 1;
-	w = w < max_ins? w : max_ins;
-	max_del = (int)((double)(qlen * max + end_bonus - o_del) / e_del + 1.);
-	max_del = max_del > 1? max_del : 1;
-	w = w < max_del? w : max_del; // TODO: is this necessary?
+	w = ksw_ext_band(qlen, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, &max);
 	// DP loop
 	max = h0, max_i = max_j = -1; max_ie = -1, gscore = -1;
 	max_off = 0;
@@ -478,11 +824,367 @@ int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	return max;
 }
 
+/* The SSE2 extension computes a row of ksw_extend2_scalar() eight cells at a
+ * time, with 16-bit scores. As E and F are derived from M, not from H, they
+ * do not depend on the cells to their left in the same row: E is computed
+ * cell by cell, and F is a prefix max-scan of max{M-gapo-gape,0} decreasing
+ * by gape per column. H[] and E[] hold the same values as eh_t::h and
+ * eh_t::e, such that the band and the outputs are those of the scalar code. */
+
+int ksw_extend2_buf(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off, kswbuf_t *buf)
+{
+	int16_t *mem, *qp, *H, *E; // query profile and score arrays
+	int i, j, k, ql8 = qlen + 8, beg, end, max, max_i, max_j, max_ie, gscore, max_off;
+	__m128i zero, oe_del_v, e_del_v, oe_ins_v, e_ins1, e_ins2, e_ins4, dec, lane;
+	assert(h0 > 0);
+	w = ksw_ext_band(qlen, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, &max);
+	if ((int64_t)qlen * (max > 1? max : 1) + h0 >= 0x7fff) // scores may not fit 16 bits
+		return ksw_extend2_scalar(qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, _qle, _tle, _gtle, _gscore, _max_off);
+	// allocate memory; vectors may read and write up to 8 cells past qlen
+	mem = ksw_buf_dp(buf, (ql8 + 13) * 4 + ql8 * m * 2);
+	memset(mem, 0, (ql8 + 13) * 4);
+	H = mem + 8; // the search for the max may read 7 cells before H
+	E = H + ql8 + 9;
+	qp = E + ql8 + 9;
+	// generate the query profile
+	for (k = i = 0; k < m; ++k) {
+		const int8_t *p = &mat[k * m];
+		for (j = 0; j < qlen; ++j) qp[i++] = p[query[j]];
+		for (; j < ql8; ++j) qp[i++] = 0;
+	}
+	// fill the first row
+	H[0] = h0; H[1] = h0 > o_ins + e_ins? h0 - (o_ins + e_ins) : 0;
+	for (j = 2; j <= qlen && H[j-1] > e_ins; ++j)
+		H[j] = H[j-1] - e_ins;
+#define ksw_sat16(x) ((x) < 0x7fff? (x) : 0x7fff)
+	zero = _mm_setzero_si128();
+	oe_del_v = _mm_set1_epi16(ksw_sat16(o_del + e_del));
+	e_del_v  = _mm_set1_epi16(ksw_sat16(e_del));
+	oe_ins_v = _mm_set1_epi16(ksw_sat16(o_ins + e_ins));
+	e_ins1 = _mm_set1_epi16(ksw_sat16(e_ins));
+	e_ins2 = _mm_set1_epi16(ksw_sat16(e_ins * 2));
+	e_ins4 = _mm_set1_epi16(ksw_sat16(e_ins * 4));
+	dec = _mm_set_epi16(ksw_sat16(e_ins * 8), ksw_sat16(e_ins * 7), ksw_sat16(e_ins * 6), ksw_sat16(e_ins * 5),
+						ksw_sat16(e_ins * 4), ksw_sat16(e_ins * 3), ksw_sat16(e_ins * 2), ksw_sat16(e_ins));
+#undef ksw_sat16
+	lane = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+	// DP loop
+	max = h0, max_i = max_j = -1; max_ie = -1, gscore = -1;
+	max_off = 0;
+	beg = 0, end = qlen;
+	for (i = 0; LIKELY(i < tlen); ++i) {
+		int h1, m = 0, mj = -1, g = 0;
+		const int16_t *q = &qp[target[i] * ql8];
+		__m128i vm = zero, hp;
+		// apply the band and the constraint (if provided)
+		if (beg < i - w) beg = i - w;
+		if (end > i + w + 1) end = i + w + 1;
+		if (end > qlen) end = qlen;
+		// compute the first column
+		if (beg == 0) {
+			h1 = h0 - (o_del + e_del * (i + 1));
+			if (h1 < 0) h1 = 0;
+		} else h1 = 0;
+		hp = _mm_loadu_si128((__m128i*)&H[beg]); // H(i-1,j-1) for j in [beg,beg+8)
+		H[beg] = h1;
+		for (j = beg; LIKELY(j < end); j += 8) {
+			__m128i M, e, h, t, f, hn, in;
+			in = _mm_cmpgt_epi16(_mm_set1_epi16(end - j), lane); // cells before end
+			hn = _mm_loadu_si128((__m128i*)&H[j + 8]); // load before H[j+1,j+9) is overwritten
+			M = _mm_andnot_si128(_mm_cmpeq_epi16(hp, zero), _mm_adds_epi16(hp, _mm_loadu_si128((__m128i*)&q[j])));
+			e = _mm_loadu_si128((__m128i*)&E[j]);
+			h = _mm_max_epi16(M, e);
+			// E(i+1,j) = max{M(i,j)-gapo-gape, E(i,j)-gape, 0}
+			t = _mm_max_epi16(_mm_subs_epi16(M, oe_del_v), zero);
+			t = _mm_max_epi16(_mm_subs_epi16(e, e_del_v), t);
+			// G(j) = F(i,j+1) = max{M(i,j)-gapo-gape, G(j-1)-gape, 0}
+			f = _mm_max_epi16(_mm_subs_epi16(M, oe_ins_v), zero);
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_slli_si128(f, 2), e_ins1));
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_slli_si128(f, 4), e_ins2));
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_slli_si128(f, 8), e_ins4));
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_set1_epi16(g), dec));
+			h = _mm_max_epi16(h, _mm_insert_epi16(_mm_slli_si128(f, 2), g, 0));
+			g = _mm_extract_epi16(f, 7);
+			h = _mm_and_si128(h, in);
+			vm = _mm_max_epi16(vm, h);
+			if (LIKELY(j + 8 <= end)) {
+				_mm_storeu_si128((__m128i*)&E[j], t);
+				_mm_storeu_si128((__m128i*)&H[j + 1], h);
+			} else { // keep the cells past end
+				__m128i o = _mm_loadu_si128((__m128i*)&E[j]);
+				_mm_storeu_si128((__m128i*)&E[j], _mm_or_si128(_mm_and_si128(in, t), _mm_andnot_si128(in, o)));
+				o = _mm_loadu_si128((__m128i*)&H[j + 1]);
+				_mm_storeu_si128((__m128i*)&H[j + 1], _mm_or_si128(_mm_and_si128(in, h), _mm_andnot_si128(in, o)));
+			}
+			hp = hn;
+		}
+		if (beg < end) { // get the max and the last cell that achieves it, as in the scalar code
+			vm = _mm_max_epi16(vm, _mm_srli_si128(vm, 8));
+			vm = _mm_max_epi16(vm, _mm_srli_si128(vm, 4));
+			vm = _mm_max_epi16(vm, _mm_srli_si128(vm, 2));
+			m = _mm_extract_epi16(vm, 0);
+			for (j = end - 8; j > beg - 8; j -= 8) { // H[j+1] keeps H(i,j)
+				int b = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((__m128i*)&H[j + 1]), _mm_set1_epi16(m)));
+				if (j < beg) b &= ~0U << (beg - j) * 2; // H[beg] is not a cell of this row
+				if (b) {
+					mj = j + (31 - __builtin_clz(b)) / 2;
+					break;
+				}
+			}
+			h1 = H[end];
+			j = end;
+		} else j = beg;
+		H[end] = h1; E[end] = 0;
+		if (j == qlen) {
+			max_ie = gscore > h1? max_ie : i;
+			gscore = gscore > h1? gscore : h1;
+		}
+		if (m == 0) break;
+		if (m > max) {
+			max = m, max_i = i, max_j = mj;
+			max_off = max_off > abs(mj - i)? max_off : abs(mj - i);
+		} else if (zdrop > 0) {
+			if (i - max_i > mj - max_j) {
+				if (max - m - ((i - max_i) - (mj - max_j)) * e_del > zdrop) break;
+			} else {
+				if (max - m - ((mj - max_j) - (i - max_i)) * e_ins > zdrop) break;
+			}
+		}
+		// update beg and end for the next round
+		for (j = beg; LIKELY(j < end) && H[j] == 0 && E[j] == 0; ++j);
+		beg = j;
+		for (j = end; LIKELY(j >= beg) && H[j] == 0 && E[j] == 0; --j);
+		end = j + 2 < qlen? j + 2 : qlen;
+	}
+	if (!buf) free(mem);
+	if (_qle) *_qle = max_j + 1;
+	if (_tle) *_tle = max_i + 1;
+	if (_gtle) *_gtle = max_ie + 1;
+	if (_gscore) *_gscore = gscore;
+	if (_max_off) *_max_off = max_off;
+	return max;
+}
+
+int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off)
+{
+	return ksw_extend2_buf(qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, qle, tle, gtle, gscore, max_off, 0);
+}
+
 int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off)
 {
 	return ksw_extend2(qlen, query, tlen, target, m, mat, gapo, gape, gapo, gape, w, end_bonus, zdrop, h0, qle, tle, gtle, gscore, max_off);
 }
 
+/****************************
+ *** Batched SW extension ***
+ ****************************/
+
+/* ksw_extend2_batch() extends a group of alignments in lockstep, one per
+ * lane, and all lanes are at the same row. A lane keeps exactly the eh_t
+ * array and the variables of ksw_extend2_scalar() with 16-bit values. In a
+ * row, the lanes step through the union of their bands, and a cell outside
+ * the band of a lane leaves the lane unchanged. Only the search for the new
+ * band is done lane by lane. */
+
+
+#ifdef KSW_DISPATCH
+#define ksw_ld_avx2(p)        _mm256_load_si256((__m256i*)(p))
+#define ksw_st_avx2(p, x)     _mm256_store_si256((__m256i*)(p), (x))
+#define ksw_add16_avx2        _mm256_add_epi16
+#define ksw_sub16_avx2        _mm256_sub_epi16
+#define ksw_subs_i16_avx2     _mm256_subs_epi16
+#define ksw_min_i16_avx2      _mm256_min_epi16
+#define ksw_mullo16_avx2      _mm256_mullo_epi16
+#define ksw_mulhi_u16_avx2    _mm256_mulhi_epu16
+#define ksw_andnot_avx2       _mm256_andnot_si256
+#define ksw_or_avx2           _mm256_or_si256
+#define ksw_eq16_avx2         _mm256_cmpeq_epi16
+#define ksw_gt16_avx2         _mm256_cmpgt_epi16
+#define ksw_blend_avx2(m, a, b) _mm256_blendv_epi8((b), (a), (m))
+#define ksw_any_avx2(x)       _mm256_movemask_epi8(x)
+
+
+#define KSW_EXT_INIT(SFX, ATTR) \
+	ATTR static void ksw_ext_##SFX(int n, kswext_t **ext, int qmax, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int zdrop, kswbuf_t *buf) \
+	{ \
+		enum { W = sizeof(ksw_v_##SFX) / 2 }; /* lanes */ \
+		int16_t *Q, *H, *E, *mem; \
+		int16_t a_w[W] __attribute__((aligned(64))), a_ql[W] __attribute__((aligned(64))), a_tl[W] __attribute__((aligned(64))), a_h0[W] __attribute__((aligned(64))); \
+		int16_t a_beg[W] __attribute__((aligned(64))), a_end[W] __attribute__((aligned(64))), a_t[W] __attribute__((aligned(64))); \
+		int16_t a_act[W] __attribute__((aligned(64))), a_h1[W] __attribute__((aligned(64))); \
+		int16_t r[6][W] __attribute__((aligned(64))); /* max, max_i, max_j, max_ie, gscore, max_off */ \
+		int g, j, l, sc_n = mat[4]; \
+		ksw_v_##SFX zero, one, vn, va, vb, oe_del_v, e_del_v, oe_ins_v, e_ins_v, zd; \
+		mem = (int16_t*)ksw_buf_dp(buf, ((qmax + 2) * 3 * W + 32) * 2); \
+		memset(mem, 0, ((qmax + 2) * 3 * W + 32) * 2); \
+		Q = (int16_t*)(((size_t)mem + 63) / 64 * 64); \
+		H = Q + (qmax + 2) * W; \
+		E = H + (qmax + 2) * W; \
+		zero = ksw_set16_##SFX(0), one = ksw_set16_##SFX(1), vn = ksw_set16_##SFX(sc_n), va = ksw_set16_##SFX(mat[0]), vb = ksw_set16_##SFX(mat[1]); \
+		oe_del_v = ksw_set16_##SFX(o_del + e_del), e_del_v = ksw_set16_##SFX(e_del); \
+		oe_ins_v = ksw_set16_##SFX(o_ins + e_ins), e_ins_v = ksw_set16_##SFX(e_ins); \
+		zd = ksw_set16_##SFX(zdrop < 0x7fff? zdrop : 0x7fff); \
+		for (g = 0; g < n; g += W) { \
+			kswext_t *p[W]; \
+			ksw_v_##SFX vw, vql, vtl, vh0, act, beg, end, max, max_i, max_j, max_ie, gscore, max_off; \
+			int i; \
+			for (l = 0; l < W; ++l) { /* as ksw_extend2_scalar() initializes */ \
+				int tmp; \
+				p[l] = g + l < n? ext[g + l] : 0; \
+				a_w[l] = a_ql[l] = a_tl[l] = a_h0[l] = 0; \
+				if (p[l] == 0) continue; \
+				a_ql[l] = p[l]->qlen, a_tl[l] = p[l]->tlen, a_h0[l] = p[l]->h0; \
+				a_w[l] = ksw_ext_band(p[l]->qlen, m, mat, o_del, e_del, o_ins, e_ins, p[l]->w, p[l]->end_bonus, &tmp); \
+				for (j = 0; j < p[l]->qlen; ++j) Q[j * W + l] = p[l]->query[j]; \
+				for (j = 0; j <= p[l]->qlen; ++j) H[j * W + l] = E[j * W + l] = 0; \
+				H[l] = p[l]->h0; H[W + l] = p[l]->h0 > o_ins + e_ins? p[l]->h0 - (o_ins + e_ins) : 0; \
+				for (j = 2; j <= p[l]->qlen && H[(j-1) * W + l] > e_ins; ++j) \
+					H[j * W + l] = H[(j-1) * W + l] - e_ins; \
+			} \
+			vw = ksw_ld_##SFX(a_w), vql = ksw_ld_##SFX(a_ql), vtl = ksw_ld_##SFX(a_tl), vh0 = ksw_ld_##SFX(a_h0); \
+			act = ksw_gt16_##SFX(vtl, zero); \
+			beg = zero, end = vql, max = vh0, max_off = zero; \
+			max_i = max_j = max_ie = gscore = ksw_set16_##SFX(-1); \
+			for (i = 0; ksw_any_##SFX(act); ++i) { \
+				int jmin = 0x7fff, jmax = 0, tmp; \
+				ksw_v_##SFX vi = ksw_set16_##SFX(i), len, rel, vt, sm, sx, h1, f, mv, mj, t, u, done; \
+				/* apply the band and compute the first column */ \
+				beg = ksw_max_i16_##SFX(beg, ksw_subs_i16_##SFX(vi, vw)); \
+				end = ksw_min_i16_##SFX(end, ksw_min_i16_##SFX(ksw_adds_i16_##SFX(ksw_add16_##SFX(vi, one), vw), vql)); \
+				tmp = o_del + e_del * (i + 1); \
+				h1 = ksw_subs_i16_##SFX(vh0, ksw_set16_##SFX(tmp < 0x7fff? tmp : 0x7fff)); \
+				h1 = ksw_andnot_##SFX(ksw_gt16_##SFX(beg, zero), ksw_max_i16_##SFX(h1, zero)); \
+				len = ksw_and_##SFX(act, ksw_max_i16_##SFX(ksw_sub16_##SFX(end, beg), zero)); \
+				ksw_st_##SFX(a_beg, beg), ksw_st_##SFX(a_end, end), ksw_st_##SFX(a_act, act); \
+				for (l = 0; l < W; ++l) { \
+					a_t[l] = a_act[l]? p[l]->target[i] : 0; \
+					if (a_act[l] && a_beg[l] < a_end[l]) { \
+						jmin = jmin < a_beg[l]? jmin : a_beg[l]; \
+						jmax = jmax > a_end[l]? jmax : a_end[l]; \
+					} \
+				} \
+				vt = ksw_ld_##SFX(a_t); \
+				t = ksw_eq16_##SFX(vt, ksw_set16_##SFX(4)); \
+				sm = ksw_blend_##SFX(t, vn, va), sx = ksw_blend_##SFX(t, vn, vb); /* match and mismatch */ \
+				/* j-beg+0x8000 < len+0x8000 as signed integers is 0 <= j-beg < len */ \
+				rel = ksw_sub16_##SFX(ksw_sub16_##SFX(ksw_set16_##SFX(jmin), beg), ksw_set16_##SFX(-0x8000)); \
+				len = ksw_add16_##SFX(len, ksw_set16_##SFX(-0x8000)); \
+				f = mv = mj = zero; \
+				for (j = jmin; j < jmax; ++j) { \
+					ksw_v_##SFX in, hp, q, s, M, e, h; \
+					in = ksw_gt16_##SFX(len, rel); \
+					hp = ksw_ld_##SFX(&H[j * W]); /* H(i-1,j-1) */ \
+					ksw_st_##SFX(&H[j * W], ksw_blend_##SFX(in, h1, hp)); \
+					q = ksw_ld_##SFX(&Q[j * W]); \
+					s = ksw_blend_##SFX(ksw_eq16_##SFX(q, vt), sm, sx); \
+					s = ksw_blend_##SFX(ksw_eq16_##SFX(q, ksw_set16_##SFX(4)), vn, s); \
+					M = ksw_andnot_##SFX(ksw_eq16_##SFX(hp, zero), ksw_adds_i16_##SFX(hp, s)); \
+					e = ksw_ld_##SFX(&E[j * W]); \
+					h = ksw_max_i16_##SFX(ksw_max_i16_##SFX(M, e), f); \
+					t = ksw_max_i16_##SFX(ksw_subs_i16_##SFX(M, oe_del_v), zero); \
+					ksw_st_##SFX(&E[j * W], ksw_blend_##SFX(in, ksw_max_i16_##SFX(ksw_subs_i16_##SFX(e, e_del_v), t), e)); \
+					t = ksw_max_i16_##SFX(ksw_subs_i16_##SFX(M, oe_ins_v), zero); \
+					f = ksw_blend_##SFX(in, ksw_max_i16_##SFX(ksw_subs_i16_##SFX(f, e_ins_v), t), f); \
+					h1 = ksw_blend_##SFX(in, h, h1); \
+					t = ksw_andnot_##SFX(ksw_gt16_##SFX(mv, h), in); /* the later cell wins a tie */ \
+					mj = ksw_blend_##SFX(t, rel, mj); \
+					mv = ksw_max_i16_##SFX(mv, ksw_and_##SFX(h, in)); \
+					rel = ksw_add16_##SFX(rel, one); \
+				} \
+				mj = ksw_add16_##SFX(ksw_add16_##SFX(mj, beg), ksw_set16_##SFX(-0x8000)); \
+				ksw_st_##SFX(a_h1, h1); \
+				for (l = 0; l < W; ++l) \
+					if (a_act[l]) H[a_end[l] * W + l] = a_h1[l], E[a_end[l] * W + l] = 0; \
+				/* the best score with the whole query */ \
+				t = ksw_and_##SFX(act, ksw_eq16_##SFX(ksw_blend_##SFX(ksw_gt16_##SFX(end, beg), end, beg), vql)); \
+				max_ie = ksw_blend_##SFX(ksw_andnot_##SFX(ksw_gt16_##SFX(gscore, h1), t), vi, max_ie); \
+				gscore = ksw_blend_##SFX(t, ksw_max_i16_##SFX(gscore, h1), gscore); \
+				/* the best score so far */ \
+				done = ksw_and_##SFX(act, ksw_eq16_##SFX(mv, zero)); \
+				u = ksw_andnot_##SFX(done, ksw_and_##SFX(act, ksw_gt16_##SFX(mv, max))); \
+				t = ksw_sub16_##SFX(mj, vi); \
+				t = ksw_max_i16_##SFX(t, ksw_sub16_##SFX(zero, t)); \
+				max_off = ksw_blend_##SFX(u, ksw_max_i16_##SFX(max_off, t), max_off); \
+				max = ksw_blend_##SFX(u, mv, max), max_i = ksw_blend_##SFX(u, vi, max_i), max_j = ksw_blend_##SFX(u, mj, max_j); \
+				if (zdrop > 0) { /* max - m - gap * e > zdrop, where the 32-bit product is computed from the high and low halves */ \
+					ksw_v_##SFX d, e, a, lo; \
+					d = ksw_sub16_##SFX(ksw_sub16_##SFX(vi, max_i), ksw_sub16_##SFX(mj, max_j)); \
+					e = ksw_blend_##SFX(ksw_gt16_##SFX(d, zero), e_del_v, e_ins_v); \
+					d = ksw_max_i16_##SFX(d, ksw_sub16_##SFX(zero, d)); \
+					a = ksw_subs_i16_##SFX(ksw_subs_i16_##SFX(max, mv), zd); \
+					lo = ksw_mullo16_##SFX(d, e); \
+					t = ksw_and_##SFX(ksw_gt16_##SFX(a, lo), ksw_gt16_##SFX(lo, ksw_set16_##SFX(-1))); \
+					t = ksw_and_##SFX(t, ksw_eq16_##SFX(ksw_mulhi_u16_##SFX(d, e), zero)); \
+					done = ksw_or_##SFX(done, ksw_andnot_##SFX(u, ksw_and_##SFX(act, t))); \
+				} \
+				act = ksw_andnot_##SFX(done, act); \
+				act = ksw_and_##SFX(act, ksw_gt16_##SFX(vtl, ksw_add16_##SFX(vi, one))); \
+				/* update beg and end for the next round */ \
+				ksw_st_##SFX(a_act, act); \
+				for (l = 0; l < W; ++l) { \
+					int b, e = a_end[l]; \
+					if (!a_act[l]) continue; \
+					for (b = a_beg[l]; LIKELY(b < e) && H[b * W + l] == 0 && E[b * W + l] == 0; ++b); \
+					for (j = e; LIKELY(j >= b) && H[j * W + l] == 0 && E[j * W + l] == 0; --j); \
+					a_beg[l] = b, a_end[l] = j + 2 < a_ql[l]? j + 2 : a_ql[l]; \
+				} \
+				beg = ksw_ld_##SFX(a_beg), end = ksw_ld_##SFX(a_end); \
+			} \
+			ksw_st_##SFX(r[0], max), ksw_st_##SFX(r[1], max_i), ksw_st_##SFX(r[2], max_j); \
+			ksw_st_##SFX(r[3], max_ie), ksw_st_##SFX(r[4], gscore), ksw_st_##SFX(r[5], max_off); \
+			for (l = 0; l < W && p[l]; ++l) { \
+				p[l]->score = r[0][l], p[l]->tle = r[1][l] + 1, p[l]->qle = r[2][l] + 1; \
+				p[l]->gtle = r[3][l] + 1, p[l]->gscore = r[4][l], p[l]->max_off = r[5][l]; \
+			} \
+		} \
+		if (!buf) free(mem); \
+	}
+
+KSW_EXT_INIT(avx2, KSW_AVX2)
+
+#endif // KSW_DISPATCH
+
+static int ksw_ext_cmp(const void *a, const void *b)
+{
+	const kswext_t *p = *(kswext_t* const*)a, *q = *(kswext_t* const*)b;
+	return p->qlen != q->qlen? p->qlen - q->qlen : (p > q) - (p < q);
+}
+
+static inline void ksw_ext1(kswext_t *p, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int zdrop, kswbuf_t *buf)
+{
+	p->score = ksw_extend2_buf(p->qlen, p->query, p->tlen, p->target, m, mat, o_del, e_del, o_ins, e_ins, p->w, p->end_bonus, zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off, buf);
+}
+
+void ksw_extend2_batch(int n, kswext_t *ext, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int zdrop, kswbuf_t *buf)
+{
+	kswext_t **a;
+	int i, n_a = 0, qmax = 0, max = 0, simple = (m == 5), kernel = ksw_get_kernel();
+	// the lanes compute a score from whether the two bases are equal or N, as with bwa_fill_scmat()
+	for (i = 0; i < m * m && simple; ++i) {
+		int x = i / m, y = i % m;
+		if (mat[i] != (x == 4 || y == 4? mat[4] : x == y? mat[0] : mat[1])) simple = 0;
+		max = max > mat[i]? max : mat[i];
+	}
+	a = (kswext_t**)(buf? ksw_grow(&buf->m_ptr, &buf->ptr, n * sizeof(kswext_t*)) : malloc(n * sizeof(kswext_t*)));
+	for (i = 0; i < n; ++i) {
+		kswext_t *p = &ext[i];
+		if (simple && (int64_t)p->qlen * (max > 1? max : 1) + p->h0 < 0x7fff && p->tlen < 0x7fff) a[n_a++] = p;
+		else ksw_ext1(p, m, mat, o_del, e_del, o_ins, e_ins, zdrop, buf);
+	}
+	// groups should fill the lanes, and with the 8 lanes of SSE2, ksw_extend2() is faster; 32 lanes of AVX-512 were no faster than 16 of AVX2
+	if (n_a < 16) kernel = KSW_KERNEL_SSE2;
+	if (kernel > KSW_KERNEL_SSE2) {
+		qsort(a, n_a, sizeof(kswext_t*), ksw_ext_cmp); // lanes in a group have similar lengths
+		for (i = 0; i < n_a; ++i) qmax = qmax > a[i]->qlen? qmax : a[i]->qlen;
+	}
+#ifdef KSW_DISPATCH
+	if (kernel > KSW_KERNEL_SSE2) ksw_ext_avx2(n_a, a, qmax, m, mat, o_del, e_del, o_ins, e_ins, zdrop, buf);
+	else
+#endif
+	for (i = 0; i < n_a; ++i) ksw_ext1(a[i], m, mat, o_del, e_del, o_ins, e_ins, zdrop, buf);
+	if (!buf) free(a);
+}
+
 /********************
  * Global alignment *
  ********************/
@@ -501,7 +1203,7 @@ static inline uint32_t *push_cigar(int *n_cigar, int *m_cigar, uint32_t *cigar,
 	return cigar;
 }
 
-int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar_, uint32_t **cigar_)
+int ksw_global2_scalar(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar_, uint32_t **cigar_)
 {
 	eh_t *eh;
 	int8_t *qp; // query profile
@@ -605,6 +1307,140 @@ int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	return score;
 }
 
+/* ksw_global2() computes a row (a target base) 8 cells at a time with 16-bit
+ * scores. E depends on the previous row only, and F on M of the same row, so
+ * F is a prefix max-scan along the row as in ksw_extend2(). The backtrack
+ * matrix keeps the four bits of d in ksw_global2_scalar() as bit planes: for
+ * every 8 cells, a 32-bit word holds whether h is from e, whether h is from
+ * f, whether e is extended and whether f is extended, 8 bits each. -0x8000
+ * stands for MINUS_INF as saturated arithmetic keeps it there. */
+
+int ksw_global2_buf(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar_, uint32_t **cigar_, kswbuf_t *buf)
+{
+	int16_t *qp, *H, *E; // query profile and score arrays
+	uint32_t *z; // backtrack matrix
+	int i, j, k, ql8 = qlen + 8, max = 1, score, n_z;
+	__m128i oe_del_v, e_del_v, oe_ins_v, e_ins1, e_ins2, e_ins4, dec, lane, inf1, inf2, inf4;
+	for (i = 0; i < m * m; ++i) max = max > abs(mat[i])? max : abs(mat[i]);
+	max = max > e_del? max : e_del;
+	max = max > e_ins? max : e_ins;
+	if ((int64_t)(qlen + tlen + 2) * max + o_del + o_ins >= 0x4000 || qlen - tlen > w || tlen - qlen > w) // scores may not fit 16 bits, or the last cell is outside the band
+		return ksw_global2_scalar(qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, n_cigar_, cigar_);
+	if (n_cigar_) *n_cigar_ = 0;
+	// allocate memory; vectors may read and write up to 8 cells past qlen
+	n_z = ((qlen < 2*w+1? qlen : 2*w+1) + 7) >> 3; // words per row of the backtrack matrix
+	if (!n_cigar_ || !cigar_) n_z = 0;
+	z = ksw_buf_dp(buf, (size_t)n_z * tlen * 4 + (ql8 + 9) * 4 + ql8 * m * 2);
+	H = (int16_t*)(z + (size_t)n_z * tlen);
+	memset(H, 0, (ql8 + 9) * 4);
+	E = H + ql8 + 9;
+	qp = E + ql8 + 9;
+	// generate the query profile
+	for (k = i = 0; k < m; ++k) {
+		const int8_t *p = &mat[k * m];
+		for (j = 0; j < qlen; ++j) qp[i++] = p[query[j]];
+		for (; j < ql8; ++j) qp[i++] = 0;
+	}
+	// fill the first row
+	H[0] = 0; E[0] = -0x8000;
+	for (j = 1; j <= qlen && j <= w; ++j)
+		H[j] = -(o_ins + e_ins * j), E[j] = -0x8000;
+	for (; j <= qlen; ++j) H[j] = E[j] = -0x8000; // everything is -inf outside the band
+	oe_del_v = _mm_set1_epi16(o_del + e_del);
+	e_del_v  = _mm_set1_epi16(e_del);
+	oe_ins_v = _mm_set1_epi16(o_ins + e_ins);
+	e_ins1 = _mm_set1_epi16(e_ins);
+	e_ins2 = _mm_set1_epi16(e_ins * 2);
+	e_ins4 = _mm_set1_epi16(e_ins * 4);
+	dec = _mm_set_epi16(e_ins * 8, e_ins * 7, e_ins * 6, e_ins * 5, e_ins * 4, e_ins * 3, e_ins * 2, e_ins);
+	inf1 = _mm_set_epi16(0, 0, 0, 0, 0, 0, 0, -0x8000); // -inf into the cells shifted in
+	inf2 = _mm_set_epi16(0, 0, 0, 0, 0, 0, -0x8000, -0x8000);
+	inf4 = _mm_set_epi16(0, 0, 0, 0, -0x8000, -0x8000, -0x8000, -0x8000);
+	lane = _mm_set_epi16(7, 6, 5, 4, 3, 2, 1, 0);
+	// DP loop
+	for (i = 0; LIKELY(i < tlen); ++i) { // target sequence is in the outer loop
+		int h1, beg, end, g = -0x8000;
+		const int16_t *q = &qp[target[i] * ql8];
+		uint32_t *zi = n_z? &z[(long)i * n_z] : 0;
+		__m128i hp;
+		beg = i > w? i - w : 0;
+		end = i + w + 1 < qlen? i + w + 1 : qlen; // only loop through [beg,end) of the query sequence
+		h1 = beg == 0? -(o_del + e_del * (i + 1)) : -0x8000;
+		if (beg < end) {
+			hp = _mm_loadu_si128((__m128i*)&H[beg]); // H(i-1,j-1) for j in [beg,beg+8)
+			H[beg] = h1;
+		}
+		for (j = beg; LIKELY(j < end); j += 8) {
+			__m128i M, e, h, t, t2, f, fm, hn, in, de, df, he, hf;
+			in = _mm_cmpgt_epi16(_mm_set1_epi16(end - j), lane); // cells before end
+			hn = _mm_loadu_si128((__m128i*)&H[j + 8]); // load before H[j+1,j+9) is overwritten
+			M = _mm_adds_epi16(hp, _mm_loadu_si128((__m128i*)&q[j]));
+			e = _mm_loadu_si128((__m128i*)&E[j]);
+			// E(i+1,j) = max{M(i,j)-gapo-gape, E(i,j)-gape}
+			t = _mm_subs_epi16(M, oe_del_v);
+			de = _mm_subs_epi16(e, e_del_v);
+			t = _mm_max_epi16(de, t);
+			de = _mm_cmpgt_epi16(de, _mm_subs_epi16(M, oe_del_v)); // e is extended
+			// G(j) = F(i,j+1) = max{M(i,j)-gapo-gape, G(j-1)-gape}
+			fm = _mm_subs_epi16(M, oe_ins_v);
+			f = _mm_max_epi16(fm, _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(fm, 2), inf1), e_ins1));
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(f, 4), inf2), e_ins2));
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_or_si128(_mm_slli_si128(f, 8), inf4), e_ins4));
+			f = _mm_max_epi16(f, _mm_subs_epi16(_mm_set1_epi16(g), dec));
+			t2 = _mm_insert_epi16(_mm_slli_si128(f, 2), g, 0); // F(i,j)
+			g = (int16_t)_mm_extract_epi16(f, 7);
+			f = t2;
+			df = _mm_cmpgt_epi16(_mm_subs_epi16(f, e_ins1), fm); // f is extended
+			// H(i,j) = max{M(i,j), E(i,j), F(i,j)}
+			he = _mm_cmpgt_epi16(e, M);
+			h = _mm_max_epi16(M, e);
+			hf = _mm_cmpgt_epi16(f, h);
+			h = _mm_max_epi16(h, f);
+			if (zi) zi[(j - beg) >> 3] = (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(he, hf)) | (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(de, df)) << 16;
+			if (LIKELY(j + 8 <= end)) {
+				_mm_storeu_si128((__m128i*)&E[j], t);
+				_mm_storeu_si128((__m128i*)&H[j + 1], h);
+			} else { // keep the cells past end
+				__m128i o = _mm_loadu_si128((__m128i*)&E[j]);
+				_mm_storeu_si128((__m128i*)&E[j], _mm_or_si128(_mm_and_si128(in, t), _mm_andnot_si128(in, o)));
+				o = _mm_loadu_si128((__m128i*)&H[j + 1]);
+				_mm_storeu_si128((__m128i*)&H[j + 1], _mm_or_si128(_mm_and_si128(in, h), _mm_andnot_si128(in, o)));
+			}
+			hp = hn;
+		}
+		if (beg < end) h1 = H[end];
+		H[end] = h1; E[end] = -0x8000;
+	}
+	score = H[qlen];
+	if (n_cigar_ && cigar_) { // backtrack
+		int n_cigar = 0, m_cigar = 0, which = 0;
+		uint32_t *cigar = 0, tmp;
+		i = tlen - 1; k = (i + w + 1 < qlen? i + w + 1 : qlen) - 1; // (i,k) points to the last cell
+		while (i >= 0 && k >= 0) {
+			int off = k - (i > w? i - w : 0);
+			uint32_t d = z[(long)i * n_z + (off >> 3)] >> (off & 7);
+			if (which == 0) which = d>>8&1? 2 : d&1; // h is from f, from e or from m
+			else if (which == 1) which = d>>16&1; // e is extended or opened
+			else which = d>>24&1? 2 : 0; // f is extended or opened
+			if (which == 0)      cigar = push_cigar(&n_cigar, &m_cigar, cigar, 0, 1), --i, --k;
+			else if (which == 1) cigar = push_cigar(&n_cigar, &m_cigar, cigar, 2, 1), --i;
+			else                 cigar = push_cigar(&n_cigar, &m_cigar, cigar, 1, 1), --k;
+		}
+		if (i >= 0) cigar = push_cigar(&n_cigar, &m_cigar, cigar, 2, i + 1);
+		if (k >= 0) cigar = push_cigar(&n_cigar, &m_cigar, cigar, 1, k + 1);
+		for (i = 0; i < n_cigar>>1; ++i) // reverse CIGAR
+			tmp = cigar[i], cigar[i] = cigar[n_cigar-1-i], cigar[n_cigar-1-i] = tmp;
+		*n_cigar_ = n_cigar, *cigar_ = cigar;
+	}
+	if (!buf) free(z);
+	return score;
+}
+
+int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar, uint32_t **cigar)
+{
+	return ksw_global2_buf(qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, n_cigar, cigar, 0);
+}
+
 int ksw_global(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int *n_cigar_, uint32_t **cigar_)
 {
 	return ksw_global2(qlen, query, tlen, target, m, mat, gapo, gape, gapo, gape, w, n_cigar_, cigar_);
@@ -8,9 +8,26 @@
 #define KSW_XSUBO  0x40000
 #define KSW_XSTART 0x80000
 
+// kernels of ksw_align() and ksw_align2(); see ksw_set_kernel()
+#define KSW_KERNEL_SSE2   0
+#define KSW_KERNEL_AVX2   1
+#define KSW_KERNEL_AVX512 2
+
 struct _kswq_t;
 typedef struct _kswq_t kswq_t;
 
+typedef struct { // scratch memory reused across the calls of a thread; zero it before the first use and free it with ksw_buf_destroy()
+	size_t m_dp, m_ptr;
+	void *dp, *ptr;
+} kswbuf_t;
+
+typedef struct { // an extension for ksw_extend2_batch()
+	int qlen, tlen;
+	const uint8_t *query, *target;
+	int w, end_bonus, h0;                        // as the arguments of ksw_extend2()
+	int score, qle, tle, gtle, gscore, max_off;  // output: the return value and the other outputs of ksw_extend2()
+} kswext_t;
+
 typedef struct {
 	int score; // best score
 	int te, qe; // target end and query end
@@ -63,6 +80,21 @@ extern "C" {
 	kswr_t ksw_align(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int xtra, kswq_t **qry);
 	kswr_t ksw_align2(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswq_t **qry);
 
+	/**
+	 * Select the vector width of the local alignment kernels. All kernels give
+	 * identical results. By default, the widest one supported by the CPU is
+	 * picked at the first call, and a narrower one is used for a query too
+	 * short to fill several of its vectors. A query profile is built for the
+	 * kernel in use when it is initialized and keeps using that kernel. A
+	 * negative _kernel_ restores the default.
+	 *
+	 * @return the kernel in use, or -1 if _kernel_ is not supported
+	 */
+	int ksw_set_kernel(int kernel);
+	int ksw_get_kernel(void);
+	int ksw_kernel_supported(int kernel);
+	const char *ksw_kernel_name(int kernel);
+
 	/**
 	 * Banded global alignment
 	 *
@@ -82,6 +114,10 @@ extern "C" {
 	 */
 	int ksw_global(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int *n_cigar, uint32_t **cigar);
 	int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar, uint32_t **cigar);
+	// the same as ksw_global2(), with the scratch memory in buf, which may be NULL
+	int ksw_global2_buf(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar, uint32_t **cigar, kswbuf_t *buf);
+	// the same as ksw_global2(), one cell at a time; ksw_global2() falls back to it if scores may exceed 16 bits
+	int ksw_global2_scalar(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar, uint32_t **cigar);
 
 	/**
 	 * Extend alignment
@@ -106,6 +142,29 @@ extern "C" {
 	 */
 	int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 	int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
+	// the same as ksw_extend2(), with the scratch memory in buf, which may be NULL
+	int ksw_extend2_buf(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off, kswbuf_t *buf);
+	// the same as ksw_extend2(), one cell at a time; ksw_extend2() falls back to it if scores may exceed 16 bits
+	int ksw_extend2_scalar(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
+
+	/**
+	 * Extend many alignments at a time
+	 *
+	 * With the AVX2 or AVX-512 kernel (see ksw_set_kernel()), extensions of
+	 * similar query lengths are grouped, and a group is computed in lockstep
+	 * with one extension per lane of an AVX2 vector. Otherwise, or with fewer
+	 * than 16 extensions, ksw_extend2() is called on each. An extension whose score may exceed 16 bits, or a scoring matrix
+	 * not in the form of bwa_fill_scmat(), also goes to ksw_extend2(). The
+	 * results are always identical to those of ksw_extend2().
+	 *
+	 * @param n       number of extensions
+	 * @param ext     extensions; the output fields are set on return
+	 * @param buf     scratch memory, or NULL to allocate it in the call
+	 */
+	void ksw_extend2_batch(int n, kswext_t *ext, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int zdrop, kswbuf_t *buf);
+
+	// free the memory held by buf, but not buf itself
+	void ksw_buf_destroy(kswbuf_t *buf);
 
 #ifdef __cplusplus
 }
@@ -82,6 +82,113 @@ typedef enum {
  */
 int libbwa_index(const char *db, const char *prefix_, libbwa_index_algo algo, int is_64);
 
+/**
+ * Phases of index construction, in order.
+ *
+ * LIBBWA_INDEX_PHASE_SA is skipped if the IS algorithm sampled the SA, and
+ * LIBBWA_INDEX_PHASE_KMER if no k-mer table is built.
+ *
+ * @see libbwa_index_stat
+ */
+typedef enum {
+    LIBBWA_INDEX_PHASE_PACK = 0,   // FASTA to .pac
+    LIBBWA_INDEX_PHASE_BWT = 1,    // BWT construction
+    LIBBWA_INDEX_PHASE_UPDATE = 2, // occurrence counts of the BWT
+    LIBBWA_INDEX_PHASE_SA = 3,     // sampled suffix array
+    LIBBWA_INDEX_PHASE_KMER = 4    // k-mer table
+} libbwa_index_phase;
+
+/**
+ * Progress of index construction, passed to libbwa_index_opt::progress.
+ *
+ * Times are wall-clock and CPU seconds since the phase started; the CPU time
+ * is of all threads of the process.
+ *
+ * @see libbwa_index2()
+ */
+typedef struct {
+    libbwa_index_phase phase;
+    double done;      // fraction of the phase done; 0 at its start and 1 at its end
+    double real, cpu;
+    int64_t bytes;    // input processed by the phase so far, in bytes of 2-bit bases
+    int64_t peak_rss; // peak resident memory of the process so far, in bytes
+} libbwa_index_stat;
+
+/**
+ * Callback for the progress of index construction.
+ *
+ * It is called at the start and the end of each phase. The bwtsw algorithm
+ * also reports after each block and the SA construction after each segment of
+ * the LF-walk, from one thread at a time but not always the calling thread.
+ */
+typedef void (*libbwa_index_progress)(const libbwa_index_stat *stat, void *data);
+
+/**
+ * Option structure for index function.
+ *
+ * @see libbwa_index_opt_init()
+ * @see libbwa_index_opt_destroy()
+ * @see libbwa_index2()
+ */
+typedef struct {
+    libbwa_index_algo algo;
+    int is_64;
+    int sa_intv; // SA sampling interval: 1, 2, 4, 8, 16 or 32
+    int kmer_k;  // length of the k-mer table (.kmer), at most 14; 0 for none
+    int n_threads; // threads for BWT (bwtsw) and SA construction; the index does not depend on it
+    int64_t max_mem; // memory budget in bytes; 0 for none
+    libbwa_index_progress progress; // NULL for none
+    void *progress_data; // passed to progress
+} libbwa_index_opt;
+
+/**
+ * Returns initialized libbwa_index_opt.
+ *
+ * This function dynamically allocates memory. You need to free the memory by
+ * libbwa_index_opt_destroy() after the process.
+ *
+ * @see libbwa_index_opt
+ * @see libbwa_index_opt_destroy()
+ */
+libbwa_index_opt *libbwa_index_opt_init(void);
+
+/**
+ * Destroy libbwa_index_opt.
+ *
+ * @see libbwa_index_opt
+ * @see libbwa_index_opt_init()
+ */
+void libbwa_index_opt_destroy(libbwa_index_opt *opt);
+
+/**
+ * Index database sequences in the FASTA format with options.
+ *
+ * libbwa_index() is the same with the default options. A smaller SA sampling
+ * interval makes locating hits faster at the cost of memory; with 1, the full
+ * SA is stored and no LF-walk is needed. With kmer_k > 0, the SA intervals of
+ * all k-mers are also stored, so that seeding skips the first k steps.
+ *
+ * With max_mem > 0, the algorithm (if auto) and the bwtsw block size are
+ * chosen such that no step takes more memory than max_mem, and the SA is
+ * written in passes if it does not fit. The index is the same as without the
+ * budget. LIBBWA_E_INDEX_ERROR is returned if the budget is too small.
+ *
+ * With progress set, it is called as the index is built; see
+ * libbwa_index_progress.
+ *
+ * @see libbwa_index_opt
+ */
+int libbwa_index2(const char *db, const char *prefix_, const libbwa_index_opt *opt);
+
+/**
+ * Add the sequences in fa to the index of db without rebuilding it.
+ *
+ * Equivalent to `bwa append`. The index is then the same as that of db and fa
+ * concatenated. Only the new suffixes are sorted; the suffix array samples are
+ * located on n_threads threads.
+ */
+int libbwa_index_append(const char *db, const char *fa, int n_threads);
+
 // aln
 // --------------------
 
@@ -450,6 +557,34 @@ int libbwa_bwtupdate(const char *bwt_);
  */
 int libbwa_bwt2sa(const char *bwt_, const char *out, int sa_intv);
 
+/**
+ * Generates SA from BWT and Occ with n_threads threads.
+ *
+ * Equivalent to `bwa bwt2sa -t`. The output is the same as libbwa_bwt2sa().
+ */
+int libbwa_bwt2sa2(const char *bwt_, const char *out, int sa_intv, int n_threads);
+
+// bwt2kmer
+// --------------------
+
+/**
+ * Generates the k-mer table from BWT and Occ.
+ *
+ * Equivalent to `bwa bwt2kmer`.
+ */
+int libbwa_bwt2kmer(const char *bwt_, const char *out, int k);
+
+// idx2mmap
+// --------------------
+
+/**
+ * Writes the index of db as the single file db.bwaidx, which later loads are
+ * served from by mapping it read-only instead of reading the index files.
+ *
+ * Equivalent to `bwa idx2mmap`.
+ */
+int libbwa_idx2mmap(const char *db);
+
 #ifdef __cplusplus
 }
 #endif
@@ -77,6 +77,7 @@ void libbwa_aln_core(const char *prefix, const char *fn_fa, const char *out ,con
     { // load BWT
         char *str = (char*)calloc(strlen(prefix) + 10, 1);
         strcpy(str, prefix); strcat(str, ".bwt");  bwt = bwt_restore_bwt(str);
+        strcpy(str, prefix); strcat(str, ".kmer"); bwt_restore_kmer(str, bwt);
         free(str);
     }
 
@@ -26,6 +26,7 @@
 #include "bwa.h"
 #include "bwamem.h"
 #include "kseq.h"
+#include "kvec.h"
 #include "utils.h"
 KSEQ_DECLARE(gzFile)
 
@@ -50,6 +51,8 @@ int libbwa_fastmap(const char *db, const char *read, const char *out, const libb
     int i;
 	kseq_t *seq;
 	bwtint_t k;
+	kvec_t(bwtint_t) sa = {0,0,0};
+	size_t j;
 	gzFile fp;
 	smem_i *itr;
 	const bwtintv_v *a;
@@ -62,7 +65,7 @@ int libbwa_fastmap(const char *db, const char *read, const char *out, const libb
 
 	fp = xzopen(read, "r");
 	seq = kseq_init(fp);
-	if ((idx = bwa_idx_load(db, BWA_IDX_BWT|BWA_IDX_BNS)) == 0)
+	if ((idx = bwa_idx_load(db, BWA_IDX_BWT|BWA_IDX_BNS|BWA_IDX_LAZY)) == 0)
         return LIBBWA_E_INDEX_ERROR;
 
     fpo = xopen(out, "w");
@@ -78,7 +81,13 @@ int libbwa_fastmap(const char *db, const char *read, const char *out, const libb
 			seq->seq.s[i] = nst_nt4_table[(int)seq->seq.s[i]];
 		smem_set_query(itr, seq->seq.l, (uint8_t*)seq->seq.s);
 		while ((a = smem_next(itr)) != 0) {
-			for (i = 0; i < a->n; ++i) {
+			for (i = 0, sa.n = 0; i < a->n; ++i) { // locate all occurrences to be printed in one batch
+				bwtintv_t *p = &a->a[i];
+				if ((uint32_t)p->info - (p->info>>32) < opt->min_len || p->x[2] > opt->min_iwidth) continue;
+				for (k = 0; k < p->x[2]; ++k) kv_push(bwtint_t, sa, p->x[0] + k);
+			}
+			bwt_sa_batch(idx->bwt, sa.n, sa.a, sa.a);
+			for (i = 0, j = 0; i < a->n; ++i) {
 				bwtintv_t *p = &a->a[i];
 				if ((uint32_t)p->info - (p->info>>32) < opt->min_len) continue;
 				err_fprintf(fpo, "EM\t%d\t%d\t%ld", (uint32_t)(p->info>>32), (uint32_t)p->info, (long)p->x[2]);
@@ -87,7 +96,7 @@ int libbwa_fastmap(const char *db, const char *read, const char *out, const libb
 						bwtint_t pos;
 						int len, is_rev, ref_id;
 						len  = (uint32_t)p->info - (p->info>>32);
-						pos = bns_depos(idx->bns, bwt_sa(idx->bwt, p->x[0] + k), &is_rev);
+						pos = bns_depos(idx->bns, sa.a[j++], &is_rev);
 						if (is_rev) pos -= len - 1;
 						bns_cnt_ambi(idx->bns, pos, len, &ref_id);
 						err_fprintf(fpo, "\t%s:%c%ld", idx->bns->anns[ref_id].name, "+-"[is_rev], (long)(pos - idx->bns->anns[ref_id].offset) + 1);
@@ -99,6 +108,7 @@ int libbwa_fastmap(const char *db, const char *read, const char *out, const libb
 		err_fputs("//", fpo);
 	}
 
+	free(sa.a);
 	smem_itr_destroy(itr);
 	bwa_idx_destroy(idx);
 	kseq_destroy(seq);
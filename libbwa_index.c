@@ -26,7 +26,9 @@
 #include <string.h>
 #include <math.h>
 #include <zlib.h>
+#include <unistd.h>
 
+#include "bwa.h"
 #include "bwtindex.h"
 #include "bntseq.h"
 #include "utils.h"
@@ -42,78 +44,152 @@ int libbwa_bwtupdate(const char *bwt_)
 	return LIBBWA_E_SUCCESS;
 }
 
-// Based on bwa_bwt2sa in bwtindex.c
 int libbwa_bwt2sa(const char *bwt_, const char *out, int sa_intv)
+{
+    return libbwa_bwt2sa2(bwt_, out, sa_intv, 1);
+}
+
+// Based on bwa_bwt2sa in bwtindex.c
+int libbwa_bwt2sa2(const char *bwt_, const char *out, int sa_intv, int n_threads)
 {
 	bwt_t *bwt;
 
     // Validate arguments
-    if (!bwt_ || !out) return LIBBWA_E_INVALID_ARGUMENT;
+    if (!bwt_ || !out || n_threads < 1) return LIBBWA_E_INVALID_ARGUMENT;
 
 	bwt = bwt_restore_bwt(bwt_);
-	bwt_cal_sa(bwt, sa_intv);
+	bwt_cal_sa2(bwt, sa_intv, n_threads);
 	bwt_dump_sa(out, bwt);
 	bwt_destroy(bwt);
 	return LIBBWA_E_SUCCESS;
 }
 
-// Modified based on bwa_index in bwtindex.c
+// Based on bwa_bwt2kmer in bwtindex.c
+int libbwa_bwt2kmer(const char *bwt_, const char *out, int k)
+{
+	bwt_t *bwt;
+
+    // Validate arguments
+    if (!bwt_ || !out || k < 1 || BWT_KMER_MAX < k) return LIBBWA_E_INVALID_ARGUMENT;
+
+	bwt = bwt_restore_bwt(bwt_);
+	bwt_gen_kmer(bwt, k);
+	bwt_dump_kmer(out, bwt);
+	bwt_destroy(bwt);
+	return LIBBWA_E_SUCCESS;
+}
+
+// Based on main_idx2mmap in bwashm.c
+int libbwa_idx2mmap(const char *db)
+{
+	bwaidx_t *idx;
+	char *prefix, *fn;
+
+    // Validate arguments
+    if (!db) return LIBBWA_E_INVALID_ARGUMENT;
+
+	if ((prefix = bwa_idx_infer_prefix(db)) == 0) return LIBBWA_E_INDEX_ERROR;
+	if ((idx = bwa_idx_load_from_disk(db, BWA_IDX_ALL)) == 0) {
+		free(prefix);
+		return LIBBWA_E_INDEX_ERROR;
+	}
+	fn = calloc(strlen(prefix) + 8, 1);
+	bwa_idx_dump_mmap(strcat(strcpy(fn, prefix), ".bwaidx"), idx);
+	bwa_idx_destroy(idx);
+	free(fn); free(prefix);
+	return LIBBWA_E_SUCCESS;
+}
+
+libbwa_index_opt *libbwa_index_opt_init(void)
+{
+    libbwa_index_opt *o;
+    o = calloc(1, sizeof(libbwa_index_opt));
+    o->algo = LIBBWA_INDEX_ALGO_AUTO;
+    o->is_64 = 0;
+    o->sa_intv = 32;
+    o->kmer_k = 0;
+    o->n_threads = 1;
+    o->max_mem = 0;
+    o->progress = NULL;
+    o->progress_data = NULL;
+    return o;
+}
+
+void libbwa_index_opt_destroy(libbwa_index_opt *opt)
+{
+    free(opt);
+}
+
 int libbwa_index(const char *db, const char *prefix_, libbwa_index_algo algo, int is_64)
 {
-    char *prefix, *str, *str2, *str3;
-    int64_t l_pac;
+    libbwa_index_opt *opt = libbwa_index_opt_init();
+    int ret;
+    opt->algo = algo;
+    opt->is_64 = is_64;
+    ret = libbwa_index2(db, prefix_, opt);
+    libbwa_index_opt_destroy(opt);
+    return ret;
+}
+
+static void index_progress(const bwa_idxstat_t *st, void *data)
+{
+    const libbwa_index_opt *opt = (const libbwa_index_opt*)data;
+    libbwa_index_stat s;
+    s.phase = (libbwa_index_phase)st->phase; // BWA_BUILD_* in the same order
+    s.done = st->done;
+    s.real = st->real;
+    s.cpu = st->cpu;
+    s.bytes = st->bytes;
+    s.peak_rss = st->peak_rss;
+    opt->progress(&s, opt->progress_data);
+}
+
+// Modified based on bwa_index in bwtindex.c
+int libbwa_index2(const char *db, const char *prefix_, const libbwa_index_opt *opt)
+{
+    char *prefix;
+    bwa_idxopt_t o;
+    int ret;
 
     // Validate arguments
-    if (!db || !prefix_ || 3 < algo || (is_64 < 0 || 1 < is_64))
+    if (!db || !prefix_ || !opt || 3 < opt->algo || (opt->is_64 < 0 || 1 < opt->is_64))
+        return LIBBWA_E_INVALID_ARGUMENT;
+    if (opt->sa_intv < 1 || 32 < opt->sa_intv || (opt->sa_intv & (opt->sa_intv - 1)))
+        return LIBBWA_E_INVALID_ARGUMENT;
+    if (opt->kmer_k < 0 || BWT_KMER_MAX < opt->kmer_k || opt->n_threads < 1 || opt->max_mem < 0)
         return LIBBWA_E_INVALID_ARGUMENT;
 
+    bwa_idxopt_init(&o); // the algorithms are numbered as BWTALGO_*
+    o.algo_type = opt->algo;
+    o.sa_intv = opt->sa_intv;
+    o.kmer_k = opt->kmer_k;
+    o.n_threads = opt->n_threads;
+    o.max_mem = opt->max_mem;
+    if (opt->progress) {
+        o.progress = index_progress;
+        o.progress_data = (void*)opt;
+    }
+
     prefix = (char*)calloc(strlen(prefix_) + 10, 1);
     strcpy(prefix, prefix_);
-    if (is_64) strcat(prefix, ".64");
-    str  = (char*)calloc(strlen(prefix) + 10, 1);
-    str2 = (char*)calloc(strlen(prefix) + 10, 1);
-    str3 = (char*)calloc(strlen(prefix) + 10, 1);
-
-    { // nucleotide indexing
-        gzFile fp = xzopen(db, "r");
-        l_pac = bns_fasta2bntseq(fp, prefix, 0);
-        err_gzclose(fp);
-    }
-    if (algo == LIBBWA_INDEX_ALGO_AUTO)
-        algo = l_pac > 50000000 ? LIBBWA_INDEX_ALGO_BWTSW : LIBBWA_INDEX_ALGO_IS; // set the algorithm for generating BWT
-    {
-        strcpy(str, prefix); strcat(str, ".pac");
-        strcpy(str2, prefix); strcat(str2, ".bwt");
-        if (algo == LIBBWA_INDEX_ALGO_BWTSW) bwt_bwtgen(str, str2);
-        else if (algo == LIBBWA_INDEX_ALGO_DIV || algo == LIBBWA_INDEX_ALGO_IS) {
-            bwt_t *bwt;
-            bwt = bwt_pac2bwt(str, algo == LIBBWA_INDEX_ALGO_IS);
-            bwt_dump_bwt(str2, bwt);
-            bwt_destroy(bwt);
-        }
-    }
-    {
-        bwt_t *bwt;
-        strcpy(str, prefix); strcat(str, ".bwt");
-        bwt = bwt_restore_bwt(str);
-        bwt_bwtupdate_core(bwt);
-        bwt_dump_bwt(str, bwt);
-        bwt_destroy(bwt);
-    }
-    {
-        gzFile fp = xzopen(db, "r");
-        l_pac = bns_fasta2bntseq(fp, prefix, 1);
-        err_gzclose(fp);
-    }
-    {
-        bwt_t *bwt;
-        strcpy(str, prefix); strcat(str, ".bwt");
-        strcpy(str3, prefix); strcat(str3, ".sa");
-        bwt = bwt_restore_bwt(str);
-        bwt_cal_sa(bwt, 32);
-        bwt_dump_sa(str3, bwt);
-        bwt_destroy(bwt);
-    }
-    free(str3); free(str2); free(str);
-    return LIBBWA_E_SUCCESS;
+    if (opt->is_64) strcat(prefix, ".64");
+    ret = bwa_idx_build2(db, prefix, &o);
+    free(prefix);
+    return ret == 0 ? LIBBWA_E_SUCCESS : LIBBWA_E_INDEX_ERROR;
+}
+
+// Based on bwa_append in bwtindex.c
+int libbwa_index_append(const char *db, const char *fa, int n_threads)
+{
+    char *prefix;
+    int ret;
+
+    // Validate arguments
+    if (!db || !fa || n_threads < 1) return LIBBWA_E_INVALID_ARGUMENT;
+    if (access(fa, R_OK) != 0) return LIBBWA_E_FILE_ERROR;
+
+    if ((prefix = bwa_idx_infer_prefix(db)) == 0) return LIBBWA_E_INDEX_ERROR;
+    ret = bwa_idx_append(prefix, fa, n_threads);
+    free(prefix);
+    return ret == 0? LIBBWA_E_SUCCESS : LIBBWA_E_INDEX_ERROR;
 }
@@ -11,7 +11,9 @@ int bwa_fa2pac(int argc, char *argv[]);
 int bwa_pac2bwt(int argc, char *argv[]);
 int bwa_bwtupdate(int argc, char *argv[]);
 int bwa_bwt2sa(int argc, char *argv[]);
+int bwa_bwt2kmer(int argc, char *argv[]);
 int bwa_index(int argc, char *argv[]);
+int bwa_append(int argc, char *argv[]);
 int bwt_bwtgen_main(int argc, char *argv[]);
 
 int bwa_aln(int argc, char *argv[]);
@@ -23,9 +25,11 @@ int bwa_bwtsw2(int argc, char *argv[]);
 int main_fastmap(int argc, char *argv[]);
 int main_mem(int argc, char *argv[]);
 int main_shm(int argc, char *argv[]);
+int main_idx2mmap(int argc, char *argv[]);
 
 int main_pemerge(int argc, char *argv[]);
 int main_maxk(int argc, char *argv[]);
+int main_bench(int argc, char *argv[]);
 	
 static int usage()
 {
@@ -35,6 +39,7 @@ static int usage()
 	fprintf(stderr, "Contact: Heng Li <lh3@sanger.ac.uk>\n\n");
 	fprintf(stderr, "Usage:   bwa <command> [options]\n\n");
 	fprintf(stderr, "Command: index         index sequences in the FASTA format\n");
+	fprintf(stderr, "         append        add sequences to an existing index\n");
 	fprintf(stderr, "         mem           BWA-MEM algorithm\n");
 	fprintf(stderr, "         fastmap       identify super-maximal exact matches\n");
 	fprintf(stderr, "         pemerge       merge overlapping paired ends (EXPERIMENTAL)\n");
@@ -44,11 +49,13 @@ static int usage()
 	fprintf(stderr, "         bwasw         BWA-SW for long queries\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "         shm           manage indices in shared memory\n");
+	fprintf(stderr, "         idx2mmap      write the index as one file for mmap loading\n");
 	fprintf(stderr, "         fa2pac        convert FASTA to PAC format\n");
 	fprintf(stderr, "         pac2bwt       generate BWT from PAC\n");
 	fprintf(stderr, "         pac2bwtgen    alternative algorithm for generating BWT\n");
 	fprintf(stderr, "         bwtupdate     update .bwt to the new format\n");
 	fprintf(stderr, "         bwt2sa        generate SA from BWT and Occ\n");
+	fprintf(stderr, "         bwt2kmer      generate the k-mer table from BWT and Occ\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr,
 "Note: To use BWA, you need to first index the genome with `bwa index'.\n"
@@ -74,7 +81,9 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "pac2bwtgen") == 0) ret = bwt_bwtgen_main(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwtupdate") == 0) ret = bwa_bwtupdate(argc-1, argv+1);
 	else if (strcmp(argv[1], "bwt2sa") == 0) ret = bwa_bwt2sa(argc-1, argv+1);
+	else if (strcmp(argv[1], "bwt2kmer") == 0) ret = bwa_bwt2kmer(argc-1, argv+1);
 	else if (strcmp(argv[1], "index") == 0) ret = bwa_index(argc-1, argv+1);
+	else if (strcmp(argv[1], "append") == 0) ret = bwa_append(argc-1, argv+1);
 	else if (strcmp(argv[1], "aln") == 0) ret = bwa_aln(argc-1, argv+1);
 	else if (strcmp(argv[1], "samse") == 0) ret = bwa_sai2sam_se(argc-1, argv+1);
 	else if (strcmp(argv[1], "sampe") == 0) ret = bwa_sai2sam_pe(argc-1, argv+1);
@@ -84,8 +93,10 @@ int main(int argc, char *argv[])
 	else if (strcmp(argv[1], "fastmap") == 0) ret = main_fastmap(argc-1, argv+1);
 	else if (strcmp(argv[1], "mem") == 0) ret = main_mem(argc-1, argv+1);
 	else if (strcmp(argv[1], "shm") == 0) ret = main_shm(argc-1, argv+1);
+	else if (strcmp(argv[1], "idx2mmap") == 0) ret = main_idx2mmap(argc-1, argv+1);
 	else if (strcmp(argv[1], "pemerge") == 0) ret = main_pemerge(argc-1, argv+1);
 	else if (strcmp(argv[1], "maxk") == 0) ret = main_maxk(argc-1, argv+1);
+	else if (strcmp(argv[1], "bench") == 0) ret = main_bench(argc-1, argv+1);
 	else {
 		fprintf(stderr, "[main] unrecognized command '%s'\n", argv[1]);
 		return 1;
@@ -97,7 +108,7 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "[%s] CMD:", __func__);
 		for (i = 0; i < argc; ++i)
 			fprintf(stderr, " %s", argv[i]);
-		fprintf(stderr, "\n[%s] Real time: %.3f sec; CPU: %.3f sec\n", __func__, realtime() - t_real, cputime());
+		fprintf(stderr, "\n[%s] Real time: %.3f sec; CPU: %.3f sec; Peak RSS: %.3f GB\n", __func__, realtime() - t_real, cputime(), peakrss() / 1024.0 / 1024.0 / 1024.0);
 	}
 	free(bwa_pg);
 	return ret;
@@ -14,7 +14,7 @@ int main_maxk(int argc, char *argv[])
 	int i, c, self = 0, max_len = 0;
 	uint8_t *cnt = 0;
 	uint64_t hist[256];
-	bwt_t *bwt;
+	bwaidx_t *idx;
 	kseq_t *ks;
 	smem_i *itr;
 	gzFile fp;
@@ -26,10 +26,10 @@ int main_maxk(int argc, char *argv[])
 		fprintf(stderr, "Usage: bwa maxk [-s] <index.prefix> <seq.fa>\n");
 		return 1;
 	}
+	if ((idx = bwa_idx_load(argv[optind], BWA_IDX_BWT|BWA_IDX_LAZY)) == 0) return 1; // only counts; the SA is never read
 	fp = strcmp(argv[optind+1], "-")? gzopen(argv[optind+1], "rb") : gzdopen(fileno(stdin), "rb");
 	ks = kseq_init(fp);
-	bwt = bwt_restore_bwt(argv[optind]);
-	itr = smem_itr_init(bwt);
+	itr = smem_itr_init(idx->bwt);
 	if (self) smem_config(itr, 2, INT_MAX, 0);
 	memset(hist, 0, 8 * 256);
 
@@ -60,7 +60,7 @@ int main_maxk(int argc, char *argv[])
 	free(cnt);
 
 	smem_itr_destroy(itr);
-	bwt_destroy(bwt);
+	bwa_idx_destroy(idx);
 	kseq_destroy(ks);
 	gzclose(fp);
 	return 0;
@@ -19,12 +19,15 @@
 #define _XOPEN_SOURCE 700
 #endif
 
+#include <ctype.h>
 #include <ftw.h>
 #include <stdlib.h>
 #include <string.h>
 #include <CUnit/Basic.h>
 
 #include "libbwa.h"
+#include "ksw.h"
+#include "bwa.h"
 
 #define TEST_DB "../test-resources/test.fa"
 #define TEST_READ "../test-resources/test.fq"
@@ -87,6 +90,97 @@ void libbwa_index_test(void)
     CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index(db, prefix, LIBBWA_INDEX_ALGO_AUTO, 2));
 }
 
+void libbwa_index2_test(void)
+{
+    char *db = TEST_DB;
+    char prefix[45];
+    sprintf(prefix, "%s/test2.fa", tempdir);
+    libbwa_index_opt *opt = libbwa_index_opt_init();
+
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index2(db, prefix, opt));
+    opt->sa_intv = 1;
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index2(db, prefix, opt));
+    opt->kmer_k = 10;
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index2(db, prefix, opt));
+    opt->n_threads = 4;
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index2(db, prefix, opt));
+    opt->max_mem = 1LL << 30;
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index2(db, prefix, opt));
+    opt->max_mem = 1 << 20;
+    CU_ASSERT(LIBBWA_E_INDEX_ERROR == libbwa_index2(db, prefix, opt));
+
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(NULL, prefix, opt));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, NULL, opt));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, prefix, NULL));
+    opt->sa_intv = 3;
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, prefix, opt));
+    opt->sa_intv = 64;
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, prefix, opt));
+    opt->sa_intv = 32;
+    opt->kmer_k = 15;
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, prefix, opt));
+    opt->kmer_k = 0;
+    opt->n_threads = 0;
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, prefix, opt));
+    opt->n_threads = 1;
+    opt->max_mem = -1;
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index2(db, prefix, opt));
+
+    libbwa_index_opt_destroy(opt);
+}
+
+static void index_progress_cb(const libbwa_index_stat *stat, void *data)
+{
+    libbwa_index_stat *last = (libbwa_index_stat*)data;
+    if (stat->phase < last->phase || (stat->phase == last->phase && stat->done < last->done) || stat->real < 0)
+        last->bytes = -1; // out of order
+    else if (last->bytes >= 0)
+        *last = *stat;
+}
+
+void libbwa_index_progress_test(void)
+{
+    char *db = TEST_DB;
+    char prefix[45];
+    libbwa_index_stat last;
+    sprintf(prefix, "%s/test5.fa", tempdir);
+    libbwa_index_opt *opt = libbwa_index_opt_init();
+
+    memset(&last, 0, sizeof(last));
+    opt->kmer_k = 8;
+    opt->progress = index_progress_cb;
+    opt->progress_data = &last;
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index2(db, prefix, opt));
+    CU_ASSERT(LIBBWA_INDEX_PHASE_KMER == last.phase);
+    CU_ASSERT(1.0 == last.done);
+    CU_ASSERT(0 < last.bytes && 0 < last.peak_rss);
+
+    libbwa_index_opt_destroy(opt);
+}
+
+void libbwa_index_append_test(void)
+{
+    char *db = TEST_DB;
+    char *read = TEST_READ;
+    char prefix[45], out[45];
+    sprintf(prefix, "%s/test4.fa", tempdir);
+    sprintf(out, "%s/libbwa_index_append_test.sam", tempdir);
+    libbwa_mem_opt *opt = libbwa_mem_opt_init();
+
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index(db, prefix, LIBBWA_INDEX_ALGO_AUTO, 0));
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index_append(prefix, db, 1));
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_mem(prefix, read, NULL, out, opt));
+
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index_append(NULL, db, 1));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index_append(prefix, NULL, 1));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_index_append(prefix, db, 0));
+
+    CU_ASSERT(LIBBWA_E_FILE_ERROR == libbwa_index_append(prefix, "notfound.fa", 1));
+    CU_ASSERT(LIBBWA_E_INDEX_ERROR == libbwa_index_append("notfound", db, 1));
+
+    libbwa_mem_opt_destroy(opt);
+}
+
 void libbwa_aln_test(void)
 {
     char *db = TEST_DB;
@@ -276,6 +370,201 @@ void libbwa_bwt2sa_test(void)
     CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2sa(bwt, NULL, sa_intv));
 }
 
+void libbwa_bwt2sa2_test(void)
+{
+    char *bwt = TEST_BWT;
+    char out[45];
+    sprintf(out, "%s/libbwa_bwt2sa2_test.sa", tempdir);
+    int sa_intv = 32;
+
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_bwt2sa2(bwt, out, sa_intv, 4));
+
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2sa2(NULL, out, sa_intv, 4));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2sa2(bwt, NULL, sa_intv, 4));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2sa2(bwt, out, sa_intv, 0));
+}
+
+void libbwa_bwt2kmer_test(void)
+{
+    char *bwt = TEST_BWT;
+    char out[45];
+    sprintf(out, "%s/libbwa_bwt2kmer_test.kmer", tempdir);
+
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_bwt2kmer(bwt, out, 8));
+
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2kmer(NULL, out, 8));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2kmer(bwt, NULL, 8));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2kmer(bwt, out, 0));
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_bwt2kmer(bwt, out, 15));
+}
+
+void libbwa_idx2mmap_test(void)
+{
+    char *db = TEST_DB;
+    char *read = TEST_READ;
+    char prefix[45], out[45];
+    sprintf(prefix, "%s/test3.fa", tempdir);
+    sprintf(out, "%s/libbwa_idx2mmap_test.sam", tempdir);
+    libbwa_mem_opt *opt = libbwa_mem_opt_init();
+
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_index(db, prefix, LIBBWA_INDEX_ALGO_AUTO, 0));
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_idx2mmap(prefix));
+    CU_ASSERT(LIBBWA_E_SUCCESS == libbwa_mem(prefix, read, NULL, out, opt)); // loads test3.fa.bwaidx
+
+    CU_ASSERT(LIBBWA_E_INVALID_ARGUMENT == libbwa_idx2mmap(NULL));
+
+    CU_ASSERT(LIBBWA_E_INDEX_ERROR == libbwa_idx2mmap("notfound"));
+
+    libbwa_mem_opt_destroy(opt);
+}
+
+void ksw_align2_kernel_test(void)
+{
+    int8_t mat[25];
+    uint8_t q[512], t[640];
+    int i, j, k, n, n_diff = 0;
+
+    srand48(11);
+    for (n = 0; n < 2000; ++n) { // all the penalties may be 0, including the gap open ones
+        int qlen = 1 + lrand48() % 500, tlen = 1 + lrand48() % 600, o_del = lrand48() % 4, e_del = lrand48() % 3, o_ins = lrand48() % 4, e_ins = lrand48() % 3;
+        int xtra = (lrand48() & 1? KSW_XBYTE : 0) | KSW_XSTART | KSW_XSUBO | 1;
+        kswr_t r[3];
+        bwa_fill_scmat(1 + lrand48() % 3, 1 + lrand48() % 5, mat);
+        for (j = 0; j < tlen; ++j) t[j] = lrand48() & 3;
+        for (i = 0; i < qlen; ++i) q[i] = drand48() < .2? lrand48() & 3 : t[(i + tlen / 4) % tlen];
+        for (k = KSW_KERNEL_SSE2; k <= KSW_KERNEL_AVX512; ++k) {
+            if (ksw_set_kernel(k) < 0) r[k] = r[KSW_KERNEL_SSE2]; // not supported by the CPU
+            else r[k] = ksw_align2(qlen, q, tlen, t, 5, mat, o_del, e_del, o_ins, e_ins, xtra, 0);
+            n_diff += memcmp(&r[k], &r[KSW_KERNEL_SSE2], sizeof(kswr_t)) != 0;
+        }
+    }
+    ksw_set_kernel(-1); // back to the automatic choice
+    CU_ASSERT(n_diff == 0);
+}
+
+// a random query with Ns, and a target made from it with substitutions and indels
+static void rand_pair(int qlen, uint8_t *q, int tlen, uint8_t *t)
+{
+    int i, j;
+    for (i = 0; i < qlen; ++i) q[i] = drand48() < .01? 4 : lrand48() & 3;
+    for (i = j = 0; j < tlen; ++j) {
+        double x = drand48();
+        if (i >= qlen || x < .05) t[j] = lrand48() & 3;
+        else if (x < .07 && i + 1 < qlen) t[j] = q[i + 1], i += 2; // deletion from the target
+        else if (x < .08) t[j] = lrand48() & 3; // insertion
+        else t[j] = q[i++];
+    }
+}
+
+static int extend_cmp(int qlen, const uint8_t *q, int tlen, const uint8_t *t, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0)
+{
+    int r1[5], r2[5], s1, s2;
+    s1 = ksw_extend2_scalar(qlen, q, tlen, t, 5, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, &r1[0], &r1[1], &r1[2], &r1[3], &r1[4]);
+    s2 = ksw_extend2(qlen, q, tlen, t, 5, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, &r2[0], &r2[1], &r2[2], &r2[3], &r2[4]);
+    return s1 == s2 && memcmp(r1, r2, sizeof(r1)) == 0;
+}
+
+void ksw_extend2_test(void)
+{
+    static const char *nt = "ACGTN";
+    int8_t mat[25];
+    uint8_t q[512], t[1024];
+    char *ref, line[1024];
+    int i, k, n, l_ref = 0, n_diff = 0, n_seg = 0;
+    FILE *fp;
+
+    bwa_fill_scmat(1, 4, mat);
+
+    // random sequences with substitutions, indels and Ns
+    srand48(11);
+    for (n = 0; n < 20000; ++n) {
+        int qlen = 1 + lrand48() % 300, tlen = 1 + lrand48() % (qlen + 100), o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0;
+        rand_pair(qlen, q, tlen, t);
+        o_del = lrand48() % 8, e_del = 1 + lrand48() % 3, o_ins = lrand48() % 8, e_ins = 1 + lrand48() % 3;
+        w = 1 + lrand48() % 120, end_bonus = lrand48() % 10, zdrop = lrand48() % 3? lrand48() % 120 : -1, h0 = 1 + lrand48() % 100;
+        n_diff += !extend_cmp(qlen, q, tlen, t, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0);
+    }
+    CU_ASSERT(n_diff == 0);
+
+    // segments of the reference with 3% substitutions against the reference, with the bwa-mem defaults
+    CU_ASSERT((fp = fopen(TEST_DB, "r")) != NULL);
+    if (fp == NULL) return;
+    ref = malloc(200000);
+    while (fgets(line, sizeof(line), fp) && l_ref < 199000)
+        for (i = 0; line[0] != '>' && line[i] && line[i] != '\n'; ++i)
+            ref[l_ref++] = strchr(nt, toupper(line[i]))? strchr(nt, toupper(line[i])) - nt : 4;
+    fclose(fp);
+    n_diff = 0;
+    for (k = 0; k + 350 <= l_ref; k += 97, ++n_seg) {
+        int qlen = 50 + k % 200;
+        for (i = 0; i < qlen; ++i) q[i] = drand48() < .03? lrand48() & 3 : ref[k + i];
+        n_diff += !extend_cmp(qlen, q, qlen + 100, (uint8_t*)ref + k, mat, 6, 1, 6, 1, 100, 5, 100, 20);
+    }
+    free(ref);
+    CU_ASSERT(n_seg > 0);
+    CU_ASSERT(n_diff == 0);
+}
+
+void ksw_extend2_batch_test(void)
+{
+    int8_t mat[25];
+    uint8_t *q, *t;
+    kswext_t ext[3000];
+    kswbuf_t buf = {0,0,0,0};
+    int k, r, n_diff = 0;
+
+    bwa_fill_scmat(1, 4, mat);
+    q = malloc(3000 * 300);
+    t = malloc(3000 * 400);
+    srand48(11);
+    for (r = 0; r < 4; ++r) { // batches of many groups and of a few, and too small ones
+        int n = r == 0? 3000 : r == 1? 40 : r == 2? 20 : 5;
+        for (k = 0; k < n; ++k) {
+            kswext_t *p = &ext[k];
+            p->qlen = 1 + lrand48() % 300, p->tlen = 1 + lrand48() % (p->qlen + 100);
+            rand_pair(p->qlen, &q[k * 300], p->tlen, &t[k * 400]);
+            p->query = &q[k * 300], p->target = &t[k * 400];
+            p->w = 1 + lrand48() % 120, p->end_bonus = lrand48() % 10, p->h0 = 1 + lrand48() % 100;
+        }
+        ksw_extend2_batch(n, ext, 5, mat, 6, 1, 6, 1, r & 1? -1 : 100, r < 2? &buf : 0);
+        for (k = 0; k < n; ++k) {
+            kswext_t *p = &ext[k];
+            int o[5], sc;
+            sc = ksw_extend2(p->qlen, p->query, p->tlen, p->target, 5, mat, 6, 1, 6, 1, p->w, p->end_bonus, r & 1? -1 : 100, p->h0, &o[0], &o[1], &o[2], &o[3], &o[4]);
+            n_diff += sc != p->score || o[0] != p->qle || o[1] != p->tle || o[2] != p->gtle || o[3] != p->gscore || o[4] != p->max_off;
+        }
+    }
+    free(q); free(t);
+    ksw_buf_destroy(&buf);
+    CU_ASSERT(n_diff == 0);
+}
+
+void ksw_global2_test(void)
+{
+    int8_t mat[25];
+    uint8_t q[512], t[512];
+    int n, n_diff = 0;
+    kswbuf_t buf = {0,0,0,0};
+
+    bwa_fill_scmat(1, 4, mat);
+    srand48(11);
+    for (n = 0; n < 20000; ++n) {
+        int qlen = lrand48() % 400, tlen = qlen + lrand48() % 41 - 20, w = 1 + lrand48() % 60;
+        int o = lrand48() % 8, e = 1 + lrand48() % 3, n1, n2, s1, s2;
+        uint32_t *c1 = 0, *c2 = 0;
+        tlen = tlen > 0? tlen : 0;
+        w = w > abs(tlen - qlen)? w : abs(tlen - qlen); // the last cell must be in the band for the CIGAR to be defined
+        rand_pair(qlen, q, tlen, t);
+        s1 = ksw_global2_scalar(qlen, q, tlen, t, 5, mat, o, e, o + 1, e, w, &n1, &c1);
+        s2 = ksw_global2(qlen, q, tlen, t, 5, mat, o, e, o + 1, e, w, &n2, &c2);
+        n_diff += s1 != s2 || n1 != n2 || (n1 && memcmp(c1, c2, n1 * 4) != 0);
+        n_diff += ksw_global2_buf(qlen, q, tlen, t, 5, mat, o, e, o + 1, e, w, 0, 0, &buf) != s1;
+        free(c1); free(c2);
+    }
+    ksw_buf_destroy(&buf);
+    CU_ASSERT(n_diff == 0);
+}
+
 // Main
 // --------------------
 
@@ -285,6 +574,9 @@ int main(int argc, char *argv[])
 
     CU_TestInfo tests[] = {
         {"index test", libbwa_index_test},
+        {"index2 test", libbwa_index2_test},
+        {"index progress test", libbwa_index_progress_test},
+        {"index append test", libbwa_index_append_test},
         {"aln test", libbwa_aln_test},
         {"samse test", libbwa_samse_test},
         {"sampe test", libbwa_sampe_test},
@@ -296,6 +588,13 @@ int main(int argc, char *argv[])
         {"bwtgen test", libbwa_bwtgen_test},
         // {"bwtupdate test", libbwa_bwtupdate_test}, // TODO
         {"bwt2sa test", libbwa_bwt2sa_test},
+        {"bwt2sa2 test", libbwa_bwt2sa2_test},
+        {"bwt2kmer test", libbwa_bwt2kmer_test},
+        {"idx2mmap test", libbwa_idx2mmap_test},
+        {"ksw_align2 kernel test", ksw_align2_kernel_test},
+        {"ksw_extend2 test", ksw_extend2_test},
+        {"ksw_extend2_batch test", ksw_extend2_batch_test},
+        {"ksw_global2 test", ksw_global2_test},
         CU_TEST_INFO_NULL
     };
 
@@ -39,6 +39,7 @@
 #endif
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include "utils.h"
 
 #include "ksort.h"
@@ -275,6 +276,93 @@ int err_gzclose(gzFile file)
 	return ret;
 }
 
+/**************
+ * Huge pages *
+ **************/
+
+void *huge_alloc(size_t size, int *type)
+{
+	void *p;
+#ifdef __linux__
+	size_t l = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+	p = mmap(0, l, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) { // from the hugetlbfs pool
+		*type = HUGE_TLB;
+		return p;
+	}
+#endif
+	if (posix_memalign(&p, HUGE_PAGE_SIZE, l) == 0) { // aligned, so that every 2 MB of it can be a transparent huge page
+		huge_advise(p, l);
+		*type = HUGE_THP;
+		return p;
+	}
+#endif
+	*type = HUGE_NONE;
+	return malloc(size);
+}
+
+void huge_free(void *p, size_t size, int type)
+{
+	if (type == HUGE_TLB) munmap(p, (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1));
+	else free(p);
+}
+
+void huge_advise(void *p, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	madvise(p, size, MADV_HUGEPAGE);
+#endif
+}
+
+int64_t huge_backed(const void *p, size_t size)
+{
+#ifdef __linux__
+	FILE *fp;
+	char line[1024];
+	unsigned long st, en, beg = (unsigned long)p, end = beg + size;
+	int in = 0;
+	long x;
+	int64_t n = 0;
+	if ((fp = fopen("/proc/self/smaps", "r")) == 0) return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lx-%lx ", &st, &en) == 2) // the first line of a mapping
+			in = (st < end && en > beg);
+		else if (in && (sscanf(line, "AnonHugePages: %ld kB", &x) == 1 || sscanf(line, "ShmemPmdMapped: %ld kB", &x) == 1
+					|| sscanf(line, "FilePmdMapped: %ld kB", &x) == 1 || sscanf(line, "Private_Hugetlb: %ld kB", &x) == 1
+					|| sscanf(line, "Shared_Hugetlb: %ld kB", &x) == 1))
+			n += (int64_t)x * 1024;
+	}
+	fclose(fp);
+	return n < (int64_t)size? n : (int64_t)size;
+#else
+	return -1;
+#endif
+}
+
+int64_t mem_available(void)
+{
+	int64_t n = -1;
+#ifdef __linux__
+	FILE *fp;
+	char line[256];
+	long x;
+	if ((fp = fopen("/proc/meminfo", "r")) != 0) {
+		while (fgets(line, sizeof(line), fp))
+			if (sscanf(line, "MemAvailable: %ld kB", &x) == 1) {
+				n = (int64_t)x * 1024;
+				break;
+			}
+		fclose(fp);
+	}
+#endif
+#if defined(_SC_AVPHYS_PAGES) && defined(_SC_PAGESIZE)
+	if (n < 0 && sysconf(_SC_AVPHYS_PAGES) > 0) // free memory only; lower than MemAvailable
+		n = (int64_t)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+#endif
+	return n;
+}
+
 /*********
  * Timer *
  *********/
@@ -286,6 +374,17 @@ double cputime()
 	return r.ru_utime.tv_sec + r.ru_stime.tv_sec + 1e-6 * (r.ru_utime.tv_usec + r.ru_stime.tv_usec);
 }
 
+long peakrss(void)
+{
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+#ifdef __linux__
+	return r.ru_maxrss * 1024;
+#else
+	return r.ru_maxrss;
+#endif
+}
+
 double realtime()
 {
 	struct timeval tp;
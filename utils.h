@@ -46,6 +46,12 @@
 #define xreopen(fn, mode, fp) err_xreopen_core(__func__, fn, mode, fp)
 #define xzopen(fn, mode) err_xzopen_core(__func__, fn, mode)
 
+#define HUGE_PAGE_SIZE 0x200000 // 2 MB, the huge page size on x86-64 and aarch64 with 4 KB base pages
+
+#define HUGE_NONE 0 // ordinary pages from malloc()
+#define HUGE_THP  1 // transparent huge pages, if the kernel grants them
+#define HUGE_TLB  2 // pages from the hugetlbfs pool
+
 #define xassert(cond, msg) if ((cond) == 0) _err_fatal_simple_core(__func__, msg)
 
 typedef struct {
@@ -87,6 +93,14 @@ extern "C" {
 
 	double cputime();
 	double realtime();
+	long peakrss(void); // peak resident set size of the process in bytes
+
+	// allocate _size_ bytes on hugetlbfs pages, else on transparent huge pages, else with malloc(); *type is HUGE_*
+	void *huge_alloc(size_t size, int *type);
+	void huge_free(void *p, size_t size, int type);
+	void huge_advise(void *p, size_t size); // ask for transparent huge pages on a page-aligned mapping
+	int64_t huge_backed(const void *p, size_t size); // bytes of [p,p+size) on huge pages, or -1 if unknown
+	int64_t mem_available(void); // bytes of memory available without swapping, or -1 if unknown
 
 	void ks_introsort_64 (size_t n, uint64_t *a);
 	void ks_introsort_128(size_t n, pair64_t *a);